@@ -46,6 +46,8 @@ check_include_file(sys/stat.h HAVE_SYS_STAT_H)
 check_include_file(sys/un.h HAVE_SYS_UN_H)
 check_include_file(sys/poll.h HAVE_SYS_POLL_H)
 check_include_file(sys/select.h HAVE_SYS_SELECT_H)
+check_include_file(sys/uio.h HAVE_SYS_UIO_H)
+check_include_file(sys/eventfd.h HAVE_SYS_EVENTFD_H)
 check_include_file(sched.h HAVE_SCHED_H)
 check_include_file(strings.h HAVE_STRINGS_H)
 
@@ -54,6 +56,8 @@ check_function_exists(gethostbyname_r HAVE_GETHOSTBYNAME_R)
 check_function_exists(strerror_r HAVE_STRERROR_R)
 check_function_exists(sched_get_priority_max HAVE_SCHED_GET_PRIORITY_MAX)
 check_function_exists(sched_get_priority_min HAVE_SCHED_GET_PRIORITY_MIN)
+check_function_exists(fdatasync HAVE_FDATASYNC)
+check_function_exists(fallocate HAVE_FALLOCATE)
 
 include(CheckCSourceCompiles)
 include(CheckCXXSourceCompiles)
@@ -65,6 +69,10 @@ check_cxx_source_compiles(
   "
   STRERROR_R_CHAR_P)
 
+set(HAVE_LZ4 ${WITH_LZ4})
+set(HAVE_ZSTD ${WITH_ZSTD})
+set(HAVE_OPENSSL ${WITH_OPENSSL})
+
 
 set(PACKAGE ${PACKAGE_NAME})
 set(PACKAGE_STRING "${PACKAGE_NAME} ${PACKAGE_VERSION}")
@@ -62,6 +62,13 @@ if(WITH_CPP)
     find_package(ZLIB QUIET)
     CMAKE_DEPENDENT_OPTION(WITH_ZLIB "Build with ZLIB support" ON
                            "ZLIB_FOUND" OFF)
+    # LZ4 and Zstd are header transport transforms, which need ZLIB
+    find_package(LZ4 QUIET)
+    CMAKE_DEPENDENT_OPTION(WITH_LZ4 "Build with LZ4 support" ON
+                           "LZ4_FOUND;WITH_ZLIB" OFF)
+    find_package(Zstd QUIET)
+    CMAKE_DEPENDENT_OPTION(WITH_ZSTD "Build with Zstd support" ON
+                           "Zstd_FOUND;WITH_ZLIB" OFF)
     find_package(Libevent QUIET)
     CMAKE_DEPENDENT_OPTION(WITH_LIBEVENT "Build with libevent support" ON
                            "Libevent_FOUND" OFF)
@@ -195,6 +202,8 @@ message(STATUS " Library features:")
 message(STATUS "  Build shared libraries:                     ${WITH_SHARED_LIB}")
 message(STATUS "  Build static libraries:                     ${WITH_STATIC_LIB}")
 message(STATUS "  Build with ZLIB support:                    ${WITH_ZLIB}")
+message(STATUS "  Build with LZ4 support:                     ${WITH_LZ4}")
+message(STATUS "  Build with Zstd support:                    ${WITH_ZSTD}")
 message(STATUS "  Build with libevent support:                ${WITH_LIBEVENT}")
 message(STATUS "  Build with Qt4 support:                     ${WITH_QT4}")
 message(STATUS "  Build with Qt5 support:                     ${WITH_QT5}")
@@ -0,0 +1,31 @@
+# find LZ4
+# a fast compression library (https://lz4.github.io/lz4/)
+#
+# Usage:
+# LZ4_INCLUDE_DIRS, where to find lz4.h
+# LZ4_LIBRARIES, LZ4 libraries
+# LZ4_FOUND, If false, do not try to use LZ4
+
+find_path(LZ4_INCLUDE_DIRS lz4.h)
+find_library(LZ4_LIBRARIES NAMES lz4 liblz4)
+
+if (LZ4_LIBRARIES AND LZ4_INCLUDE_DIRS)
+  set(LZ4_FOUND TRUE)
+else ()
+  set(LZ4_FOUND FALSE)
+endif ()
+
+if (LZ4_FOUND)
+  if (NOT LZ4_FIND_QUIETLY)
+    message(STATUS "Found LZ4: ${LZ4_LIBRARIES}")
+  endif ()
+else ()
+  if (LZ4_FIND_REQUIRED)
+    message(FATAL_ERROR "Could NOT find LZ4.")
+  endif ()
+endif ()
+
+mark_as_advanced(
+    LZ4_LIBRARIES
+    LZ4_INCLUDE_DIRS
+  )
@@ -0,0 +1,31 @@
+# find Zstd
+# the Zstandard compression library (https://facebook.github.io/zstd/)
+#
+# Usage:
+# ZSTD_INCLUDE_DIRS, where to find zstd.h
+# ZSTD_LIBRARIES, Zstd libraries
+# Zstd_FOUND, If false, do not try to use Zstd
+
+find_path(ZSTD_INCLUDE_DIRS zstd.h)
+find_library(ZSTD_LIBRARIES NAMES zstd libzstd)
+
+if (ZSTD_LIBRARIES AND ZSTD_INCLUDE_DIRS)
+  set(Zstd_FOUND TRUE)
+else ()
+  set(Zstd_FOUND FALSE)
+endif ()
+
+if (Zstd_FOUND)
+  if (NOT Zstd_FIND_QUIETLY)
+    message(STATUS "Found Zstd: ${ZSTD_LIBRARIES}")
+  endif ()
+else ()
+  if (Zstd_FIND_REQUIRED)
+    message(FATAL_ERROR "Could NOT find Zstd.")
+  endif ()
+endif ()
+
+mark_as_advanced(
+    ZSTD_LIBRARIES
+    ZSTD_INCLUDE_DIRS
+  )
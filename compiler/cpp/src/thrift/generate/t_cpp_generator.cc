@@ -64,6 +64,8 @@ public:
     gen_templates_ = false;
     gen_templates_only_ = false;
     gen_moveable_ = false;
+    gen_binary_view_ = false;
+    gen_arena_ = false;
     for( iter = parsed_options.begin(); iter != parsed_options.end(); ++iter) {
       if( iter->first.compare("pure_enums") == 0) {
         gen_pure_enums_ = true;
@@ -80,6 +82,10 @@ public:
         gen_templates_only_ = (iter->second == "only");
       } else if( iter->first.compare("moveable_types") == 0) {
         gen_moveable_ = true;
+      } else if( iter->first.compare("binary_view") == 0) {
+        gen_binary_view_ = true;
+      } else if( iter->first.compare("arena") == 0) {
+        gen_arena_ = true;
       } else {
         throw "unknown option cpp:" + iter->first;
       }
@@ -221,6 +227,7 @@ public:
   std::string namespace_close(std::string ns);
   std::string type_name(t_type* ttype, bool in_typedef = false, bool arg = false);
   std::string base_type_name(t_base_type::t_base tbase);
+  std::string arena_container_name(t_type* ttype, bool in_typedef);
   std::string declare_field(t_field* tfield,
                             bool init = false,
                             bool pointer = false,
@@ -250,6 +257,47 @@ public:
 
   bool is_reference(t_field* tfield) { return tfield->get_reference(); }
 
+  /**
+   * True if the type is a binary that is generated as a TBinaryView.
+   */
+  bool is_binary_view(t_type* ttype) {
+    return gen_binary_view_ && ttype->is_base_type() && ((t_base_type*)ttype)->is_binary()
+           && ttype->annotations_.find("cpp.type") == ttype->annotations_.end();
+  }
+
+  /**
+   * True if the type is a string that is generated as a TArenaString.
+   */
+  bool is_arena_string(t_type* ttype) {
+    return gen_arena_ && ttype->is_base_type()
+           && ((t_base_type*)ttype)->get_base() == t_base_type::TYPE_STRING
+           && !is_binary_view(ttype)
+           && ttype->annotations_.find("cpp.type") == ttype->annotations_.end();
+  }
+
+  /**
+   * The suffix of the TProtocol calls that read or write a list as one
+   * array ("I32", "I64" or "Double"), or "" if the list is not a
+   * std::vector of one of those types and goes element by element.
+   */
+  std::string bulk_list_suffix(t_list* tlist) {
+    t_type* elem_type = get_true_type(tlist->get_elem_type());
+    if (tlist->has_cpp_name() || !elem_type->is_base_type()
+        || elem_type->annotations_.find("cpp.type") != elem_type->annotations_.end()) {
+      return "";
+    }
+    switch (((t_base_type*)elem_type)->get_base()) {
+    case t_base_type::TYPE_I32:
+      return "I32";
+    case t_base_type::TYPE_I64:
+      return "I64";
+    case t_base_type::TYPE_DOUBLE:
+      return "Double";
+    default:
+      return "";
+    }
+  }
+
   bool is_complex_type(t_type* ttype) {
     ttype = get_true_type(ttype);
 
@@ -288,6 +336,18 @@ private:
    */
   bool gen_moveable_;
 
+  /**
+   * True if we should generate binary fields as TBinaryView, which can borrow
+   * from the transport's read buffer instead of copying.
+   */
+  bool gen_binary_view_;
+
+  /**
+   * True if we should generate strings and containers with TArenaAllocator,
+   * so that deserialized requests are allocated from a per-call arena.
+   */
+  bool gen_arena_;
+
   /**
    * True iff we should use a path prefix in our #include statements for other
    * thrift-generated header files.
@@ -379,6 +439,12 @@ void t_cpp_generator::init_generator() {
            << "#include <thrift/protocol/TProtocol.h>" << endl
            << "#include <thrift/transport/TTransport.h>" << endl
            << endl;
+  if (gen_binary_view_) {
+    f_types_ << "#include <thrift/TBinaryView.h>" << endl << endl;
+  }
+  if (gen_arena_) {
+    f_types_ << "#include <thrift/TArena.h>" << endl << endl;
+  }
   // Include C++xx compatibility header
   f_types_ << "#include <thrift/cxxfunctional.h>" << endl;
 
@@ -1621,6 +1687,7 @@ void t_cpp_generator::generate_service(t_service* tservice) {
     f_header_ << "#include <thrift/async/TAsyncDispatchProcessor.h>" << endl;
   }
   f_header_ << "#include <thrift/async/TConcurrentClientSyncInfo.h>" << endl;
+  f_header_ << "#include <thrift/async/TConcurrentClientMux.h>" << endl;
   f_header_ << "#include \"" << get_include_prefix(*get_program()) << program_name_ << "_types.h\""
             << endl;
 
@@ -2192,6 +2259,19 @@ void t_cpp_generator::generate_service_client(t_service* tservice, string style)
                 << "(iprot, oprot) {}" << endl;
     }
 
+    if (style == "Concurrent") {
+      // Calls made through a TConcurrentClientMux share its connection and
+      // its reader thread instead of taking turns reading responses.
+      f_header_ << indent() << service_name_ << style << "Client" << short_suffix
+                << "(boost::shared_ptr< ::apache::thrift::async::TConcurrentClientMux> mux) ";
+      if (extends.empty()) {
+        f_header_ << ": iprot_(NULL), oprot_(NULL), mux_(mux) {}" << endl;
+      } else {
+        f_header_ << ":" << endl;
+        f_header_ << indent() << "  " << extends << style << client_suffix << "(mux) {}" << endl;
+      }
+    }
+
     // create the setProtocol methods
     if (extends.empty()) {
       f_header_ << " private:" << endl;
@@ -2328,7 +2408,9 @@ void t_cpp_generator::generate_service_client(t_service* tservice, string style)
 
     if (style == "Concurrent") {
       f_header_ <<
-        indent() << "::apache::thrift::async::TConcurrentClientSyncInfo sync_;"<<endl;
+        indent() << "::apache::thrift::async::TConcurrentClientSyncInfo sync_;"<<endl <<
+        indent() << "boost::shared_ptr< ::apache::thrift::async::TConcurrentClientMux> mux_;"
+                 << endl;
     }
     indent_down();
   }
@@ -2431,6 +2513,31 @@ void t_cpp_generator::generate_service_client(t_service* tservice, string style)
       string argsname = tservice->get_name() + "_" + (*f_iter)->get_name() + "_pargs";
       string resultname = tservice->get_name() + "_" + (*f_iter)->get_name() + "_presult";
 
+      if (style == "Concurrent") {
+        out << indent() << "if (this->mux_) {" << endl;
+        indent_up();
+        out << indent() << "::apache::thrift::async::TConcurrentMuxSendSentry sentry(this->mux_.get());"
+            << endl << indent()
+            << "::apache::thrift::protocol::TProtocol* oprot = sentry.getProtocol().get();" << endl
+            << indent() << "oprot->writeMessageBegin(\"" << (*f_iter)->get_name()
+            << "\", ::apache::thrift::protocol::"
+            << ((*f_iter)->is_oneway() ? "T_ONEWAY" : "T_CALL") << ", sentry.getSeqId());" << endl
+            << endl << indent() << argsname << " args;" << endl;
+        for (fld_iter = fields.begin(); fld_iter != fields.end(); ++fld_iter) {
+          out << indent() << "args." << (*fld_iter)->get_name() << " = &"
+              << (*fld_iter)->get_name() << ";" << endl;
+        }
+        out << indent() << "args.write(oprot);" << endl << endl << indent()
+            << "oprot->writeMessageEnd();" << endl;
+        if ((*f_iter)->is_oneway()) {
+          out << indent() << "sentry.send(true);" << endl << indent() << "return;" << endl;
+        } else {
+          out << indent() << "return sentry.send(false);" << endl;
+        }
+        scope_down(out);
+        out << endl;
+      }
+
       string cseqidVal = "0";
       if (style == "Concurrent") {
         if (!(*f_iter)->is_oneway()) {
@@ -2498,6 +2605,27 @@ void t_cpp_generator::generate_service_client(t_service* tservice, string style)
         indent(out) << function_signature(&recv_function, "", scope) << endl;
         scope_up(out);
 
+        if (style == "Concurrent") {
+          // The mux has already matched the response to this call, so the
+          // plain client reads it.
+          out << indent() << "if (this->mux_) {" << endl;
+          indent_up();
+          out << indent()
+              << "::apache::thrift::async::TConcurrentMuxRecvSentry sentry(this->mux_.get(), seqid);"
+              << endl << indent() << service_name_ << "Client client(sentry.getProtocol());" << endl;
+          t_type* returntype = (*f_iter)->get_returntype();
+          if (returntype->is_void()) {
+            out << indent() << "client.recv_" << funname << "();" << endl << indent() << "return;"
+                << endl;
+          } else if (is_complex_type(returntype)) {
+            out << indent() << "client.recv_" << funname << "(_return);" << endl << indent()
+                << "return;" << endl;
+          } else {
+            out << indent() << "return client.recv_" << funname << "();" << endl;
+          }
+          scope_down(out);
+        }
+
         out << endl <<
           indent() << "int32_t rseqid = 0;" << endl <<
           indent() << "std::string fname;" << endl <<
@@ -3631,6 +3759,9 @@ void t_cpp_generator::generate_deserialize_field(ofstream& out,
     generate_deserialize_struct(out, (t_struct*)type, name, is_reference(tfield));
   } else if (type->is_container()) {
     generate_deserialize_container(out, type, name);
+  } else if (is_arena_string(type)) {
+    indent(out) << "xfer += ::apache::thrift::readArenaString(*iprot, " << name << ", "
+                << (((t_base_type*)type)->is_binary() ? "true" : "false") << ");" << endl;
   } else if (type->is_base_type()) {
     indent(out) << "xfer += iprot->";
     t_base_type::t_base tbase = ((t_base_type*)type)->get_base();
@@ -3639,7 +3770,9 @@ void t_cpp_generator::generate_deserialize_field(ofstream& out,
       throw "compiler error: cannot serialize void field in a struct: " + name;
       break;
     case t_base_type::TYPE_STRING:
-      if (((t_base_type*)type)->is_binary()) {
+      if (is_binary_view(type)) {
+        out << "readBinaryView(" << name << ");";
+      } else if (((t_base_type*)type)->is_binary()) {
         out << "readBinary(" << name << ");";
       } else {
         out << "readString(" << name << ");";
@@ -3734,6 +3867,19 @@ void t_cpp_generator::generate_deserialize_container(ofstream& out, t_type* ttyp
         << "xfer += iprot->readListBegin(" << etype << ", " << size << ");" << endl;
     if (!use_push) {
       indent(out) << prefix << ".resize(" << size << ");" << endl;
+
+      // Numeric lists are read in one call, which lets the protocol decode
+      // the whole run at once.
+      string bulk_suffix = bulk_list_suffix((t_list*)ttype);
+      if (!bulk_suffix.empty()) {
+        indent(out) << "if (" << size << " > 0) {" << endl;
+        indent(out) << "  xfer += iprot->read" << bulk_suffix << "Array(&" << prefix << "[0], "
+                    << size << ");" << endl;
+        indent(out) << "}" << endl;
+        indent(out) << "xfer += iprot->readListEnd();" << endl;
+        scope_down(out);
+        return;
+      }
     }
   }
 
@@ -3835,6 +3981,9 @@ void t_cpp_generator::generate_serialize_field(ofstream& out,
     generate_serialize_struct(out, (t_struct*)type, name, is_reference(tfield));
   } else if (type->is_container()) {
     generate_serialize_container(out, type, name);
+  } else if (is_arena_string(type)) {
+    indent(out) << "xfer += ::apache::thrift::writeArenaString(*oprot, " << name << ", "
+                << (((t_base_type*)type)->is_binary() ? "true" : "false") << ");" << endl;
   } else if (type->is_base_type() || type->is_enum()) {
 
     indent(out) << "xfer += oprot->";
@@ -3846,7 +3995,9 @@ void t_cpp_generator::generate_serialize_field(ofstream& out,
         throw "compiler error: cannot serialize void field in a struct: " + name;
         break;
       case t_base_type::TYPE_STRING:
-        if (((t_base_type*)type)->is_binary()) {
+        if (is_binary_view(type)) {
+          out << "writeBinaryView(" << name << ");";
+        } else if (((t_base_type*)type)->is_binary()) {
           out << "writeBinary(" << name << ");";
         } else {
           out << "writeString(" << name << ");";
@@ -3923,6 +4074,17 @@ void t_cpp_generator::generate_serialize_container(ofstream& out, t_type* ttype,
     indent(out) << "xfer += oprot->writeListBegin("
                 << type_to_enum(((t_list*)ttype)->get_elem_type()) << ", "
                 << "static_cast<uint32_t>(" << prefix << ".size()));" << endl;
+
+    string bulk_suffix = bulk_list_suffix((t_list*)ttype);
+    if (!bulk_suffix.empty()) {
+      indent(out) << "if (!" << prefix << ".empty()) {" << endl;
+      indent(out) << "  xfer += oprot->write" << bulk_suffix << "Array(&" << prefix << "[0], "
+                  << "static_cast<uint32_t>(" << prefix << ".size()));" << endl;
+      indent(out) << "}" << endl;
+      indent(out) << "xfer += oprot->writeListEnd();" << endl;
+      scope_down(out);
+      return;
+    }
   }
 
   string iter = tmp("_iter");
@@ -4067,6 +4229,10 @@ string t_cpp_generator::type_name(t_type* ttype, bool in_typedef, bool arg) {
     std::map<string, string>::iterator it = ttype->annotations_.find("cpp.type");
     if (it != ttype->annotations_.end()) {
       bname = it->second;
+    } else if (is_binary_view(ttype)) {
+      bname = "::apache::thrift::TBinaryView";
+    } else if (is_arena_string(ttype)) {
+      bname = "::apache::thrift::TArenaString";
     }
 
     if (!arg) {
@@ -4087,6 +4253,8 @@ string t_cpp_generator::type_name(t_type* ttype, bool in_typedef, bool arg) {
     t_container* tcontainer = (t_container*)ttype;
     if (tcontainer->has_cpp_name()) {
       cname = tcontainer->get_cpp_name();
+    } else if (gen_arena_) {
+      cname = arena_container_name(ttype, in_typedef);
     } else if (ttype->is_map()) {
       t_map* tmap = (t_map*)ttype;
       cname = "std::map<" + type_name(tmap->get_key_type(), in_typedef) + ", "
@@ -4135,6 +4303,30 @@ string t_cpp_generator::type_name(t_type* ttype, bool in_typedef, bool arg) {
   }
 }
 
+/**
+ * Returns the name of a container type that allocates with TArenaAllocator.
+ *
+ * @param ttype The container type
+ * @return String of the type name, i.e. std::vector<type, TArenaAllocator<type> >
+ */
+string t_cpp_generator::arena_container_name(t_type* ttype, bool in_typedef) {
+  string allocator = "::apache::thrift::TArenaAllocator";
+  if (ttype->is_map()) {
+    t_map* tmap = (t_map*)ttype;
+    string ktype = type_name(tmap->get_key_type(), in_typedef);
+    string vtype = type_name(tmap->get_val_type(), in_typedef);
+    return "std::map<" + ktype + ", " + vtype + ", std::less<" + ktype + " >, " + allocator
+           + "<std::pair<const " + ktype + ", " + vtype + " > > > ";
+  } else if (ttype->is_set()) {
+    string etype = type_name(((t_set*)ttype)->get_elem_type(), in_typedef);
+    return "std::set<" + etype + ", std::less<" + etype + " >, " + allocator + "<" + etype
+           + " > > ";
+  } else {
+    string etype = type_name(((t_list*)ttype)->get_elem_type(), in_typedef);
+    return "std::vector<" + etype + ", " + allocator + "<" + etype + " > > ";
+  }
+}
+
 /**
  * Returns the C++ type that corresponds to the thrift type.
  *
@@ -4371,4 +4563,8 @@ THRIFT_REGISTER_GENERATOR(
     "    templates:       Generate templatized reader/writer methods.\n"
     "    pure_enums:      Generate pure enums instead of wrapper classes.\n"
     "    include_prefix:  Use full include paths in generated files.\n"
-    "    moveable_types:  Generate move constructors and assignment operators.\n")
+    "    moveable_types:  Generate move constructors and assignment operators.\n"
+    "    binary_view:     Generate binary fields as TBinaryView, which can reference the\n"
+    "                     transport's read buffer instead of copying.\n"
+    "    arena:           Generate strings and containers that allocate from the per-call\n"
+    "                     TArena of the server.\n")
@@ -0,0 +1,119 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements. See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership. The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied. See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+#include <thrift/TArena.h>
+
+#include <algorithm>
+#include <cstdlib>
+
+#if defined(_MSC_VER)
+#define THRIFT_ARENA_TLS __declspec(thread)
+#else
+#define THRIFT_ARENA_TLS __thread
+#endif
+
+namespace apache {
+namespace thrift {
+
+static THRIFT_ARENA_TLS TArena* currentArena = NULL;
+
+const size_t TArena::DEFAULT_BLOCK_SIZE;
+const size_t TArena::MAX_BLOCK_SIZE;
+const size_t TArena::ALIGNMENT;
+
+TArena::TArena(size_t blockSize)
+  : blocks_(NULL), cur_(NULL), end_(NULL), blockSize_(blockSize), used_(0) {
+}
+
+TArena::~TArena() {
+  if (currentArena == this) {
+    currentArena = NULL;
+  }
+  freeBlocks();
+}
+
+void* TArena::allocateSlow(size_t size) {
+  // Oversized requests get a block of their own, and the current block
+  // stays in use for the small ones that follow.
+  size_t dataSize = (std::max)(size, blockSize_);
+  Block* block = static_cast<Block*>(std::malloc(headerSize() + dataSize));
+  if (block == NULL) {
+    throw std::bad_alloc();
+  }
+  block->size = dataSize;
+  uint8_t* data = reinterpret_cast<uint8_t*>(block) + headerSize();
+
+  if (size >= blockSize_ && blocks_ != NULL) {
+    block->next = blocks_->next;
+    blocks_->next = block;
+  } else {
+    block->next = blocks_;
+    blocks_ = block;
+    cur_ = data + size;
+    end_ = data + dataSize;
+  }
+  used_ += size;
+  return data;
+}
+
+bool TArena::owns(const void* ptr) const {
+  const uint8_t* p = static_cast<const uint8_t*>(ptr);
+  for (const Block* block = blocks_; block != NULL; block = block->next) {
+    const uint8_t* data = reinterpret_cast<const uint8_t*>(block) + headerSize();
+    if (p >= data && p < data + block->size) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void TArena::reset() {
+  if (blocks_ != NULL && blocks_->next == NULL && blocks_->size == blockSize_) {
+    // Common case: everything fit in one block, keep it for the next cycle.
+    cur_ = reinterpret_cast<uint8_t*>(blocks_) + headerSize();
+  } else {
+    while (blockSize_ < used_ && blockSize_ < MAX_BLOCK_SIZE) {
+      blockSize_ *= 2;
+    }
+    freeBlocks();
+  }
+  used_ = 0;
+}
+
+void TArena::freeBlocks() {
+  while (blocks_ != NULL) {
+    Block* next = blocks_->next;
+    std::free(blocks_);
+    blocks_ = next;
+  }
+  cur_ = NULL;
+  end_ = NULL;
+}
+
+TArena* TArena::current() {
+  return currentArena;
+}
+
+TArena* TArena::setCurrent(TArena* arena) {
+  TArena* previous = currentArena;
+  currentArena = arena;
+  return previous;
+}
+}
+} // apache::thrift
@@ -0,0 +1,281 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements. See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership. The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied. See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+#ifndef _THRIFT_TARENA_H_
+#define _THRIFT_TARENA_H_ 1
+
+#include <thrift/Thrift.h>
+#include <thrift/TBinaryView.h>
+
+#include <boost/noncopyable.hpp>
+
+#include <cstddef>
+#include <limits>
+#include <new>
+#include <string>
+#if __cplusplus >= 201103L || (defined(_MSC_VER) && _MSC_VER >= 1900)
+#include <type_traits>
+#endif
+
+namespace apache {
+namespace thrift {
+
+/**
+ * A bump-pointer allocator for the objects of a single request.
+ *
+ * Types generated with "--gen cpp:arena" use TArenaAllocator, which takes
+ * memory from the arena that was current on the thread when the container
+ * was constructed, or from the heap if there was none.  The servers make a
+ * per-connection arena current while a call is processed and reset it
+ * before the next one, so the arguments and results of a call are freed
+ * all at once instead of one allocation at a time.
+ *
+ * Anything allocated from an arena must be destroyed before the arena is
+ * reset.  Handlers that keep data beyond the call should copy it into
+ * ordinary types, or allocate it under a TArenaScope(NULL).
+ */
+class TArena : boost::noncopyable {
+public:
+  static const size_t DEFAULT_BLOCK_SIZE = 16 * 1024;
+  static const size_t MAX_BLOCK_SIZE = 1024 * 1024;
+
+  explicit TArena(size_t blockSize = DEFAULT_BLOCK_SIZE);
+
+  ~TArena();
+
+  /**
+   * Returns size bytes of suitably aligned memory.  Memory is only given
+   * back by reset().  Even for a size of 0 the pointer is valid and
+   * distinct from the others.
+   */
+  void* allocate(size_t size) {
+    size = ((size != 0 ? size : 1) + ALIGNMENT - 1) & ~(ALIGNMENT - 1);
+    if (size <= static_cast<size_t>(end_ - cur_)) {
+      void* ptr = cur_;
+      cur_ += size;
+      used_ += size;
+      return ptr;
+    }
+    return allocateSlow(size);
+  }
+
+  /**
+   * Whether ptr points into memory handed out by this arena.
+   */
+  bool owns(const void* ptr) const;
+
+  /**
+   * Releases everything allocated from the arena.  If the last cycle needed
+   * more than one block, the block size grows so the next one will not.
+   */
+  void reset();
+
+  /**
+   * Bytes handed out since the last reset.
+   */
+  size_t used() const { return used_; }
+
+  /**
+   * The arena that TArenaAllocator uses on this thread, or NULL.
+   */
+  static TArena* current();
+
+  /**
+   * Makes arena current on this thread and returns the previous one.
+   */
+  static TArena* setCurrent(TArena* arena);
+
+private:
+  static const size_t ALIGNMENT = 2 * sizeof(void*);
+
+  struct Block {
+    Block* next;
+    size_t size;
+  };
+
+  static size_t headerSize() { return (sizeof(Block) + ALIGNMENT - 1) & ~(ALIGNMENT - 1); }
+
+  void* allocateSlow(size_t size);
+  void freeBlocks();
+
+  Block* blocks_;
+  uint8_t* cur_;
+  uint8_t* end_;
+  size_t blockSize_;
+  size_t used_;
+};
+
+/**
+ * Makes an arena current for the lifetime of the object.
+ */
+class TArenaScope : boost::noncopyable {
+public:
+  explicit TArenaScope(TArena* arena) : previous_(TArena::setCurrent(arena)) {}
+
+  ~TArenaScope() { TArena::setCurrent(previous_); }
+
+private:
+  TArena* previous_;
+};
+
+/**
+ * Standard allocator that allocates from a TArena, or from the heap.
+ *
+ * A default constructed allocator takes the arena that is current on the
+ * calling thread, and copies keep it, so a container allocates from the
+ * arena that was current when it was constructed.  Memory from the arena is
+ * only reclaimed on reset; deallocate() frees nothing but heap memory, on
+ * whichever thread and under whichever arena it is called.
+ *
+ * Swapping or move assigning containers hands the memory over together with
+ * the allocator it came from.  Copy assignment keeps the allocator of the
+ * target, so assigning to a container built without an arena is the way
+ * to keep a copy beyond the reset.
+ */
+template <typename T>
+class TArenaAllocator {
+public:
+  typedef T value_type;
+  typedef T* pointer;
+  typedef const T* const_pointer;
+  typedef T& reference;
+  typedef const T& const_reference;
+  typedef size_t size_type;
+  typedef ptrdiff_t difference_type;
+
+  template <typename U>
+  struct rebind {
+    typedef TArenaAllocator<U> other;
+  };
+
+#if __cplusplus >= 201103L || (defined(_MSC_VER) && _MSC_VER >= 1900)
+  // Allocators of different arenas compare unequal, and containers may only
+  // exchange memory if the allocators go along with it
+  typedef std::false_type propagate_on_container_copy_assignment;
+  typedef std::true_type propagate_on_container_move_assignment;
+  typedef std::true_type propagate_on_container_swap;
+#endif
+
+  TArenaAllocator() : arena_(TArena::current()) {}
+
+  explicit TArenaAllocator(TArena* arena) : arena_(arena) {}
+
+  template <typename U>
+  TArenaAllocator(const TArenaAllocator<U>& other) : arena_(other.arena()) {}
+
+  /**
+   * The arena allocated from, or NULL for the heap.
+   */
+  TArena* arena() const { return arena_; }
+
+  pointer address(reference x) const { return &x; }
+  const_pointer address(const_reference x) const { return &x; }
+
+  pointer allocate(size_type n, const void* hint = 0) {
+    (void)hint;
+    if (n > max_size()) {
+      throw std::bad_alloc();
+    }
+    if (arena_ != NULL) {
+      return static_cast<pointer>(arena_->allocate(n * sizeof(T)));
+    }
+    return static_cast<pointer>(::operator new(n * sizeof(T)));
+  }
+
+  void deallocate(pointer p, size_type n) {
+    (void)n;
+    if (arena_ == NULL) {
+      ::operator delete(p);
+    }
+  }
+
+  size_type max_size() const { return (std::numeric_limits<size_type>::max)() / sizeof(T); }
+
+  void construct(pointer p, const T& value) { new (static_cast<void*>(p)) T(value); }
+
+  void destroy(pointer p) { p->~T(); }
+
+private:
+  TArena* arena_;
+};
+
+template <>
+class TArenaAllocator<void> {
+public:
+  typedef void value_type;
+  typedef void* pointer;
+  typedef const void* const_pointer;
+
+  template <typename U>
+  struct rebind {
+    typedef TArenaAllocator<U> other;
+  };
+
+  TArenaAllocator() : arena_(TArena::current()) {}
+
+  explicit TArenaAllocator(TArena* arena) : arena_(arena) {}
+
+  template <typename U>
+  TArenaAllocator(const TArenaAllocator<U>& other) : arena_(other.arena()) {}
+
+  TArena* arena() const { return arena_; }
+
+private:
+  TArena* arena_;
+};
+
+template <typename T, typename U>
+inline bool operator==(const TArenaAllocator<T>& a, const TArenaAllocator<U>& b) {
+  return a.arena() == b.arena();
+}
+
+template <typename T, typename U>
+inline bool operator!=(const TArenaAllocator<T>& a, const TArenaAllocator<U>& b) {
+  return a.arena() != b.arena();
+}
+
+typedef std::basic_string<char, std::char_traits<char>, TArenaAllocator<char> > TArenaString;
+
+/**
+ * Reads a string or binary field into a TArenaString.  Where the protocol
+ * can borrow from its transport the value is copied straight from the
+ * frame buffer into the string.
+ */
+template <class Protocol_>
+uint32_t readArenaString(Protocol_& prot, TArenaString& str, bool binary) {
+  TBinaryView view;
+  uint32_t xfer = binary ? prot.readBinaryView(view) : prot.readStringView(view);
+  str.assign(reinterpret_cast<const char*>(view.data()), view.size());
+  return xfer;
+}
+
+/**
+ * Writes a TArenaString as a string or binary field, by reference where the
+ * protocol allows it.
+ */
+template <class Protocol_>
+uint32_t writeArenaString(Protocol_& prot, const TArenaString& str, bool binary) {
+  TBinaryView view(reinterpret_cast<const uint8_t*>(str.data()),
+                   static_cast<uint32_t>(str.size()));
+  return binary ? prot.writeBinaryView(view) : prot.writeStringView(view);
+}
+}
+} // apache::thrift
+
+#endif // #ifndef _THRIFT_TARENA_H_
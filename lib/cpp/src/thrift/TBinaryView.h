@@ -0,0 +1,165 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements. See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership. The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied. See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+
+#ifndef _THRIFT_TBINARYVIEW_H_
+#define _THRIFT_TBINARYVIEW_H_ 1
+
+#include <thrift/Thrift.h>
+
+#include <algorithm>
+#include <cstring>
+#include <ostream>
+#include <string>
+
+#include <boost/shared_array.hpp>
+
+namespace apache {
+namespace thrift {
+
+/**
+ * A binary value that can refer to bytes it does not own.
+ *
+ * The C++ generator emits this type for binary fields when invoked with
+ * "--gen cpp:binary_view".  On read, protocols that support it (see
+ * TProtocol::readBinaryView) point the view straight into the frame buffer
+ * of the transport instead of copying into a std::string.  The view then
+ * holds a pin on the transport buffer, so the transport will not reuse that
+ * memory while the view (or any copy of it) is alive.  Transports without
+ * pinnable buffers make the view fall back to private storage.
+ *
+ * Views created from a std::string or C string own a copy of the data.
+ * Views created from a raw pointer without a pin are only valid as long as
+ * the caller keeps that memory alive; call own() to detach them.
+ */
+class TBinaryView {
+public:
+  TBinaryView() : data_(NULL), size_(0), owned_(false) {}
+
+  TBinaryView(const std::string& str) : data_(NULL), size_(0), storage_(str), owned_(true) {}
+
+  TBinaryView(const char* str) : data_(NULL), size_(0), storage_(str), owned_(true) {}
+
+  TBinaryView(const uint8_t* data,
+              uint32_t size,
+              const boost::shared_array<uint8_t>& pin = boost::shared_array<uint8_t>())
+    : data_(data), size_(size), pin_(pin), owned_(false) {}
+
+  const uint8_t* data() const {
+    return owned_ ? reinterpret_cast<const uint8_t*>(storage_.data()) : data_;
+  }
+
+  uint32_t size() const { return owned_ ? static_cast<uint32_t>(storage_.size()) : size_; }
+
+  bool empty() const { return size() == 0; }
+
+  /**
+   * Whether the view holds its own copy of the bytes.
+   */
+  bool owned() const { return owned_; }
+
+  /**
+   * Returns a copy of the bytes.
+   */
+  std::string str() const { return std::string(reinterpret_cast<const char*>(data()), size()); }
+
+  /**
+   * Points the view at memory owned elsewhere, optionally pinning it.
+   */
+  void assign(const uint8_t* data,
+              uint32_t size,
+              const boost::shared_array<uint8_t>& pin = boost::shared_array<uint8_t>()) {
+    data_ = data;
+    size_ = size;
+    pin_ = pin;
+    storage_.clear();
+    owned_ = false;
+  }
+
+  /**
+   * Copies str into the view's own storage.
+   */
+  void assign(const std::string& str) {
+    storage();
+    storage_ = str;
+  }
+
+  /**
+   * Releases any referenced memory and returns the view's own storage, which
+   * becomes the contents of the view.  Used by protocols that cannot borrow.
+   */
+  std::string& storage() {
+    data_ = NULL;
+    size_ = 0;
+    pin_.reset();
+    owned_ = true;
+    return storage_;
+  }
+
+  /**
+   * Copies referenced bytes into the view's own storage so that it no longer
+   * depends on the memory it was pointing at.
+   */
+  void own() {
+    if (!owned_) {
+      std::string copy(reinterpret_cast<const char*>(data_), size_);
+      storage().swap(copy);
+    }
+  }
+
+  void swap(TBinaryView& that) {
+    using std::swap;
+    swap(data_, that.data_);
+    swap(size_, that.size_);
+    swap(pin_, that.pin_);
+    swap(storage_, that.storage_);
+    swap(owned_, that.owned_);
+  }
+
+  bool operator==(const TBinaryView& that) const {
+    return size() == that.size() && (size() == 0 || std::memcmp(data(), that.data(), size()) == 0);
+  }
+
+  bool operator!=(const TBinaryView& that) const { return !(*this == that); }
+
+  bool operator<(const TBinaryView& that) const {
+    uint32_t len = (std::min)(size(), that.size());
+    int cmp = len == 0 ? 0 : std::memcmp(data(), that.data(), len);
+    return cmp < 0 || (cmp == 0 && size() < that.size());
+  }
+
+private:
+  const uint8_t* data_;
+  uint32_t size_;
+  boost::shared_array<uint8_t> pin_;
+  std::string storage_;
+  bool owned_;
+};
+
+inline void swap(TBinaryView& a, TBinaryView& b) {
+  a.swap(b);
+}
+
+inline std::ostream& operator<<(std::ostream& out, const TBinaryView& view) {
+  return out.write(reinterpret_cast<const char*>(view.data()), view.size());
+}
+}
+} // apache::thrift
+
+#endif // #ifndef _THRIFT_TBINARYVIEW_H_
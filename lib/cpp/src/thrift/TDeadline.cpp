@@ -0,0 +1,104 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements. See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership. The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied. See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+#ifndef __STDC_LIMIT_MACROS
+#define __STDC_LIMIT_MACROS
+#endif
+#include <stdint.h>
+
+#include <thrift/TDeadline.h>
+#include <thrift/concurrency/Util.h>
+
+#include <boost/lexical_cast.hpp>
+
+#include <limits>
+
+#if defined(_MSC_VER)
+#define THRIFT_DEADLINE_TLS __declspec(thread)
+#else
+#define THRIFT_DEADLINE_TLS __thread
+#endif
+
+namespace apache {
+namespace thrift {
+
+using concurrency::Util;
+
+const char* const TDeadline::HEADER = "timeout_ms";
+const int64_t TDeadline::NONE = std::numeric_limits<int64_t>::max();
+
+// Thread-local variables need constant initializers before C++11
+static THRIFT_DEADLINE_TLS int64_t currentDeadline = INT64_MAX;
+static THRIFT_DEADLINE_TLS int64_t currentReceived = 0;
+
+void TDeadline::setTimeout(Headers& headers, int64_t timeout) {
+  headers[HEADER] = boost::lexical_cast<std::string>(timeout);
+}
+
+void TDeadline::propagate(Headers& headers) {
+  int64_t left = remaining();
+  if (left == NONE) {
+    headers.erase(HEADER);
+  } else {
+    // The callee fails the call right away if there is no time left
+    setTimeout(headers, left > 0 ? left : 0);
+  }
+}
+
+bool TDeadline::getTimeout(const Headers& headers, int64_t& timeout) {
+  Headers::const_iterator it = headers.find(HEADER);
+  if (it == headers.end()) {
+    return false;
+  }
+  try {
+    timeout = boost::lexical_cast<int64_t>(it->second);
+  } catch (const boost::bad_lexical_cast&) {
+    return false;
+  }
+  return true;
+}
+
+int64_t TDeadline::current() {
+  return currentDeadline;
+}
+
+int64_t TDeadline::setCurrent(int64_t deadline) {
+  int64_t previous = currentDeadline;
+  currentDeadline = deadline;
+  return previous;
+}
+
+int64_t TDeadline::remaining() {
+  if (currentDeadline == NONE) {
+    return NONE;
+  }
+  return currentDeadline - Util::currentTime();
+}
+
+int64_t TDeadline::received() {
+  return currentReceived;
+}
+
+int64_t TDeadline::setReceived(int64_t received) {
+  int64_t previous = currentReceived;
+  currentReceived = received;
+  return previous;
+}
+}
+} // apache::thrift
@@ -0,0 +1,144 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements. See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership. The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied. See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+#ifndef _THRIFT_TDEADLINE_H_
+#define _THRIFT_TDEADLINE_H_ 1
+
+#include <thrift/Thrift.h>
+
+#include <boost/noncopyable.hpp>
+
+#include <map>
+#include <string>
+
+namespace apache {
+namespace thrift {
+
+/**
+ * Deadlines of calls, carried in THeaderTransport headers.
+ *
+ * A client that will not wait longer than some number of milliseconds for
+ * an answer puts that timeout into the headers of the call, e.g. with
+ * setTimeout(protocol->getWriteHeaders(), 500).  Headers go out with a
+ * single message, so this is done before every call.  The timeout is
+ * relative so that the clocks of client and server need not agree.
+ *
+ * A server whose processor is wrapped in a TDeadlineProcessor counts the
+ * timeout from the time the call was received, fails calls whose deadline
+ * has passed before they reach the handler, and makes the deadline current
+ * on the thread while the handler runs.  Handlers see the time they have
+ * left with remaining(), and pass it on to the calls they make with
+ * propagate().
+ *
+ * Times are milliseconds on the clock of concurrency::Util::currentTime().
+ */
+class TDeadline {
+public:
+  typedef std::map<std::string, std::string> Headers;
+
+  /// Header the timeout of a call is sent in
+  static const char* const HEADER;
+
+  /// Deadline of a call that has none
+  static const int64_t NONE;
+
+  /**
+   * Gives the next call sent with headers a timeout, in milliseconds.
+   */
+  static void setTimeout(Headers& headers, int64_t timeout);
+
+  /**
+   * Gives the next call sent with headers what is left of the deadline of
+   * the call being processed on this thread, if it has one.
+   */
+  static void propagate(Headers& headers);
+
+  /**
+   * Reads the timeout of a received call.
+   *
+   * @return Whether headers hold a valid timeout
+   */
+  static bool getTimeout(const Headers& headers, int64_t& timeout);
+
+  /**
+   * The deadline of the call being processed on this thread, or NONE.
+   */
+  static int64_t current();
+
+  /**
+   * Makes deadline current on this thread and returns the previous one.
+   */
+  static int64_t setCurrent(int64_t deadline);
+
+  /**
+   * Milliseconds left until the current deadline, zero or less once it has
+   * passed, or NONE.
+   */
+  static int64_t remaining();
+
+  /**
+   * Whether the current deadline has passed.
+   */
+  static bool expired() { return remaining() <= 0; }
+
+  /**
+   * When the server received the call being processed on this thread, or 0
+   * if the server did not say.  Servers that queue calls before processing
+   * them set this, so that time spent in the queue counts against the
+   * deadline.
+   */
+  static int64_t received();
+
+  /**
+   * Sets when the call processed on this thread was received and returns
+   * the previous value.
+   */
+  static int64_t setReceived(int64_t received);
+};
+
+/**
+ * Makes a deadline current for the lifetime of the object.
+ */
+class TDeadlineScope : boost::noncopyable {
+public:
+  explicit TDeadlineScope(int64_t deadline) : previous_(TDeadline::setCurrent(deadline)) {}
+
+  ~TDeadlineScope() { TDeadline::setCurrent(previous_); }
+
+private:
+  int64_t previous_;
+};
+
+/**
+ * Sets when the call being processed was received for the lifetime of the
+ * object.
+ */
+class TReceivedScope : boost::noncopyable {
+public:
+  explicit TReceivedScope(int64_t received) : previous_(TDeadline::setReceived(received)) {}
+
+  ~TReceivedScope() { TDeadline::setReceived(previous_); }
+
+private:
+  int64_t previous_;
+};
+}
+} // apache::thrift
+
+#endif // #ifndef _THRIFT_TDEADLINE_H_
@@ -0,0 +1,316 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements. See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership. The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied. See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+#include <thrift/thrift-config.h>
+
+#include <thrift/async/TConcurrentClientMux.h>
+#include <thrift/TApplicationException.h>
+#include <thrift/concurrency/PlatformThreadFactory.h>
+#include <thrift/transport/TTransportException.h>
+
+#include <cstring>
+
+#ifdef HAVE_NETINET_IN_H
+#include <netinet/in.h>
+#endif
+
+#ifdef HAVE_ARPA_INET_H
+#include <arpa/inet.h>
+#endif
+
+namespace apache {
+namespace thrift {
+namespace async {
+
+using boost::shared_ptr;
+using namespace ::apache::thrift::concurrency;
+using namespace ::apache::thrift::protocol;
+using namespace ::apache::thrift::transport;
+
+const uint32_t TConcurrentClientMux::DEFAULT_MAX_PENDING;
+const uint32_t TConcurrentClientMux::DEFAULT_MAX_FRAME_SIZE;
+
+/// How long a caller waits for a free slot before looking again
+static const int64_t CAPACITY_WAIT_MS = 10;
+
+/// Larger response buffers are freed when their call finishes
+static const size_t MAX_RETAINED_RESPONSE = 64 * 1024;
+
+class TConcurrentClientMux::Reader : public Runnable {
+public:
+  explicit Reader(TConcurrentClientMux& mux) : mux_(mux) {}
+
+  void run() { mux_.readResponses(); }
+
+private:
+  TConcurrentClientMux& mux_;
+};
+
+TConcurrentClientMux::TConcurrentClientMux(shared_ptr<TTransport> transport,
+                                           shared_ptr<TProtocolFactory> protocolFactory,
+                                           uint32_t maxPending)
+  : transport_(transport),
+    protocolFactory_(protocolFactory),
+    mask_(0),
+    maxFrameSize_(DEFAULT_MAX_FRAME_SIZE),
+    nextSeqId_(0),
+    dead_(false),
+    capacityWaiters_(0) {
+  uint32_t slots = 1;
+  while (slots < maxPending && slots < (1u << 30)) {
+    slots <<= 1;
+  }
+  slots_.reset(new Slot[slots]);
+  mask_ = slots - 1;
+
+  if (!transport_->isOpen()) {
+    transport_->open();
+  }
+
+  PlatformThreadFactory threadFactory;
+  threadFactory.setDetached(false);
+  readerThread_ = threadFactory.newThread(shared_ptr<Runnable>(new Reader(*this)));
+  readerThread_->start();
+}
+
+TConcurrentClientMux::~TConcurrentClientMux() {
+  try {
+    close();
+  } catch (...) {
+    // ignore
+  }
+}
+
+void TConcurrentClientMux::close() {
+  dead_.store(true, boost::memory_order_release);
+  {
+    Guard g(writeMutex_);
+    if (transport_->isOpen()) {
+      transport_->close();
+    }
+  }
+  if (readerThread_) {
+    readerThread_->join();
+    readerThread_.reset();
+  }
+}
+
+uint32_t TConcurrentClientMux::claimSlot(int32_t& seqid) {
+  for (;;) {
+    if (isDead()) {
+      throwDeadConnection();
+    }
+
+    // Every sequence id maps to one slot, so probing moves on to the next
+    // id until it lands on a free slot.
+    for (uint32_t probe = 0; probe <= mask_; ++probe) {
+      uint32_t next = nextSeqId_.fetch_add(1, boost::memory_order_relaxed);
+      uint32_t index = next & mask_;
+      Slot& slot = slots_[index];
+      int expected = SLOT_FREE;
+      if (slot.state.compare_exchange_strong(expected, SLOT_CLAIMED, boost::memory_order_acquire)) {
+        slot.seqid = static_cast<int32_t>(next);
+        seqid = slot.seqid;
+        if (!slot.output) {
+          slot.output.reset(new TMemoryBuffer());
+          slot.outputProtocol = protocolFactory_->getProtocol(slot.output);
+          slot.input.reset(new TMemoryBuffer());
+          slot.inputProtocol = protocolFactory_->getProtocol(slot.input);
+        }
+        // Leave room for the frame size
+        uint32_t placeholder = 0;
+        slot.output->resetBuffer();
+        slot.output->write(reinterpret_cast<const uint8_t*>(&placeholder), sizeof(placeholder));
+        return index;
+      }
+    }
+
+    // Every call slot is in use, wait for one to finish
+    Synchronized s(capacityMonitor_);
+    capacityWaiters_.fetch_add(1, boost::memory_order_relaxed);
+    capacityMonitor_.waitForTimeRelative(CAPACITY_WAIT_MS);
+    capacityWaiters_.fetch_sub(1, boost::memory_order_relaxed);
+  }
+}
+
+void TConcurrentClientMux::releaseSlot(uint32_t index) {
+  Slot& slot = slots_[index];
+  if (slot.response.capacity() > MAX_RETAINED_RESPONSE) {
+    std::string().swap(slot.response);
+  }
+  slot.state.store(SLOT_FREE, boost::memory_order_release);
+  if (capacityWaiters_.load(boost::memory_order_relaxed) > 0) {
+    Synchronized s(capacityMonitor_);
+    capacityMonitor_.notify();
+  }
+}
+
+void TConcurrentClientMux::sendFrame(uint32_t index, bool oneway) {
+  Slot& slot = slots_[index];
+  if (!oneway) {
+    // The response may be read before the write below returns
+    Synchronized s(slot.monitor);
+    slot.state.store(SLOT_WAITING, boost::memory_order_relaxed);
+  }
+
+  uint8_t* buf;
+  uint32_t size;
+  slot.output->getBuffer(&buf, &size);
+  uint32_t frameSize = htonl(size - static_cast<uint32_t>(sizeof(frameSize)));
+  std::memcpy(buf, &frameSize, sizeof(frameSize));
+
+  Guard g(writeMutex_);
+  if (isDead()) {
+    throwDeadConnection();
+  }
+  try {
+    transport_->write(buf, size);
+    transport_->flush();
+  } catch (...) {
+    markDead();
+    throw;
+  }
+}
+
+void TConcurrentClientMux::waitForResponse(uint32_t index) {
+  Slot& slot = slots_[index];
+  Synchronized s(slot.monitor);
+  while (slot.state.load(boost::memory_order_relaxed) == SLOT_WAITING) {
+    if (isDead()) {
+      throwDeadConnection();
+    }
+    slot.monitor.waitForever();
+  }
+  slot.input->resetBuffer(reinterpret_cast<uint8_t*>(const_cast<char*>(slot.response.data())),
+                          static_cast<uint32_t>(slot.response.size()));
+}
+
+void TConcurrentClientMux::readResponses() {
+  shared_ptr<TMemoryBuffer> peekBuffer(new TMemoryBuffer());
+  shared_ptr<TProtocol> peekProtocol = protocolFactory_->getProtocol(peekBuffer);
+  std::string frame;
+  std::string fname;
+
+  try {
+    for (;;) {
+      uint32_t size;
+      transport_->readAll(reinterpret_cast<uint8_t*>(&size), sizeof(size));
+      size = ntohl(size);
+      if (size > maxFrameSize_) {
+        throw TTransportException(TTransportException::CORRUPTED_DATA,
+                                  "Received an oversized response frame");
+      }
+      frame.resize(size);
+      if (size > 0) {
+        transport_->readAll(reinterpret_cast<uint8_t*>(&frame[0]), size);
+      }
+
+      TMessageType mtype;
+      int32_t seqid;
+      peekBuffer->resetBuffer(reinterpret_cast<uint8_t*>(&frame[0]), size);
+      peekProtocol->readMessageBegin(fname, mtype, seqid);
+      deliver(seqid, frame);
+    }
+  } catch (const TException& x) {
+    if (!isDead()) {
+      GlobalOutput.printf("TConcurrentClientMux: reader stopped: %s", x.what());
+    }
+  }
+  markDead();
+}
+
+void TConcurrentClientMux::deliver(int32_t seqid, std::string& frame) {
+  Slot& slot = slots_[static_cast<uint32_t>(seqid) & mask_];
+  Synchronized s(slot.monitor);
+  if (slot.seqid != seqid || slot.state.load(boost::memory_order_relaxed) != SLOT_WAITING) {
+    GlobalOutput.printf("TConcurrentClientMux: dropped response with unknown seqid %d", seqid);
+    return;
+  }
+  // Hand the frame over and take the slot's old buffer for the next read
+  slot.response.swap(frame);
+  slot.state.store(SLOT_DONE, boost::memory_order_relaxed);
+  slot.monitor.notify();
+}
+
+void TConcurrentClientMux::markDead() {
+  dead_.store(true, boost::memory_order_release);
+  for (uint32_t i = 0; i <= mask_; ++i) {
+    Synchronized s(slots_[i].monitor);
+    slots_[i].monitor.notifyAll();
+  }
+  Synchronized s(capacityMonitor_);
+  capacityMonitor_.notifyAll();
+}
+
+void TConcurrentClientMux::throwDeadConnection() {
+  throw TTransportException(TTransportException::NOT_OPEN,
+                            "this client died on another thread, and is now in an unusable state");
+}
+
+TConcurrentMuxSendSentry::TConcurrentMuxSendSentry(TConcurrentClientMux* mux)
+  : mux_(*mux), seqid_(0), sent_(false) {
+  slot_ = mux_.claimSlot(seqid_);
+}
+
+TConcurrentMuxSendSentry::~TConcurrentMuxSendSentry() {
+  if (!sent_) {
+    mux_.releaseSlot(slot_);
+  }
+}
+
+shared_ptr<TProtocol> TConcurrentMuxSendSentry::getProtocol() {
+  return mux_.slots_[slot_].outputProtocol;
+}
+
+int32_t TConcurrentMuxSendSentry::send(bool oneway) {
+  mux_.sendFrame(slot_, oneway);
+  if (oneway) {
+    mux_.releaseSlot(slot_);
+  }
+  sent_ = true;
+  return seqid_;
+}
+
+TConcurrentMuxRecvSentry::TConcurrentMuxRecvSentry(TConcurrentClientMux* mux, int32_t seqid)
+  : mux_(*mux), slot_(static_cast<uint32_t>(seqid) & mux->mask_) {
+  TConcurrentClientMux::Slot& slot = mux_.slots_[slot_];
+  int state = slot.state.load(boost::memory_order_acquire);
+  if (slot.seqid != seqid
+      || (state != TConcurrentClientMux::SLOT_WAITING && state != TConcurrentClientMux::SLOT_DONE)) {
+    throw TApplicationException(TApplicationException::BAD_SEQUENCE_ID,
+                                "no call is waiting for this seqid");
+  }
+  try {
+    mux_.waitForResponse(slot_);
+  } catch (...) {
+    mux_.releaseSlot(slot_);
+    throw;
+  }
+}
+
+TConcurrentMuxRecvSentry::~TConcurrentMuxRecvSentry() {
+  mux_.releaseSlot(slot_);
+}
+
+shared_ptr<TProtocol> TConcurrentMuxRecvSentry::getProtocol() {
+  return mux_.slots_[slot_].inputProtocol;
+}
+}
+}
+} // apache::thrift::async
@@ -0,0 +1,185 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements. See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership. The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied. See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+#ifndef _THRIFT_TCONCURRENTCLIENTMUX_H_
+#define _THRIFT_TCONCURRENTCLIENTMUX_H_ 1
+
+#include <thrift/protocol/TProtocol.h>
+#include <thrift/transport/TBufferTransports.h>
+#include <thrift/concurrency/Monitor.h>
+#include <thrift/concurrency/Mutex.h>
+#include <thrift/concurrency/Thread.h>
+#include <boost/atomic.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/scoped_array.hpp>
+#include <boost/shared_ptr.hpp>
+#include <string>
+
+namespace apache {
+namespace thrift {
+namespace async {
+
+class TConcurrentClientMux;
+
+/**
+ * Claims a call slot and sends the request written to getProtocol().
+ * If the sentry goes away before send(), the slot is given back.
+ */
+class TConcurrentMuxSendSentry : boost::noncopyable {
+public:
+  explicit TConcurrentMuxSendSentry(TConcurrentClientMux* mux);
+  ~TConcurrentMuxSendSentry();
+
+  /// Sequence id to write into the request.
+  int32_t getSeqId() const { return seqid_; }
+
+  /// Protocol to write the request to.
+  boost::shared_ptr< ::apache::thrift::protocol::TProtocol> getProtocol();
+
+  /**
+   * Sends the request as one frame.
+   *
+   * @param oneway true if no response is expected.
+   * @return the sequence id to pass to TConcurrentMuxRecvSentry.
+   */
+  int32_t send(bool oneway);
+
+private:
+  TConcurrentClientMux& mux_;
+  uint32_t slot_;
+  int32_t seqid_;
+  bool sent_;
+};
+
+/**
+ * Waits for the response to a call sent with TConcurrentMuxSendSentry and
+ * gives back its slot when destroyed.
+ */
+class TConcurrentMuxRecvSentry : boost::noncopyable {
+public:
+  TConcurrentMuxRecvSentry(TConcurrentClientMux* mux, int32_t seqid);
+  ~TConcurrentMuxRecvSentry();
+
+  /// Protocol to read the response from.
+  boost::shared_ptr< ::apache::thrift::protocol::TProtocol> getProtocol();
+
+private:
+  TConcurrentClientMux& mux_;
+  uint32_t slot_;
+};
+
+/**
+ * Lets many threads make calls over one framed connection at the same time.
+ *
+ * Each call serializes into a buffer of its own and writes it as one frame.
+ * A reader thread reads the response frames and hands each one to the call
+ * with the same sequence id, so responses may come back in any order and no
+ * caller ever reads on behalf of another.  Calls are kept in a fixed table
+ * indexed by sequence id, which the reader looks up without locking.
+ *
+ * Generated concurrent clients take a TConcurrentClientMux in place of
+ * protocols.  The server must use framed transport.
+ */
+class TConcurrentClientMux : boost::noncopyable {
+public:
+  static const uint32_t DEFAULT_MAX_PENDING = 1024;
+  static const uint32_t DEFAULT_MAX_FRAME_SIZE = 256 * 1024 * 1024;
+
+  /**
+   * Starts the reader thread on an open transport.
+   *
+   * @param transport the connection; the mux does the framing itself.
+   * @param protocolFactory the protocol calls are made with.
+   * @param maxPending calls that may be in flight at once, rounded up to a
+   *        power of two.  More callers wait for a call to finish.
+   */
+  TConcurrentClientMux(
+      boost::shared_ptr< ::apache::thrift::transport::TTransport> transport,
+      boost::shared_ptr< ::apache::thrift::protocol::TProtocolFactory> protocolFactory,
+      uint32_t maxPending = DEFAULT_MAX_PENDING);
+
+  /// Closes the transport and waits for the reader thread.
+  ~TConcurrentClientMux();
+
+  /**
+   * Closes the transport.  Calls in flight and all later ones fail with a
+   * TTransportException.
+   */
+  void close();
+
+  /// Whether the connection failed or was closed.
+  bool isDead() const { return dead_.load(boost::memory_order_acquire); }
+
+  /// Set the largest response frame that will be accepted.
+  void setMaxFrameSize(uint32_t maxFrameSize) { maxFrameSize_ = maxFrameSize; }
+
+private:
+  enum SlotState { SLOT_FREE, SLOT_CLAIMED, SLOT_WAITING, SLOT_DONE };
+
+  struct Slot {
+    Slot() : state(SLOT_FREE), seqid(0) {}
+
+    boost::atomic<int> state;
+    int32_t seqid;
+    ::apache::thrift::concurrency::Monitor monitor;
+
+    boost::shared_ptr< ::apache::thrift::transport::TMemoryBuffer> output;
+    boost::shared_ptr< ::apache::thrift::protocol::TProtocol> outputProtocol;
+    boost::shared_ptr< ::apache::thrift::transport::TMemoryBuffer> input;
+    boost::shared_ptr< ::apache::thrift::protocol::TProtocol> inputProtocol;
+    std::string response;
+  };
+
+  class Reader;
+
+  uint32_t claimSlot(int32_t& seqid);
+  void releaseSlot(uint32_t index);
+  void sendFrame(uint32_t index, bool oneway);
+  void waitForResponse(uint32_t index);
+  void readResponses();
+  void deliver(int32_t seqid, std::string& frame);
+  void markDead();
+  void throwDeadConnection();
+
+  boost::shared_ptr< ::apache::thrift::transport::TTransport> transport_;
+  boost::shared_ptr< ::apache::thrift::protocol::TProtocolFactory> protocolFactory_;
+
+  boost::scoped_array<Slot> slots_;
+  uint32_t mask_;
+  uint32_t maxFrameSize_;
+
+  boost::atomic<uint32_t> nextSeqId_;
+  boost::atomic<bool> dead_;
+
+  /// Callers waiting for a free slot
+  ::apache::thrift::concurrency::Monitor capacityMonitor_;
+  boost::atomic<int> capacityWaiters_;
+
+  /// Serializes frames on the wire
+  ::apache::thrift::concurrency::Mutex writeMutex_;
+
+  boost::shared_ptr< ::apache::thrift::concurrency::Thread> readerThread_;
+
+  friend class TConcurrentMuxSendSentry;
+  friend class TConcurrentMuxRecvSentry;
+};
+}
+}
+} // apache::thrift::async
+
+#endif // _THRIFT_TCONCURRENTCLIENTMUX_H_
@@ -24,9 +24,12 @@
 #include <thrift/concurrency/Monitor.h>
 #include <thrift/concurrency/Util.h>
 
+#include <boost/atomic.hpp>
+#include <boost/scoped_array.hpp>
 #include <boost/shared_ptr.hpp>
 
 #include <assert.h>
+#include <map>
 #include <queue>
 #include <set>
 
@@ -547,6 +550,550 @@ private:
   Monitor monitor_;
 };
 
+/**
+ * ThreadManager whose task queue is a bounded lock-free ring.
+ *
+ * Producers and workers hand tasks over through a multi-producer,
+ * multi-consumer array queue (after Dmitry Vyukov's design): each slot
+ * carries a sequence number that tells whether it is free or filled for a
+ * given lap, so add() and dequeue only contend on a compare-and-swap of the
+ * head or tail index.  Locks are taken only to put idle workers to sleep and
+ * wake them up, to block add() while the queue is full, and to add or
+ * remove workers.
+ *
+ * The queue is always bounded.  A pendingTaskCountMax of 0 selects
+ * DEFAULT_CAPACITY pending tasks.  Expired tasks are discarded, counted and
+ * passed to the expire callback when a worker reaches them, so
+ * removeExpiredTasks() has nothing to do.  remove() likewise only marks the
+ * task in its slot, and the worker that reaches it drops it.
+ */
+class LockFreeThreadManager : public ThreadManager {
+
+public:
+  static const size_t DEFAULT_CAPACITY = 64 * 1024;
+
+  LockFreeThreadManager(size_t workerCount, size_t pendingTaskCountMax);
+
+  ~LockFreeThreadManager() { stop(); }
+
+  void start();
+
+  void stop() { stopImpl(false); }
+
+  void join() { stopImpl(true); }
+
+  ThreadManager::STATE state() const { return state_; }
+
+  shared_ptr<ThreadFactory> threadFactory() const {
+    Synchronized s(monitor_);
+    return threadFactory_;
+  }
+
+  void threadFactory(shared_ptr<ThreadFactory> value) {
+    Synchronized s(monitor_);
+    threadFactory_ = value;
+  }
+
+  void addWorker(size_t value);
+
+  void removeWorker(size_t value);
+
+  size_t idleWorkerCount() const { return idleCount_; }
+
+  size_t workerCount() const { return workerCount_; }
+
+  size_t pendingTaskCount() const { return pendingCount_; }
+
+  size_t totalTaskCount() const { return pendingCount_ + activeCount_; }
+
+  size_t pendingTaskCountMax() const { return pendingTaskCountMax_; }
+
+  size_t expiredTaskCount() { return expiredCount_.exchange(0); }
+
+  void add(shared_ptr<Runnable> value, int64_t timeout, int64_t expiration);
+
+  void remove(shared_ptr<Runnable> task);
+
+  shared_ptr<Runnable> removeNextPending();
+
+  void removeExpiredTasks() {}
+
+  void setExpireCallback(ExpireCallback expireCallback) { expireCallback_ = expireCallback; }
+
+private:
+  class Worker;
+  friend class Worker;
+
+  struct Cell {
+    boost::atomic<size_t> sequence;
+    shared_ptr<Runnable> runnable;
+    int64_t expireTime;
+    // The task while it may still run; remove() clears it to cancel the task
+    boost::atomic<Runnable*> pending;
+  };
+
+  // Keeps the two ends of the ring on separate cache lines
+  struct Index {
+    char padBefore[64];
+    boost::atomic<size_t> value;
+    char padAfter[64 - sizeof(boost::atomic<size_t>)];
+  };
+
+  static const int SPIN_COUNT = 64;
+
+  void stopImpl(bool join);
+  bool canSleep();
+  bool reserve();
+  void enqueue(const shared_ptr<Runnable>& runnable, int64_t expireTime);
+  bool dequeue(shared_ptr<Runnable>& runnable, int64_t& expireTime);
+  bool take(shared_ptr<Runnable>& runnable, bool execute);
+  bool retire();
+
+  const size_t initialWorkerCount_;
+  const size_t pendingTaskCountMax_;
+  size_t mask_;
+  boost::scoped_array<Cell> cells_;
+  Index enqueuePos_;
+  Index dequeuePos_;
+
+  boost::atomic<size_t> pendingCount_;
+  boost::atomic<size_t> activeCount_;
+  boost::atomic<size_t> idleCount_;
+  boost::atomic<size_t> waitingAdds_;
+  boost::atomic<size_t> expiredCount_;
+  boost::atomic<size_t> workerCount_;
+  boost::atomic<size_t> workerMaxCount_;
+  ExpireCallback expireCallback_;
+
+  ThreadManager::STATE state_;
+  shared_ptr<ThreadFactory> threadFactory_;
+
+  Monitor monitor_;
+  Monitor addMonitor_;
+  Monitor workerMonitor_;
+
+  std::set<shared_ptr<Thread> > workers_;
+  std::set<shared_ptr<Thread> > deadWorkers_;
+  std::map<const Thread::id_t, shared_ptr<Thread> > idMap_;
+};
+
+const size_t LockFreeThreadManager::DEFAULT_CAPACITY;
+
+class LockFreeThreadManager::Worker : public Runnable {
+
+public:
+  Worker(LockFreeThreadManager* manager) : manager_(manager) {}
+
+  void run() {
+    bool active = false;
+    {
+      bool notifyManager = false;
+      {
+        Synchronized s(manager_->monitor_);
+        active = manager_->workerCount_ < manager_->workerMaxCount_;
+        if (active) {
+          manager_->workerCount_++;
+          notifyManager = manager_->workerCount_ == manager_->workerMaxCount_;
+        }
+      }
+
+      if (notifyManager) {
+        Synchronized s(manager_->workerMonitor_);
+        manager_->workerMonitor_.notify();
+      }
+    }
+
+    while (active) {
+      shared_ptr<Runnable> runnable;
+      bool shrinking = manager_->workerCount_ > manager_->workerMaxCount_;
+
+      // Spin briefly before going to sleep; under load the next task is
+      // usually only a few cycles away.
+      bool found = false;
+      if (!shrinking || manager_->state_ == ThreadManager::JOINING) {
+        for (int spin = 0; !found && spin < SPIN_COUNT; ++spin) {
+          found = manager_->take(runnable, true);
+        }
+      }
+
+      if (found) {
+        try {
+          runnable->run();
+        } catch (const std::exception& e) {
+          GlobalOutput.printf("[ERROR] task->run() raised an exception: %s", e.what());
+        } catch (...) {
+          GlobalOutput.printf("[ERROR] task->run() raised an unknown exception");
+        }
+        manager_->activeCount_--;
+        continue;
+      }
+
+      if (shrinking) {
+        // Retire and register as dead in one step, so removeWorker() cannot
+        // see the new worker count before this thread is in deadWorkers_
+        Synchronized w(manager_->workerMonitor_);
+        Synchronized s(manager_->monitor_);
+        if (manager_->retire()) {
+          manager_->deadWorkers_.insert(this->thread());
+          if (manager_->workerCount_ == manager_->workerMaxCount_) {
+            manager_->workerMonitor_.notify();
+          }
+          return;
+        }
+      }
+
+      /**
+       * Nothing to do.  The idle count is raised before pendingCount_ is
+       * checked, and add() publishes a task before it checks the idle count,
+       * so one side always sees the other.
+       */
+      Synchronized s(manager_->monitor_);
+      manager_->idleCount_++;
+      while (manager_->pendingCount_ == 0
+             && manager_->workerCount_ <= manager_->workerMaxCount_) {
+        manager_->monitor_.wait();
+      }
+      manager_->idleCount_--;
+    }
+
+    // Started while the pool was already full
+    Synchronized s(manager_->workerMonitor_);
+    manager_->deadWorkers_.insert(this->thread());
+  }
+
+private:
+  LockFreeThreadManager* manager_;
+};
+
+LockFreeThreadManager::LockFreeThreadManager(size_t workerCount, size_t pendingTaskCountMax)
+  : initialWorkerCount_(workerCount),
+    pendingTaskCountMax_(pendingTaskCountMax != 0 ? pendingTaskCountMax : DEFAULT_CAPACITY),
+    mask_(0),
+    pendingCount_(0),
+    activeCount_(0),
+    idleCount_(0),
+    waitingAdds_(0),
+    expiredCount_(0),
+    workerCount_(0),
+    workerMaxCount_(0),
+    state_(ThreadManager::UNINITIALIZED) {
+  size_t capacity = 2;
+  while (capacity < pendingTaskCountMax_) {
+    capacity *= 2;
+  }
+  mask_ = capacity - 1;
+  cells_.reset(new Cell[capacity]);
+  for (size_t ix = 0; ix < capacity; ix++) {
+    cells_[ix].sequence.store(ix, boost::memory_order_relaxed);
+    cells_[ix].expireTime = 0LL;
+    cells_[ix].pending.store(NULL, boost::memory_order_relaxed);
+  }
+  enqueuePos_.value.store(0, boost::memory_order_relaxed);
+  dequeuePos_.value.store(0, boost::memory_order_relaxed);
+}
+
+void LockFreeThreadManager::start() {
+  if (state_ == ThreadManager::STOPPED) {
+    return;
+  }
+
+  {
+    Synchronized s(monitor_);
+    if (state_ != ThreadManager::UNINITIALIZED) {
+      return;
+    }
+    if (!threadFactory_) {
+      throw InvalidArgumentException();
+    }
+    state_ = ThreadManager::STARTED;
+  }
+
+  addWorker(initialWorkerCount_);
+}
+
+void LockFreeThreadManager::stopImpl(bool join) {
+  bool doStop = false;
+  if (state_ == ThreadManager::STOPPED) {
+    return;
+  }
+
+  {
+    Synchronized s(monitor_);
+    if (state_ != ThreadManager::STOPPING && state_ != ThreadManager::JOINING
+        && state_ != ThreadManager::STOPPED) {
+      doStop = true;
+      state_ = join ? ThreadManager::JOINING : ThreadManager::STOPPING;
+    }
+  }
+
+  if (doStop) {
+    removeWorker(workerCount_);
+  }
+
+  {
+    Synchronized s(monitor_);
+    state_ = ThreadManager::STOPPED;
+  }
+}
+
+void LockFreeThreadManager::addWorker(size_t value) {
+  std::set<shared_ptr<Thread> > newThreads;
+  for (size_t ix = 0; ix < value; ix++) {
+    shared_ptr<Worker> worker(new Worker(this));
+    newThreads.insert(threadFactory_->newThread(worker));
+  }
+
+  {
+    Synchronized s(monitor_);
+    workerMaxCount_ += value;
+    workers_.insert(newThreads.begin(), newThreads.end());
+  }
+
+  for (std::set<shared_ptr<Thread> >::iterator ix = newThreads.begin(); ix != newThreads.end();
+       ++ix) {
+    (*ix)->start();
+    Synchronized s(monitor_);
+    idMap_.insert(std::pair<const Thread::id_t, shared_ptr<Thread> >((*ix)->getId(), *ix));
+  }
+
+  {
+    Synchronized s(workerMonitor_);
+    while (workerCount_ != workerMaxCount_) {
+      workerMonitor_.wait();
+    }
+  }
+}
+
+void LockFreeThreadManager::removeWorker(size_t value) {
+  {
+    Synchronized s(monitor_);
+    if (value > workerMaxCount_) {
+      throw InvalidArgumentException();
+    }
+
+    workerMaxCount_ -= value;
+    monitor_.notifyAll();
+  }
+
+  {
+    Synchronized s(workerMonitor_);
+
+    while (workerCount_ != workerMaxCount_) {
+      workerMonitor_.wait();
+    }
+
+    Synchronized m(monitor_);
+    for (std::set<shared_ptr<Thread> >::iterator ix = deadWorkers_.begin();
+         ix != deadWorkers_.end();
+         ++ix) {
+      idMap_.erase((*ix)->getId());
+      workers_.erase(*ix);
+    }
+
+    deadWorkers_.clear();
+  }
+}
+
+/**
+ * Decides, with workerMonitor_ and monitor_ held, whether the calling worker
+ * should exit.
+ */
+bool LockFreeThreadManager::retire() {
+  if (workerCount_ <= workerMaxCount_
+      || (state_ == ThreadManager::JOINING && pendingCount_ != 0)) {
+    return false;
+  }
+  workerCount_--;
+  return true;
+}
+
+bool LockFreeThreadManager::canSleep() {
+  const Thread::id_t id = threadFactory_->getCurrentThreadId();
+  Synchronized s(monitor_);
+  return idMap_.find(id) == idMap_.end();
+}
+
+/**
+ * Claims room for one task, failing if pendingTaskCountMax_ are pending.
+ * Since every filled slot is covered by a claim, enqueue() always finds a
+ * free slot afterwards.
+ */
+bool LockFreeThreadManager::reserve() {
+  size_t count = pendingCount_.load(boost::memory_order_relaxed);
+  do {
+    if (count >= pendingTaskCountMax_) {
+      return false;
+    }
+  } while (!pendingCount_.compare_exchange_weak(count, count + 1));
+  return true;
+}
+
+void LockFreeThreadManager::enqueue(const shared_ptr<Runnable>& runnable, int64_t expireTime) {
+  size_t pos = enqueuePos_.value.load(boost::memory_order_relaxed);
+  Cell* cell;
+  for (;;) {
+    cell = &cells_[pos & mask_];
+    size_t seq = cell->sequence.load(boost::memory_order_acquire);
+    if (seq == pos) {
+      if (enqueuePos_.value.compare_exchange_weak(pos, pos + 1, boost::memory_order_relaxed)) {
+        break;
+      }
+    } else {
+      // Another producer took this slot, or a worker is still emptying it
+      pos = enqueuePos_.value.load(boost::memory_order_relaxed);
+    }
+  }
+
+  cell->runnable = runnable;
+  cell->expireTime = expireTime;
+  cell->pending.store(runnable.get(), boost::memory_order_relaxed);
+  cell->sequence.store(pos + 1);
+}
+
+bool LockFreeThreadManager::dequeue(shared_ptr<Runnable>& runnable, int64_t& expireTime) {
+  size_t pos = dequeuePos_.value.load(boost::memory_order_relaxed);
+  Cell* cell;
+  for (;;) {
+    cell = &cells_[pos & mask_];
+    size_t seq = cell->sequence.load(boost::memory_order_acquire);
+    intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos + 1);
+    if (diff == 0) {
+      if (dequeuePos_.value.compare_exchange_weak(pos, pos + 1, boost::memory_order_relaxed)) {
+        break;
+      }
+    } else if (diff < 0) {
+      return false;
+    } else {
+      pos = dequeuePos_.value.load(boost::memory_order_relaxed);
+    }
+  }
+
+  runnable.swap(cell->runnable);
+  expireTime = cell->expireTime;
+  if (cell->pending.exchange(NULL) == NULL) {
+    // Removed while it was queued
+    runnable.reset();
+  }
+  cell->sequence.store(pos + mask_ + 1, boost::memory_order_release);
+  return true;
+}
+
+/**
+ * Dequeues the next task that has neither expired nor been removed.  If
+ * execute is set the task is counted as active until the caller decrements
+ * activeCount_.
+ */
+bool LockFreeThreadManager::take(shared_ptr<Runnable>& runnable, bool execute) {
+  int64_t now = 0LL; // we won't ask for the time until we need it
+
+  for (;;) {
+    int64_t expireTime;
+    if (!dequeue(runnable, expireTime)) {
+      return false;
+    }
+
+    bool removed = !runnable;
+    bool expired = false;
+    if (!removed && expireTime != 0LL) {
+      if (now == 0LL) {
+        now = Util::currentTime();
+      }
+      expired = expireTime <= now;
+    }
+
+    if (execute && !removed && !expired) {
+      activeCount_++;
+    }
+    pendingCount_--;
+    if (waitingAdds_ != 0) {
+      Synchronized s(addMonitor_);
+      addMonitor_.notify();
+    }
+
+    if (removed) {
+      continue;
+    }
+    if (!expired) {
+      return true;
+    }
+    if (expireCallback_) {
+      expireCallback_(runnable);
+    }
+    expiredCount_++;
+    runnable.reset();
+  }
+}
+
+void LockFreeThreadManager::add(shared_ptr<Runnable> value, int64_t timeout, int64_t expiration) {
+  if (state_ != ThreadManager::STARTED) {
+    throw IllegalStateException(
+        "LockFreeThreadManager::add ThreadManager "
+        "not started");
+  }
+
+  if (!reserve()) {
+    if (timeout < 0 || !canSleep()) {
+      throw TooManyPendingTasksException();
+    }
+
+    Synchronized s(addMonitor_);
+    waitingAdds_++;
+    try {
+      while (!reserve()) {
+        addMonitor_.wait(timeout);
+      }
+    } catch (...) {
+      waitingAdds_--;
+      throw;
+    }
+    waitingAdds_--;
+  }
+
+  enqueue(value, expiration != 0LL ? Util::currentTime() + expiration : 0LL);
+
+  // If a worker is idle wake it, otherwise the busy ones will get to the
+  // task in time
+  if (idleCount_ != 0) {
+    Synchronized s(monitor_);
+    monitor_.notify();
+  }
+}
+
+void LockFreeThreadManager::remove(shared_ptr<Runnable> task) {
+  if (state_ != ThreadManager::STARTED) {
+    throw IllegalStateException(
+        "LockFreeThreadManager::remove ThreadManager not "
+        "started");
+  }
+
+  // Clear the first slot still holding the task.  A worker that took the
+  // slot already has cleared it itself, so a task that started running is
+  // never matched.
+  size_t end = enqueuePos_.value.load(boost::memory_order_acquire);
+  for (size_t pos = dequeuePos_.value.load(boost::memory_order_acquire); pos != end; ++pos) {
+    Cell* cell = &cells_[pos & mask_];
+    if (cell->sequence.load(boost::memory_order_acquire) != pos + 1) {
+      continue;
+    }
+    Runnable* expected = task.get();
+    if (cell->pending.compare_exchange_strong(expected, NULL)) {
+      return;
+    }
+  }
+}
+
+shared_ptr<Runnable> LockFreeThreadManager::removeNextPending() {
+  if (state_ != ThreadManager::STARTED) {
+    throw IllegalStateException(
+        "LockFreeThreadManager::removeNextPending "
+        "ThreadManager not started");
+  }
+
+  shared_ptr<Runnable> runnable;
+  take(runnable, false);
+  return runnable;
+}
+
 shared_ptr<ThreadManager> ThreadManager::newThreadManager() {
   return shared_ptr<ThreadManager>(new ThreadManager::Impl());
 }
@@ -555,6 +1102,11 @@ shared_ptr<ThreadManager> ThreadManager::newSimpleThreadManager(size_t count,
                                                                 size_t pendingTaskCountMax) {
   return shared_ptr<ThreadManager>(new SimpleThreadManager(count, pendingTaskCountMax));
 }
+
+shared_ptr<ThreadManager> ThreadManager::newLockFreeThreadManager(size_t count,
+                                                                  size_t pendingTaskCountMax) {
+  return shared_ptr<ThreadManager>(new LockFreeThreadManager(count, pendingTaskCountMax));
+}
 }
 }
 } // apache::thrift::concurrency
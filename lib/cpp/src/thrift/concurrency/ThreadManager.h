@@ -151,7 +151,10 @@ public:
                    int64_t expiration = 0LL) = 0;
 
   /**
-   * Removes a pending task
+   * Removes a pending task.  A task that is already running is not affected.
+   *
+   * Only the lock-free thread manager implements this; the others leave the
+   * task queued.
    */
   virtual void remove(boost::shared_ptr<Runnable> task) = 0;
 
@@ -185,6 +188,18 @@ public:
   static boost::shared_ptr<ThreadManager> newSimpleThreadManager(size_t count = 4,
                                                                  size_t pendingTaskCountMax = 0);
 
+  /**
+   * Creates a thread manager like newSimpleThreadManager() whose task queue is
+   * a bounded lock-free ring, so that add() and the workers do not serialize
+   * on a mutex under load.  The queue holds at most pendingTaskCountMax tasks;
+   * 0 selects a default capacity of 65536.  Expired tasks are dropped when a
+   * worker reaches them rather than by removeExpiredTasks().  Likewise
+   * remove() cancels the task in place: it is not run, but stays counted by
+   * pendingTaskCount() until a worker reaches and drops it.
+   */
+  static boost::shared_ptr<ThreadManager> newLockFreeThreadManager(size_t count = 4,
+                                                                   size_t pendingTaskCountMax = 0);
+
   class Task;
 
   class Worker;
@@ -19,11 +19,18 @@
 
 #include <thrift/concurrency/TimerManager.h>
 #include <thrift/concurrency/Exception.h>
+#include <thrift/concurrency/Mutex.h>
 #include <thrift/concurrency/Util.h>
 
 #include <assert.h>
-#include <iostream>
-#include <set>
+#include <algorithm>
+#include <limits>
+
+#if defined(_MSC_VER)
+#define THRIFT_TIMER_TLS __declspec(thread)
+#else
+#define THRIFT_TIMER_TLS __thread
+#endif
 
 namespace apache {
 namespace thrift {
@@ -31,6 +38,14 @@ namespace concurrency {
 
 using boost::shared_ptr;
 
+/// Shard of the calling thread plus one, or 0 until it first adds a task
+static THRIFT_TIMER_TLS size_t threadShard = 0;
+
+/// Hands out the thread shards round-robin
+static boost::atomic<size_t> nextThreadShard(0);
+
+static const int64_t NEVER = (std::numeric_limits<int64_t>::max)();
+
 /**
  * TimerManager class
  *
@@ -41,7 +56,14 @@ class TimerManager::Task : public Runnable {
 public:
   enum STATE { WAITING, EXECUTING, CANCELLED, COMPLETE };
 
-  Task(shared_ptr<Runnable> runnable) : runnable_(runnable), state_(WAITING) {}
+  Task(shared_ptr<Runnable> runnable, int64_t expiration, size_t shard)
+    : runnable_(runnable),
+      state_(WAITING),
+      expiration_(expiration),
+      shard_(shard),
+      slot_(NULL),
+      prev_(NULL),
+      next_(NULL) {}
 
   ~Task() {}
 
@@ -54,8 +76,230 @@ public:
 
 private:
   shared_ptr<Runnable> runnable_;
+  friend class TimerManager;
   friend class TimerManager::Dispatcher;
+  friend class TimerManager::Shard;
   STATE state_;
+  int64_t expiration_;
+  size_t shard_;
+  /// Keeps the task alive while it is in a wheel
+  shared_ptr<Task> self_;
+  /// The wheel slot the task is in, or NULL, and its neighbours there
+  Task** slot_;
+  Task* prev_;
+  Task* next_;
+};
+
+/**
+ * One set of timing wheels.  Level 0 has a slot for each of the next 256
+ * milliseconds, level 1 one for each of the next 256 spans of 256
+ * milliseconds, and so on.  When time reaches the start of a span, the
+ * tasks in its slot are put back into the wheels, one level lower; tasks
+ * expire from level 0.  All members are guarded by mutex_.
+ */
+class TimerManager::Shard {
+
+public:
+  Shard() : current_(Util::currentTime()), count_(0) {
+    for (int level = 0; level < LEVELS; ++level) {
+      levelCount_[level] = 0;
+      for (int index = 0; index < SLOTS; ++index) {
+        slots_[level][index] = NULL;
+      }
+    }
+  }
+
+  ~Shard() { clear(); }
+
+  /**
+   * Puts a task into the slot for its expiration.
+   *
+   * @param now the current time, which the wheels catch up to if empty.
+   */
+  void insert(Task* task, int64_t now) {
+    if (count_ == 0 && current_ < now) {
+      current_ = now;
+    }
+    insert(task);
+  }
+
+  /// Takes a task out of its slot.
+  void unlink(Task* task) {
+    if (task->prev_ != NULL) {
+      task->prev_->next_ = task->next_;
+    } else {
+      *task->slot_ = task->next_;
+    }
+    if (task->next_ != NULL) {
+      task->next_->prev_ = task->prev_;
+    }
+    --levelCount_[(task->slot_ - &slots_[0][0]) / SLOTS];
+    --count_;
+    task->slot_ = NULL;
+    task->prev_ = NULL;
+    task->next_ = NULL;
+  }
+
+  /**
+   * Moves the wheels up to now and takes the tasks due by then out.
+   *
+   * @param expired where the expired tasks are appended.
+   */
+  void advance(int64_t now, std::vector<shared_ptr<Task> >& expired) {
+    while (current_ <= now) {
+      if (count_ == 0) {
+        current_ = now + 1;
+        break;
+      }
+
+      int index = static_cast<int>(current_ & (SLOTS - 1));
+      if (index == 0) {
+        // The start of a span of every level whose lower bits are all 0
+        for (int level = 1; level < LEVELS; ++level) {
+          int shift = LEVEL_BITS * level;
+          cascade(level, static_cast<int>((current_ >> shift) & (SLOTS - 1)));
+          if (((current_ >> shift) & (SLOTS - 1)) != 0) {
+            break;
+          }
+        }
+      } else if (levelCount_[0] == 0) {
+        // Nothing can expire before the next span starts
+        current_ = (std::min)(now + 1, (current_ | (SLOTS - 1)) + 1);
+        continue;
+      }
+
+      Task* task;
+      while ((task = slots_[0][index]) != NULL) {
+        unlink(task);
+        task->state_ = Task::EXECUTING;
+        expired.push_back(shared_ptr<Task>());
+        expired.back().swap(task->self_);
+      }
+      ++current_;
+    }
+  }
+
+  /**
+   * Returns the time anything in the wheels is due next: a task to expire,
+   * or a slot whose tasks move down a level.
+   */
+  int64_t nextEvent() const {
+    int64_t next = NEVER;
+    if (count_ == 0) {
+      return next;
+    }
+    for (int level = 0; level < LEVELS; ++level) {
+      if (levelCount_[level] == 0) {
+        continue;
+      }
+      // Spans from the first one that has not started yet
+      int shift = LEVEL_BITS * level;
+      int64_t first = (current_ + (int64_t(1) << shift) - 1) >> shift;
+      for (int64_t span = first; span < first + SLOTS; ++span) {
+        if (slots_[level][span & (SLOTS - 1)] != NULL) {
+          next = (std::min)(next, span << shift);
+          break;
+        }
+      }
+    }
+    return next;
+  }
+
+  /**
+   * Cancels the tasks that would run runnable.
+   *
+   * @return the number of tasks cancelled.
+   */
+  size_t cancel(const shared_ptr<Runnable>& runnable) {
+    size_t cancelled = 0;
+    for (int level = 0; level < LEVELS; ++level) {
+      for (int index = 0; index < SLOTS; ++index) {
+        Task* task = slots_[level][index];
+        while (task != NULL) {
+          Task* next = task->next_;
+          if (task->runnable_ == runnable) {
+            cancel(task);
+            ++cancelled;
+          }
+          task = next;
+        }
+      }
+    }
+    return cancelled;
+  }
+
+  /// Cancels a task that is in the wheels.
+  void cancel(Task* task) {
+    unlink(task);
+    task->state_ = Task::CANCELLED;
+    // May delete the task
+    task->self_.reset();
+  }
+
+  /// Drops every task.
+  void clear() {
+    for (int level = 0; level < LEVELS; ++level) {
+      for (int index = 0; index < SLOTS; ++index) {
+        while (slots_[level][index] != NULL) {
+          cancel(slots_[level][index]);
+        }
+      }
+    }
+  }
+
+  Mutex mutex_;
+
+private:
+  static const int LEVEL_BITS = 8;
+  static const int LEVELS = 4;
+  static const int SLOTS = 1 << LEVEL_BITS;
+
+  void insert(Task* task) {
+    int64_t when = task->expiration_;
+    int64_t delta = when - current_;
+    int level = 0;
+    if (delta < 0) {
+      // Overdue; expires right away
+      when = current_;
+    } else {
+      while (level < LEVELS - 1 && delta >= int64_t(1) << (LEVEL_BITS * (level + 1))) {
+        ++level;
+      }
+      if (delta >= int64_t(1) << (LEVEL_BITS * LEVELS)) {
+        // Beyond the wheels; goes into the last slot and is placed again
+        // from there
+        when = current_ + (int64_t(1) << (LEVEL_BITS * LEVELS)) - 1;
+      }
+    }
+
+    Task** slot = &slots_[level][(when >> (LEVEL_BITS * level)) & (SLOTS - 1)];
+    task->slot_ = slot;
+    task->prev_ = NULL;
+    task->next_ = *slot;
+    if (*slot != NULL) {
+      (*slot)->prev_ = task;
+    }
+    *slot = task;
+    ++levelCount_[level];
+    ++count_;
+  }
+
+  /// Puts the tasks of a slot back into the wheels, a level lower.
+  void cascade(int level, int index) {
+    Task* task = slots_[level][index];
+    while (task != NULL) {
+      Task* next = task->next_;
+      unlink(task);
+      insert(task);
+      task = next;
+    }
+  }
+
+  /// The next millisecond to process
+  int64_t current_;
+  size_t count_;
+  size_t levelCount_[LEVELS];
+  Task* slots_[LEVELS][SLOTS];
 };
 
 class TimerManager::Dispatcher : public Runnable {
@@ -68,8 +312,8 @@ public:
   /**
    * Dispatcher entry point
    *
-   * As long as dispatcher thread is running, pull tasks off the task taskMap_
-   * and execute.
+   * As long as dispatcher thread is running, move the wheels along, execute
+   * the tasks that expired and sleep until something is due again.
    */
   void run() {
     {
@@ -80,48 +324,42 @@ public:
       }
     }
 
-    do {
-      std::set<shared_ptr<TimerManager::Task> > expiredTasks;
-      {
-        Synchronized s(manager_->monitor_);
-        task_iterator expiredTaskEnd;
-        int64_t now = Util::currentTime();
-        while (manager_->state_ == TimerManager::STARTED
-               && (expiredTaskEnd = manager_->taskMap_.upper_bound(now))
-                  == manager_->taskMap_.begin()) {
-          int64_t timeout = 0LL;
-          if (!manager_->taskMap_.empty()) {
-            timeout = manager_->taskMap_.begin()->first - now;
-          }
-          assert((timeout != 0 && manager_->taskCount_ > 0)
-                 || (timeout == 0 && manager_->taskCount_ == 0));
-          try {
-            manager_->monitor_.wait(timeout);
-          } catch (TimedOutException&) {
-          }
-          now = Util::currentTime();
-        }
-
-        if (manager_->state_ == TimerManager::STARTED) {
-          for (task_iterator ix = manager_->taskMap_.begin(); ix != expiredTaskEnd; ix++) {
-            shared_ptr<TimerManager::Task> task = ix->second;
-            expiredTasks.insert(task);
-            if (task->state_ == TimerManager::Task::WAITING) {
-              task->state_ = TimerManager::Task::EXECUTING;
-            }
-            manager_->taskCount_--;
-          }
-          manager_->taskMap_.erase(manager_->taskMap_.begin(), expiredTaskEnd);
-        }
+    std::vector<shared_ptr<TimerManager::Task> > expiredTasks;
+    while (manager_->state_ == TimerManager::STARTED) {
+      // Anything added while the shards are looked at wakes us up again
+      manager_->nextWakeup_ = NEVER;
+      int64_t now = Util::currentTime();
+      int64_t next = NEVER;
+      for (size_t ix = 0; ix < manager_->shards_.size(); ++ix) {
+        TimerManager::Shard& shard = *manager_->shards_[ix];
+        Guard g(shard.mutex_);
+        shard.advance(now, expiredTasks);
+        next = (std::min)(next, shard.nextEvent());
       }
+      manager_->nextWakeup_ = next;
+      manager_->taskCount_ -= expiredTasks.size();
 
-      for (std::set<shared_ptr<Task> >::iterator ix = expiredTasks.begin();
+      for (std::vector<shared_ptr<Task> >::iterator ix = expiredTasks.begin();
            ix != expiredTasks.end();
            ++ix) {
         (*ix)->run();
       }
+      expiredTasks.clear();
 
-    } while (manager_->state_ == TimerManager::STARTED);
+      Synchronized s(manager_->monitor_);
+      if (manager_->kicked_) {
+        manager_->kicked_ = false;
+        continue;
+      }
+      now = Util::currentTime();
+      if (manager_->state_ != TimerManager::STARTED || next <= now) {
+        continue;
+      }
+      try {
+        manager_->monitor_.wait(next == NEVER ? 0LL : next - now);
+      } catch (TimedOutException&) {
+      }
+    }
 
     {
       Synchronized s(manager_->monitor_);
@@ -143,10 +381,15 @@ private:
 #pragma warning(disable : 4355) // 'this' used in base member initializer list
 #endif
 
-TimerManager::TimerManager()
+TimerManager::TimerManager(size_t shardCount)
   : taskCount_(0),
     state_(TimerManager::UNINITIALIZED),
+    nextWakeup_(NEVER),
+    kicked_(false),
     dispatcher_(shared_ptr<Dispatcher>(new Dispatcher(this))) {
+  for (size_t ix = 0; ix < (std::max)(shardCount, size_t(1)); ++ix) {
+    shards_.push_back(shared_ptr<Shard>(new Shard()));
+  }
 }
 
 #if defined(_MSC_VER)
@@ -212,7 +455,11 @@ void TimerManager::stop() {
 
   if (doStop) {
     // Clean up any outstanding tasks
-    taskMap_.clear();
+    for (size_t ix = 0; ix < shards_.size(); ++ix) {
+      Guard g(shards_[ix]->mutex_);
+      shards_[ix]->clear();
+    }
+    taskCount_ = 0;
 
     // Remove dispatcher's reference to us.
     dispatcher_->manager_ = NULL;
@@ -234,34 +481,23 @@ size_t TimerManager::taskCount() const {
 }
 
 void TimerManager::add(shared_ptr<Runnable> task, int64_t timeout) {
-  int64_t now = Util::currentTime();
-  timeout += now;
-
-  {
-    Synchronized s(monitor_);
-    if (state_ != TimerManager::STARTED) {
-      throw IllegalStateException();
-    }
+  addTimer(task, timeout);
+}
 
-    // If the task map is empty, we will kick the dispatcher for sure. Otherwise, we kick him
-    // if the expiration time is shorter than the current value. Need to test before we insert,
-    // because the new task might insert at the front.
-    bool notifyRequired = (taskCount_ == 0) ? true : timeout < taskMap_.begin()->first;
+void TimerManager::add(shared_ptr<Runnable> task, const struct THRIFT_TIMESPEC& value) {
+  addTimer(task, value);
+}
 
-    taskCount_++;
-    taskMap_.insert(
-        std::pair<int64_t, shared_ptr<Task> >(timeout, shared_ptr<Task>(new Task(task))));
+void TimerManager::add(shared_ptr<Runnable> task, const struct timeval& value) {
+  addTimer(task, value);
+}
 
-    // If the task map was empty, or if we have an expiration that is earlier
-    // than any previously seen, kick the dispatcher so it can update its
-    // timeout
-    if (notifyRequired) {
-      monitor_.notify();
-    }
-  }
+TimerManager::Timer TimerManager::addTimer(shared_ptr<Runnable> task, int64_t timeout) {
+  return addAt(task, Util::currentTime() + timeout);
 }
 
-void TimerManager::add(shared_ptr<Runnable> task, const struct THRIFT_TIMESPEC& value) {
+TimerManager::Timer TimerManager::addTimer(shared_ptr<Runnable> task,
+                                           const struct THRIFT_TIMESPEC& value) {
 
   int64_t expiration;
   Util::toMilliseconds(expiration, value);
@@ -272,10 +508,11 @@ void TimerManager::add(shared_ptr<Runnable> task, const struct THRIFT_TIMESPEC&
     throw InvalidArgumentException();
   }
 
-  add(task, expiration - now);
+  return addAt(task, expiration);
 }
 
-void TimerManager::add(shared_ptr<Runnable> task, const struct timeval& value) {
+TimerManager::Timer TimerManager::addTimer(shared_ptr<Runnable> task,
+                                           const struct timeval& value) {
 
   int64_t expiration;
   Util::toMilliseconds(expiration, value);
@@ -286,15 +523,78 @@ void TimerManager::add(shared_ptr<Runnable> task, const struct timeval& value) {
     throw InvalidArgumentException();
   }
 
-  add(task, expiration - now);
+  return addAt(task, expiration);
+}
+
+TimerManager::Timer TimerManager::addAt(shared_ptr<Runnable> task, int64_t expiration) {
+  if (state_ != TimerManager::STARTED) {
+    throw IllegalStateException();
+  }
+
+  if (threadShard == 0) {
+    threadShard = ++nextThreadShard;
+  }
+  size_t shardIndex = (threadShard - 1) % shards_.size();
+  shared_ptr<Task> timer(new Task(task, expiration, shardIndex));
+
+  // Counted first so the dispatcher never takes the count below zero
+  taskCount_++;
+  {
+    Shard& shard = *shards_[shardIndex];
+    Guard g(shard.mutex_);
+    timer->self_ = timer;
+    shard.insert(timer.get(), Util::currentTime());
+  }
+  kick(expiration);
+  return timer;
+}
+
+void TimerManager::kick(int64_t expiration) {
+  // Most tasks are due after whatever the dispatcher waits for already
+  if (expiration < nextWakeup_) {
+    Synchronized s(monitor_);
+    kicked_ = true;
+    if (expiration < nextWakeup_) {
+      nextWakeup_ = expiration;
+    }
+    monitor_.notify();
+  }
 }
 
 void TimerManager::remove(shared_ptr<Runnable> task) {
-  (void)task;
-  Synchronized s(monitor_);
   if (state_ != TimerManager::STARTED) {
     throw IllegalStateException();
   }
+
+  size_t removed = 0;
+  for (size_t ix = 0; ix < shards_.size(); ++ix) {
+    Guard g(shards_[ix]->mutex_);
+    removed += shards_[ix]->cancel(task);
+  }
+  if (removed == 0) {
+    throw NoSuchTaskException();
+  }
+  taskCount_ -= removed;
+}
+
+void TimerManager::remove(Timer timer) {
+  if (state_ != TimerManager::STARTED) {
+    throw IllegalStateException();
+  }
+
+  shared_ptr<Task> task = timer.lock();
+  if (!task) {
+    throw UncancellableTaskException();
+  }
+  {
+    Shard& shard = *shards_[task->shard_];
+    Guard g(shard.mutex_);
+    if (task->slot_ == NULL) {
+      throw UncancellableTaskException();
+    }
+    shard.cancel(task.get());
+  }
+  taskCount_--;
 }
 
 TimerManager::STATE TimerManager::state() const {
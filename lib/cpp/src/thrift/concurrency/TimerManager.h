@@ -24,8 +24,10 @@
 #include <thrift/concurrency/Monitor.h>
 #include <thrift/concurrency/Thread.h>
 
+#include <boost/atomic.hpp>
 #include <boost/shared_ptr.hpp>
-#include <map>
+#include <boost/weak_ptr.hpp>
+#include <vector>
 #include <time.h>
 
 namespace apache {
@@ -37,12 +39,35 @@ namespace concurrency {
  *
  * This class dispatches timer tasks when they fall due.
  *
+ * Tasks are kept in hierarchical timing wheels with a resolution of one
+ * millisecond: four levels of 256 slots each, where a task moves down a
+ * level whenever the slot it is in comes up, until it expires from the
+ * lowest one.  Adding a task and cancelling it through the Timer handle
+ * addTimer() returns are O(1).  The wheels are sharded, each with its own lock,
+ * and every thread adds to the shard it was assigned on first use, so
+ * threads adding timeouts at the same time do not contend.
+ *
  * @version $Id:$
  */
 class TimerManager {
 
+  class Task;
+
 public:
-  TimerManager();
+  /// Number of shards a TimerManager uses by default
+  static const size_t DEFAULT_SHARD_COUNT = 8;
+
+  /**
+   * Handle for a task that was added, which remove() can cancel it through.
+   * It does not keep the task alive once it has run or been cancelled.
+   */
+  typedef boost::weak_ptr<Task> Timer;
+
+  /**
+   * @param shardCount number of wheels, each with a lock of its own, that
+   *                   the tasks are spread over.
+   */
+  explicit TimerManager(size_t shardCount = DEFAULT_SHARD_COUNT);
 
   virtual ~TimerManager();
 
@@ -89,35 +114,66 @@ public:
   virtual void add(boost::shared_ptr<Runnable> task, const struct timeval& timeout);
 
   /**
-   * Removes a pending task
+   * Like add(), and returns a handle that remove(Timer) can cancel the task
+   * through without looking at the other pending tasks.
+   *
+   * @param task The task to execute
+   * @param timeout Time in milliseconds to delay before executing task
+   * @return handle to cancel the task with
+   */
+  virtual Timer addTimer(boost::shared_ptr<Runnable> task, int64_t timeout);
+
+  /// See addTimer(boost::shared_ptr<Runnable>, int64_t).
+  virtual Timer addTimer(boost::shared_ptr<Runnable> task, const struct THRIFT_TIMESPEC& timeout);
+
+  /// See addTimer(boost::shared_ptr<Runnable>, int64_t).
+  virtual Timer addTimer(boost::shared_ptr<Runnable> task, const struct timeval& timeout);
+
+  /**
+   * Removes all pending tasks for the given runnable.  This has to look at
+   * every pending task; remove(Timer) does not.
    *
    * @throws NoSuchTaskException Specified task doesn't exist. It was either
    *                             processed already or this call was made for a
    *                             task that was never added to this timer
+   */
+  virtual void remove(boost::shared_ptr<Runnable> task);
+
+  /**
+   * Removes the pending task a handle from addTimer() refers to.
    *
    * @throws UncancellableTaskException Specified task is already being
-   *                                    executed or has completed execution.
+   *                                    executed, has completed execution or
+   *                                    was removed already.
    */
-  virtual void remove(boost::shared_ptr<Runnable> task);
+  virtual void remove(Timer timer);
 
   enum STATE { UNINITIALIZED, STARTING, STARTED, STOPPING, STOPPED };
 
   virtual STATE state() const;
 
 private:
+  /// Adds a task due at the given absolute time in milliseconds.
+  Timer addAt(boost::shared_ptr<Runnable> task, int64_t expiration);
+
+  /// Wakes the dispatcher if a task due at expiration is earlier than it expects.
+  void kick(int64_t expiration);
+
   boost::shared_ptr<const ThreadFactory> threadFactory_;
-  class Task;
   friend class Task;
-  std::multimap<int64_t, boost::shared_ptr<Task> > taskMap_;
-  size_t taskCount_;
+  class Shard;
+  std::vector<boost::shared_ptr<Shard> > shards_;
+  boost::atomic<size_t> taskCount_;
   Monitor monitor_;
-  STATE state_;
+  boost::atomic<STATE> state_;
+  /// When the dispatcher is going to wake up next; guards against lost wakeups
+  /// together with kicked_, which monitor_ protects
+  boost::atomic<int64_t> nextWakeup_;
+  bool kicked_;
   class Dispatcher;
   friend class Dispatcher;
   boost::shared_ptr<Dispatcher> dispatcher_;
   boost::shared_ptr<Thread> dispatcherThread_;
-  typedef std::multimap<int64_t, boost::shared_ptr<TimerManager::Task> >::iterator task_iterator;
-  typedef std::pair<task_iterator, task_iterator> task_range;
 };
 }
 }
@@ -0,0 +1,110 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements. See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership. The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied. See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+#ifndef THRIFT_TDEADLINEPROCESSOR_H_
+#define THRIFT_TDEADLINEPROCESSOR_H_ 1
+
+#include <thrift/TApplicationException.h>
+#include <thrift/TDeadline.h>
+#include <thrift/TProcessor.h>
+#include <thrift/concurrency/Util.h>
+#include <thrift/processor/TMultiplexedProcessor.h>
+#include <thrift/protocol/THeaderProtocol.h>
+
+namespace apache {
+namespace thrift {
+
+/**
+ * <code>TDeadlineProcessor</code> enforces the deadlines clients send in the
+ * headers of their calls (see TDeadline).
+ *
+ * Calls received over a THeaderProtocol with a TDeadline::HEADER header
+ * whose deadline has passed by the time they are processed do not reach the
+ * wrapped processor: they are answered with a TApplicationException, or
+ * dropped if they are oneway.  Other calls are processed with their deadline
+ * current on the thread, or TDeadline::NONE if they have none.
+ *
+ * <blockquote><code>
+ *     shared_ptr<TProcessor> processor(new TDeadlineProcessor(
+ *         shared_ptr<TProcessor>(new CalculatorProcessor(handler))));
+ *     TNonblockingServer server(processor,
+ *                               shared_ptr<TProtocolFactory>(new THeaderProtocolFactory()),
+ *                               9090);
+ * </code></blockquote>
+ */
+class TDeadlineProcessor : public TProcessor {
+public:
+  explicit TDeadlineProcessor(boost::shared_ptr<TProcessor> processor) : processor_(processor) {}
+
+  bool process(boost::shared_ptr<protocol::TProtocol> in,
+               boost::shared_ptr<protocol::TProtocol> out,
+               void* connectionContext) {
+    boost::shared_ptr<protocol::THeaderProtocol> headerProtocol
+        = boost::dynamic_pointer_cast<protocol::THeaderProtocol>(in);
+    if (!headerProtocol) {
+      TDeadlineScope deadlineScope(TDeadline::NONE);
+      return processor_->process(in, out, connectionContext);
+    }
+
+    // Reading the beginning of the message reads the headers, which the
+    // wrapped processor gets to see through a StoredMessageProtocol
+    std::string name;
+    protocol::TMessageType type;
+    int32_t seqid;
+    in->readMessageBegin(name, type, seqid);
+
+    int64_t deadline = TDeadline::NONE;
+    int64_t timeout;
+    if (TDeadline::getTimeout(headerProtocol->getHeaders(), timeout)) {
+      int64_t now = concurrency::Util::currentTime();
+      int64_t received = TDeadline::received();
+      int64_t base = received != 0 ? received : now;
+      // A timeout too large to add up is as good as none
+      deadline = timeout > TDeadline::NONE - base ? TDeadline::NONE : base + timeout;
+      if (deadline <= now) {
+        in->skip(protocol::T_STRUCT);
+        in->readMessageEnd();
+        in->getTransport()->readEnd();
+        if (type != protocol::T_ONEWAY) {
+          TApplicationException x(TApplicationException::INTERNAL_ERROR,
+                                  "TDeadlineProcessor: deadline exceeded before processing");
+          out->writeMessageBegin(name, protocol::T_EXCEPTION, seqid);
+          x.write(out.get());
+          out->writeMessageEnd();
+          out->getTransport()->writeEnd();
+          out->getTransport()->flush();
+        }
+        return true;
+      }
+    }
+
+    TDeadlineScope deadlineScope(deadline);
+    return processor_->process(boost::shared_ptr<protocol::TProtocol>(
+                                   new protocol::StoredMessageProtocol(in, name, type, seqid)),
+                               out,
+                               connectionContext);
+  }
+
+private:
+  boost::shared_ptr<TProcessor> processor_;
+};
+}
+} // apache::thrift
+
+#endif // THRIFT_TDEADLINEPROCESSOR_H_
@@ -119,6 +119,17 @@ public:
 
   inline uint32_t writeBinary(const std::string& str);
 
+  inline uint32_t writeBinaryView(const TBinaryView& view);
+
+  // Strings are encoded like binary values
+  uint32_t writeStringView(const TBinaryView& view) { return writeBinaryView(view); }
+
+  inline uint32_t writeI32Array(const int32_t* values, uint32_t count);
+
+  inline uint32_t writeI64Array(const int64_t* values, uint32_t count);
+
+  inline uint32_t writeDoubleArray(const double* values, uint32_t count);
+
   /**
    * Reading functions
    */
@@ -166,10 +177,30 @@ public:
 
   inline uint32_t readBinary(std::string& str);
 
+  inline uint32_t readBinaryView(TBinaryView& view);
+
+  uint32_t readStringView(TBinaryView& view) { return readBinaryView(view); }
+
+  inline uint32_t readI32Array(int32_t* values, uint32_t count);
+
+  inline uint32_t readI64Array(int64_t* values, uint32_t count);
+
+  inline uint32_t readDoubleArray(double* values, uint32_t count);
+
 protected:
   template <typename StrType>
   uint32_t readStringBody(StrType& str, int32_t sz);
 
+  // Converting to and from the wire is the same permutation of bytes
+  static uint32_t wireWord(uint32_t word) { return ByteOrder_::toWire32(word); }
+  static uint64_t wireWord(uint64_t word) { return ByteOrder_::toWire64(word); }
+
+  template <typename Word_>
+  uint32_t writeWordArray(const void* values, uint32_t count);
+
+  template <typename Word_>
+  uint32_t readWordArray(void* values, uint32_t count);
+
   Transport_* trans_;
 
   int32_t string_limit_;
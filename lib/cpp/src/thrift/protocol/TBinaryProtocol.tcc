@@ -22,6 +22,8 @@
 
 #include <thrift/protocol/TBinaryProtocol.h>
 
+#include <algorithm>
+#include <cstring>
 #include <limits>
 
 namespace apache {
@@ -189,7 +191,81 @@ uint32_t TBinaryProtocolT<Transport_, ByteOrder_>::writeString(const StrType& st
 
 template <class Transport_, class ByteOrder_>
 uint32_t TBinaryProtocolT<Transport_, ByteOrder_>::writeBinary(const std::string& str) {
-  return TBinaryProtocolT<Transport_, ByteOrder_>::writeString(str);
+  if (str.size() > static_cast<size_t>((std::numeric_limits<int32_t>::max)()))
+    throw TProtocolException(TProtocolException::SIZE_LIMIT);
+  uint32_t size = static_cast<uint32_t>(str.size());
+  uint32_t result = writeI32((int32_t)size);
+  if (size > 0) {
+    // Binary fields belong to the struct being written, which outlives the
+    // flush, so large payloads may be written by reference.
+    this->trans_->writeRef((uint8_t*)str.data(), size);
+  }
+  return result + size;
+}
+
+template <class Transport_, class ByteOrder_>
+uint32_t TBinaryProtocolT<Transport_, ByteOrder_>::writeBinaryView(const TBinaryView& view) {
+  if (view.size() > static_cast<uint32_t>((std::numeric_limits<int32_t>::max)()))
+    throw TProtocolException(TProtocolException::SIZE_LIMIT);
+  uint32_t size = view.size();
+  uint32_t result = writeI32((int32_t)size);
+  if (size > 0) {
+    this->trans_->writeRef(view.data(), size);
+  }
+  return result + size;
+}
+
+template <class Transport_, class ByteOrder_>
+uint32_t TBinaryProtocolT<Transport_, ByteOrder_>::writeI32Array(const int32_t* values,
+                                                                 uint32_t count) {
+  return writeWordArray<uint32_t>(values, count);
+}
+
+template <class Transport_, class ByteOrder_>
+uint32_t TBinaryProtocolT<Transport_, ByteOrder_>::writeI64Array(const int64_t* values,
+                                                                 uint32_t count) {
+  return writeWordArray<uint64_t>(values, count);
+}
+
+template <class Transport_, class ByteOrder_>
+uint32_t TBinaryProtocolT<Transport_, ByteOrder_>::writeDoubleArray(const double* values,
+                                                                    uint32_t count) {
+  BOOST_STATIC_ASSERT(sizeof(double) == sizeof(uint64_t));
+  BOOST_STATIC_ASSERT(std::numeric_limits<double>::is_iec559);
+  return writeWordArray<uint64_t>(values, count);
+}
+
+/**
+ * Writes an array of fixed-width values.  If the wire byte order is the
+ * host's the array is written by reference, like a binary view; otherwise
+ * it is byte swapped a chunk at a time, in a loop the compiler can
+ * vectorize.
+ */
+template <class Transport_, class ByteOrder_>
+template <typename Word_>
+uint32_t TBinaryProtocolT<Transport_, ByteOrder_>::writeWordArray(const void* values,
+                                                                  uint32_t count) {
+  if (count > (std::numeric_limits<uint32_t>::max)() / sizeof(Word_)) {
+    throw TProtocolException(TProtocolException::SIZE_LIMIT);
+  }
+  const uint8_t* data = static_cast<const uint8_t*>(values);
+  uint32_t size = count * static_cast<uint32_t>(sizeof(Word_));
+  if (wireWord(static_cast<Word_>(1)) == 1) {
+    this->trans_->writeRef(data, size);
+    return size;
+  }
+
+  Word_ chunk[1024 / sizeof(Word_)];
+  for (uint32_t offset = 0; offset < size;) {
+    uint32_t len = (std::min)(size - offset, static_cast<uint32_t>(sizeof(chunk)));
+    std::memcpy(chunk, data + offset, len);
+    for (uint32_t i = 0; i < len / sizeof(Word_); ++i) {
+      chunk[i] = wireWord(chunk[i]);
+    }
+    this->trans_->write(reinterpret_cast<const uint8_t*>(chunk), len);
+    offset += len;
+  }
+  return size;
 }
 
 /**
@@ -415,6 +491,77 @@ uint32_t TBinaryProtocolT<Transport_, ByteOrder_>::readBinary(std::string& str)
   return TBinaryProtocolT<Transport_, ByteOrder_>::readString(str);
 }
 
+template <class Transport_, class ByteOrder_>
+uint32_t TBinaryProtocolT<Transport_, ByteOrder_>::readBinaryView(TBinaryView& view) {
+  int32_t size;
+  uint32_t result = readI32(size);
+
+  if (size < 0) {
+    throw TProtocolException(TProtocolException::NEGATIVE_SIZE);
+  }
+  if (this->string_limit_ > 0 && size > this->string_limit_) {
+    throw TProtocolException(TProtocolException::SIZE_LIMIT);
+  }
+
+  if (size == 0) {
+    view.storage().clear();
+    return result;
+  }
+
+  // Point into the frame buffer if the transport can pin it
+  boost::shared_array<uint8_t> pin;
+  const uint8_t* buf = this->trans_->borrowPinned((uint32_t)size, pin);
+  if (buf != NULL) {
+    view.assign(buf, (uint32_t)size, pin);
+    this->trans_->consume((uint32_t)size);
+    return result + (uint32_t)size;
+  }
+
+  return result + readStringBody(view.storage(), size);
+}
+
+template <class Transport_, class ByteOrder_>
+uint32_t TBinaryProtocolT<Transport_, ByteOrder_>::readI32Array(int32_t* values, uint32_t count) {
+  return readWordArray<uint32_t>(values, count);
+}
+
+template <class Transport_, class ByteOrder_>
+uint32_t TBinaryProtocolT<Transport_, ByteOrder_>::readI64Array(int64_t* values, uint32_t count) {
+  return readWordArray<uint64_t>(values, count);
+}
+
+template <class Transport_, class ByteOrder_>
+uint32_t TBinaryProtocolT<Transport_, ByteOrder_>::readDoubleArray(double* values, uint32_t count) {
+  BOOST_STATIC_ASSERT(sizeof(double) == sizeof(uint64_t));
+  BOOST_STATIC_ASSERT(std::numeric_limits<double>::is_iec559);
+  return readWordArray<uint64_t>(values, count);
+}
+
+/**
+ * Reads an array of fixed-width values with a single copy out of the
+ * transport, then byte swaps them in place if the wire order is not the
+ * host's.
+ */
+template <class Transport_, class ByteOrder_>
+template <typename Word_>
+uint32_t TBinaryProtocolT<Transport_, ByteOrder_>::readWordArray(void* values, uint32_t count) {
+  if (count > (std::numeric_limits<uint32_t>::max)() / sizeof(Word_)) {
+    throw TProtocolException(TProtocolException::SIZE_LIMIT);
+  }
+  uint8_t* data = static_cast<uint8_t*>(values);
+  uint32_t size = count * static_cast<uint32_t>(sizeof(Word_));
+  this->trans_->readAll(data, size);
+  if (wireWord(static_cast<Word_>(1)) != 1) {
+    for (uint32_t offset = 0; offset < size; offset += sizeof(Word_)) {
+      Word_ word;
+      std::memcpy(&word, data + offset, sizeof(word));
+      word = wireWord(word);
+      std::memcpy(data + offset, &word, sizeof(word));
+    }
+  }
+  return size;
+}
+
 template <class Transport_, class ByteOrder_>
 template <typename StrType>
 uint32_t TBinaryProtocolT<Transport_, ByteOrder_>::readStringBody(StrType& str, int32_t size) {
@@ -140,6 +140,11 @@ public:
 
   uint32_t writeBinary(const std::string& str);
 
+  uint32_t writeBinaryView(const TBinaryView& view);
+
+  // Strings are encoded like binary values
+  uint32_t writeStringView(const TBinaryView& view) { return writeBinaryView(view); }
+
   /**
   * These methods are called by structs, but don't actually have any wired
   * output or purpose
@@ -195,6 +200,14 @@ public:
 
   uint32_t readBinary(std::string& str);
 
+  uint32_t readBinaryView(TBinaryView& view);
+
+  uint32_t readStringView(TBinaryView& view) { return readBinaryView(view); }
+
+  uint32_t readI32Array(int32_t* values, uint32_t count);
+
+  uint32_t readI64Array(int64_t* values, uint32_t count);
+
   /*
    *These methods are here for the struct to call, but don't have any wire
    * encoding.
@@ -210,6 +223,10 @@ protected:
   uint32_t readVarint64(int64_t& i64);
   int32_t zigzagToI32(uint32_t n);
   int64_t zigzagToI64(uint64_t n);
+  void fromZigzag(uint64_t n, int32_t& value) { value = zigzagToI32(static_cast<uint32_t>(n)); }
+  void fromZigzag(uint64_t n, int64_t& value) { value = zigzagToI64(n); }
+  template <typename Int_>
+  uint32_t readZigzagArray(Int_* values, uint32_t count);
   TType getTType(int8_t type);
 
   // Buffer for reading strings, save for the lifetime of the protocol to
@@ -19,10 +19,17 @@
 #ifndef _THRIFT_PROTOCOL_TCOMPACTPROTOCOL_TCC_
 #define _THRIFT_PROTOCOL_TCOMPACTPROTOCOL_TCC_ 1
 
+#include <cstring>
 #include <limits>
 
 #include "thrift/config.h"
 
+#if defined(__BMI2__)
+#include <immintrin.h>
+#elif defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
 /*
  * TCompactProtocol::i*ToZigzag depend on the fact that the right shift
  * operator on a signed integer is an arithmetic (sign-extending) shift.
@@ -82,6 +89,134 @@ const int8_t TTypeToCType[16] = {
   CT_LIST, // T_LIST
 };
 
+/*
+ * Varint kernels.  Instead of a loop per byte these load eight bytes at
+ * once, find the last byte of the varint from the cleared continuation
+ * bits, and move the 7-bit groups into place with a few masks and shifts,
+ * or with a single pext/pdep instruction when built for BMI2.
+ */
+
+const uint64_t VARINT_PAYLOAD_BITS = 0x7f7f7f7f7f7f7f7fULL;
+const uint64_t VARINT_CONTINUATION_BITS = 0x8080808080808080ULL;
+
+inline uint64_t loadLittleEndian64(const uint8_t* buf) {
+  uint64_t word;
+  std::memcpy(&word, buf, sizeof(word));
+  return THRIFT_letohll(word);
+}
+
+inline void storeLittleEndian64(uint8_t* buf, uint64_t word) {
+  word = THRIFT_htolell(word);
+  std::memcpy(buf, &word, sizeof(word));
+}
+
+inline uint32_t countTrailingZeros64(uint64_t x) {
+#if defined(__GNUC__)
+  return static_cast<uint32_t>(__builtin_ctzll(x));
+#elif defined(_MSC_VER) && defined(_M_X64)
+  unsigned long index;
+  _BitScanForward64(&index, x);
+  return index;
+#else
+  uint32_t n = 0;
+  while (!(x & 1)) {
+    x >>= 1;
+    ++n;
+  }
+  return n;
+#endif
+}
+
+inline uint32_t countLeadingZeros64(uint64_t x) {
+#if defined(__GNUC__)
+  return static_cast<uint32_t>(__builtin_clzll(x));
+#elif defined(_MSC_VER) && defined(_M_X64)
+  unsigned long index;
+  _BitScanReverse64(&index, x);
+  return 63 - index;
+#else
+  uint32_t n = 0;
+  while (!(x & 0x8000000000000000ULL)) {
+    x <<= 1;
+    ++n;
+  }
+  return n;
+#endif
+}
+
+/**
+ * Packs the low 7 bits of each byte of word into the low 56 bits.
+ */
+inline uint64_t gatherVarintPayload(uint64_t word) {
+#if defined(__BMI2__)
+  return _pext_u64(word, VARINT_PAYLOAD_BITS);
+#else
+  word &= VARINT_PAYLOAD_BITS;
+  word = (word & 0x007f007f007f007fULL) | ((word & 0x7f007f007f007f00ULL) >> 1);
+  word = (word & 0x00003fff00003fffULL) | ((word & 0x3fff00003fff0000ULL) >> 2);
+  return (word & 0x000000000fffffffULL) | ((word & 0x0fffffff00000000ULL) >> 4);
+#endif
+}
+
+/**
+ * The reverse of gatherVarintPayload: spreads the low 56 bits of value
+ * over the low 7 bits of each byte.
+ */
+inline uint64_t spreadVarintPayload(uint64_t value) {
+#if defined(__BMI2__)
+  return _pdep_u64(value, VARINT_PAYLOAD_BITS);
+#else
+  value = (value & 0x000000000fffffffULL) | ((value & 0x00fffffff0000000ULL) << 4);
+  value = (value & 0x00003fff00003fffULL) | ((value & 0x0fffc0000fffc000ULL) << 2);
+  return (value & 0x007f007f007f007fULL) | ((value & 0x3f803f803f803f80ULL) << 1);
+#endif
+}
+
+/**
+ * Decodes a varint from buf, which must have at least 10 readable bytes.
+ * Returns the number of bytes it took, or 0 if it is longer than 10 bytes.
+ */
+inline uint32_t decodeVarint64(const uint8_t* buf, uint64_t& value) {
+  uint64_t word = loadLittleEndian64(buf);
+  uint64_t stops = ~word & VARINT_CONTINUATION_BITS;
+  if (stops != 0) {
+    // Keep the bytes up to and including the first one that ends the varint
+    uint64_t last = stops & (0 - stops);
+    value = gatherVarintPayload(word & (last ^ (last - 1)));
+    return (countTrailingZeros64(stops) >> 3) + 1;
+  }
+  value = gatherVarintPayload(word) | (static_cast<uint64_t>(buf[8] & 0x7f) << 56);
+  if (!(buf[8] & 0x80)) {
+    return 9;
+  }
+  value |= static_cast<uint64_t>(buf[9] & 0x7f) << 63;
+  return (buf[9] & 0x80) ? 0 : 10;
+}
+
+/**
+ * Encodes n as a varint into buf, which must have room for 10 bytes even
+ * if fewer are used.  Returns the number of bytes used.
+ */
+inline uint32_t encodeVarint64(uint64_t n, uint8_t* buf) {
+  if (n < 0x80) {
+    buf[0] = static_cast<uint8_t>(n);
+    return 1;
+  }
+  if (n < (1ULL << 56)) {
+    uint32_t size = (64 - countLeadingZeros64(n) + 6) / 7;
+    uint64_t continuation = 0x0080808080808080ULL >> ((8 - size) * 8);
+    storeLittleEndian64(buf, spreadVarintPayload(n) | continuation);
+    return size;
+  }
+  uint32_t size = 0;
+  while (n >= 0x80) {
+    buf[size++] = static_cast<uint8_t>((n & 0x7f) | 0x80);
+    n >>= 7;
+  }
+  buf[size++] = static_cast<uint8_t>(n);
+  return size;
+}
+
 }} // end detail::compact namespace
 
 
@@ -285,6 +420,19 @@ uint32_t TCompactProtocolT<Transport_>::writeBinary(const std::string& str) {
   return wsize;
 }
 
+template <class Transport_>
+uint32_t TCompactProtocolT<Transport_>::writeBinaryView(const TBinaryView& view) {
+  uint32_t ssize = view.size();
+  uint32_t wsize = writeVarint32(ssize);
+  if(ssize > (std::numeric_limits<uint32_t>::max)() - wsize)
+    throw TProtocolException(TProtocolException::SIZE_LIMIT);
+  wsize += ssize;
+  if (ssize > 0) {
+    trans_->writeRef(view.data(), ssize);
+  }
+  return wsize;
+}
+
 //
 // Internal Writing methods
 //
@@ -344,18 +492,8 @@ uint32_t TCompactProtocolT<Transport_>::writeCollectionBegin(const TType elemTyp
  */
 template <class Transport_>
 uint32_t TCompactProtocolT<Transport_>::writeVarint32(uint32_t n) {
-  uint8_t buf[5];
-  uint32_t wsize = 0;
-
-  while (true) {
-    if ((n & ~0x7F) == 0) {
-      buf[wsize++] = (int8_t)n;
-      break;
-    } else {
-      buf[wsize++] = (int8_t)((n & 0x7F) | 0x80);
-      n >>= 7;
-    }
-  }
+  uint8_t buf[10];
+  uint32_t wsize = detail::compact::encodeVarint64(n, buf);
   trans_->write(buf, wsize);
   return wsize;
 }
@@ -366,17 +504,7 @@ uint32_t TCompactProtocolT<Transport_>::writeVarint32(uint32_t n) {
 template <class Transport_>
 uint32_t TCompactProtocolT<Transport_>::writeVarint64(uint64_t n) {
   uint8_t buf[10];
-  uint32_t wsize = 0;
-
-  while (true) {
-    if ((n & ~0x7FL) == 0) {
-      buf[wsize++] = (int8_t)n;
-      break;
-    } else {
-      buf[wsize++] = (int8_t)((n & 0x7F) | 0x80);
-      n >>= 7;
-    }
-  }
+  uint32_t wsize = detail::compact::encodeVarint64(n, buf);
   trans_->write(buf, wsize);
   return wsize;
 }
@@ -648,6 +776,61 @@ uint32_t TCompactProtocolT<Transport_>::readI64(int64_t& i64) {
   return rsize;
 }
 
+/**
+ * Read a run of i32 list elements.
+ */
+template <class Transport_>
+uint32_t TCompactProtocolT<Transport_>::readI32Array(int32_t* values, uint32_t count) {
+  return readZigzagArray(values, count);
+}
+
+/**
+ * Read a run of i64 list elements.
+ */
+template <class Transport_>
+uint32_t TCompactProtocolT<Transport_>::readI64Array(int64_t* values, uint32_t count) {
+  return readZigzagArray(values, count);
+}
+
+/**
+ * Decode zigzag varints straight out of the transport's buffer for as long
+ * as a whole varint is known to be there, falling back to readVarint64()
+ * for ones that may cross the end of the buffer.
+ */
+template <class Transport_>
+template <typename Int_>
+uint32_t TCompactProtocolT<Transport_>::readZigzagArray(Int_* values, uint32_t count) {
+  uint32_t rsize = 0;
+  uint32_t i = 0;
+  while (i < count) {
+    uint8_t buf[10];
+    uint32_t buf_size = sizeof(buf);
+    const uint8_t* borrowed = trans_->borrow(buf, &buf_size);
+    if (borrowed == NULL) {
+      int64_t value;
+      rsize += readVarint64(value);
+      fromZigzag(static_cast<uint64_t>(value), values[i++]);
+      continue;
+    }
+
+    const uint8_t* ptr = borrowed;
+    const uint8_t* safe_end = borrowed + buf_size - (sizeof(buf) - 1);
+    for (; i < count && ptr < safe_end; ++i) {
+      uint64_t value;
+      uint32_t size = detail::compact::decodeVarint64(ptr, value);
+      if (UNLIKELY(size == 0)) {
+        throw TProtocolException(TProtocolException::INVALID_DATA, "Variable-length int over 10 bytes.");
+      }
+      ptr += size;
+      fromZigzag(value, values[i]);
+    }
+    uint32_t used = static_cast<uint32_t>(ptr - borrowed);
+    trans_->consume(used);
+    rsize += used;
+  }
+  return rsize;
+}
+
 /**
  * No magic here - just read a double off the wire.
  */
@@ -709,6 +892,39 @@ uint32_t TCompactProtocolT<Transport_>::readBinary(std::string& str) {
   return rsize + (uint32_t)size;
 }
 
+/**
+ * Read a byte[] from the wire into a view, borrowing from the transport
+ * where it can pin its buffer.
+ */
+template <class Transport_>
+uint32_t TCompactProtocolT<Transport_>::readBinaryView(TBinaryView& view) {
+  int32_t rsize = 0;
+  int32_t size;
+
+  rsize += readVarint32(size);
+  if (size < 0) {
+    throw TProtocolException(TProtocolException::NEGATIVE_SIZE);
+  }
+  if (string_limit_ > 0 && size > string_limit_) {
+    throw TProtocolException(TProtocolException::SIZE_LIMIT);
+  }
+
+  boost::shared_array<uint8_t> pin;
+  const uint8_t* buf = size > 0 ? trans_->borrowPinned((uint32_t)size, pin) : NULL;
+  if (buf != NULL) {
+    view.assign(buf, (uint32_t)size, pin);
+    trans_->consume((uint32_t)size);
+    return rsize + (uint32_t)size;
+  }
+
+  std::string& str = view.storage();
+  str.resize(size);
+  if (size > 0) {
+    trans_->readAll(reinterpret_cast<uint8_t*>(&str[0]), size);
+  }
+  return rsize + (uint32_t)size;
+}
+
 /**
  * Read an i32 from the wire as a varint. The MSB of each byte is set
  * if there is another byte to follow. This can read up to 5 bytes.
@@ -736,21 +952,14 @@ uint32_t TCompactProtocolT<Transport_>::readVarint64(int64_t& i64) {
 
   // Fast path.
   if (borrowed != NULL) {
-    while (true) {
-      uint8_t byte = borrowed[rsize];
-      rsize++;
-      val |= (uint64_t)(byte & 0x7f) << shift;
-      shift += 7;
-      if (!(byte & 0x80)) {
-        i64 = val;
-        trans_->consume(rsize);
-        return rsize;
-      }
-      // Have to check for invalid data so we don't crash.
-      if (UNLIKELY(rsize == sizeof(buf))) {
-        throw TProtocolException(TProtocolException::INVALID_DATA, "Variable-length int over 10 bytes.");
-      }
+    rsize = detail::compact::decodeVarint64(borrowed, val);
+    // Have to check for invalid data so we don't crash.
+    if (UNLIKELY(rsize == 0)) {
+      throw TProtocolException(TProtocolException::INVALID_DATA, "Variable-length int over 10 bytes.");
     }
+    i64 = val;
+    trans_->consume(rsize);
+    return rsize;
   }
 
   // Slow path.
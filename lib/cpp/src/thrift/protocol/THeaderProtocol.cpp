@@ -147,6 +147,26 @@ uint32_t THeaderProtocol::writeBinary(const std::string& str) {
   return proto_->writeBinary(str);
 }
 
+uint32_t THeaderProtocol::writeBinaryView(const TBinaryView& view) {
+  return proto_->writeBinaryView(view);
+}
+
+uint32_t THeaderProtocol::writeStringView(const TBinaryView& view) {
+  return proto_->writeStringView(view);
+}
+
+uint32_t THeaderProtocol::writeI32Array(const int32_t* values, uint32_t count) {
+  return proto_->writeI32Array(values, count);
+}
+
+uint32_t THeaderProtocol::writeI64Array(const int64_t* values, uint32_t count) {
+  return proto_->writeI64Array(values, count);
+}
+
+uint32_t THeaderProtocol::writeDoubleArray(const double* values, uint32_t count) {
+  return proto_->writeDoubleArray(values, count);
+}
+
 /**
  * Reading functions
  */
@@ -247,6 +267,26 @@ uint32_t THeaderProtocol::readString(std::string& str) {
 uint32_t THeaderProtocol::readBinary(std::string& binary) {
   return proto_->readBinary(binary);
 }
+
+uint32_t THeaderProtocol::readBinaryView(TBinaryView& view) {
+  return proto_->readBinaryView(view);
+}
+
+uint32_t THeaderProtocol::readStringView(TBinaryView& view) {
+  return proto_->readStringView(view);
+}
+
+uint32_t THeaderProtocol::readI32Array(int32_t* values, uint32_t count) {
+  return proto_->readI32Array(values, count);
+}
+
+uint32_t THeaderProtocol::readI64Array(int64_t* values, uint32_t count) {
+  return proto_->readI64Array(values, count);
+}
+
+uint32_t THeaderProtocol::readDoubleArray(double* values, uint32_t count) {
+  return proto_->readDoubleArray(values, count);
+}
 }
 }
 } // apache::thrift::protocol
@@ -23,13 +23,33 @@
 #include <boost/locale.hpp>
 #include <boost/math/special_functions/fpclassify.hpp>
 
+#if __cplusplus >= 201703L && defined(__has_include)
+#if __has_include(<charconv>)
+#include <charconv>
+#endif
+#endif
 #include <cmath>
+#include <cstdlib>
+#include <cstring>
 #include <limits>
 #include <locale>
 #include <sstream>
 #include <stdexcept>
 
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define THRIFT_JSON_AVX2 1
+#endif
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define THRIFT_JSON_SSE2 1
+#endif
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
 #include <thrift/protocol/TBase64Utils.h>
+#include <thrift/transport/PlatformSocket.h>
 #include <thrift/transport/TTransportException.h>
 
 using namespace apache::thrift::transport;
@@ -296,135 +316,172 @@ static bool isLowSurrogate(uint16_t val) {
   return val >= 0xDC00 && val <= 0xDFFF;
 }
 
-/**
- * Class to serve as base JSON context and as base class for other context
- * implementations
- */
-class TJSONContext {
-
-public:
-  TJSONContext(){};
-
-  virtual ~TJSONContext(){};
-
-  /**
-   * Write context data to the transport. Default is to do nothing.
-   */
-  virtual uint32_t write(TTransport& trans) {
-    (void)trans;
-    return 0;
-  };
-
-  /**
-   * Read context data from the transport. Default is to do nothing.
-   */
-  virtual uint32_t read(TJSONProtocol::LookaheadReader& reader) {
-    (void)reader;
-    return 0;
-  };
-
-  /**
-   * Return true if numbers need to be escaped as strings in this context.
-   * Default behavior is to return false.
-   */
-  virtual bool escapeNum() { return false; }
-};
-
-// Context class for object member key-value pairs
-class JSONPairContext : public TJSONContext {
-
-public:
-  JSONPairContext() : first_(true), colon_(true) {}
-
-  uint32_t write(TTransport& trans) {
-    if (first_) {
-      first_ = false;
-      colon_ = true;
-      return 0;
-    } else {
-      trans.write(colon_ ? &kJSONPairSeparator : &kJSONElemSeparator, 1);
-      colon_ = !colon_;
-      return 1;
-    }
+// Return the index of the lowest set bit in a non-zero mask
+static inline uint32_t lowestSetBit(uint32_t mask) {
+#if defined(__GNUC__)
+  return static_cast<uint32_t>(__builtin_ctz(mask));
+#elif defined(_MSC_VER)
+  unsigned long index;
+  _BitScanForward(&index, mask);
+  return static_cast<uint32_t>(index);
+#else
+  uint32_t index = 0;
+  while (!(mask & 1)) {
+    mask >>= 1;
+    ++index;
   }
-
-  uint32_t read(TJSONProtocol::LookaheadReader& reader) {
-    if (first_) {
-      first_ = false;
-      colon_ = true;
-      return 0;
-    } else {
-      uint8_t ch = (colon_ ? kJSONPairSeparator : kJSONElemSeparator);
-      colon_ = !colon_;
-      return readSyntaxChar(reader, ch);
+  return index;
+#endif
+}
+
+// Return the number of bytes at the start of [begin, end) that are neither
+// '"' nor '\', nor, if withControls is set, below 0x20.  Such runs go in and
+// out of a JSON string unchanged, so callers copy them in bulk.  Blocks of 32
+// or 16 bytes are compared at once where AVX2 or SSE2 is available.
+template <bool withControls>
+static size_t plainJSONRun(const uint8_t* begin, const uint8_t* end) {
+  const uint8_t* p = begin;
+#ifdef THRIFT_JSON_AVX2
+  const __m256i quote32 = _mm256_set1_epi8(kJSONStringDelimiter);
+  const __m256i backslash32 = _mm256_set1_epi8(kJSONBackslash);
+  const __m256i control32 = _mm256_set1_epi8(0x1F);
+  for (; end - p >= 32; p += 32) {
+    __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+    __m256i m = _mm256_or_si256(_mm256_cmpeq_epi8(v, quote32), _mm256_cmpeq_epi8(v, backslash32));
+    if (withControls) {
+      // v <= 0x1F exactly when max(v, 0x1F) == 0x1F
+      m = _mm256_or_si256(m, _mm256_cmpeq_epi8(_mm256_max_epu8(v, control32), control32));
+    }
+    uint32_t mask = static_cast<uint32_t>(_mm256_movemask_epi8(m));
+    if (mask != 0) {
+      return static_cast<size_t>(p - begin) + lowestSetBit(mask);
     }
   }
-
-  // Numbers must be turned into strings if they are the key part of a pair
-  virtual bool escapeNum() { return colon_; }
-
-private:
-  bool first_;
-  bool colon_;
-};
-
-// Context class for lists
-class JSONListContext : public TJSONContext {
-
-public:
-  JSONListContext() : first_(true) {}
-
-  uint32_t write(TTransport& trans) {
-    if (first_) {
-      first_ = false;
-      return 0;
-    } else {
-      trans.write(&kJSONElemSeparator, 1);
-      return 1;
+#endif
+#ifdef THRIFT_JSON_SSE2
+  const __m128i quote16 = _mm_set1_epi8(kJSONStringDelimiter);
+  const __m128i backslash16 = _mm_set1_epi8(kJSONBackslash);
+  const __m128i control16 = _mm_set1_epi8(0x1F);
+  for (; end - p >= 16; p += 16) {
+    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+    __m128i m = _mm_or_si128(_mm_cmpeq_epi8(v, quote16), _mm_cmpeq_epi8(v, backslash16));
+    if (withControls) {
+      m = _mm_or_si128(m, _mm_cmpeq_epi8(_mm_max_epu8(v, control16), control16));
+    }
+    uint32_t mask = static_cast<uint32_t>(_mm_movemask_epi8(m));
+    if (mask != 0) {
+      return static_cast<size_t>(p - begin) + lowestSetBit(mask);
     }
   }
-
-  uint32_t read(TJSONProtocol::LookaheadReader& reader) {
-    if (first_) {
-      first_ = false;
-      return 0;
-    } else {
-      return readSyntaxChar(reader, kJSONElemSeparator);
+#endif
+  for (; p != end; ++p) {
+    if (*p == kJSONStringDelimiter || *p == kJSONBackslash || (withControls && *p < 0x20)) {
+      break;
     }
   }
+  return static_cast<size_t>(p - begin);
+}
+
+// Append the code point cp to str as UTF-8
+static void appendUTF8(std::string& str, uint32_t cp) {
+  char buf[4];
+  size_t len;
+  if (cp < 0x80) {
+    buf[0] = static_cast<char>(cp);
+    len = 1;
+  } else if (cp < 0x800) {
+    buf[0] = static_cast<char>(0xC0 | (cp >> 6));
+    buf[1] = static_cast<char>(0x80 | (cp & 0x3F));
+    len = 2;
+  } else if (cp < 0x10000) {
+    buf[0] = static_cast<char>(0xE0 | (cp >> 12));
+    buf[1] = static_cast<char>(0x80 | ((cp >> 6) & 0x3F));
+    buf[2] = static_cast<char>(0x80 | (cp & 0x3F));
+    len = 3;
+  } else {
+    buf[0] = static_cast<char>(0xF0 | (cp >> 18));
+    buf[1] = static_cast<char>(0x80 | ((cp >> 12) & 0x3F));
+    buf[2] = static_cast<char>(0x80 | ((cp >> 6) & 0x3F));
+    buf[3] = static_cast<char>(0x80 | (cp & 0x3F));
+    len = 4;
+  }
+  str.append(buf, len);
+}
 
-private:
-  bool first_;
-};
+// Deepest nesting that never makes the context stack allocate
+static const size_t kJSONReservedContexts = 32;
 
 TJSONProtocol::TJSONProtocol(boost::shared_ptr<TTransport> ptrans)
   : TVirtualProtocol<TJSONProtocol>(ptrans),
     trans_(ptrans.get()),
-    context_(new TJSONContext()),
     reader_(*ptrans) {
+  contexts_.reserve(kJSONReservedContexts);
+  contexts_.push_back(JSONContext(JSONContext::BASE));
 }
 
 TJSONProtocol::~TJSONProtocol() {
 }
 
-void TJSONProtocol::pushContext(boost::shared_ptr<TJSONContext> c) {
-  contexts_.push(context_);
-  context_ = c;
+void TJSONProtocol::pushContext(JSONContext::Kind kind) {
+  contexts_.push_back(JSONContext(kind));
 }
 
 void TJSONProtocol::popContext() {
-  context_ = contexts_.top();
-  contexts_.pop();
+  contexts_.pop_back();
+}
+
+// Objects alternate ':' and ',' between their members, arrays always use ','
+// and the top level has no separators.
+uint32_t TJSONProtocol::writeContext() {
+  JSONContext& context = contexts_.back();
+  if (context.kind == JSONContext::BASE) {
+    return 0;
+  }
+  if (context.first) {
+    context.first = false;
+    context.colon = true;
+    return 0;
+  }
+  if (context.kind == JSONContext::PAIR) {
+    trans_->write(context.colon ? &kJSONPairSeparator : &kJSONElemSeparator, 1);
+    context.colon = !context.colon;
+  } else {
+    trans_->write(&kJSONElemSeparator, 1);
+  }
+  return 1;
+}
+
+uint32_t TJSONProtocol::readContext() {
+  JSONContext& context = contexts_.back();
+  if (context.kind == JSONContext::BASE) {
+    return 0;
+  }
+  if (context.first) {
+    context.first = false;
+    context.colon = true;
+    return 0;
+  }
+  if (context.kind == JSONContext::PAIR) {
+    uint8_t ch = (context.colon ? kJSONPairSeparator : kJSONElemSeparator);
+    context.colon = !context.colon;
+    return readSyntaxChar(reader_, ch);
+  }
+  return readSyntaxChar(reader_, kJSONElemSeparator);
+}
+
+// Numbers must be turned into strings if they are the key part of a pair
+bool TJSONProtocol::contextEscapesNum() const {
+  const JSONContext& context = contexts_.back();
+  return context.kind == JSONContext::PAIR && context.colon;
 }
 
 // Write the character ch as a JSON escape sequence ("\u00xx")
 uint32_t TJSONProtocol::writeJSONEscapeChar(uint8_t ch) {
-  trans_->write((const uint8_t*)kJSONEscapePrefix.c_str(),
-                static_cast<uint32_t>(kJSONEscapePrefix.length()));
-  uint8_t outCh = hexChar(ch >> 4);
-  trans_->write(&outCh, 1);
-  outCh = hexChar(ch);
-  trans_->write(&outCh, 1);
+  uint8_t buf[6];
+  std::memcpy(buf, kJSONEscapePrefix.data(), 4);
+  buf[4] = hexChar(ch >> 4);
+  buf[5] = hexChar(ch);
+  trans_->write(buf, 6);
   return 6;
 }
 
@@ -432,8 +489,8 @@ uint32_t TJSONProtocol::writeJSONEscapeChar(uint8_t ch) {
 uint32_t TJSONProtocol::writeJSONChar(uint8_t ch) {
   if (ch >= 0x30) {
     if (ch == kJSONBackslash) { // Only special character >= 0x30 is '\'
-      trans_->write(&kJSONBackslash, 1);
-      trans_->write(&kJSONBackslash, 1);
+      const uint8_t buf[2] = {kJSONBackslash, kJSONBackslash};
+      trans_->write(buf, 2);
       return 2;
     } else {
       trans_->write(&ch, 1);
@@ -446,8 +503,8 @@ uint32_t TJSONProtocol::writeJSONChar(uint8_t ch) {
       trans_->write(&ch, 1);
       return 1;
     } else if (outCh > 1) {
-      trans_->write(&kJSONBackslash, 1);
-      trans_->write(&outCh, 1);
+      const uint8_t buf[2] = {kJSONBackslash, outCh};
+      trans_->write(buf, 2);
       return 2;
     } else {
       return writeJSONEscapeChar(ch);
@@ -456,15 +513,24 @@ uint32_t TJSONProtocol::writeJSONChar(uint8_t ch) {
 }
 
 // Write out the contents of the string str as a JSON string, escaping
-// characters as appropriate.
+// characters as appropriate.  Runs that need no escaping are written whole.
 uint32_t TJSONProtocol::writeJSONString(const std::string& str) {
-  uint32_t result = context_->write(*trans_);
+  uint32_t result = writeContext();
   result += 2; // For quotes
   trans_->write(&kJSONStringDelimiter, 1);
-  std::string::const_iterator iter(str.begin());
-  std::string::const_iterator end(str.end());
-  while (iter != end) {
-    result += writeJSONChar(*iter++);
+  const uint8_t* p = reinterpret_cast<const uint8_t*>(str.data());
+  const uint8_t* end = p + str.size();
+  while (p != end) {
+    size_t run = plainJSONRun<true>(p, end);
+    if (run > 0) {
+      trans_->write(p, static_cast<uint32_t>(run));
+      result += static_cast<uint32_t>(run);
+      p += run;
+      if (p == end) {
+        break;
+      }
+    }
+    result += writeJSONChar(*p++);
   }
   trans_->write(&kJSONStringDelimiter, 1);
   return result;
@@ -473,7 +539,7 @@ uint32_t TJSONProtocol::writeJSONString(const std::string& str) {
 // Write out the contents of the string as JSON string, base64-encoding
 // the string's contents, and escaping as appropriate
 uint32_t TJSONProtocol::writeJSONBase64(const std::string& str) {
-  uint32_t result = context_->write(*trans_);
+  uint32_t result = writeContext();
   result += 2; // For quotes
   trans_->write(&kJSONStringDelimiter, 1);
   uint8_t b[4];
@@ -498,84 +564,131 @@ uint32_t TJSONProtocol::writeJSONBase64(const std::string& str) {
   return result;
 }
 
+namespace {
+
+// Pairs of decimal digits, so integers are formatted two digits at a time
+const char kDigitPairs[] =
+    "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+    "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+// Formats value so that it ends just before end, and returns its start.
+char* formatInteger(int64_t value, char* end) {
+  uint64_t n = value < 0 ? 0 - static_cast<uint64_t>(value) : static_cast<uint64_t>(value);
+  while (n >= 100) {
+    const char* pair = kDigitPairs + (n % 100) * 2;
+    n /= 100;
+    *--end = pair[1];
+    *--end = pair[0];
+  }
+  if (n >= 10) {
+    const char* pair = kDigitPairs + n * 2;
+    *--end = pair[1];
+    *--end = pair[0];
+  } else {
+    *--end = static_cast<char>('0' + n);
+  }
+  if (value < 0) {
+    *--end = '-';
+  }
+  return end;
+}
+
+// Formats a finite d with the fewest significant digits that read back as
+// d, and returns the length.
+uint32_t formatDouble(double d, char* buf, size_t size) {
+#if defined(__cpp_lib_to_chars) && __cpp_lib_to_chars >= 201611L
+  std::to_chars_result converted = std::to_chars(buf, buf + size, d);
+  return static_cast<uint32_t>(converted.ptr - buf);
+#else
+  // Most values need 15 digits or fewer; 17 are always enough
+  int len = 0;
+  for (int precision = 15; precision <= 17; ++precision) {
+    len = THRIFT_SNPRINTF(buf, size, "%.*g", precision, d);
+    if (precision == 17 || std::strtod(buf, NULL) == d) {
+      break;
+    }
+  }
+  // snprintf follows the C locale, but JSON always uses '.'
+  for (int i = 0; i < len; ++i) {
+    char ch = buf[i];
+    if ((ch < '0' || ch > '9') && ch != '-' && ch != '+' && ch != 'e') {
+      buf[i] = '.';
+    }
+  }
+  return static_cast<uint32_t>(len);
+#endif
+}
+}
+
 // Convert the given integer type to a JSON number, or a string
 // if the context requires it (eg: key in a map pair).
 template <typename NumberType>
 uint32_t TJSONProtocol::writeJSONInteger(NumberType num) {
-  uint32_t result = context_->write(*trans_);
-  std::string val(boost::lexical_cast<std::string>(num));
-  bool escapeNum = context_->escapeNum();
+  uint32_t result = writeContext();
+
+  // Room for the digits of any 64-bit integer, a sign and quotes
+  char buf[24];
+  char* end = buf + sizeof(buf);
+  bool escapeNum = contextEscapesNum();
   if (escapeNum) {
-    trans_->write(&kJSONStringDelimiter, 1);
-    result += 1;
+    *--end = kJSONStringDelimiter;
   }
-  if (val.length() > (std::numeric_limits<uint32_t>::max)())
-    throw TProtocolException(TProtocolException::SIZE_LIMIT);
-  trans_->write((const uint8_t*)val.c_str(), static_cast<uint32_t>(val.length()));
-  result += static_cast<uint32_t>(val.length());
+  char* begin = formatInteger(static_cast<int64_t>(num), end);
   if (escapeNum) {
-    trans_->write(&kJSONStringDelimiter, 1);
-    result += 1;
+    *--begin = kJSONStringDelimiter;
+    ++end;
   }
-  return result;
-}
-
-namespace {
-std::string doubleToString(double d) {
-  std::ostringstream str;
-  str.imbue(std::locale::classic());
-  const int max_digits10 = 2 + std::numeric_limits<double>::digits10;
-  str.precision(max_digits10);
-  str << d;
-  return str.str();
-}
+  uint32_t len = static_cast<uint32_t>(end - begin);
+  trans_->write(reinterpret_cast<const uint8_t*>(begin), len);
+  return result + len;
 }
 
 // Convert the given double to a JSON string, which is either the number,
 // "NaN" or "Infinity" or "-Infinity".
 uint32_t TJSONProtocol::writeJSONDouble(double num) {
-  uint32_t result = context_->write(*trans_);
-  std::string val;
+  uint32_t result = writeContext();
+
+  // Room for 17 digits, a sign, a point, an exponent and quotes
+  char buf[32];
+  char* begin = buf + 1;
+  uint32_t len;
 
   bool special = false;
   switch (boost::math::fpclassify(num)) {
   case FP_INFINITE:
     if (boost::math::signbit(num)) {
-      val = kThriftNegativeInfinity;
+      len = static_cast<uint32_t>(kThriftNegativeInfinity.length());
+      std::memcpy(begin, kThriftNegativeInfinity.data(), len);
     } else {
-      val = kThriftInfinity;
+      len = static_cast<uint32_t>(kThriftInfinity.length());
+      std::memcpy(begin, kThriftInfinity.data(), len);
     }
     special = true;
     break;
   case FP_NAN:
-    val = kThriftNan;
+    len = static_cast<uint32_t>(kThriftNan.length());
+    std::memcpy(begin, kThriftNan.data(), len);
     special = true;
     break;
   default:
-    val = doubleToString(num);
+    len = formatDouble(num, begin, sizeof(buf) - 2);
     break;
   }
 
-  bool escapeNum = special || context_->escapeNum();
-  if (escapeNum) {
-    trans_->write(&kJSONStringDelimiter, 1);
-    result += 1;
-  }
-  if (val.length() > (std::numeric_limits<uint32_t>::max)())
-    throw TProtocolException(TProtocolException::SIZE_LIMIT);
-  trans_->write((const uint8_t*)val.c_str(), static_cast<uint32_t>(val.length()));
-  result += static_cast<uint32_t>(val.length());
-  if (escapeNum) {
-    trans_->write(&kJSONStringDelimiter, 1);
-    result += 1;
+  if (special || contextEscapesNum()) {
+    *--begin = kJSONStringDelimiter;
+    begin[len + 1] = kJSONStringDelimiter;
+    len += 2;
   }
-  return result;
+  trans_->write(reinterpret_cast<const uint8_t*>(begin), len);
+  return result + len;
 }
 
 uint32_t TJSONProtocol::writeJSONObjectStart() {
-  uint32_t result = context_->write(*trans_);
+  uint32_t result = writeContext();
   trans_->write(&kJSONObjectStart, 1);
-  pushContext(boost::shared_ptr<TJSONContext>(new JSONPairContext()));
+  pushContext(JSONContext::PAIR);
   return result + 1;
 }
 
@@ -586,9 +699,9 @@ uint32_t TJSONProtocol::writeJSONObjectEnd() {
 }
 
 uint32_t TJSONProtocol::writeJSONArrayStart() {
-  uint32_t result = context_->write(*trans_);
+  uint32_t result = writeContext();
   trans_->write(&kJSONArrayStart, 1);
-  pushContext(boost::shared_ptr<TJSONContext>(new JSONListContext()));
+  pushContext(JSONContext::LIST);
   return result + 1;
 }
 
@@ -684,9 +797,7 @@ uint32_t TJSONProtocol::writeBool(const bool value) {
 }
 
 uint32_t TJSONProtocol::writeByte(const int8_t byte) {
-  // writeByte() must be handled specially because boost::lexical cast sees
-  // int8_t as a text type instead of an integer type
-  return writeJSONInteger((int16_t)byte);
+  return writeJSONInteger(byte);
 }
 
 uint32_t TJSONProtocol::writeI16(const int16_t i16) {
@@ -739,12 +850,27 @@ uint32_t TJSONProtocol::readJSONEscapeChar(uint16_t* out) {
 
 // Decodes a JSON string, including unescaping, and returns the string via str
 uint32_t TJSONProtocol::readJSONString(std::string& str, bool skipContext) {
-  uint32_t result = (skipContext ? 0 : context_->read(reader_));
+  uint32_t result = (skipContext ? 0 : readContext());
   result += readJSONSyntaxChar(kJSONStringDelimiter);
   std::vector<uint16_t> codeunits;
   uint8_t ch;
   str.clear();
   while (true) {
+    // Copy everything up to the next quote or backslash straight out of the
+    // transport's buffer.  Not while a low surrogate is due, as any plain
+    // character there is an error.
+    if (codeunits.empty()) {
+      uint32_t avail;
+      const uint8_t* buf = reader_.borrow(&avail);
+      if (buf != NULL) {
+        size_t run = plainJSONRun<false>(buf, buf + avail);
+        if (run > 0) {
+          str.append(reinterpret_cast<const char*>(buf), run);
+          reader_.consume(static_cast<uint32_t>(run));
+          result += static_cast<uint32_t>(run);
+        }
+      }
+    }
     ch = reader_.read();
     ++result;
     if (ch == kJSONStringDelimiter) {
@@ -764,9 +890,15 @@ uint32_t TJSONProtocol::readJSONString(std::string& str, bool skipContext) {
             throw TProtocolException(TProtocolException::INVALID_DATA,
                                      "Missing UTF-16 high surrogate pair.");
           }
-          codeunits.push_back(cp);
-          codeunits.push_back(0);
-          str += boost::locale::conv::utf_to_utf<char>(codeunits.data());
+          if (codeunits.empty()) {
+            appendUTF8(str, cp);
+          } else if (codeunits.size() == 1 && isLowSurrogate(cp)) {
+            appendUTF8(str, 0x10000 + ((codeunits[0] - 0xD800u) << 10) + (cp - 0xDC00u));
+          } else {
+            codeunits.push_back(cp);
+            codeunits.push_back(0);
+            str += boost::locale::conv::utf_to_utf<char>(codeunits.data());
+          }
           codeunits.clear();
         }
         continue;
@@ -846,8 +978,8 @@ uint32_t TJSONProtocol::readJSONNumericChars(std::string& str) {
 // returning them via num
 template <typename NumberType>
 uint32_t TJSONProtocol::readJSONInteger(NumberType& num) {
-  uint32_t result = context_->read(reader_);
-  if (context_->escapeNum()) {
+  uint32_t result = readContext();
+  if (contextEscapesNum()) {
     result += readJSONSyntaxChar(kJSONStringDelimiter);
   }
   std::string str;
@@ -858,7 +990,7 @@ uint32_t TJSONProtocol::readJSONInteger(NumberType& num) {
     throw TProtocolException(TProtocolException::INVALID_DATA,
                                  "Expected numeric value; got \"" + str + "\"");
   }
-  if (context_->escapeNum()) {
+  if (contextEscapesNum()) {
     result += readJSONSyntaxChar(kJSONStringDelimiter);
   }
   return result;
@@ -878,7 +1010,7 @@ double stringToDouble(const std::string& s) {
 
 // Reads a JSON number or string and interprets it as a double.
 uint32_t TJSONProtocol::readJSONDouble(double& num) {
-  uint32_t result = context_->read(reader_);
+  uint32_t result = readContext();
   std::string str;
   if (reader_.peek() == kJSONStringDelimiter) {
     result += readJSONString(str, true);
@@ -890,7 +1022,7 @@ uint32_t TJSONProtocol::readJSONDouble(double& num) {
     } else if (str == kThriftNegativeInfinity) {
       num = -HUGE_VAL;
     } else {
-      if (!context_->escapeNum()) {
+      if (!contextEscapesNum()) {
         // Throw exception -- we should not be in a string in this case
         throw TProtocolException(TProtocolException::INVALID_DATA,
                                      "Numeric data unexpectedly quoted");
@@ -903,7 +1035,7 @@ uint32_t TJSONProtocol::readJSONDouble(double& num) {
       }
     }
   } else {
-    if (context_->escapeNum()) {
+    if (contextEscapesNum()) {
       // This will throw - we should have had a quote if escapeNum == true
       readJSONSyntaxChar(kJSONStringDelimiter);
     }
@@ -919,9 +1051,9 @@ uint32_t TJSONProtocol::readJSONDouble(double& num) {
 }
 
 uint32_t TJSONProtocol::readJSONObjectStart() {
-  uint32_t result = context_->read(reader_);
+  uint32_t result = readContext();
   result += readJSONSyntaxChar(kJSONObjectStart);
-  pushContext(boost::shared_ptr<TJSONContext>(new JSONPairContext()));
+  pushContext(JSONContext::PAIR);
   return result;
 }
 
@@ -932,9 +1064,9 @@ uint32_t TJSONProtocol::readJSONObjectEnd() {
 }
 
 uint32_t TJSONProtocol::readJSONArrayStart() {
-  uint32_t result = context_->read(reader_);
+  uint32_t result = readContext();
   result += readJSONSyntaxChar(kJSONArrayStart);
-  pushContext(boost::shared_ptr<TJSONContext>(new JSONListContext()));
+  pushContext(JSONContext::LIST);
   return result;
 }
 
@@ -22,15 +22,12 @@
 
 #include <thrift/protocol/TVirtualProtocol.h>
 
-#include <stack>
+#include <vector>
 
 namespace apache {
 namespace thrift {
 namespace protocol {
 
-// Forward declaration
-class TJSONContext;
-
 /**
  * JSON protocol for Thrift.
  *
@@ -86,11 +83,10 @@ class TJSONContext;
  * More discussion of the double handling is probably warranted. The aim of
  * the current implementation is to match as closely as possible the behavior
  * of Java's Double.toString(), which has no precision loss.  Implementors in
- * other languages should strive to achieve that where possible. I have not
- * yet verified whether boost:lexical_cast, which is doing that work for me in
- * C++, loses any precision, but I am leaving this as a future improvement. I
- * may try to provide a C component for this, so that other languages could
- * bind to the same underlying implementation for maximum consistency.
+ * other languages should strive to achieve that where possible.  Doubles are
+ * written with the fewest significant digits that read back as the same
+ * value, so 0.1 is written as 0.1 rather than 0.10000000000000001.  Without
+ * std::to_chars (C++17) at least 15 digits are tried first.
  *
  */
 class TJSONProtocol : public TVirtualProtocol<TJSONProtocol> {
@@ -100,10 +96,33 @@ public:
   ~TJSONProtocol();
 
 private:
-  void pushContext(boost::shared_ptr<TJSONContext> c);
+  /**
+   * Separator state of the JSON value being written or read: the top
+   * level, an object (whose members alternate key and value) or an array.
+   */
+  struct JSONContext {
+    enum Kind { BASE, PAIR, LIST };
+
+    explicit JSONContext(Kind k) : kind(k), first(true), colon(true) {}
+
+    Kind kind;
+    bool first;
+    bool colon;
+  };
+
+  void pushContext(JSONContext::Kind kind);
 
   void popContext();
 
+  /// Write the separator the current context needs before the next value
+  uint32_t writeContext();
+
+  /// Read the separator the current context needs before the next value
+  uint32_t readContext();
+
+  /// Whether numbers must be quoted, as they must when they are map keys
+  bool contextEscapesNum() const;
+
   uint32_t writeJSONEscapeChar(uint8_t ch);
 
   uint32_t writeJSONChar(uint8_t ch);
@@ -266,6 +285,20 @@ public:
       return data_;
     }
 
+    /**
+     * Returns the bytes the transport has buffered, to be passed to
+     * consume(), or NULL if it has none or a peeked byte comes first.
+     */
+    const uint8_t* borrow(uint32_t* len) {
+      if (hasData_) {
+        return NULL;
+      }
+      *len = 1;
+      return trans_->borrow(NULL, len);
+    }
+
+    void consume(uint32_t len) { trans_->consume(len); }
+
   private:
     TTransport* trans_;
     bool hasData_;
@@ -275,8 +308,9 @@ public:
 private:
   TTransport* trans_;
 
-  std::stack<boost::shared_ptr<TJSONContext> > contexts_;
-  boost::shared_ptr<TJSONContext> context_;
+  // Contexts by value, with room reserved for typical nesting, so entering
+  // a struct, list or map does not allocate.  The back is the current one.
+  std::vector<JSONContext> contexts_;
   LookaheadReader reader_;
 };
 
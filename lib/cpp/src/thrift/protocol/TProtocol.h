@@ -25,6 +25,7 @@
 #include <Winsock2.h>
 #endif
 
+#include <thrift/TBinaryView.h>
 #include <thrift/transport/TTransport.h>
 #include <thrift/protocol/TProtocolException.h>
 
@@ -276,6 +277,16 @@ public:
 
   virtual uint32_t writeBinary_virt(const std::string& str) = 0;
 
+  virtual uint32_t writeBinaryView_virt(const TBinaryView& view) = 0;
+
+  virtual uint32_t writeStringView_virt(const TBinaryView& view) = 0;
+
+  virtual uint32_t writeI32Array_virt(const int32_t* values, uint32_t count) = 0;
+
+  virtual uint32_t writeI64Array_virt(const int64_t* values, uint32_t count) = 0;
+
+  virtual uint32_t writeDoubleArray_virt(const double* values, uint32_t count) = 0;
+
   uint32_t writeMessageBegin(const std::string& name,
                              const TMessageType messageType,
                              const int32_t seqid) {
@@ -383,6 +394,38 @@ public:
     return writeBinary_virt(str);
   }
 
+  uint32_t writeBinaryView(const TBinaryView& view) {
+    T_VIRTUAL_CALL();
+    return writeBinaryView_virt(view);
+  }
+
+  /**
+   * Writes the bytes of a view as a string value.
+   */
+  uint32_t writeStringView(const TBinaryView& view) {
+    T_VIRTUAL_CALL();
+    return writeStringView_virt(view);
+  }
+
+  /**
+   * Writes count list elements from values, the same as calling writeI32()
+   * for each.  Protocols with a fixed-width encoding write them in one go.
+   */
+  uint32_t writeI32Array(const int32_t* values, uint32_t count) {
+    T_VIRTUAL_CALL();
+    return writeI32Array_virt(values, count);
+  }
+
+  uint32_t writeI64Array(const int64_t* values, uint32_t count) {
+    T_VIRTUAL_CALL();
+    return writeI64Array_virt(values, count);
+  }
+
+  uint32_t writeDoubleArray(const double* values, uint32_t count) {
+    T_VIRTUAL_CALL();
+    return writeDoubleArray_virt(values, count);
+  }
+
   /**
    * Reading functions
    */
@@ -431,6 +474,16 @@ public:
 
   virtual uint32_t readBinary_virt(std::string& str) = 0;
 
+  virtual uint32_t readBinaryView_virt(TBinaryView& view) = 0;
+
+  virtual uint32_t readStringView_virt(TBinaryView& view) = 0;
+
+  virtual uint32_t readI32Array_virt(int32_t* values, uint32_t count) = 0;
+
+  virtual uint32_t readI64Array_virt(int64_t* values, uint32_t count) = 0;
+
+  virtual uint32_t readDoubleArray_virt(double* values, uint32_t count) = 0;
+
   uint32_t readMessageBegin(std::string& name, TMessageType& messageType, int32_t& seqid) {
     T_VIRTUAL_CALL();
     return readMessageBegin_virt(name, messageType, seqid);
@@ -531,6 +584,48 @@ public:
     return readBinary_virt(str);
   }
 
+  /**
+   * Reads a binary value into a view.  Where the transport allows it the
+   * view refers to the transport's frame buffer instead of a copy.
+   */
+  uint32_t readBinaryView(TBinaryView& view) {
+    T_VIRTUAL_CALL();
+    return readBinaryView_virt(view);
+  }
+
+  /**
+   * Reads a string value into a view, like readBinaryView().
+   */
+  uint32_t readStringView(TBinaryView& view) {
+    T_VIRTUAL_CALL();
+    return readStringView_virt(view);
+  }
+
+  /**
+   * Reads count consecutive i32 list elements, as written by writeI32(),
+   * into values.  Protocols decode the whole run at once where they can.
+   */
+  uint32_t readI32Array(int32_t* values, uint32_t count) {
+    T_VIRTUAL_CALL();
+    return readI32Array_virt(values, count);
+  }
+
+  /**
+   * Reads count consecutive i64 list elements into values.
+   */
+  uint32_t readI64Array(int64_t* values, uint32_t count) {
+    T_VIRTUAL_CALL();
+    return readI64Array_virt(values, count);
+  }
+
+  /**
+   * Reads count consecutive double list elements into values.
+   */
+  uint32_t readDoubleArray(double* values, uint32_t count) {
+    T_VIRTUAL_CALL();
+    return readDoubleArray_virt(values, count);
+  }
+
   /*
    * std::vector is specialized for bool, and its elements are individual bits
    * rather than bools.   We need to define a different version of readBool()
@@ -92,6 +92,21 @@ public:
   virtual uint32_t writeDouble_virt(const double dub) { return protocol->writeDouble(dub); }
   virtual uint32_t writeString_virt(const std::string& str) { return protocol->writeString(str); }
   virtual uint32_t writeBinary_virt(const std::string& str) { return protocol->writeBinary(str); }
+  virtual uint32_t writeBinaryView_virt(const TBinaryView& view) {
+    return protocol->writeBinaryView(view);
+  }
+  virtual uint32_t writeStringView_virt(const TBinaryView& view) {
+    return protocol->writeStringView(view);
+  }
+  virtual uint32_t writeI32Array_virt(const int32_t* values, uint32_t count) {
+    return protocol->writeI32Array(values, count);
+  }
+  virtual uint32_t writeI64Array_virt(const int64_t* values, uint32_t count) {
+    return protocol->writeI64Array(values, count);
+  }
+  virtual uint32_t writeDoubleArray_virt(const double* values, uint32_t count) {
+    return protocol->writeDoubleArray(values, count);
+  }
 
   virtual uint32_t readMessageBegin_virt(std::string& name,
                                          TMessageType& messageType,
@@ -140,6 +155,17 @@ public:
 
   virtual uint32_t readString_virt(std::string& str) { return protocol->readString(str); }
   virtual uint32_t readBinary_virt(std::string& str) { return protocol->readBinary(str); }
+  virtual uint32_t readBinaryView_virt(TBinaryView& view) { return protocol->readBinaryView(view); }
+  virtual uint32_t readStringView_virt(TBinaryView& view) { return protocol->readStringView(view); }
+  virtual uint32_t readI32Array_virt(int32_t* values, uint32_t count) {
+    return protocol->readI32Array(values, count);
+  }
+  virtual uint32_t readI64Array_virt(int64_t* values, uint32_t count) {
+    return protocol->readI64Array(values, count);
+  }
+  virtual uint32_t readDoubleArray_virt(double* values, uint32_t count) {
+    return protocol->readDoubleArray(values, count);
+  }
 
 private:
   shared_ptr<TProtocol> protocol;
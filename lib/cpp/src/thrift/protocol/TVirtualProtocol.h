@@ -393,6 +393,26 @@ public:
     return static_cast<Protocol_*>(this)->writeBinary(str);
   }
 
+  virtual uint32_t writeBinaryView_virt(const TBinaryView& view) {
+    return static_cast<Protocol_*>(this)->writeBinaryView(view);
+  }
+
+  virtual uint32_t writeStringView_virt(const TBinaryView& view) {
+    return static_cast<Protocol_*>(this)->writeStringView(view);
+  }
+
+  virtual uint32_t writeI32Array_virt(const int32_t* values, uint32_t count) {
+    return static_cast<Protocol_*>(this)->writeI32Array(values, count);
+  }
+
+  virtual uint32_t writeI64Array_virt(const int64_t* values, uint32_t count) {
+    return static_cast<Protocol_*>(this)->writeI64Array(values, count);
+  }
+
+  virtual uint32_t writeDoubleArray_virt(const double* values, uint32_t count) {
+    return static_cast<Protocol_*>(this)->writeDoubleArray(values, count);
+  }
+
   /**
    * Reading functions
    */
@@ -471,6 +491,26 @@ public:
     return static_cast<Protocol_*>(this)->readBinary(str);
   }
 
+  virtual uint32_t readBinaryView_virt(TBinaryView& view) {
+    return static_cast<Protocol_*>(this)->readBinaryView(view);
+  }
+
+  virtual uint32_t readStringView_virt(TBinaryView& view) {
+    return static_cast<Protocol_*>(this)->readStringView(view);
+  }
+
+  virtual uint32_t readI32Array_virt(int32_t* values, uint32_t count) {
+    return static_cast<Protocol_*>(this)->readI32Array(values, count);
+  }
+
+  virtual uint32_t readI64Array_virt(int64_t* values, uint32_t count) {
+    return static_cast<Protocol_*>(this)->readI64Array(values, count);
+  }
+
+  virtual uint32_t readDoubleArray_virt(double* values, uint32_t count) {
+    return static_cast<Protocol_*>(this)->readDoubleArray(values, count);
+  }
+
   virtual uint32_t skip_virt(TType type) { return static_cast<Protocol_*>(this)->skip(type); }
 
   /*
@@ -488,6 +528,86 @@ public:
     return ::apache::thrift::protocol::skip(*prot, type);
   }
 
+  /*
+   * Provide default readBinaryView() and writeBinaryView() implementations
+   * that copy through readBinary() and writeBinary(), and likewise for
+   * strings.  Protocols that can borrow from or write by reference to their
+   * transport override these.
+   */
+  uint32_t readBinaryView(TBinaryView& view) {
+    return static_cast<Protocol_*>(this)->readBinary(view.storage());
+  }
+
+  uint32_t writeBinaryView(const TBinaryView& view) {
+    return static_cast<Protocol_*>(this)->writeBinary(view.str());
+  }
+
+  uint32_t readStringView(TBinaryView& view) {
+    return static_cast<Protocol_*>(this)->readString(view.storage());
+  }
+
+  uint32_t writeStringView(const TBinaryView& view) {
+    return static_cast<Protocol_*>(this)->writeString(view.str());
+  }
+
+  /*
+   * Provide default implementations of the array reads and writes that
+   * handle one element at a time.
+   */
+  uint32_t readI32Array(int32_t* values, uint32_t count) {
+    Protocol_* const prot = static_cast<Protocol_*>(this);
+    uint32_t xfer = 0;
+    for (uint32_t i = 0; i < count; ++i) {
+      xfer += prot->readI32(values[i]);
+    }
+    return xfer;
+  }
+
+  uint32_t readI64Array(int64_t* values, uint32_t count) {
+    Protocol_* const prot = static_cast<Protocol_*>(this);
+    uint32_t xfer = 0;
+    for (uint32_t i = 0; i < count; ++i) {
+      xfer += prot->readI64(values[i]);
+    }
+    return xfer;
+  }
+
+  uint32_t readDoubleArray(double* values, uint32_t count) {
+    Protocol_* const prot = static_cast<Protocol_*>(this);
+    uint32_t xfer = 0;
+    for (uint32_t i = 0; i < count; ++i) {
+      xfer += prot->readDouble(values[i]);
+    }
+    return xfer;
+  }
+
+  uint32_t writeI32Array(const int32_t* values, uint32_t count) {
+    Protocol_* const prot = static_cast<Protocol_*>(this);
+    uint32_t xfer = 0;
+    for (uint32_t i = 0; i < count; ++i) {
+      xfer += prot->writeI32(values[i]);
+    }
+    return xfer;
+  }
+
+  uint32_t writeI64Array(const int64_t* values, uint32_t count) {
+    Protocol_* const prot = static_cast<Protocol_*>(this);
+    uint32_t xfer = 0;
+    for (uint32_t i = 0; i < count; ++i) {
+      xfer += prot->writeI64(values[i]);
+    }
+    return xfer;
+  }
+
+  uint32_t writeDoubleArray(const double* values, uint32_t count) {
+    Protocol_* const prot = static_cast<Protocol_*>(this);
+    uint32_t xfer = 0;
+    for (uint32_t i = 0; i < count; ++i) {
+      xfer += prot->writeDouble(values[i]);
+    }
+    return xfer;
+  }
+
   /*
    * Provide a default readBool() implementation for use with
    * std::vector<bool>, that behaves the same as reading into a normal bool.
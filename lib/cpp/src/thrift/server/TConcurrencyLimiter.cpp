@@ -0,0 +1,113 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements. See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership. The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied. See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+#include <thrift/server/TConcurrencyLimiter.h>
+#include <thrift/concurrency/Util.h>
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+namespace apache {
+namespace thrift {
+namespace server {
+
+using concurrency::Guard;
+using concurrency::Util;
+
+const size_t TAdaptiveConcurrencyLimiter::DEFAULT_INITIAL_LIMIT;
+const size_t TAdaptiveConcurrencyLimiter::DEFAULT_MIN_LIMIT;
+const size_t TAdaptiveConcurrencyLimiter::DEFAULT_MAX_LIMIT;
+const int64_t TAdaptiveConcurrencyLimiter::DEFAULT_TARGET_DELAY;
+const int64_t TAdaptiveConcurrencyLimiter::DEFAULT_INTERVAL;
+
+TAdaptiveConcurrencyLimiter::TAdaptiveConcurrencyLimiter(size_t initialLimit,
+                                                         size_t minLimit,
+                                                         size_t maxLimit)
+  : minLimit_(std::max<size_t>(minLimit, 1)),
+    maxLimit_(std::max(maxLimit, minLimit_)),
+    targetDelay_(DEFAULT_TARGET_DELAY),
+    interval_(DEFAULT_INTERVAL),
+    inFlight_(0),
+    rejected_(0),
+    intervalStart_(Util::currentTimeUsec()),
+    minDelay_(std::numeric_limits<int64_t>::max()),
+    maxInFlight_(0) {
+  limit_ = static_cast<double>(std::min(std::max(initialLimit, minLimit_), maxLimit_));
+}
+
+bool TAdaptiveConcurrencyLimiter::tryAcquire() {
+  Guard g(mutex_);
+  if (inFlight_ >= static_cast<size_t>(limit_)) {
+    ++rejected_;
+    return false;
+  }
+  maxInFlight_ = std::max(maxInFlight_, ++inFlight_);
+  return true;
+}
+
+void TAdaptiveConcurrencyLimiter::dispatched(int64_t queueDelay) {
+  int64_t now = Util::currentTimeUsec();
+  Guard g(mutex_);
+  minDelay_ = std::min(minDelay_, queueDelay);
+  if (now - intervalStart_ >= interval_) {
+    update();
+    intervalStart_ = now;
+    minDelay_ = std::numeric_limits<int64_t>::max();
+    maxInFlight_ = inFlight_;
+  }
+}
+
+void TAdaptiveConcurrencyLimiter::release() {
+  Guard g(mutex_);
+  if (inFlight_ > 0) {
+    --inFlight_;
+  }
+}
+
+void TAdaptiveConcurrencyLimiter::update() {
+  double limit = limit_;
+  if (minDelay_ > targetDelay_) {
+    // Even the luckiest call waited too long, so there is a standing queue
+    limit *= std::max(0.5, static_cast<double>(targetDelay_) / minDelay_);
+  } else if (maxInFlight_ >= static_cast<size_t>(limit_)) {
+    // Calls got through quickly although the limit was reached
+    limit += std::sqrt(limit);
+  }
+  limit_ = std::min(std::max(limit, static_cast<double>(minLimit_)),
+                    static_cast<double>(maxLimit_));
+}
+
+size_t TAdaptiveConcurrencyLimiter::getLimit() const {
+  Guard g(mutex_);
+  return static_cast<size_t>(limit_);
+}
+
+size_t TAdaptiveConcurrencyLimiter::getInFlight() const {
+  Guard g(mutex_);
+  return inFlight_;
+}
+
+uint64_t TAdaptiveConcurrencyLimiter::getRejected() const {
+  Guard g(mutex_);
+  return rejected_;
+}
+}
+}
+} // apache::thrift::server
@@ -0,0 +1,155 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements. See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership. The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied. See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+#ifndef _THRIFT_SERVER_TCONCURRENCYLIMITER_H_
+#define _THRIFT_SERVER_TCONCURRENCYLIMITER_H_ 1
+
+#include <thrift/Thrift.h>
+#include <thrift/concurrency/Mutex.h>
+
+#include <boost/noncopyable.hpp>
+
+namespace apache {
+namespace thrift {
+namespace server {
+
+/**
+ * Decides how many calls a server has in flight at once.  A server asks
+ * before it queues a call for a worker; calls that are not let in are
+ * answered with a TApplicationException instead of being processed.
+ *
+ * Implementations are called from the IO and worker threads of the server
+ * at the same time.
+ */
+class TConcurrencyLimiter {
+public:
+  virtual ~TConcurrencyLimiter() {}
+
+  /**
+   * Asks to let a call in.
+   *
+   * @return true if the call may be queued; release() must then follow.
+   */
+  virtual bool tryAcquire() = 0;
+
+  /**
+   * Called when a call that was let in starts running on a worker.
+   *
+   * @param queueDelay microseconds the call waited for the worker.
+   */
+  virtual void dispatched(int64_t queueDelay) { (void)queueDelay; }
+
+  /**
+   * Called when a call that was let in is done, or was dropped from the
+   * queue.
+   */
+  virtual void release() = 0;
+};
+
+/**
+ * Limits the calls in flight to what the workers get through without a
+ * standing queue.
+ *
+ * Like CoDel, it looks at the smallest delay calls saw between being queued
+ * and being dispatched over each interval: bursts that drain within the
+ * interval do not count, a queue that never drains does.  When that delay
+ * is above the target, the limit shrinks in proportion (by at most half
+ * per interval).  When it is below and the calls in flight reached the
+ * limit, the limit grows by its square root, to find out whether the
+ * workers can take more.
+ */
+class TAdaptiveConcurrencyLimiter : public TConcurrencyLimiter, boost::noncopyable {
+public:
+  static const size_t DEFAULT_INITIAL_LIMIT = 32;
+  static const size_t DEFAULT_MIN_LIMIT = 1;
+  static const size_t DEFAULT_MAX_LIMIT = 1000;
+
+  /// Queue delay above which the limit shrinks, in microseconds
+  static const int64_t DEFAULT_TARGET_DELAY = 5000;
+
+  /// Time over which the smallest queue delay is taken, in microseconds
+  static const int64_t DEFAULT_INTERVAL = 100000;
+
+  TAdaptiveConcurrencyLimiter(size_t initialLimit = DEFAULT_INITIAL_LIMIT,
+                              size_t minLimit = DEFAULT_MIN_LIMIT,
+                              size_t maxLimit = DEFAULT_MAX_LIMIT);
+
+  bool tryAcquire();
+
+  void dispatched(int64_t queueDelay);
+
+  void release();
+
+  /**
+   * Get the number of calls currently let in at once.
+   */
+  size_t getLimit() const;
+
+  /**
+   * Get the number of calls in flight.
+   */
+  size_t getInFlight() const;
+
+  /**
+   * Get the number of calls turned away since the limiter was created.
+   */
+  uint64_t getRejected() const;
+
+  int64_t getTargetDelay() const { return targetDelay_; }
+
+  /**
+   * Set the queue delay above which the limit shrinks.
+   *
+   * @param delay delay in microseconds.
+   */
+  void setTargetDelay(int64_t delay) { targetDelay_ = delay; }
+
+  int64_t getInterval() const { return interval_; }
+
+  /**
+   * Set the time over which the smallest queue delay is taken, and between
+   * changes of the limit.
+   *
+   * @param interval time in microseconds.
+   */
+  void setInterval(int64_t interval) { interval_ = interval; }
+
+private:
+  /// Changes the limit at the end of an interval
+  void update();
+
+  concurrency::Mutex mutex_;
+  double limit_;
+  size_t minLimit_;
+  size_t maxLimit_;
+  int64_t targetDelay_;
+  int64_t interval_;
+  size_t inFlight_;
+  uint64_t rejected_;
+
+  /// Start of the current interval, and what was seen since
+  int64_t intervalStart_;
+  int64_t minDelay_;
+  size_t maxInFlight_;
+};
+}
+}
+} // apache::thrift::server
+
+#endif // #ifndef _THRIFT_SERVER_TCONCURRENCYLIMITER_H_
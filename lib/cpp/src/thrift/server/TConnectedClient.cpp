@@ -59,6 +59,9 @@ void TConnectedClient::run() {
     }
 
     try {
+      // Everything the previous call allocated from the arena is gone by now
+      arena_.reset();
+      TArenaScope arenaScope(&arena_);
       if (!processor_->process(inputProtocol_, outputProtocol_, opaqueContext_)) {
         break;
       }
@@ -21,6 +21,7 @@
 #define _THRIFT_SERVER_TCONNECTEDCLIENT_H_ 1
 
 #include <boost/shared_ptr.hpp>
+#include <thrift/TArena.h>
 #include <thrift/TProcessor.h>
 #include <thrift/protocol/TProtocol.h>
 #include <thrift/server/TServer.h>
@@ -102,6 +103,11 @@ private:
    * Context acquired from the eventHandler_ if one exists.
    */
   void* opaqueContext_;
+
+  /**
+   * Arena that is current while a call is processed; reset between calls.
+   */
+  apache::thrift::TArena arena_;
 };
 }
 }
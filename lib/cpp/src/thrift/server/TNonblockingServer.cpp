@@ -22,11 +22,20 @@
 #include <thrift/thrift-config.h>
 
 #include <thrift/server/TNonblockingServer.h>
+#include <thrift/TApplicationException.h>
+#include <thrift/TArena.h>
+#include <thrift/TDeadline.h>
 #include <thrift/concurrency/Exception.h>
 #include <thrift/transport/TSocket.h>
 #include <thrift/concurrency/PlatformThreadFactory.h>
+#include <thrift/concurrency/Util.h>
 #include <thrift/transport/PlatformSocket.h>
+#ifdef HAVE_OPENSSL
+#include <thrift/transport/TSSLSocket.h>
+#endif
 
+#include <algorithm>
+#include <deque>
 #include <iostream>
 
 #ifdef HAVE_SYS_SELECT_H
@@ -60,6 +69,14 @@
 #include <sched.h>
 #endif
 
+#ifdef HAVE_SYS_EVENTFD_H
+#include <sys/eventfd.h>
+#endif
+
+#ifdef HAVE_SYS_UIO_H
+#include <sys/uio.h>
+#endif
+
 #ifndef AF_LOCAL
 #define AF_LOCAL AF_UNIX
 #endif
@@ -85,8 +102,8 @@ using apache::thrift::transport::TSocket;
 using apache::thrift::transport::TTransportException;
 using boost::shared_ptr;
 
-/// Three states for sockets: recv frame size, recv data, and send mode
-enum TSocketState { SOCKET_RECV_FRAMING, SOCKET_RECV, SOCKET_SEND };
+/// Four states for sockets: TLS handshake, recv frame size, recv data, and send mode
+enum TSocketState { SOCKET_TLS_HANDSHAKE, SOCKET_RECV_FRAMING, SOCKET_RECV, SOCKET_SEND };
 
 /**
  * Five states for the nonblocking server:
@@ -105,11 +122,84 @@ enum TAppState {
   APP_CLOSE_CONNECTION
 };
 
+/**
+ * A TMemoryBuffer that responses are written into, with a buffer from the
+ * IO thread's pool that it only holds while a response is built and sent.
+ */
+class TPooledMemoryBuffer : public TMemoryBuffer {
+public:
+  TPooledMemoryBuffer() : TMemoryBuffer(NULL, 0) {}
+
+  /// Starts writing, empty, into a pool buffer of size bytes.
+  void attach(uint8_t* buf, uint32_t size) {
+    resetBuffer(buf, size, TAKE_OWNERSHIP);
+    resetBuffer();
+  }
+
+  /**
+   * Takes the buffer, which writes may have grown, away again.
+   *
+   * @param size set to the size of the buffer returned.
+   * @return the buffer, or NULL if there is none.
+   */
+  uint8_t* detach(uint32_t& size) {
+    uint8_t* buf = owner_ ? buffer_ : NULL;
+    size = owner_ ? bufferSize_ : 0;
+    owner_ = false;
+    resetBuffer(NULL, 0);
+    return buf;
+  }
+};
+
+/**
+ * Frees a request frame that views still pinned when the server was done
+ * with it, once the last of them lets go (see lendFrame()).
+ */
+struct TFrameDeleter {
+  TFrameDeleter() : buf(NULL) {}
+  void operator()(uint8_t*) { std::free(buf); }
+  uint8_t* buf;
+};
+
+/**
+ * Gets a pin that keeps the frame in buf out of the pool while views read
+ * from it are alive.  The pins on all frames of one owner share its token,
+ * so pinning costs no allocation once the token exists.
+ */
+static boost::shared_array<uint8_t> pinFrame(boost::shared_array<uint8_t>& token, uint8_t* buf) {
+  // The token itself points nowhere, so only its count tells if it exists
+  if (token.use_count() == 0) {
+    token = boost::shared_array<uint8_t>(static_cast<uint8_t*>(NULL), TFrameDeleter());
+  }
+  return boost::shared_array<uint8_t>(token, buf);
+}
+
+/**
+ * Leaves the frame in buf to the views still pinning it, if there are any,
+ * and the last of them frees it.  The owner gets a new token on its next
+ * pinFrame().
+ *
+ * @return false if nothing pins the frame, so the caller still owns buf.
+ */
+static bool lendFrame(boost::shared_array<uint8_t>& token, uint8_t* buf) {
+  if (token.use_count() <= 1) {
+    return false;
+  }
+  // Our reference keeps the deleter from running before it knows buf
+  boost::get_deleter<TFrameDeleter>(token)->buf = buf;
+  token.reset();
+  return true;
+}
+
 /**
  * Represents a connection that is handled via libevent. This connection
  * essentially encapsulates a socket that has some associated libevent state.
  */
 class TNonblockingServer::TConnection {
+public:
+  class Task;
+  class Request;
+
 private:
   /// Server IO Thread handling this connection
   TNonblockingIOThread* ioThread_;
@@ -123,6 +213,17 @@ private:
   /// Object wrapping network socket
   boost::shared_ptr<TSocket> tSocket_;
 
+#ifdef HAVE_OPENSSL
+  /// The same socket as tSocket_, for TLS connections
+  boost::shared_ptr<TSSLSocket> sslSocket_;
+#endif
+
+  /// Readiness a TLS call waits for, besides what the state waits for
+  short tlsWant_;
+
+  /// Whether TLS data has been decrypted but not read yet
+  bool tlsPending_;
+
   /// Libevent object
   struct event event_;
 
@@ -147,6 +248,19 @@ private:
   /// Read buffer size
   uint32_t readBufferSize_;
 
+  /// Shared by the pins on frames in readBuffer_, see pinFrame()
+  boost::shared_array<uint8_t> readToken_;
+
+  /// Bytes read from the socket ahead of the frame they belong to
+  uint8_t* readAhead_;
+
+  /// Size of readAhead_
+  uint32_t readAheadSize_;
+
+  /// Where in readAhead_ the bytes not taken yet start and end
+  uint32_t readAheadPos_;
+  uint32_t readAheadEnd_;
+
   /// Write buffer
   uint8_t* writeBuffer_;
 
@@ -156,17 +270,11 @@ private:
   /// How far through writing are we?
   uint32_t writeBufferPos_;
 
-  /// Largest size of write buffer seen since buffer was constructed
-  size_t largestWriteBufferSize_;
-
-  /// Count of the number of calls for use with getResizeBufferEveryN().
-  int32_t callsForResize_;
-
   /// Transport to read from
   boost::shared_ptr<TMemoryBuffer> inputTransport_;
 
   /// Transport that processor writes to
-  boost::shared_ptr<TMemoryBuffer> outputTransport_;
+  boost::shared_ptr<TPooledMemoryBuffer> outputTransport_;
 
   /// extra transport generated by transport factory (e.g. BufferedRouterTransport)
   boost::shared_ptr<TTransport> factoryInputTransport_;
@@ -184,6 +292,40 @@ private:
   /// Thrift call context, if any
   void* connectionContext_;
 
+  /// Arena that is current while a call is processed; reset between calls
+  TArena arena_;
+
+  /// Link in the IO thread's completion queue while a notify is pending
+  TConnection* nextCompletion_;
+
+  /// Whether requests on this connection are pipelined
+  bool pipelined_;
+
+  /// Pipelined requests being processed, in the order they arrived
+  std::deque<Request*> pending_;
+
+  /// Pipelined requests whose responses are waiting to be sent
+  std::deque<Request*> responses_;
+
+  /// Request objects not in use
+  std::vector<Request*> freeRequests_;
+
+  /// Set when close() has to wait for pipelined requests to finish
+  bool closing_;
+
+  /**
+   * Pipelined requests marked done by their tasks and not yet taken by
+   * completeRequests().  The task that raises it from zero notifies the IO
+   * thread; no task touches the connection after counting its request.
+   */
+  boost::atomic<uint32_t> doneCount_;
+
+  /// Counted requests that completeRequests() has not taken off pending_ yet
+  uint32_t doneCredit_;
+
+  /// Where this connection is in the IO thread's active connections
+  size_t activeIndex_;
+
   /// Go into read mode
   void setRead() { setFlags(EV_READ | EV_PERSIST); }
 
@@ -193,6 +335,12 @@ private:
   /// Set socket idle
   void setIdle() { setFlags(0); }
 
+  /// Go back to waiting for what the current state needs
+  void resetFlags();
+
+  /// Makes the event go off for input the socket will not announce
+  void notifyBufferedInput();
+
   /**
    * Set event flags for this connection.
    *
@@ -208,9 +356,115 @@ private:
    */
   void workSocket();
 
-public:
-  class Task;
+  /**
+   * Libevent handler for pipelined connections, which may be reading and
+   * writing at the same time.
+   *
+   * @param which the flags libevent passed.
+   */
+  void workPipelined(short which);
+
+  /// Whether the connection is TLS
+  bool isTLS() const;
+
+  /**
+   * Takes the TLS handshake as far as the socket allows.
+   *
+   * @return true once it is done.
+   */
+  bool handshake();
+
+  /**
+   * Reads what the socket has, up to len bytes.
+   *
+   * @return the bytes read, 0 once the peer has closed the connection, or
+   *         -1 if a TLS connection has to wait for the socket first.
+   */
+  int32_t readSocket(uint8_t* buf, uint32_t len);
+
+  /**
+   * Takes up to len bytes of input, from what was read ahead or else from
+   * the socket.  Like readSocket(), returns -1 if it has to wait.
+   */
+  int32_t readInput(uint8_t* buf, uint32_t len);
+
+  /**
+   * Writes what the socket takes right away.
+   *
+   * @return the bytes written, possibly 0.
+   */
+  uint32_t writeSocket(const uint8_t* buf, uint32_t len);
+
+#ifdef HAVE_SYS_UIO_H
+  /// Like writeSocket(), for several buffers.
+  uint32_t writevSocket(const struct iovec* iov, int iovcnt);
+#endif
+
+#ifdef HAVE_OPENSSL
+  /// Waits for the readiness a TLS call that returned early asked for.
+  void waitForTLS();
+
+  /// Stops waiting for readiness only a TLS call asked for.
+  void tlsProgressed();
+#endif
+
+  /**
+   * Points the transports at a request frame, lending it to views pinned
+   * with token, and prepares for the response.
+   */
+  void resetTransports(uint8_t* buf,
+                       uint32_t len,
+                       boost::shared_array<uint8_t>& token,
+                       TMemoryBuffer* inputTransport,
+                       TPooledMemoryBuffer* outputTransport);
+
+  /// Gives the buffer of a response, once sent, back to the IO thread.
+  void releaseOutput(TPooledMemoryBuffer* outputTransport);
+
+  /// Gives the read buffer back to the IO thread.
+  void releaseReadBuffer();
+
+  /// Gives the read-ahead buffer back to the IO thread.
+  void releaseReadAhead();
+
+  /**
+   * Gets the response from outputTransport and puts the frame size in front.
+   *
+   * @return false if there is no response, i.e. the call was oneway.
+   */
+  bool frameResponse(TMemoryBuffer* outputTransport, uint8_t*& buf, uint32_t& len);
+
+  /// Hands the frame just read to the thread manager as a pipelined request.
+  void dispatchRequest();
+
+  /**
+   * Takes finished pipelined requests off pending_.  Only called for the
+   * notification sent by requestDone(), or by the IO thread in its place.
+   *
+   * @return false if the connection was closed.
+   */
+  bool completeRequests();
+
+  /**
+   * Sends as much of the queued responses as the socket takes.
+   *
+   * @return false if the connection was closed.
+   */
+  bool sendResponses();
+
+  /// Gets an unused Request object, creating one if needed.
+  Request* takeRequest();
+
+  /// Returns a Request object once its response has been sent.
+  void releaseRequest(Request* request);
 
+  /// Frees all Request objects.
+  void deleteRequests();
+
+  /// Reads and writes on a pipelined connection as far as the limits allow.
+  void setPipelineFlags();
+
+public:
   /// Constructor
   TConnection(THRIFT_SOCKET socket,
               TNonblockingIOThread* ioThread,
@@ -218,6 +472,12 @@ public:
               socklen_t addrLen) {
     readBuffer_ = NULL;
     readBufferSize_ = 0;
+    readAhead_ = NULL;
+    readAheadSize_ = 0;
+    nextCompletion_ = NULL;
+    closing_ = false;
+    doneCount_ = 0;
+    doneCredit_ = 0;
 
     ioThread_ = ioThread;
     server_ = ioThread->getServer();
@@ -225,24 +485,32 @@ public:
     // Allocate input and output transports these only need to be allocated
     // once per TConnection (they don't need to be reallocated on init() call)
     inputTransport_.reset(new TMemoryBuffer(readBuffer_, readBufferSize_));
-    outputTransport_.reset(
-        new TMemoryBuffer(static_cast<uint32_t>(server_->getWriteBufferDefaultSize())));
+    outputTransport_.reset(new TPooledMemoryBuffer());
     tSocket_.reset(new TSocket());
     init(socket, ioThread, addr, addrLen);
   }
 
-  ~TConnection() { std::free(readBuffer_); }
+  ~TConnection() {
+    deleteRequests();
+    if (!lendFrame(readToken_, readBuffer_)) {
+      std::free(readBuffer_);
+    }
+    std::free(readAhead_);
+  }
+
+  /// Position in the IO thread's active connections, kept by the IO thread
+  size_t getActiveIndex() const { return activeIndex_; }
+  void setActiveIndex(size_t index) { activeIndex_ = index; }
 
-  /// Close this connection and free or reset its resources.
+  /**
+   * Close this connection and free or reset its resources.  While pipelined
+   * requests are still being processed the socket only goes idle, and the
+   * close is finished when the last of them is done.
+   */
   void close();
 
-  /**
-    * Check buffers against any size limits and shrink it if exceeded.
-    *
-    * @param readLimit we reduce read buffer size to this (if nonzero).
-    * @param writeLimit if nonzero and write buffer is larger, replace it.
-    */
-  void checkIdleBufferMemLimit(size_t readLimit, size_t writeLimit);
+  /// Gives up on pipelined requests still being processed, before a final close.
+  void abandonRequests();
 
   /// Initialize
   void init(THRIFT_SOCKET socket,
@@ -265,9 +533,14 @@ public:
    * @param which the flags associated with the event.
    * @param v void* callback arg where we placed TConnection's "this".
    */
-  static void eventHandler(evutil_socket_t fd, short /* which */, void* v) {
+  static void eventHandler(evutil_socket_t fd, short which, void* v) {
     assert(fd == static_cast<evutil_socket_t>(((TConnection*)v)->getTSocket()->getSocketFD()));
-    ((TConnection*)v)->workSocket();
+    TConnection* connection = (TConnection*)v;
+    if (connection->pipelined_) {
+      connection->workPipelined(which);
+    } else {
+      connection->workSocket();
+    }
   }
 
   /**
@@ -281,12 +554,42 @@ public:
    */
   bool notifyIOThread() { return ioThread_->notify(this); }
 
+  /**
+   * Marks a pipelined request as processed and notifies the IO thread,
+   * unless a notification for this connection is pending already.  Can be
+   * called from any thread.
+   *
+   * @return true if successful, false if unable to notify.
+   */
+  bool requestDone(Request* request);
+
+  /**
+   * Called by the IO thread for each notifyIOThread(), to make the
+   * transition the notification stands for.
+   */
+  void notified() {
+    if (pipelined_ && appState_ != APP_INIT) {
+      completeRequests();
+    } else {
+      transition();
+    }
+  }
+
+  /// Next connection in the IO thread's completion queue.
+  TConnection* getNextCompletion() const { return nextCompletion_; }
+
+  /// Links this connection into the IO thread's completion queue.
+  void setNextCompletion(TConnection* next) { nextCompletion_ = next; }
+
   /*
    * Returns the number of this connection's currently assigned IO
    * thread.
    */
   int getIOThreadNumber() const { return ioThread_->getThreadNumber(); }
 
+  /// Returns the IO thread this connection is currently assigned to.
+  TNonblockingIOThread* getIOThread() const { return ioThread_; }
+
   /// Force connection shutdown for this connection.
   void forceClose() {
     appState_ = APP_CLOSE_CONNECTION;
@@ -310,27 +613,137 @@ public:
 
   /// return the Thrift connection context if any
   void* getConnectionContext() { return connectionContext_; }
+
+  /// return the arena used for calls on this connection
+  TArena* getArena() { return &arena_; }
+};
+
+/**
+ * A pipelined request: the frame it was read into, the transports and
+ * protocols its task works on, and its response while that is sent.
+ */
+class TNonblockingServer::TConnection::Request {
+public:
+  Request() : buffer(NULL), bufferSize(0), done_(false), closeConnection_(false) {
+    resetWrite();
+  }
+
+  ~Request() {
+    if (!lendFrame(bufferToken, buffer)) {
+      std::free(buffer);
+    }
+  }
+
+  /// Frame buffer; swapped with the connection's read buffer
+  uint8_t* buffer;
+  uint32_t bufferSize;
+
+  /// Shared by the pins on frames in buffer, see pinFrame()
+  boost::shared_array<uint8_t> bufferToken;
+
+  boost::shared_ptr<TMemoryBuffer> inputTransport;
+  boost::shared_ptr<TPooledMemoryBuffer> outputTransport;
+  boost::shared_ptr<TTransport> factoryInputTransport;
+  boost::shared_ptr<TTransport> factoryOutputTransport;
+  boost::shared_ptr<TProtocol> inputProtocol;
+  boost::shared_ptr<TProtocol> outputProtocol;
+
+  /// Response being sent
+  uint8_t* writeBuffer;
+  uint32_t writeBufferSize;
+  uint32_t writeBufferPos;
+
+  TArena* getArena() { return &arena_; }
+
+  /// Whether the task is done, or was dropped
+  bool isDone() const { return done_.load(boost::memory_order_acquire); }
+
+  /// Called by the task, before notifying the IO thread
+  void setDone() { done_.store(true, boost::memory_order_release); }
+
+  /// Whether the connection has to be closed instead of responding
+  bool getCloseConnection() const { return closeConnection_; }
+
+  void setCloseConnection() { closeConnection_ = true; }
+
+  /// Readies the object for another request
+  void reset() {
+    done_.store(false, boost::memory_order_relaxed);
+    closeConnection_ = false;
+    resetWrite();
+  }
+
+private:
+  void resetWrite() {
+    writeBuffer = NULL;
+    writeBufferSize = 0;
+    writeBufferPos = 0;
+  }
+
+  TArena arena_;
+  boost::atomic<bool> done_;
+  bool closeConnection_;
 };
 
+/**
+ * Answers the call in input with a TApplicationException instead of
+ * processing it, or just consumes it if it is oneway.
+ */
+static void rejectCall(TProtocol* input, TProtocol* output) {
+  std::string name;
+  TMessageType type;
+  int32_t seqid;
+  input->readMessageBegin(name, type, seqid);
+  input->skip(T_STRUCT);
+  input->readMessageEnd();
+  input->getTransport()->readEnd();
+  if (type == T_ONEWAY) {
+    return;
+  }
+  TApplicationException x(TApplicationException::INTERNAL_ERROR,
+                          "TNonblockingServer: too many calls in flight");
+  output->writeMessageBegin(name, T_EXCEPTION, seqid);
+  x.write(output);
+  output->writeMessageEnd();
+  output->getTransport()->writeEnd();
+  output->getTransport()->flush();
+}
+
 class TNonblockingServer::TConnection::Task : public Runnable {
 public:
   Task(boost::shared_ptr<TProcessor> processor,
        boost::shared_ptr<TProtocol> input,
        boost::shared_ptr<TProtocol> output,
-       TConnection* connection)
+       TConnection* connection,
+       Request* request = NULL,
+       boost::shared_ptr<TConcurrencyLimiter> limiter = boost::shared_ptr<TConcurrencyLimiter>())
     : processor_(processor),
       input_(input),
       output_(output),
       connection_(connection),
+      request_(request),
+      limiter_(limiter),
       serverEventHandler_(connection_->getServerEventHandler()),
-      connectionContext_(connection_->getConnectionContext()) {}
+      connectionContext_(connection_->getConnectionContext()),
+      queued_(Util::currentTimeUsec()) {}
+
+  /// Covers tasks that are dropped without running or being closed
+  ~Task() { releaseLimiter(); }
 
   void run() {
+    if (limiter_) {
+      limiter_->dispatched(Util::currentTimeUsec() - queued_);
+    }
     try {
+      // Time spent waiting for a worker counts against the deadlines of calls
+      TReceivedScope receivedScope(queued_ / 1000);
       for (;;) {
         if (serverEventHandler_) {
           serverEventHandler_->processContext(connectionContext_, connection_->getTSocket());
         }
+        TArena* arena = request_ != NULL ? request_->getArena() : connection_->getArena();
+        arena->reset();
+        TArenaScope arenaScope(arena);
         if (!processor_->process(input_, output_, connectionContext_)
             || !input_->getTransport()->peek()) {
           break;
@@ -348,37 +761,95 @@ public:
     } catch (...) {
       GlobalOutput.printf("TNonblockingServer: unknown exception while processing.");
     }
+    releaseLimiter();
 
     // Signal completion back to the libevent thread via a pipe
-    if (!connection_->notifyIOThread()) {
+    if (request_ != NULL) {
+      if (!connection_->requestDone(request_)) {
+        GlobalOutput.printf("TNonblockingServer: failed to notifyIOThread.");
+        throw TException("TNonblockingServer::Task::run: failed write on notify pipe");
+      }
+    } else if (!connection_->notifyIOThread()) {
       GlobalOutput.printf("TNonblockingServer: failed to notifyIOThread, closing.");
       connection_->close();
       throw TException("TNonblockingServer::Task::run: failed write on notify pipe");
     }
   }
 
+  /// Drops the task without running it and closes its connection.
+  void forceClose() {
+    releaseLimiter();
+    if (request_ != NULL) {
+      request_->setCloseConnection();
+      if (!connection_->requestDone(request_)) {
+        throw TException("TNonblockingServer::Task::forceClose: failed write on notify pipe");
+      }
+    } else {
+      assert(connection_->getState() == APP_WAIT_TASK);
+      connection_->forceClose();
+    }
+  }
+
   TConnection* getTConnection() { return connection_; }
 
 private:
+  void releaseLimiter() {
+    if (limiter_) {
+      limiter_->release();
+      limiter_.reset();
+    }
+  }
+
   boost::shared_ptr<TProcessor> processor_;
   boost::shared_ptr<TProtocol> input_;
   boost::shared_ptr<TProtocol> output_;
   TConnection* connection_;
+  Request* request_;
+  /// The limiter that let the task in, until it is released
+  boost::shared_ptr<TConcurrencyLimiter> limiter_;
   boost::shared_ptr<TServerEventHandler> serverEventHandler_;
   void* connectionContext_;
+  int64_t queued_;
 };
 
+bool TNonblockingServer::TConnection::requestDone(Request* request) {
+  request->setDone();
+  // A count above zero means completeRequests() is running or about to, and
+  // it takes this request along.  Otherwise the IO thread does not look at
+  // the requests until it gets the notification sent here, so the
+  // connection cannot go away before it is sent.
+  return doneCount_.fetch_add(1, boost::memory_order_acq_rel) != 0 || notifyIOThread();
+}
+
 void TNonblockingServer::TConnection::init(THRIFT_SOCKET socket,
                                            TNonblockingIOThread* ioThread,
                                            const sockaddr* addr,
                                            socklen_t addrLen) {
+  ioThread_ = ioThread;
+  server_ = ioThread->getServer();
+
+#ifdef HAVE_OPENSSL
+  if (server_->getSSLSocketFactory() && !sslSocket_) {
+    // Kept, like a plain socket, when the connection is reused
+    sslSocket_ = server_->getSSLSocketFactory()->createSocket();
+    sslSocket_->server(true);
+    tSocket_ = sslSocket_;
+  }
+#endif
   tSocket_->setSocketFD(socket);
   tSocket_->setCachedAddress(addr, addrLen);
 
-  ioThread_ = ioThread;
-  server_ = ioThread->getServer();
   appState_ = APP_INIT;
   eventFlags_ = 0;
+  tlsWant_ = 0;
+  tlsPending_ = false;
+  readAheadPos_ = 0;
+  readAheadEnd_ = 0;
+
+  pipelined_ = server_->getMaxPipelinedRequests() > 1 && server_->isThreadPoolProcessing();
+  closing_ = false;
+  doneCount_ = 0;
+  doneCredit_ = 0;
 
   readBufferPos_ = 0;
   readWant_ = 0;
@@ -386,10 +857,8 @@ void TNonblockingServer::TConnection::init(THRIFT_SOCKET socket,
   writeBuffer_ = NULL;
   writeBufferSize_ = 0;
   writeBufferPos_ = 0;
-  largestWriteBufferSize_ = 0;
 
-  socketState_ = SOCKET_RECV_FRAMING;
-  callsForResize_ = 0;
+  socketState_ = isTLS() ? SOCKET_TLS_HANDSHAKE : SOCKET_RECV_FRAMING;
 
   // get input/transports
   factoryInputTransport_ = server_->getInputTransportFactory()->getTransport(inputTransport_);
@@ -422,6 +891,22 @@ void TNonblockingServer::TConnection::workSocket() {
   uint32_t fetch = 0;
 
   switch (socketState_) {
+  case SOCKET_TLS_HANDSHAKE:
+    try {
+      if (!handshake()) {
+        return;
+      }
+    } catch (TTransportException& te) {
+      GlobalOutput.printf("TConnection::workSocket(): %s", te.what());
+      close();
+      return;
+    }
+
+    // Now the first frame can be read
+    socketState_ = SOCKET_RECV_FRAMING;
+    transition();
+    return;
+
   case SOCKET_RECV_FRAMING:
     union {
       uint8_t buf[sizeof(uint32_t)];
@@ -433,14 +918,17 @@ void TNonblockingServer::TConnection::workSocket() {
     // determine size of this frame
     try {
       // Read from the socket
-      fetch = tSocket_->read(&framing.buf[readBufferPos_],
-                             uint32_t(sizeof(framing.size) - readBufferPos_));
-      if (fetch == 0) {
+      got = readInput(&framing.buf[readBufferPos_],
+                      uint32_t(sizeof(framing.size) - readBufferPos_));
+      if (got < 0) {
+        return;
+      }
+      if (got == 0) {
         // Whenever we get here it means a remote disconnect
         close();
         return;
       }
-      readBufferPos_ += fetch;
+      readBufferPos_ += got;
     } catch (TTransportException& te) {
       GlobalOutput.printf("TConnection::workSocket(): %s", te.what());
       close();
@@ -471,7 +959,12 @@ void TNonblockingServer::TConnection::workSocket() {
     }
     // size known; now get the rest of the frame
     transition();
-    return;
+    if (readAheadPos_ == readAheadEnd_ || readBufferPos_ == readWant_) {
+      return;
+    }
+    // Some of it was read already and the socket may have nothing more, so
+    // take it from the read-ahead buffer before waiting for the socket
+    // fall through
 
   case SOCKET_RECV:
     // It is an error to be in this state if we already have all the data
@@ -480,7 +973,7 @@ void TNonblockingServer::TConnection::workSocket() {
     try {
       // Read from the socket
       fetch = readWant_ - readBufferPos_;
-      got = tSocket_->read(readBuffer_ + readBufferPos_, fetch);
+      got = readInput(readBuffer_ + readBufferPos_, fetch);
     } catch (TTransportException& te) {
       GlobalOutput.printf("TConnection::workSocket(): %s", te.what());
       close();
@@ -488,6 +981,11 @@ void TNonblockingServer::TConnection::workSocket() {
       return;
     }
 
+    if (got < 0) {
+      // TLS has to wait for the socket
+      return;
+    }
+
     if (got > 0) {
       // Move along in the buffer
       readBufferPos_ += got;
@@ -520,7 +1018,7 @@ void TNonblockingServer::TConnection::workSocket() {
 
     try {
       left = writeBufferSize_ - writeBufferPos_;
-      sent = tSocket_->write_partial(writeBuffer_ + writeBufferPos_, left);
+      sent = writeSocket(writeBuffer_ + writeBufferPos_, left);
     } catch (TTransportException& te) {
       GlobalOutput.printf("TConnection::workSocket(): %s ", te.what());
       close();
@@ -562,35 +1060,46 @@ void TNonblockingServer::TConnection::transition() {
   assert(ioThread_);
   assert(server_);
 
+  // Whether a request was turned away by the concurrency limiter, or the
+  // limiter that let it in
+  bool rejected = false;
+  boost::shared_ptr<TConcurrencyLimiter> limiter;
+
   // Switch upon the state that we are currently in and move to a new state
   switch (appState_) {
 
   case APP_READ_REQUEST:
+    if (pipelined_) {
+      // The request gets a task of its own and we go on reading
+      dispatchRequest();
+      return;
+    }
+
     // We are done reading the request, package the read buffer into transport
     // and get back some data from the dispatch function
-    if (server_->getHeaderTransport()) {
-      inputTransport_->resetBuffer(readBuffer_, readBufferPos_);
-      outputTransport_->resetBuffer();
-    } else {
-      // We saved room for the framing size in case header transport needed it,
-      // but just skip it for the non-header case
-      inputTransport_->resetBuffer(readBuffer_ + 4, readBufferPos_ - 4);
-      outputTransport_->resetBuffer();
-
-      // Prepend four bytes of blank space to the buffer so we can
-      // write the frame size there later.
-      outputTransport_->getWritePtr(4);
-      outputTransport_->wroteBytes(4);
-    }
+    resetTransports(readBuffer_,
+                    readBufferPos_,
+                    readToken_,
+                    inputTransport_.get(),
+                    outputTransport_.get());
 
     server_->incrementActiveProcessors();
 
     if (server_->isThreadPoolProcessing()) {
+      limiter = server_->getConcurrencyLimiter();
+      if (limiter && !limiter->tryAcquire()) {
+        // The call is answered right here instead of being queued
+        limiter.reset();
+        rejected = true;
+      }
+    }
+
+    if (server_->isThreadPoolProcessing() && !rejected) {
       // We are setting up a Task to do this work and we will wait on it
 
       // Create task and dispatch to the thread manager
       boost::shared_ptr<Runnable> task = boost::shared_ptr<Runnable>(
-          new Task(processor_, inputProtocol_, outputProtocol_, this));
+          new Task(processor_, inputProtocol_, outputProtocol_, this, NULL, limiter));
       // The application is now waiting on the task to finish
       appState_ = APP_WAIT_TASK;
 
@@ -612,11 +1121,17 @@ void TNonblockingServer::TConnection::transition() {
       return;
     } else {
       try {
-        if (serverEventHandler_) {
-          serverEventHandler_->processContext(connectionContext_, getTSocket());
+        if (rejected) {
+          rejectCall(inputProtocol_.get(), outputProtocol_.get());
+        } else {
+          if (serverEventHandler_) {
+            serverEventHandler_->processContext(connectionContext_, getTSocket());
+          }
+          // Invoke the processor
+          arena_.reset();
+          TArenaScope arenaScope(&arena_);
+          processor_->process(inputProtocol_, outputProtocol_, connectionContext_);
         }
-        // Invoke the processor
-        processor_->process(inputProtocol_, outputProtocol_, connectionContext_);
       } catch (const TTransportException& ttx) {
         GlobalOutput.printf(
             "TNonblockingServer transport error in "
@@ -642,6 +1157,7 @@ void TNonblockingServer::TConnection::transition() {
 
   // Intentionally fall through here, the call to process has written into
   // the writeBuffer_
+  // fall through
 
   case APP_WAIT_TASK:
     // We have now finished processing a task and the result has been written
@@ -649,22 +1165,15 @@ void TNonblockingServer::TConnection::transition() {
     // the writeBuffer_ for actual writing by the libevent thread
 
     server_->decrementActiveProcessors();
-    // Get the result of the operation
-    outputTransport_->getBuffer(&writeBuffer_, &writeBufferSize_);
 
     // If the function call generated return data, then move into the send
     // state and get going
-    // 4 bytes were reserved for frame size
-    if (writeBufferSize_ > 4) {
+    if (frameResponse(outputTransport_.get(), writeBuffer_, writeBufferSize_)) {
 
       // Move into write state
       writeBufferPos_ = 0;
       socketState_ = SOCKET_SEND;
 
-      // Put the frame size into the write buffer
-      int32_t frameSize = (int32_t)htonl(writeBufferSize_ - 4);
-      memcpy(writeBuffer_, &frameSize, 4);
-
       // Socket into write mode
       appState_ = APP_SEND_RESULT;
       setWrite();
@@ -680,26 +1189,23 @@ void TNonblockingServer::TConnection::transition() {
     goto LABEL_APP_INIT;
 
   case APP_SEND_RESULT:
-    // it's now safe to perform buffer size housekeeping.
-    if (writeBufferSize_ > largestWriteBufferSize_) {
-      largestWriteBufferSize_ = writeBufferSize_;
-    }
-    if (server_->getResizeBufferEveryN() > 0
-        && ++callsForResize_ >= server_->getResizeBufferEveryN()) {
-      checkIdleBufferMemLimit(server_->getIdleReadBufferLimit(),
-                              server_->getIdleWriteBufferLimit());
-      callsForResize_ = 0;
-    }
-
-  // N.B.: We also intentionally fall through here into the INIT state!
+  // N.B.: We intentionally fall through here into the INIT state!
 
   LABEL_APP_INIT:
   case APP_INIT:
+    if (socketState_ == SOCKET_TLS_HANDSHAKE) {
+      // TLS connections handshake first, and come back here once it is done
+      setRead();
+      return;
+    }
 
-    // Clear write buffer variables
+    // Clear write buffer variables; the buffers of the request and its
+    // response go back to the pool until the next frame comes in
     writeBuffer_ = NULL;
     writeBufferPos_ = 0;
     writeBufferSize_ = 0;
+    releaseOutput(outputTransport_.get());
+    releaseReadBuffer();
 
     // Into read4 state we go
     socketState_ = SOCKET_RECV_FRAMING;
@@ -718,24 +1224,11 @@ void TNonblockingServer::TConnection::transition() {
   case APP_READ_FRAME_SIZE:
     readWant_ += 4;
 
-    // We just read the request length
-    // Double the buffer size until it is big enough
+    // We just read the request length; take a buffer big enough for it
     if (readWant_ > readBufferSize_) {
-      if (readBufferSize_ == 0) {
-        readBufferSize_ = 1;
-      }
-      uint32_t newSize = readBufferSize_;
-      while (readWant_ > newSize) {
-        newSize *= 2;
-      }
-
-      uint8_t* newBuffer = (uint8_t*)std::realloc(readBuffer_, newSize);
-      if (newBuffer == NULL) {
-        // nothing else to be done...
-        throw std::bad_alloc();
-      }
-      readBuffer_ = newBuffer;
-      readBufferSize_ = newSize;
+      releaseReadBuffer();
+      readBufferSize_ = readWant_;
+      readBuffer_ = ioThread_->allocateBuffer(readBufferSize_);
     }
 
     readBufferPos_ = 4;
@@ -761,29 +1254,476 @@ void TNonblockingServer::TConnection::transition() {
   }
 }
 
-void TNonblockingServer::TConnection::setFlags(short eventFlags) {
-  // Catch the do nothing case
-  if (eventFlags_ == eventFlags) {
-    return;
+void TNonblockingServer::TConnection::resetTransports(uint8_t* buf,
+                                                      uint32_t len,
+                                                      boost::shared_array<uint8_t>& token,
+                                                      TMemoryBuffer* inputTransport,
+                                                      TPooledMemoryBuffer* outputTransport) {
+  uint32_t size = static_cast<uint32_t>(server_->getWriteBufferDefaultSize());
+  outputTransport->attach(ioThread_->allocateBuffer(size), size);
+
+  if (server_->getHeaderTransport()) {
+    inputTransport->resetBuffer(buf, len, pinFrame(token, buf));
+    outputTransport->resetBuffer();
+  } else {
+    // We saved room for the framing size in case header transport needed it,
+    // but just skip it for the non-header case
+    inputTransport->resetBuffer(buf + 4, len - 4, pinFrame(token, buf));
+    outputTransport->resetBuffer();
+
+    // Prepend four bytes of blank space to the buffer so we can
+    // write the frame size there later.
+    outputTransport->getWritePtr(4);
+    outputTransport->wroteBytes(4);
   }
+}
 
-  // Delete a previously existing event
-  if (eventFlags_ != 0) {
-    if (event_del(&event_) == -1) {
-      GlobalOutput("TConnection::setFlags event_del");
-      return;
-    }
+void TNonblockingServer::TConnection::releaseOutput(TPooledMemoryBuffer* outputTransport) {
+  uint32_t size;
+  uint8_t* buf = outputTransport->detach(size);
+  ioThread_->releaseBuffer(buf, size);
+}
+
+void TNonblockingServer::TConnection::releaseReadBuffer() {
+  // Only views may still pin the frame now
+  inputTransport_->resetBuffer();
+  if (!lendFrame(readToken_, readBuffer_)) {
+    ioThread_->releaseBuffer(readBuffer_, readBufferSize_);
   }
+  readBuffer_ = NULL;
+  readBufferSize_ = 0;
+}
 
-  // Update in memory structure
-  eventFlags_ = eventFlags;
+void TNonblockingServer::TConnection::releaseReadAhead() {
+  ioThread_->releaseBuffer(readAhead_, readAheadSize_);
+  readAhead_ = NULL;
+  readAheadSize_ = 0;
+  readAheadPos_ = 0;
+  readAheadEnd_ = 0;
+}
 
-  // Do not call event_set if there are no flags
-  if (!eventFlags_) {
-    return;
+bool TNonblockingServer::TConnection::frameResponse(TMemoryBuffer* outputTransport,
+                                                    uint8_t*& buf,
+                                                    uint32_t& len) {
+  // Get the result of the operation
+  outputTransport->getBuffer(&buf, &len);
+
+  // 4 bytes were reserved for frame size
+  if (len <= 4) {
+    return false;
   }
 
-  /*
+  // Put the frame size into the write buffer
+  int32_t frameSize = (int32_t)htonl(len - 4);
+  memcpy(buf, &frameSize, 4);
+  return true;
+}
+
+void TNonblockingServer::TConnection::workPipelined(short which) {
+  if (tlsWant_ != 0) {
+    // A TLS call waits for the socket, which may now be ready either way
+    which |= EV_READ | EV_WRITE;
+  }
+  if ((which & EV_WRITE) && !sendResponses()) {
+    return;
+  }
+  // Sending may have closed the connection or stopped reading
+  if ((which & EV_READ) && (eventFlags_ & EV_READ)) {
+    workSocket();
+  }
+}
+
+void TNonblockingServer::TConnection::dispatchRequest() {
+  // The request takes over the read buffer, so the frame needs no copy
+  Request* request = takeRequest();
+  std::swap(request->buffer, readBuffer_);
+  std::swap(request->bufferSize, readBufferSize_);
+  resetTransports(request->buffer,
+                  readBufferPos_,
+                  request->bufferToken,
+                  request->inputTransport.get(),
+                  request->outputTransport.get());
+
+  server_->incrementActiveProcessors();
+  pending_.push_back(request);
+
+  boost::shared_ptr<TConcurrencyLimiter> limiter = server_->getConcurrencyLimiter();
+  bool rejected = limiter && !limiter->tryAcquire();
+  if (rejected) {
+    // The request is answered right here, in turn with the others
+    try {
+      rejectCall(request->inputProtocol.get(), request->outputProtocol.get());
+    } catch (const TException& tx) {
+      GlobalOutput.printf("TNonblockingServer: failed to reject pipelined request: %s", tx.what());
+      request->setCloseConnection();
+    }
+    request->setDone();
+  } else {
+    boost::shared_ptr<Runnable> task = boost::shared_ptr<Runnable>(new Task(processor_,
+                                                                            request->inputProtocol,
+                                                                            request->outputProtocol,
+                                                                            this,
+                                                                            request,
+                                                                            limiter));
+    try {
+      server_->addTask(task);
+    } catch (const TException& tx) {
+      // The ThreadManager is shutting down or full
+      GlobalOutput.printf("TNonblockingServer: failed to add pipelined task: %s", tx.what());
+      pending_.pop_back();
+      releaseRequest(request);
+      server_->decrementActiveProcessors();
+      close();
+      return;
+    }
+  }
+
+  // Back to reading the next frame size
+  socketState_ = SOCKET_RECV_FRAMING;
+  appState_ = APP_READ_FRAME_SIZE;
+  readBufferPos_ = 0;
+
+  // A rejected request is counted like one finished by a task, but taken
+  // off pending_ right away instead of through a notification, unless one
+  // is on its way already
+  if (rejected && doneCount_.fetch_add(1, boost::memory_order_acq_rel) == 0) {
+    completeRequests();
+    return;
+  }
+  setPipelineFlags();
+}
+
+bool TNonblockingServer::TConnection::completeRequests() {
+  bool outOfOrder = server_->getPipelineOutOfOrder();
+  bool closeConnection = false;
+  uint32_t count = doneCount_.load(boost::memory_order_acquire);
+  for (;;) {
+    // No more requests are taken than were counted.  A task may have marked
+    // its request done and not counted it yet; if that request is taken,
+    // one that was counted stays on pending_ and keeps the connection open
+    // until the task is through.
+    doneCredit_ += count;
+    std::deque<Request*>::iterator it = pending_.begin();
+    while (doneCredit_ > 0 && it != pending_.end()) {
+      Request* request = *it;
+      if (!request->isDone()) {
+        if (!outOfOrder) {
+          // Later responses wait for this one
+          break;
+        }
+        ++it;
+        continue;
+      }
+      it = pending_.erase(it);
+      --doneCredit_;
+      server_->decrementActiveProcessors();
+
+      if (request->getCloseConnection()) {
+        closeConnection = true;
+      }
+      if (closing_ || closeConnection
+          || !frameResponse(request->outputTransport.get(),
+                            request->writeBuffer,
+                            request->writeBufferSize)) {
+        releaseRequest(request);
+      } else {
+        responses_.push_back(request);
+      }
+    }
+
+    // Requests counted meanwhile sent no notification; take them too
+    uint32_t left = doneCount_.fetch_sub(count, boost::memory_order_acq_rel) - count;
+    if (left == 0) {
+      break;
+    }
+    count = left;
+  }
+
+  if (closing_ || closeConnection) {
+    close();
+    return false;
+  }
+  setPipelineFlags();
+  return true;
+}
+
+bool TNonblockingServer::TConnection::sendResponses() {
+  while (!responses_.empty()) {
+    uint32_t left = 0;
+    uint32_t sent = 0;
+    try {
+#ifdef HAVE_SYS_UIO_H
+      // Small responses go out together in one send
+      struct iovec iov[16];
+      int iovcnt = 0;
+      for (std::deque<Request*>::iterator it = responses_.begin();
+           it != responses_.end() && iovcnt < 16;
+           ++it, ++iovcnt) {
+        iov[iovcnt].iov_base = (*it)->writeBuffer + (*it)->writeBufferPos;
+        iov[iovcnt].iov_len = (*it)->writeBufferSize - (*it)->writeBufferPos;
+        left += static_cast<uint32_t>(iov[iovcnt].iov_len);
+      }
+      sent = writevSocket(iov, iovcnt);
+#else
+      Request* request = responses_.front();
+      left = request->writeBufferSize - request->writeBufferPos;
+      sent = writeSocket(request->writeBuffer + request->writeBufferPos, left);
+#endif
+    } catch (TTransportException& te) {
+      GlobalOutput.printf("TConnection::sendResponses(): %s ", te.what());
+      close();
+      return false;
+    }
+
+    bool full = sent < left;
+    while (sent > 0) {
+      Request* request = responses_.front();
+      uint32_t remaining = request->writeBufferSize - request->writeBufferPos;
+      if (sent < remaining) {
+        request->writeBufferPos += sent;
+        break;
+      }
+      sent -= remaining;
+      responses_.pop_front();
+      releaseRequest(request);
+    }
+
+    if (full) {
+      // Wait for the socket to drain
+      break;
+    }
+  }
+
+  setPipelineFlags();
+  return true;
+}
+
+TNonblockingServer::TConnection::Request* TNonblockingServer::TConnection::takeRequest() {
+  if (!freeRequests_.empty()) {
+    Request* request = freeRequests_.back();
+    freeRequests_.pop_back();
+    return request;
+  }
+
+  Request* request = new Request();
+  request->inputTransport.reset(new TMemoryBuffer());
+  request->outputTransport.reset(new TPooledMemoryBuffer());
+  request->factoryInputTransport
+      = server_->getInputTransportFactory()->getTransport(request->inputTransport);
+  request->factoryOutputTransport
+      = server_->getOutputTransportFactory()->getTransport(request->outputTransport);
+  if (server_->getHeaderTransport()) {
+    request->inputProtocol
+        = server_->getInputProtocolFactory()->getProtocol(request->factoryInputTransport,
+                                                          request->factoryOutputTransport);
+    request->outputProtocol = request->inputProtocol;
+  } else {
+    request->inputProtocol
+        = server_->getInputProtocolFactory()->getProtocol(request->factoryInputTransport);
+    request->outputProtocol
+        = server_->getOutputProtocolFactory()->getProtocol(request->factoryOutputTransport);
+  }
+  return request;
+}
+
+void TNonblockingServer::TConnection::releaseRequest(Request* request) {
+  request->inputTransport->resetBuffer();
+  if (!lendFrame(request->bufferToken, request->buffer)) {
+    ioThread_->releaseBuffer(request->buffer, request->bufferSize);
+  }
+  request->buffer = NULL;
+  request->bufferSize = 0;
+  releaseOutput(request->outputTransport.get());
+  request->reset();
+  freeRequests_.push_back(request);
+}
+
+void TNonblockingServer::TConnection::deleteRequests() {
+  while (!responses_.empty()) {
+    releaseRequest(responses_.front());
+    responses_.pop_front();
+  }
+  for (size_t i = 0; i < freeRequests_.size(); ++i) {
+    delete freeRequests_[i];
+  }
+  freeRequests_.clear();
+}
+
+void TNonblockingServer::TConnection::abandonRequests() {
+  while (!pending_.empty()) {
+    freeRequests_.push_back(pending_.front());
+    pending_.pop_front();
+  }
+}
+
+void TNonblockingServer::TConnection::setPipelineFlags() {
+  short eventFlags = 0;
+  if (pending_.size() + responses_.size() < server_->getMaxPipelinedRequests()) {
+    eventFlags |= EV_READ;
+  }
+  if (!responses_.empty()) {
+    eventFlags |= EV_WRITE;
+  }
+  setFlags(eventFlags != 0 ? eventFlags | EV_PERSIST : 0);
+}
+
+bool TNonblockingServer::TConnection::isTLS() const {
+#ifdef HAVE_OPENSSL
+  return sslSocket_ != NULL;
+#else
+  return false;
+#endif
+}
+
+bool TNonblockingServer::TConnection::handshake() {
+#ifdef HAVE_OPENSSL
+  if (!sslSocket_->handshakeNonblocking()) {
+    waitForTLS();
+    return false;
+  }
+  tlsProgressed();
+#endif
+  return true;
+}
+
+int32_t TNonblockingServer::TConnection::readSocket(uint8_t* buf, uint32_t len) {
+#ifdef HAVE_OPENSSL
+  if (sslSocket_) {
+    int32_t got = sslSocket_->readNonblocking(buf, len);
+    if (got < 0) {
+      waitForTLS();
+    } else if (got > 0) {
+      tlsProgressed();
+      // Anything decrypted along with this is not announced by the socket,
+      // so the event has to go off for it by hand (see setFlags())
+      tlsPending_ = sslSocket_->hasPendingData();
+      notifyBufferedInput();
+    }
+    return got;
+  }
+#endif
+  return static_cast<int32_t>(tSocket_->read(buf, len));
+}
+
+int32_t TNonblockingServer::TConnection::readInput(uint8_t* buf, uint32_t len) {
+  if (readAheadPos_ == readAheadEnd_) {
+    if (len >= server_->getReadAheadSize()) {
+      // Large reads need no copy, and reading ahead may be off
+      return readSocket(buf, len);
+    }
+    // The buffer is only held while it has input in it
+    readAheadSize_ = static_cast<uint32_t>(server_->getReadAheadSize());
+    readAhead_ = ioThread_->allocateBuffer(readAheadSize_);
+    int32_t got = readSocket(readAhead_, readAheadSize_);
+    if (got <= 0) {
+      releaseReadAhead();
+      return got;
+    }
+    readAheadPos_ = 0;
+    readAheadEnd_ = static_cast<uint32_t>(got);
+  }
+
+  uint32_t take = (std::min)(len, readAheadEnd_ - readAheadPos_);
+  memcpy(buf, readAhead_ + readAheadPos_, take);
+  readAheadPos_ += take;
+  if (readAheadPos_ == readAheadEnd_) {
+    releaseReadAhead();
+  }
+  return static_cast<int32_t>(take);
+}
+
+uint32_t TNonblockingServer::TConnection::writeSocket(const uint8_t* buf, uint32_t len) {
+#ifdef HAVE_OPENSSL
+  if (sslSocket_) {
+    int32_t sent = sslSocket_->writeNonblocking(buf, len);
+    if (sent < 0) {
+      waitForTLS();
+      return 0;
+    }
+    tlsProgressed();
+    return static_cast<uint32_t>(sent);
+  }
+#endif
+  return tSocket_->write_partial(buf, len);
+}
+
+#ifdef HAVE_SYS_UIO_H
+uint32_t TNonblockingServer::TConnection::writevSocket(const struct iovec* iov, int iovcnt) {
+#ifdef HAVE_OPENSSL
+  if (sslSocket_) {
+    // TLS has nothing to gather; each buffer goes out in records of its own
+    uint32_t sent = 0;
+    for (int i = 0; i < iovcnt; ++i) {
+      uint32_t len = static_cast<uint32_t>(iov[i].iov_len);
+      uint32_t wrote = writeSocket(static_cast<const uint8_t*>(iov[i].iov_base), len);
+      sent += wrote;
+      if (wrote < len) {
+        break;
+      }
+    }
+    return sent;
+  }
+#endif
+  return tSocket_->writev_partial(iov, iovcnt);
+}
+#endif
+
+#ifdef HAVE_OPENSSL
+void TNonblockingServer::TConnection::waitForTLS() {
+  short want = sslSocket_->wantWrite() ? EV_WRITE : EV_READ;
+  if (tlsWant_ != want) {
+    tlsWant_ = want;
+    resetFlags();
+  }
+}
+
+void TNonblockingServer::TConnection::tlsProgressed() {
+  if (tlsWant_ != 0) {
+    tlsWant_ = 0;
+    resetFlags();
+  }
+}
+#endif
+
+void TNonblockingServer::TConnection::resetFlags() {
+  if (pipelined_) {
+    setPipelineFlags();
+  } else if (socketState_ == SOCKET_SEND) {
+    setWrite();
+  } else {
+    setRead();
+  }
+}
+
+void TNonblockingServer::TConnection::setFlags(short eventFlags) {
+  // A TLS call may wait for the other direction too, e.g. during a handshake
+  if (eventFlags != 0) {
+    eventFlags |= tlsWant_;
+  }
+
+  // Catch the do nothing case
+  if (eventFlags_ == eventFlags) {
+    notifyBufferedInput();
+    return;
+  }
+
+  // Delete a previously existing event
+  if (eventFlags_ != 0) {
+    if (event_del(&event_) == -1) {
+      GlobalOutput("TConnection::setFlags event_del");
+      return;
+    }
+  }
+
+  // Update in memory structure
+  eventFlags_ = eventFlags;
+
+  // Do not call event_set if there are no flags
+  if (!eventFlags_) {
+    return;
+  }
+
+  /*
    * event_set:
    *
    * Prepares the event structure &event to be used in future calls to
@@ -817,12 +1757,31 @@ void TNonblockingServer::TConnection::setFlags(short eventFlags) {
   if (event_add(&event_, 0) == -1) {
     GlobalOutput("TConnection::setFlags(): could not event_add");
   }
+
+  notifyBufferedInput();
+}
+
+void TNonblockingServer::TConnection::notifyBufferedInput() {
+  // Input that was read ahead, or decrypted ahead by TLS, is taken without
+  // waiting for the socket
+  if ((tlsPending_ || readAheadPos_ < readAheadEnd_) && (eventFlags_ & EV_READ)) {
+    event_active(&event_, EV_READ, 1);
+  }
 }
 
 /**
  * Closes a connection
  */
 void TNonblockingServer::TConnection::close() {
+  if (!pending_.empty()) {
+    // Tasks still use this connection; completeRequests() finishes the job
+    closing_ = true;
+    setIdle();
+    return;
+  }
+  closing_ = false;
+  deleteRequests();
+
   // Delete the registered libevent
   if (event_del(&event_) == -1) {
     GlobalOutput.perror("TConnection::close() event_del", THRIFT_GET_SOCKET_ERROR);
@@ -831,6 +1790,12 @@ void TNonblockingServer::TConnection::close() {
   if (serverEventHandler_) {
     serverEventHandler_->deleteContext(connectionContext_, inputProtocol_, outputProtocol_);
   }
+
+  // An idle connection holds no buffers
+  releaseOutput(outputTransport_.get());
+  releaseReadBuffer();
+  releaseReadAhead();
+  TNonblockingIOThread* ioThread = ioThread_;
   ioThread_ = NULL;
 
   // Close the socket
@@ -844,33 +1809,59 @@ void TNonblockingServer::TConnection::close() {
   processor_.reset();
 
   // Give this object back to the server that owns it
-  server_->returnConnection(this);
+  server_->returnConnection(this, ioThread);
 }
 
-void TNonblockingServer::TConnection::checkIdleBufferMemLimit(size_t readLimit, size_t writeLimit) {
-  if (readLimit > 0 && readBufferSize_ > readLimit) {
-    free(readBuffer_);
-    readBuffer_ = NULL;
-    readBufferSize_ = 0;
+void TNonblockingServer::setSSLSocketFactory(
+    boost::shared_ptr<TSSLSocketFactory> sslSocketFactory) {
+#ifdef HAVE_OPENSSL
+  if (sslSocketFactory) {
+    // Sessions are cached for resumption the way a server looks them up
+    sslSocketFactory->server(true);
   }
+  sslSocketFactory_ = sslSocketFactory;
+#else
+  (void)sslSocketFactory;
+  throw TException("TNonblockingServer: TLS needs a library built with OpenSSL");
+#endif
+}
 
-  if (writeLimit > 0 && largestWriteBufferSize_ > writeLimit) {
-    // just start over
-    outputTransport_->resetBuffer(static_cast<uint32_t>(server_->getWriteBufferDefaultSize()));
-    largestWriteBufferSize_ = 0;
+/// Warns that a buffer setting the pool replaced was changed to no effect.
+static void warnObsoleteBufferSetting(const char* setter, bool isDefault) {
+  if (!isDefault) {
+    GlobalOutput.printf("TNonblockingServer: %s() has no effect, idle connections hold no "
+                        "buffers; see setBufferPoolLimit()",
+                        setter);
   }
 }
 
+void TNonblockingServer::setIdleReadBufferLimit(size_t limit) {
+  warnObsoleteBufferSetting("setIdleReadBufferLimit",
+                            limit == static_cast<size_t>(IDLE_READ_BUFFER_LIMIT));
+  idleReadBufferLimit_ = limit;
+}
+
+void TNonblockingServer::setIdleWriteBufferLimit(size_t limit) {
+  warnObsoleteBufferSetting("setIdleWriteBufferLimit",
+                            limit == static_cast<size_t>(IDLE_WRITE_BUFFER_LIMIT));
+  idleWriteBufferLimit_ = limit;
+}
+
+void TNonblockingServer::setResizeBufferEveryN(int32_t count) {
+  warnObsoleteBufferSetting("setResizeBufferEveryN", count == RESIZE_BUFFER_EVERY_N);
+  resizeBufferEveryN_ = count;
+}
+
 TNonblockingServer::~TNonblockingServer() {
-  // Close any active connections (moves them to the idle connection stack)
-  while (activeConnections_.size()) {
-    activeConnections_.front()->close();
-  }
-  // Clean up unused TConnection objects in connectionStack_
-  while (!connectionStack_.empty()) {
-    TConnection* connection = connectionStack_.top();
-    connectionStack_.pop();
-    delete connection;
+  // Tasks still queued or running use the requests and connections freed
+  // below, so let them finish first
+  if (threadManager_ && threadManager_->state() == ThreadManager::STARTED) {
+    threadManager_->join();
+  }
+
+  // Close any active connections and clean up unused TConnection objects
+  for (size_t i = 0; i < ioThreads_.size(); ++i) {
+    ioThreads_[i]->deleteConnections();
   }
   // The TNonblockingIOThread objects have shared_ptrs to the Thread
   // objects and the Thread objects have shared_ptrs to the TNonblockingIOThread
@@ -883,53 +1874,49 @@ TNonblockingServer::~TNonblockingServer() {
 }
 
 /**
- * Creates a new connection either by reusing an object off the stack or
- * by allocating a new one entirely
+ * Creates a new connection either by reusing an object from the IO thread's
+ * pool or by allocating a new one entirely
  */
-TNonblockingServer::TConnection* TNonblockingServer::createConnection(THRIFT_SOCKET socket,
-                                                                      const sockaddr* addr,
-                                                                      socklen_t addrLen) {
-  // Check the stack
-  Guard g(connMutex_);
-
-  // pick an IO thread to handle this connection -- currently round robin
-  assert(nextIOThread_ < ioThreads_.size());
-  int selectedThreadIdx = nextIOThread_;
-  nextIOThread_ = static_cast<uint32_t>((nextIOThread_ + 1) % ioThreads_.size());
-
-  TNonblockingIOThread* ioThread = ioThreads_[selectedThreadIdx].get();
+TNonblockingServer::TConnection* TNonblockingServer::createConnection(
+    THRIFT_SOCKET socket,
+    const sockaddr* addr,
+    socklen_t addrLen,
+    TNonblockingIOThread* ioThread) {
+  // pick an IO thread to handle this connection -- round robin unless the
+  // accepting thread keeps it
+  if (ioThread == NULL) {
+    assert(nextIOThread_ < ioThreads_.size());
+    int selectedThreadIdx = nextIOThread_;
+    nextIOThread_ = static_cast<uint32_t>((nextIOThread_ + 1) % ioThreads_.size());
+
+    ioThread = ioThreads_[selectedThreadIdx].get();
+  }
 
-  // Check the connection stack to see if we can re-use
-  TConnection* result = NULL;
-  if (connectionStack_.empty()) {
+  // Check the thread's pool to see if we can re-use
+  TConnection* result = ioThread->takeIdleConnection();
+  if (result == NULL) {
     result = new TConnection(socket, ioThread, addr, addrLen);
     ++numTConnections_;
+    ioThread->addActiveConnection(result);
   } else {
-    result = connectionStack_.top();
-    connectionStack_.pop();
+    --numIdleConnections_;
     result->init(socket, ioThread, addr, addrLen);
   }
-  activeConnections_.push_back(result);
   return result;
 }
 
 /**
- * Returns a connection to the stack
+ * Returns a connection to the pool of its IO thread
  */
-void TNonblockingServer::returnConnection(TConnection* connection) {
-  Guard g(connMutex_);
-
-  activeConnections_.erase(std::remove(activeConnections_.begin(),
-                                       activeConnections_.end(),
-                                       connection),
-                           activeConnections_.end());
-
-  if (connectionStackLimit_ && (connectionStack_.size() >= connectionStackLimit_)) {
+void TNonblockingServer::returnConnection(TConnection* connection,
+                                          TNonblockingIOThread* ioThread) {
+  bool keep = !connectionStackLimit_ || numIdleConnections_ < connectionStackLimit_;
+  ioThread->removeActiveConnection(connection, keep);
+  if (keep) {
+    ++numIdleConnections_;
+  } else {
     delete connection;
     --numTConnections_;
-  } else {
-    connection->checkIdleBufferMemLimit(idleReadBufferLimit_, idleWriteBufferLimit_);
-    connectionStack_.push(connection);
   }
 }
 
@@ -937,10 +1924,12 @@ void TNonblockingServer::returnConnection(TConnection* connection) {
  * Server socket had something happen.  We accept all waiting client
  * connections on fd and assign TConnection objects to handle those requests.
  */
-void TNonblockingServer::handleEvent(THRIFT_SOCKET fd, short which) {
+void TNonblockingServer::handleEvent(THRIFT_SOCKET fd,
+                                     short which,
+                                     TNonblockingIOThread* ioThread) {
   (void)which;
   // Make sure that libevent didn't mess up the socket handles
-  assert(fd == serverSocket_);
+  assert(fd == ioThread->getListenSocket());
 
   // Server socket accepted a new connection
   socklen_t addrLen;
@@ -983,7 +1972,8 @@ void TNonblockingServer::handleEvent(THRIFT_SOCKET fd, short which) {
     }
 
     // Create a new TConnection for this client socket.
-    TConnection* clientConnection = createConnection(clientSocket, addrp, addrLen);
+    TConnection* clientConnection
+        = createConnection(clientSocket, addrp, addrLen, reusePort_ ? ioThread : NULL);
 
     // Fail fast if we could not create a TConnection object
     if (clientConnection == NULL) {
@@ -1000,16 +1990,15 @@ void TNonblockingServer::handleEvent(THRIFT_SOCKET fd, short which) {
      * (We need to avoid writing to our own notification pipe, to
      * avoid possible deadlocks if the pipe is full.)
      *
-     * The IO thread #0 is the only one that handles these listen
-     * events, so unless the connection has been assigned to thread #0
-     * we know it's not on our thread.
+     * With SO_REUSEPORT listeners every connection stays on the thread
+     * that accepted it, so it never needs the handoff.
      */
-    if (clientConnection->getIOThreadNumber() == 0) {
+    if (clientConnection->getIOThreadNumber() == ioThread->getThreadNumber()) {
       clientConnection->transition();
     } else {
       if (!clientConnection->notifyIOThread()) {
         GlobalOutput.perror("[ERROR] notifyIOThread failed on fresh connection, closing", errno);
-        returnConnection(clientConnection);
+        returnConnection(clientConnection, clientConnection->getIOThread());
       }
     }
 
@@ -1028,6 +2017,14 @@ void TNonblockingServer::handleEvent(THRIFT_SOCKET fd, short which) {
  * Creates a socket to listen on and binds it to the local port.
  */
 void TNonblockingServer::createAndListenOnSocket() {
+  // Set up this file descriptor for listening
+  listenSocket(bindSocket(port_));
+}
+
+/**
+ * Creates a socket and binds it to the wildcard address.
+ */
+THRIFT_SOCKET TNonblockingServer::bindSocket(int port) {
 #ifdef _WIN32
   TWinsockSingleton::create();
 #endif // _WIN32
@@ -1037,15 +2034,15 @@ void TNonblockingServer::createAndListenOnSocket() {
   struct addrinfo hints, *res, *res0;
   int error;
 
-  char port[sizeof("65536") + 1];
+  char portStr[sizeof("65536") + 1];
   memset(&hints, 0, sizeof(hints));
   hints.ai_family = PF_UNSPEC;
   hints.ai_socktype = SOCK_STREAM;
   hints.ai_flags = AI_PASSIVE | AI_ADDRCONFIG;
-  sprintf(port, "%d", port_);
+  sprintf(portStr, "%d", port);
 
   // Wildcard address
-  error = getaddrinfo(NULL, port, &hints, &res0);
+  error = getaddrinfo(NULL, portStr, &hints, &res0);
   if (error) {
     throw TException("TNonblockingServer::serve() getaddrinfo "
                      + string(THRIFT_GAI_STRERROR(error)));
@@ -1079,6 +2076,19 @@ void TNonblockingServer::createAndListenOnSocket() {
   // Set THRIFT_NO_SOCKET_CACHING to avoid 2MSL delay on server restart
   setsockopt(s, SOL_SOCKET, THRIFT_NO_SOCKET_CACHING, const_cast_sockopt(&one), sizeof(one));
 
+#ifdef SO_REUSEPORT
+  // Lets every IO thread bind its own socket to the same port
+  if (reusePort_
+      && -1 == setsockopt(s, SOL_SOCKET, SO_REUSEPORT, const_cast_sockopt(&one), sizeof(one))) {
+    int errno_copy = THRIFT_GET_SOCKET_ERROR;
+    ::THRIFT_CLOSESOCKET(s);
+    freeaddrinfo(res0);
+    throw TTransportException(TTransportException::NOT_OPEN,
+                              "TNonblockingServer::serve() SO_REUSEPORT",
+                              errno_copy);
+  }
+#endif
+
   if (::bind(s, res->ai_addr, static_cast<int>(res->ai_addrlen)) == -1) {
     ::THRIFT_CLOSESOCKET(s);
     freeaddrinfo(res0);
@@ -1090,8 +2100,7 @@ void TNonblockingServer::createAndListenOnSocket() {
   // Done with the addr info
   freeaddrinfo(res0);
 
-  // Set up this file descriptor for listening
-  listenSocket(s);
+  return s;
 }
 
 /**
@@ -1099,6 +2108,29 @@ void TNonblockingServer::createAndListenOnSocket() {
  * to prepare for use in the server.
  */
 void TNonblockingServer::listenSocket(THRIFT_SOCKET s) {
+  prepareListenSocket(s);
+
+  // Cool, this socket is good to go, set it as the serverSocket_
+  serverSocket_ = s;
+
+  if (!port_) {
+    struct sockaddr_storage addr;
+    socklen_t size = sizeof(addr);
+    if (!getsockname(serverSocket_, reinterpret_cast<sockaddr*>(&addr), &size)) {
+      if (addr.ss_family == AF_INET6) {
+        const struct sockaddr_in6* sin = reinterpret_cast<const struct sockaddr_in6*>(&addr);
+        listenPort_ = ntohs(sin->sin6_port);
+      } else {
+        const struct sockaddr_in* sin = reinterpret_cast<const struct sockaddr_in*>(&addr);
+        listenPort_ = ntohs(sin->sin_port);
+      }
+    } else {
+      GlobalOutput.perror("TNonblocking: failed to get listen port: ", THRIFT_GET_SOCKET_ERROR);
+    }
+  }
+}
+
+void TNonblockingServer::prepareListenSocket(THRIFT_SOCKET s) {
   // Set socket to nonblocking mode
   int flags;
   if ((flags = THRIFT_FCNTL(s, THRIFT_F_GETFL, 0)) < 0
@@ -1132,25 +2164,6 @@ void TNonblockingServer::listenSocket(THRIFT_SOCKET s) {
     ::THRIFT_CLOSESOCKET(s);
     throw TTransportException(TTransportException::NOT_OPEN, "TNonblockingServer::serve() listen");
   }
-
-  // Cool, this socket is good to go, set it as the serverSocket_
-  serverSocket_ = s;
-
-  if (!port_) {
-    struct sockaddr_storage addr;
-    socklen_t size = sizeof(addr);
-    if (!getsockname(serverSocket_, reinterpret_cast<sockaddr*>(&addr), &size)) {
-      if (addr.ss_family == AF_INET6) {
-        const struct sockaddr_in6* sin = reinterpret_cast<const struct sockaddr_in6*>(&addr);
-        listenPort_ = ntohs(sin->sin6_port);
-      } else {
-        const struct sockaddr_in* sin = reinterpret_cast<const struct sockaddr_in*>(&addr);
-        listenPort_ = ntohs(sin->sin_port);
-      }
-    } else {
-      GlobalOutput.perror("TNonblocking: failed to get listen port: ", THRIFT_GET_SOCKET_ERROR);
-    }
-  }
 }
 
 void TNonblockingServer::setThreadManager(boost::shared_ptr<ThreadManager> threadManager) {
@@ -1167,7 +2180,7 @@ void TNonblockingServer::setThreadManager(boost::shared_ptr<ThreadManager> threa
 }
 
 bool TNonblockingServer::serverOverloaded() {
-  size_t activeConnections = numTConnections_ - connectionStack_.size();
+  size_t activeConnections = getNumActiveConnections();
   if (numActiveProcessors_ > maxActiveProcessors_ || activeConnections > maxConnections_) {
     if (!overloaded_) {
       GlobalOutput.printf("TNonblockingServer: overload condition begun.");
@@ -1193,9 +2206,7 @@ bool TNonblockingServer::drainPendingTask() {
   if (threadManager_) {
     boost::shared_ptr<Runnable> task = threadManager_->removeNextPending();
     if (task) {
-      TConnection* connection = static_cast<TConnection::Task*>(task.get())->getTConnection();
-      assert(connection && connection->getServer() && connection->getState() == APP_WAIT_TASK);
-      connection->forceClose();
+      static_cast<TConnection::Task*>(task.get())->forceClose();
       return true;
     }
   }
@@ -1203,9 +2214,7 @@ bool TNonblockingServer::drainPendingTask() {
 }
 
 void TNonblockingServer::expireClose(boost::shared_ptr<Runnable> task) {
-  TConnection* connection = static_cast<TConnection::Task*>(task.get())->getTConnection();
-  assert(connection && connection->getServer() && connection->getState() == APP_WAIT_TASK);
-  connection->forceClose();
+  static_cast<TConnection::Task*>(task.get())->forceClose();
 }
 
 void TNonblockingServer::stop() {
@@ -1221,6 +2230,13 @@ void TNonblockingServer::stop() {
 void TNonblockingServer::registerEvents(event_base* user_event_base) {
   userEventBase_ = user_event_base;
 
+#ifndef SO_REUSEPORT
+  if (reusePort_) {
+    GlobalOutput.printf("TNonblockingServer: SO_REUSEPORT not supported, accepting on one thread.");
+    reusePort_ = false;
+  }
+#endif
+
   // init listen socket
   if (serverSocket_ == THRIFT_INVALID_SOCKET)
     createAndListenOnSocket();
@@ -1234,8 +2250,13 @@ void TNonblockingServer::registerEvents(event_base* user_event_base) {
   assert(numIOThreads_ == 1 || !userEventBase_);
 
   for (uint32_t id = 0; id < numIOThreads_; ++id) {
-    // the first IO thread also does the listening on server socket
+    // the first IO thread also does the listening on server socket; with
+    // SO_REUSEPORT the others listen on sockets of their own
     THRIFT_SOCKET listenFd = (id == 0 ? serverSocket_ : THRIFT_INVALID_SOCKET);
+    if (id != 0 && reusePort_) {
+      listenFd = bindSocket(listenPort_);
+      prepareListenSocket(listenFd);
+    }
 
     shared_ptr<TNonblockingIOThread> thread(
         new TNonblockingIOThread(this, id, listenFd, useHighPriorityIOThreads_));
@@ -1310,7 +2331,9 @@ TNonblockingIOThread::TNonblockingIOThread(TNonblockingServer* server,
     listenSocket_(listenSocket),
     useHighPriority_(useHighPriority),
     eventBase_(NULL),
-    ownEventBase_(false) {
+    ownEventBase_(false),
+    completions_(NULL),
+    freeBufferBytes_(0) {
   notificationPipeFDs_[0] = -1;
   notificationPipeFDs_[1] = -1;
 }
@@ -1331,6 +2354,15 @@ TNonblockingIOThread::~TNonblockingIOThread() {
     listenSocket_ = THRIFT_INVALID_SOCKET;
   }
 
+#ifdef HAVE_SYS_EVENTFD_H
+  if (notificationPipeFDs_[0] >= 0 && notificationPipeFDs_[0] == notificationPipeFDs_[1]) {
+    if (0 != ::close(notificationPipeFDs_[0])) {
+      GlobalOutput.perror("TNonblockingIOThread notification eventfd close(): ", errno);
+    }
+    notificationPipeFDs_[0] = notificationPipeFDs_[1] = THRIFT_INVALID_SOCKET;
+  }
+#endif
+
   for (int i = 0; i < 2; ++i) {
     if (notificationPipeFDs_[i] >= 0) {
       if (0 != ::THRIFT_CLOSESOCKET(notificationPipeFDs_[i])) {
@@ -1340,9 +2372,26 @@ TNonblockingIOThread::~TNonblockingIOThread() {
       notificationPipeFDs_[i] = THRIFT_INVALID_SOCKET;
     }
   }
+
+  for (int i = 0; i <= MAX_BUFFER_SHIFT - MIN_BUFFER_SHIFT; ++i) {
+    for (size_t j = 0; j < freeBuffers_[i].size(); ++j) {
+      std::free(freeBuffers_[i][j]);
+    }
+  }
 }
 
 void TNonblockingIOThread::createNotificationPipe() {
+#ifdef HAVE_SYS_EVENTFD_H
+  // An eventfd is a single descriptor holding a counter, so any number of
+  // wakeups fit in it and one read() consumes them all.
+  int efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (efd >= 0) {
+    notificationPipeFDs_[0] = notificationPipeFDs_[1] = efd;
+    return;
+  }
+  GlobalOutput.perror("TNonblockingServer::createNotificationPipe eventfd(), using socketpair: ",
+                      errno);
+#endif
   if (evutil_socketpair(AF_LOCAL, SOCK_STREAM, 0, notificationPipeFDs_) == -1) {
     GlobalOutput.perror("TNonblockingServer::createNotificationPipe ", EVUTIL_SOCKET_ERROR());
     throw TException("can't create notification pipe");
@@ -1396,7 +2445,7 @@ void TNonblockingIOThread::registerEvents() {
               listenSocket_,
               EV_READ | EV_PERSIST,
               TNonblockingIOThread::listenHandler,
-              server_);
+              this);
     event_base_set(eventBase_, &serverEvent_);
 
     // Add the event and start up the server
@@ -1430,87 +2479,226 @@ void TNonblockingIOThread::registerEvents() {
 }
 
 bool TNonblockingIOThread::notify(TNonblockingServer::TConnection* conn) {
-  THRIFT_SOCKET fd = getNotificationSendFD();
-  if (fd < 0) {
+  if (getNotificationSendFD() < 0) {
     return false;
   }
 
-  fd_set wfds, efds;
-  long ret = -1;
-  long kSize = sizeof(conn);
-  const char* pos = reinterpret_cast<const char*>(&conn);
+  // Push onto the completion queue.  Only the push that finds the queue
+  // empty has to wake the IO thread; the others are picked up by the same
+  // notifyHandler call.
+  TNonblockingServer::TConnection* head = completions_.load(boost::memory_order_relaxed);
+  do {
+    conn->setNextCompletion(head);
+  } while (!completions_.compare_exchange_weak(head,
+                                               conn,
+                                               boost::memory_order_release,
+                                               boost::memory_order_relaxed));
+
+  if (head != NULL || wakeup()) {
+    return true;
+  }
 
-  while (kSize > 0) {
-    FD_ZERO(&wfds);
-    FD_ZERO(&efds);
-    FD_SET(fd, &wfds);
-    FD_SET(fd, &efds);
-    ret = select(static_cast<int>(fd + 1), NULL, &wfds, &efds, NULL);
-    if (ret < 0) {
-      return false;
-    } else if (ret == 0) {
-      continue;
+  // The caller closes the connection when this fails, so it must not stay
+  // queued.  If more connections were pushed on top of it meanwhile, it
+  // cannot be taken out again; it is then left to whatever wakes the IO
+  // thread next rather than closed while it is still linked.
+  TNonblockingServer::TConnection* expected = conn;
+  if (completions_.compare_exchange_strong(expected,
+                                           conn->getNextCompletion(),
+                                           boost::memory_order_relaxed,
+                                           boost::memory_order_relaxed)) {
+    return false;
+  }
+  GlobalOutput.printf("TNonblockingIOThread::notify: wakeup failed, leaving connection queued");
+  return true;
+}
+
+TNonblockingServer::TConnection* TNonblockingIOThread::takeIdleConnection() {
+  Guard g(connMutex_);
+  if (idleConnections_.empty()) {
+    return NULL;
+  }
+  TNonblockingServer::TConnection* conn = idleConnections_.back();
+  idleConnections_.pop_back();
+  conn->setActiveIndex(activeConnections_.size());
+  activeConnections_.push_back(conn);
+  return conn;
+}
+
+void TNonblockingIOThread::addActiveConnection(TNonblockingServer::TConnection* conn) {
+  Guard g(connMutex_);
+  conn->setActiveIndex(activeConnections_.size());
+  activeConnections_.push_back(conn);
+}
+
+void TNonblockingIOThread::removeActiveConnection(TNonblockingServer::TConnection* conn,
+                                                  bool keep) {
+  Guard g(connMutex_);
+  // Move the last connection into the place of this one
+  size_t index = conn->getActiveIndex();
+  assert(index < activeConnections_.size() && activeConnections_[index] == conn);
+  activeConnections_[index] = activeConnections_.back();
+  activeConnections_[index]->setActiveIndex(index);
+  activeConnections_.pop_back();
+  if (keep) {
+    idleConnections_.push_back(conn);
+  }
+}
+
+void TNonblockingIOThread::deleteConnections() {
+  // close() puts the connection back into idleConnections_; no lock is
+  // held around it since the thread is not running any more
+  while (!activeConnections_.empty()) {
+    activeConnections_.back()->abandonRequests();
+    activeConnections_.back()->close();
+  }
+  while (!idleConnections_.empty()) {
+    delete idleConnections_.back();
+    idleConnections_.pop_back();
+  }
+}
+
+uint8_t* TNonblockingIOThread::allocateBuffer(uint32_t& size) {
+  int shift = MIN_BUFFER_SHIFT;
+  while (shift <= MAX_BUFFER_SHIFT && (uint32_t(1) << shift) < size) {
+    ++shift;
+  }
+  uint8_t* buf = NULL;
+  if (shift <= MAX_BUFFER_SHIFT) {
+    // The smallest class that fits
+    size = uint32_t(1) << shift;
+    std::vector<uint8_t*>& freeList = freeBuffers_[shift - MIN_BUFFER_SHIFT];
+    if (!freeList.empty()) {
+      buf = freeList.back();
+      freeList.pop_back();
+      freeBufferBytes_ -= size;
+      return buf;
     }
+  }
+  buf = static_cast<uint8_t*>(std::malloc(size));
+  if (buf == NULL) {
+    throw std::bad_alloc();
+  }
+  return buf;
+}
 
-    if (FD_ISSET(fd, &efds)) {
-      ::THRIFT_CLOSESOCKET(fd);
-      return false;
+void TNonblockingIOThread::releaseBuffer(uint8_t* buf, uint32_t size) {
+  if (buf == NULL) {
+    return;
+  }
+  if (size >= (uint32_t(1) << MIN_BUFFER_SHIFT) && size <= (uint32_t(1) << MAX_BUFFER_SHIFT)) {
+    // The largest class it fits
+    int shift = MAX_BUFFER_SHIFT;
+    while ((uint32_t(1) << shift) > size) {
+      --shift;
     }
+    size = uint32_t(1) << shift;
+    if (freeBufferBytes_ + size <= server_->getBufferPoolLimit()) {
+      freeBuffers_[shift - MIN_BUFFER_SHIFT].push_back(buf);
+      freeBufferBytes_ += size;
+      return;
+    }
+  }
+  std::free(buf);
+}
 
-    if (FD_ISSET(fd, &wfds)) {
-      ret = send(fd, pos, kSize, 0);
-      if (ret < 0) {
-        if (errno == EAGAIN) {
-          continue;
-        }
+bool TNonblockingIOThread::wakeup() {
+  THRIFT_SOCKET fd = getNotificationSendFD();
+  if (fd < 0) {
+    return false;
+  }
 
-        ::THRIFT_CLOSESOCKET(fd);
+  uint64_t one = 1;
+#ifdef HAVE_SYS_EVENTFD_H
+  if (fd == getNotificationRecvFD()) {
+    // The counter cannot realistically overflow, so this never blocks.
+    while (::write(fd, &one, sizeof(one)) < 0) {
+      if (errno != EINTR) {
         return false;
       }
-
-      kSize -= ret;
-      pos += ret;
     }
+    return true;
   }
+#endif
 
+  // A full socket buffer means the IO thread has wakeups pending already,
+  // and a short write is as good as a whole one because the reader only
+  // drains the bytes.
+  while (send(fd, cast_sockopt(&one), sizeof(one), 0) < 0) {
+    if (THRIFT_GET_SOCKET_ERROR == THRIFT_EWOULDBLOCK || THRIFT_GET_SOCKET_ERROR == THRIFT_EAGAIN) {
+      return true;
+    }
+    if (THRIFT_GET_SOCKET_ERROR != THRIFT_EINTR) {
+      return false;
+    }
+  }
   return true;
 }
 
+bool TNonblockingIOThread::drainWakeups() {
+  THRIFT_SOCKET fd = getNotificationRecvFD();
+
+#ifdef HAVE_SYS_EVENTFD_H
+  if (fd == getNotificationSendFD()) {
+    uint64_t count;
+    if (::read(fd, &count, sizeof(count)) < 0 && errno != EAGAIN && errno != EINTR) {
+      GlobalOutput.perror("TNonblocking: notifyHandler read() failed: ", errno);
+      return false;
+    }
+    return true;
+  }
+#endif
+
+  char buf[256];
+  while (true) {
+    long nBytes = recv(fd, cast_sockopt(buf), sizeof(buf), 0);
+    if (nBytes > 0) {
+      continue;
+    } else if (nBytes == 0) {
+      GlobalOutput.printf("notifyHandler: Notify socket closed!");
+      return true;
+    } else if (THRIFT_GET_SOCKET_ERROR == THRIFT_EWOULDBLOCK
+               || THRIFT_GET_SOCKET_ERROR == THRIFT_EAGAIN) {
+      return true;
+    } else if (THRIFT_GET_SOCKET_ERROR != THRIFT_EINTR) {
+      GlobalOutput.perror("TNonblocking: notifyHandler read() failed: ", THRIFT_GET_SOCKET_ERROR);
+      return false;
+    }
+  }
+}
+
 /* static */
 void TNonblockingIOThread::notifyHandler(evutil_socket_t fd, short which, void* v) {
   TNonblockingIOThread* ioThread = (TNonblockingIOThread*)v;
   assert(ioThread);
+  (void)fd;
   (void)which;
 
-  while (true) {
-    TNonblockingServer::TConnection* connection = 0;
-    const int kSize = sizeof(connection);
-    long nBytes = recv(fd, cast_sockopt(&connection), kSize, 0);
-    if (nBytes == kSize) {
-      if (connection == NULL) {
-        // this is the command to stop our thread, exit the handler!
-        return;
-      }
-      connection->transition();
-    } else if (nBytes > 0) {
-      // throw away these bytes and hope that next time we get a solid read
-      GlobalOutput.printf("notifyHandler: Bad read of %d bytes, wanted %d", nBytes, kSize);
-      ioThread->breakLoop(true);
-      return;
-    } else if (nBytes == 0) {
-      GlobalOutput.printf("notifyHandler: Notify socket closed!");
-      // exit the loop
-      break;
-    } else { // nBytes < 0
-      if (THRIFT_GET_SOCKET_ERROR != THRIFT_EWOULDBLOCK
-          && THRIFT_GET_SOCKET_ERROR != THRIFT_EAGAIN) {
-        GlobalOutput.perror("TNonblocking: notifyHandler read() failed: ", THRIFT_GET_SOCKET_ERROR);
-        ioThread->breakLoop(true);
-        return;
-      }
-      // exit the loop
-      break;
-    }
+  // Consume the wakeup before taking the queue, so that a connection queued
+  // after the exchange below always leaves a wakeup behind for the next call.
+  if (!ioThread->drainWakeups()) {
+    ioThread->breakLoop(true);
+    return;
+  }
+
+  TNonblockingServer::TConnection* batch
+      = ioThread->completions_.exchange(NULL, boost::memory_order_acquire);
+
+  // The queue is a stack; reverse it to handle connections in the order
+  // they were queued.
+  TNonblockingServer::TConnection* connection = NULL;
+  while (batch != NULL) {
+    TNonblockingServer::TConnection* next = batch->getNextCompletion();
+    batch->setNextCompletion(connection);
+    connection = batch;
+    batch = next;
+  }
+
+  while (connection != NULL) {
+    TNonblockingServer::TConnection* next = connection->getNextCompletion();
+    connection->setNextCompletion(NULL);
+    connection->notified();
+    connection = next;
   }
 }
 
@@ -1530,12 +2718,10 @@ void TNonblockingIOThread::breakLoop(bool error) {
   // it wakes up.  We need to force it to wake up, in case there are
   // no real events it needs to process.
   //
-  // If we're running in the same thread, we can't use the notify(0)
-  // mechanism to stop the thread, but happily if we're running in the
-  // same thread, this means the thread can't be blocking in the event
-  // loop either.
+  // If we're running in the same thread, we don't need the wakeup, since
+  // the thread can't be blocking in the event loop.
   if (!Thread::is_current(threadId_)) {
-    notify(NULL);
+    wakeup();
   }
 }
 
@@ -22,6 +22,7 @@
 
 #include <thrift/Thrift.h>
 #include <thrift/server/TServer.h>
+#include <thrift/server/TConcurrencyLimiter.h>
 #include <thrift/transport/PlatformSocket.h>
 #include <thrift/transport/TBufferTransports.h>
 #include <thrift/transport/TSocket.h>
@@ -30,7 +31,7 @@
 #include <thrift/concurrency/Thread.h>
 #include <thrift/concurrency/PlatformThreadFactory.h>
 #include <thrift/concurrency/Mutex.h>
-#include <stack>
+#include <boost/atomic.hpp>
 #include <vector>
 #include <string>
 #include <cstdlib>
@@ -43,10 +44,14 @@
 
 namespace apache {
 namespace thrift {
+namespace transport {
+class TSSLSocketFactory;
+}
 namespace server {
 
 using apache::thrift::transport::TMemoryBuffer;
 using apache::thrift::transport::TSocket;
+using apache::thrift::transport::TSSLSocketFactory;
 using apache::thrift::protocol::TProtocol;
 using apache::thrift::concurrency::Runnable;
 using apache::thrift::concurrency::ThreadManager;
@@ -100,6 +105,11 @@ inline SOCKOPT_CAST_T* cast_sockopt(T* v) {
  * It does not use the TServerTransport framework, but rather has socket
  * operations hardcoded for use with select.
  *
+ * Binary views (see TBinaryView) read from a request point into its frame
+ * rather than copying, unless the header transport is used.  A frame that
+ * views still refer to when the request is done is freed by the last of
+ * them instead of going back to the buffer pool.
+ *
  */
 
 /// Overload condition actions.
@@ -124,6 +134,9 @@ private:
   /// Default limit on size of idle connection pool
   static const size_t CONNECTION_STACK_LIMIT = 1024;
 
+  /// Default limit on the free buffer memory each IO thread keeps for reuse
+  static const size_t BUFFER_POOL_LIMIT = 4 * 1024 * 1024;
+
   /// Default limit on frame size
   static const int MAX_FRAME_SIZE = 256 * 1024 * 1024;
 
@@ -136,6 +149,9 @@ private:
   /// Default size of write buffer
   static const int WRITE_BUFFER_DEFAULT_SIZE = 1024;
 
+  /// Default size of the buffer a connection reads ahead into
+  static const int READ_AHEAD_SIZE = 4096;
+
   /// Maximum size of read buffer allocated to idle connection (0 = unlimited)
   static const int IDLE_READ_BUFFER_LIMIT = 1024;
 
@@ -154,9 +170,15 @@ private:
   /// Whether to set high scheduling priority for IO threads
   bool useHighPriorityIOThreads_;
 
+  /// Whether every IO thread accepts on its own SO_REUSEPORT socket
+  bool reusePort_;
+
   /// Server socket file descriptor
   THRIFT_SOCKET serverSocket_;
 
+  /// Creates the sockets of TLS connections; NULL for plain connections
+  boost::shared_ptr<TSSLSocketFactory> sslSocketFactory_;
+
   /// Port server runs on. Zero when letting OS decide actual port
   int port_;
 
@@ -178,14 +200,18 @@ private:
   // Vector of IOThread objects that will handle our IO
   std::vector<boost::shared_ptr<TNonblockingIOThread> > ioThreads_;
 
-  // Index of next IO Thread to be used (for round-robin)
+  // Index of next IO Thread to be used (for round-robin); only used by the
+  // accepting thread
   uint32_t nextIOThread_;
 
-  // Synchronizes access to connection stack and similar data
+  // Synchronizes access to the processor count and similar data
   Mutex connMutex_;
 
   /// Number of TConnection object we've created
-  size_t numTConnections_;
+  boost::atomic<size_t> numTConnections_;
+
+  /// Number of TConnection objects kept by the IO threads for reuse
+  boost::atomic<size_t> numIdleConnections_;
 
   /// Number of Connections processing or waiting to process
   size_t numActiveProcessors_;
@@ -205,6 +231,12 @@ private:
   /// Time in milliseconds before an unperformed task expires (0 == infinite).
   int64_t taskExpireTime_;
 
+  /// Limit for requests in flight on one connection (1 == no pipelining)
+  size_t maxPipelinedRequests_;
+
+  /// Whether pipelined responses are sent as soon as they are ready
+  bool pipelineOutOfOrder_;
+
   /**
    * Hysteresis for overload state.  This is the fraction of the overload
    * value that needs to be reached before the overload state is cleared;
@@ -215,33 +247,30 @@ private:
   /// Action to take when we're overloaded.
   TOverloadAction overloadAction_;
 
-  /**
-   * The write buffer is initialized (and when idleWriteBufferLimit_ is checked
-   * and found to be exceeded, reinitialized) to this size.
-   */
+  /// Decides which calls are queued for the thread manager (NULL == all)
+  boost::shared_ptr<TConcurrencyLimiter> concurrencyLimiter_;
+
+  /// Size of the write buffer a response starts out with.
   size_t writeBufferDefaultSize_;
 
   /**
-   * Max read buffer size for an idle TConnection.  When we place an idle
-   * TConnection into connectionStack_ or on every resizeBufferEveryN_ calls,
-   * we will free the buffer (such that it will be reinitialized by the next
-   * received frame) if it has exceeded this limit.  0 disables this check.
+   * Connections read up to this many bytes at once and take frames, or the
+   * start of them, out of what they got.  Frame bodies at least this large
+   * are read straight into the frame.  0 disables reading ahead.
    */
-  size_t idleReadBufferLimit_;
+  size_t readAheadSize_;
 
   /**
-   * Max write buffer size for an idle connection.  When we place an idle
-   * TConnection into connectionStack_ or on every resizeBufferEveryN_ calls,
-   * we insure that its write buffer is <= to this size; otherwise we
-   * replace it with a new one of writeBufferDefaultSize_ bytes to insure that
-   * idle connections don't hog memory. 0 disables this check.
+   * Free frame and response buffers each IO thread keeps for its
+   * connections to reuse, in bytes.  Connections only hold buffers while a
+   * frame is read, processed or answered, and give them back to the pool of
+   * their IO thread in between.
    */
-  size_t idleWriteBufferLimit_;
+  size_t bufferPoolLimit_;
 
-  /**
-   * Every N calls we check the buffer size limits on a connected TConnection.
-   * 0 disables (i.e. the checks are only done when a connection closes).
-   */
+  /// No longer used; idle connections hold no buffers (see bufferPoolLimit_)
+  size_t idleReadBufferLimit_;
+  size_t idleWriteBufferLimit_;
   int32_t resizeBufferEveryN_;
 
   /// Set if we are currently in an overloaded state.
@@ -253,22 +282,6 @@ private:
   /// Count of connections dropped on overload since server started
   uint64_t nTotalConnectionsDropped_;
 
-  /**
-   * This is a stack of all the objects that have been created but that
-   * are NOT currently in use. When we close a connection, we place it on this
-   * stack so that the object can be reused later, rather than freeing the
-   * memory and reallocating a new object later.
-   */
-  std::stack<TConnection*> connectionStack_;
-
-  /**
-   * This container holds pointers to all active connections. This container
-   * allows the server to clean up unlcosed connection objects at destruction,
-   * which in turn allows their transports, protocols, processors and handlers
-   * to deallocate and clean up correctly.
-   */
-  std::vector<TConnection*> activeConnections_;
-
   /**
    * Called when server socket had something happen.  We accept all waiting
    * client connections on listen socket fd and assign TConnection objects
@@ -276,28 +289,35 @@ private:
    *
    * @param fd the listen socket.
    * @param which the event flag that triggered the handler.
+   * @param ioThread the IO thread that owns the listen socket.
    */
-  void handleEvent(THRIFT_SOCKET fd, short which);
+  void handleEvent(THRIFT_SOCKET fd, short which, TNonblockingIOThread* ioThread);
 
   void init(int port) {
     serverSocket_ = THRIFT_INVALID_SOCKET;
     numIOThreads_ = DEFAULT_IO_THREADS;
     nextIOThread_ = 0;
     useHighPriorityIOThreads_ = false;
+    reusePort_ = false;
     port_ = port;
     listenPort_ = port;
     userEventBase_ = NULL;
     threadPoolProcessing_ = false;
     numTConnections_ = 0;
+    numIdleConnections_ = 0;
     numActiveProcessors_ = 0;
     connectionStackLimit_ = CONNECTION_STACK_LIMIT;
     maxActiveProcessors_ = MAX_ACTIVE_PROCESSORS;
     maxConnections_ = MAX_CONNECTIONS;
     maxFrameSize_ = MAX_FRAME_SIZE;
     taskExpireTime_ = 0;
+    maxPipelinedRequests_ = 1;
+    pipelineOutOfOrder_ = false;
     overloadHysteresis_ = 0.8;
     overloadAction_ = T_OVERLOAD_NO_ACTION;
     writeBufferDefaultSize_ = WRITE_BUFFER_DEFAULT_SIZE;
+    readAheadSize_ = READ_AHEAD_SIZE;
+    bufferPoolLimit_ = BUFFER_POOL_LIMIT;
     idleReadBufferLimit_ = IDLE_READ_BUFFER_LIMIT;
     idleWriteBufferLimit_ = IDLE_WRITE_BUFFER_LIMIT;
     resizeBufferEveryN_ = RESIZE_BUFFER_EVERY_N;
@@ -383,6 +403,10 @@ public:
     setThreadManager(threadManager);
   }
 
+  /**
+   * Joins the thread manager, if it is still started, so that no task is
+   * left using the connections being freed.
+   */
   ~TNonblockingServer();
 
   void setThreadManager(boost::shared_ptr<ThreadManager> threadManager);
@@ -412,6 +436,34 @@ public:
   /** Return the number of IO threads used by this server. */
   size_t getNumIOThreads() const { return numIOThreads_; }
 
+  /** Return whether every IO thread accepts on its own listen socket. */
+  bool getReusePort() const { return reusePort_; }
+
+  /**
+   * Set whether every IO thread opens its own SO_REUSEPORT listen socket and
+   * accepts its connections itself, so that the kernel spreads new
+   * connections over the IO threads.  By default IO thread #0 accepts all
+   * connections and hands them to the others round-robin.  Can only be used
+   * before the call to serve(), and is ignored where SO_REUSEPORT is not
+   * available.
+   */
+  void setReusePort(bool val) { reusePort_ = val; }
+
+  /** Return the factory TLS connections get their sockets from, if any. */
+  boost::shared_ptr<TSSLSocketFactory> getSSLSocketFactory() const { return sslSocketFactory_; }
+
+  /**
+   * Serve TLS: every connection gets a socket from the factory, with its
+   * SSL context and access manager, and handshakes before its first frame.
+   * The handshake and all TLS reads and writes are driven by the IO
+   * threads like plain ones, so they never wait for a slow peer.  The
+   * factory is switched to server mode.  Can only be used before the call
+   * to serve().
+   *
+   * @throw TException if the library was built without OpenSSL.
+   */
+  void setSSLSocketFactory(boost::shared_ptr<TSSLSocketFactory> sslSocketFactory);
+
   /**
    * Get the maximum number of unused TConnection we will hold in reserve.
    *
@@ -451,7 +503,7 @@ public:
    *
    * @return count of idle connection objects.
    */
-  size_t getNumIdleConnections() const { return connectionStack_.size(); }
+  size_t getNumIdleConnections() const { return numIdleConnections_; }
 
   /**
    * Return count of number of connections which are currently processing.
@@ -557,6 +609,30 @@ public:
    */
   void setOverloadAction(TOverloadAction overloadAction) { overloadAction_ = overloadAction; }
 
+  /**
+   * Get the limiter that decides which calls are queued for the thread
+   * manager.
+   *
+   * @return the limiter, or NULL if all calls are queued.
+   */
+  boost::shared_ptr<TConcurrencyLimiter> getConcurrencyLimiter() const {
+    return concurrencyLimiter_;
+  }
+
+  /**
+   * Set the limiter that decides which calls are queued for the thread
+   * manager, e.g. a TAdaptiveConcurrencyLimiter.  Calls it turns away are
+   * answered right away with a TApplicationException, or dropped if they
+   * are oneway, and the connection stays open.  Unlike the overload
+   * actions, this works per call and needs no limits tuned to the host.
+   * Only used with a thread manager, and only before the call to serve().
+   *
+   * @param limiter the limiter, or NULL to queue all calls.
+   */
+  void setConcurrencyLimiter(boost::shared_ptr<TConcurrencyLimiter> limiter) {
+    concurrencyLimiter_ = limiter;
+  }
+
   /**
    * Get the time in milliseconds after which a task expires (0 == infinite).
    *
@@ -571,6 +647,37 @@ public:
    */
   void setTaskExpireTime(int64_t taskExpireTime) { taskExpireTime_ = taskExpireTime; }
 
+  /**
+   * Get the maximum number of requests a connection may have in flight.
+   *
+   * @return the current limit; 1 means requests are handled one at a time.
+   */
+  size_t getMaxPipelinedRequests() const { return maxPipelinedRequests_; }
+
+  /**
+   * Set the maximum number of requests a connection may have in flight.
+   * With a limit above 1 and a thread manager, a connection keeps reading
+   * frames while earlier ones are processed, and hands each one to the
+   * thread manager as its own task.  Requests from one connection may then
+   * run concurrently, so handlers must not rely on them being serialized.
+   * Without a thread manager requests are still handled one at a time.
+   *
+   * @param maxRequests the new limit, at least 1.
+   */
+  void setMaxPipelinedRequests(size_t maxRequests) {
+    maxPipelinedRequests_ = maxRequests > 0 ? maxRequests : 1;
+  }
+
+  /** Return whether pipelined responses may be sent out of order. */
+  bool getPipelineOutOfOrder() const { return pipelineOutOfOrder_; }
+
+  /**
+   * Set whether the responses to pipelined requests are sent as soon as
+   * they are ready rather than in the order the requests arrived.  Only
+   * clients that match responses to requests by sequence id can use this.
+   */
+  void setPipelineOutOfOrder(bool val) { pipelineOutOfOrder_ = val; }
+
   /**
    * Determine if the server is currently overloaded.
    * This function checks the maximums for open connections and connections
@@ -603,76 +710,71 @@ public:
   void setWriteBufferDefaultSize(size_t size) { writeBufferDefaultSize_ = size; }
 
   /**
-   * Get the maximum size of read buffer allocated to idle TConnection objects.
+   * Get the size of the buffer TConnection objects read ahead into.
    *
-   * @return # bytes beyond which we will dealloc idle buffer.
+   * @return # bytes read from a socket at once; 0 when reading ahead is off.
    */
-  size_t getIdleReadBufferLimit() const { return idleReadBufferLimit_; }
+  size_t getReadAheadSize() const { return readAheadSize_; }
 
   /**
-   * [NOTE: This is for backwards compatibility, use getIdleReadBufferLimit().]
-   * Get the maximum size of read buffer allocated to idle TConnection objects.
+   * Set the size of the buffer TConnection objects read ahead into, so that
+   * a small frame and the ones after it come in one read instead of at
+   * least two.  Can only be used before the call to serve().
    *
-   * @return # bytes beyond which we will dealloc idle buffer.
+   * @param size # bytes read from a socket at once; 0 turns reading ahead off.
    */
-  size_t getIdleBufferMemLimit() const { return idleReadBufferLimit_; }
+  void setReadAheadSize(size_t size) { readAheadSize_ = size; }
 
   /**
-   * Set the maximum size read buffer allocated to idle TConnection objects.
-   * If a TConnection object is found (either on connection close or between
-   * calls when resizeBufferEveryN_ is set) with more than this much memory
-   * allocated to its read buffer, we free it and allow it to be reinitialized
-   * on the next received frame.
+   * Get the free buffer memory each IO thread keeps for its connections.
    *
-   * @param limit of bytes beyond which we will shrink buffers when checked.
+   * @return # bytes of free buffers kept per IO thread.
    */
-  void setIdleReadBufferLimit(size_t limit) { idleReadBufferLimit_ = limit; }
+  size_t getBufferPoolLimit() const { return bufferPoolLimit_; }
 
   /**
-   * [NOTE: This is for backwards compatibility, use setIdleReadBufferLimit().]
-   * Set the maximum size read buffer allocated to idle TConnection objects.
-   * If a TConnection object is found (either on connection close or between
-   * calls when resizeBufferEveryN_ is set) with more than this much memory
-   * allocated to its read buffer, we free it and allow it to be reinitialized
-   * on the next received frame.
+   * Set the free buffer memory each IO thread keeps for its connections.
+   * Buffers are kept in power of two sizes up to 1MB; connections take them
+   * for a frame and its response and give them back once the response is
+   * sent, so idle connections hold none.  Buffers given back beyond this
+   * limit are freed.
    *
-   * @param limit of bytes beyond which we will shrink buffers when checked.
+   * @param limit # bytes of free buffers kept per IO thread; 0 keeps none.
    */
-  void setIdleBufferMemLimit(size_t limit) { idleReadBufferLimit_ = limit; }
+  void setBufferPoolLimit(size_t limit) { bufferPoolLimit_ = limit; }
 
   /**
-   * Get the maximum size of write buffer allocated to idle TConnection objects.
+   * @deprecated Idle connections no longer hold buffers, so the limits
+   * below have nothing to trim and no effect; see setBufferPoolLimit().
+   * They are kept for backwards compatibility, and setting one to other
+   * than its default logs a warning.
    *
-   * @return # bytes beyond which we will reallocate buffers when checked.
+   * Get the maximum size of read buffer allocated to idle TConnection objects.
+   *
+   * @return # bytes beyond which we will dealloc idle buffer.
    */
+  size_t getIdleReadBufferLimit() const { return idleReadBufferLimit_; }
+
+  /// See getIdleReadBufferLimit().
+  size_t getIdleBufferMemLimit() const { return idleReadBufferLimit_; }
+
+  /// See getIdleReadBufferLimit().
+  void setIdleReadBufferLimit(size_t limit);
+
+  /// See getIdleReadBufferLimit().
+  void setIdleBufferMemLimit(size_t limit) { setIdleReadBufferLimit(limit); }
+
+  /// See getIdleReadBufferLimit().
   size_t getIdleWriteBufferLimit() const { return idleWriteBufferLimit_; }
 
-  /**
-   * Set the maximum size write buffer allocated to idle TConnection objects.
-   * If a TConnection object is found (either on connection close or between
-   * calls when resizeBufferEveryN_ is set) with more than this much memory
-   * allocated to its write buffer, we destroy and construct that buffer with
-   * writeBufferDefaultSize_ bytes.
-   *
-   * @param limit of bytes beyond which we will shrink buffers when idle.
-   */
-  void setIdleWriteBufferLimit(size_t limit) { idleWriteBufferLimit_ = limit; }
+  /// See getIdleReadBufferLimit().
+  void setIdleWriteBufferLimit(size_t limit);
 
-  /**
-   * Get # of calls made between buffer size checks.  0 means disabled.
-   *
-   * @return # of calls between buffer size checks.
-   */
+  /// See getIdleReadBufferLimit().
   int32_t getResizeBufferEveryN() const { return resizeBufferEveryN_; }
 
-  /**
-   * Check buffer sizes every "count" calls.  This allows buffer limits
-   * to be enforced for persistent connections with a controllable degree
-   * of overhead. 0 disables checks except at connection close.
-   *
-   * @param count the number of calls between checks, or 0 to disable
-   */
-  void setResizeBufferEveryN(int32_t count) { resizeBufferEveryN_ = count; }
+  /// See getIdleReadBufferLimit().
+  void setResizeBufferEveryN(int32_t count);
 
   /**
    * Main workhorse function, starts up the server listening on a port and
@@ -734,18 +836,39 @@ private:
    * @param socket FD of socket associated with this connection.
    * @param addr the sockaddr of the client
    * @param addrLen the length of addr
+   * @param ioThread the IO thread to assign the connection to, or NULL to
+   *        pick one round-robin.
    * @return pointer to initialized TConnection object.
    */
-  TConnection* createConnection(THRIFT_SOCKET socket, const sockaddr* addr, socklen_t addrLen);
+  TConnection* createConnection(THRIFT_SOCKET socket,
+                                const sockaddr* addr,
+                                socklen_t addrLen,
+                                TNonblockingIOThread* ioThread);
 
   /**
-   * Returns a connection to pool or deletion.  If the connection pool
-   * (a stack) isn't full, place the connection object on it, otherwise
-   * just delete it.
+   * Creates a socket and binds it to the given port on the wildcard
+   * address, with SO_REUSEPORT set if reusePort_ is.
+   *
+   * @param port the port to bind, or 0 to let the OS pick one.
+   * @return the bound socket.
+   */
+  THRIFT_SOCKET bindSocket(int port);
+
+  /**
+   * Sets the options of a bound socket and starts listening on it.
+   *
+   * @param fd descriptor of the bound socket.
+   */
+  void prepareListenSocket(THRIFT_SOCKET fd);
+
+  /**
+   * Returns a connection to the pool of the IO thread it was assigned to,
+   * or deletes it if the connection stack limit is reached.
    *
    * @param connection the TConection being returned.
+   * @param ioThread the IO thread the connection was assigned to.
    */
-  void returnConnection(TConnection* connection);
+  void returnConnection(TConnection* connection, TNonblockingIOThread* ioThread);
 };
 
 class TNonblockingIOThread : public Runnable {
@@ -769,11 +892,15 @@ public:
   // Returns the number of this IO thread.
   int getThreadNumber() const { return number_; }
 
+  // Returns the listen socket of this thread, if any.
+  THRIFT_SOCKET getListenSocket() const { return listenSocket_; }
+
   // Returns the thread id associated with this object.  This should
   // only be called after the thread has been started.
   Thread::id_t getThreadId() const { return threadId_; }
 
-  // Returns the send-fd for task complete notifications.
+  // Returns the send-fd for task complete notifications.  When an eventfd
+  // is used this is the same descriptor as the read-fd.
   evutil_socket_t getNotificationSendFD() const { return notificationPipeFDs_[1]; }
 
   // Returns the read-fd for task complete notifications.
@@ -785,9 +912,37 @@ public:
   // Sets the actual thread object associated with this IO thread.
   void setThread(const boost::shared_ptr<Thread>& t) { thread_ = t; }
 
-  // Used by TConnection objects to indicate processing has finished.
+  // Used by TConnection objects to indicate processing has finished.  The
+  // connection is queued and the IO thread is only woken up if the queue
+  // was empty, so a burst of completions costs a single wakeup.  Returns
+  // false only if the connection was not left on the queue.
   bool notify(TNonblockingServer::TConnection* conn);
 
+  // Takes a connection object kept for reuse by this thread, or returns
+  // NULL if there is none, and counts it as active.  Can be called from any
+  // thread, like the other connection calls.
+  TNonblockingServer::TConnection* takeIdleConnection();
+
+  // Counts a new connection object of this thread as active.
+  void addActiveConnection(TNonblockingServer::TConnection* conn);
+
+  // Takes a closed connection off the active ones and keeps it for reuse,
+  // unless keep is false.
+  void removeActiveConnection(TNonblockingServer::TConnection* conn, bool keep);
+
+  // Closes the active connections of this thread and deletes the connection
+  // objects kept for reuse.  Only called once the thread has stopped.
+  void deleteConnections();
+
+  // Takes a buffer of at least size bytes from this thread's pool, or
+  // allocates one, and sets size to the size of the buffer.  The buffers
+  // are only to be taken and given back on this thread.
+  uint8_t* allocateBuffer(uint32_t& size);
+
+  // Gives back a buffer from allocateBuffer(), which may have been grown
+  // with realloc() to size bytes since.  NULL is ignored.
+  void releaseBuffer(uint8_t* buf, uint32_t size);
+
   // Enters the event loop and does not return until a call to stop().
   virtual void run();
 
@@ -803,9 +958,9 @@ public:
 private:
   /**
    * C-callable event handler for signaling task completion.  Provides a
-   * callback that libevent can understand that will read a connection
-   * object's address from a pipe and call connection->transition() for
-   * that object.
+   * callback that libevent can understand that will consume the wakeup
+   * and call connection->transition() for every connection queued by
+   * notify() since the last call, in the order they were queued.
    *
    * @param fd the descriptor the event occurred on.
    */
@@ -817,10 +972,11 @@ private:
    *
    * @param fd the descriptor the event occurred on.
    * @param which the flags associated with the event.
-   * @param v void* callback arg where we placed TNonblockingServer's "this".
+   * @param v void* callback arg where we placed TNonblockingIOThread's "this".
    */
   static void listenHandler(evutil_socket_t fd, short which, void* v) {
-    ((TNonblockingServer*)v)->handleEvent(fd, which);
+    TNonblockingIOThread* ioThread = (TNonblockingIOThread*)v;
+    ioThread->getServer()->handleEvent(fd, which, ioThread);
   }
 
   /// Exits the loop ASAP in case of shutdown or error.
@@ -829,6 +985,12 @@ private:
   /// Create the pipe used to notify I/O process of task completion.
   void createNotificationPipe();
 
+  /// Wakes up the event loop through the notification pipe.
+  bool wakeup();
+
+  /// Consumes pending wakeups.  Returns false if the pipe is unusable.
+  bool drainWakeups();
+
   /// Unregisters our events for notification and listen sockets.
   void cleanupEvents();
 
@@ -836,6 +998,10 @@ private:
   void setCurrentThreadHighPriority(bool value);
 
 private:
+  /// Smallest and largest buffers kept in the pool, as powers of two
+  static const int MIN_BUFFER_SHIFT = 8;
+  static const int MAX_BUFFER_SHIFT = 20;
+
   /// associated server
   TNonblockingServer* server_;
 
@@ -865,8 +1031,29 @@ private:
   struct event notificationEvent_;
 
   /// File descriptors for pipe used for task completion notification.
+  /// Both entries hold the same descriptor when an eventfd is used.
   evutil_socket_t notificationPipeFDs_[2];
 
+  /// Connections waiting for notifyHandler, most recently queued first.
+  /// Pushed by any thread and taken as a whole by the IO thread.
+  boost::atomic<TNonblockingServer::TConnection*> completions_;
+
+  /// Guards the connection lists, which the accepting thread uses as well
+  Mutex connMutex_;
+
+  /// Connections of this thread that are open
+  std::vector<TNonblockingServer::TConnection*> activeConnections_;
+
+  /// Closed connections of this thread kept for reuse; they hold no buffers
+  std::vector<TNonblockingServer::TConnection*> idleConnections_;
+
+  /// Free buffers by size: freeBuffers_[i] holds buffers of at least
+  /// 2^(i + MIN_BUFFER_SHIFT) bytes.  Only used on this thread.
+  std::vector<uint8_t*> freeBuffers_[MAX_BUFFER_SHIFT - MIN_BUFFER_SHIFT + 1];
+
+  /// Bytes in freeBuffers_, counting each buffer by its size class
+  size_t freeBufferBytes_;
+
   /// Actual IO Thread
   boost::shared_ptr<Thread> thread_;
 };
@@ -21,6 +21,7 @@
 #include <algorithm>
 
 #include <thrift/transport/TBufferTransports.h>
+#include <thrift/transport/TSocket.h>
 
 using std::string;
 
@@ -28,6 +29,23 @@ namespace apache {
 namespace thrift {
 namespace transport {
 
+#ifdef HAVE_SYS_UIO_H
+/**
+ * Writes the buffers described by iov to trans.  Sockets get them in a
+ * single scatter/gather write; other transports get one write() apiece.
+ */
+static void writeGathered(TTransport* trans, const struct iovec* iov, int iovcnt) {
+  TSocket* socket = dynamic_cast<TSocket*>(trans);
+  if (socket != NULL) {
+    socket->writev(iov, iovcnt);
+    return;
+  }
+  for (int i = 0; i < iovcnt; ++i) {
+    trans->write(static_cast<const uint8_t*>(iov[i].iov_base), static_cast<uint32_t>(iov[i].iov_len));
+  }
+}
+#endif
+
 uint32_t TBufferedTransport::readSlow(uint8_t* buf, uint32_t len) {
   uint32_t have = static_cast<uint32_t>(rBound_ - rBase_);
 
@@ -87,12 +105,24 @@ void TBufferedTransport::writeSlow(const uint8_t* buf, uint32_t len) {
   // This case also covers the case where the buffer is empty,
   // but it is clearer (I think) to think of it as two separate cases.
   if ((have_bytes + len >= 2 * wBufSize_) || (have_bytes == 0)) {
-    // TODO(dreiss): writev
+    // Reset wBase_ first so that we stay sane if the write throws.
+    wBase_ = wBuf_.get();
+#ifdef HAVE_SYS_UIO_H
+    if (have_bytes > 0) {
+      struct iovec iov[2];
+      iov[0].iov_base = wBuf_.get();
+      iov[0].iov_len = have_bytes;
+      iov[1].iov_base = const_cast<uint8_t*>(buf);
+      iov[1].iov_len = len;
+      writeGathered(transport_.get(), iov, 2);
+      return;
+    }
+#else
     if (have_bytes > 0) {
       transport_->write(wBuf_.get(), have_bytes);
     }
+#endif
     transport_->write(buf, len);
-    wBase_ = wBuf_.get();
     return;
   }
 
@@ -205,10 +235,11 @@ bool TFramedTransport::readFrame() {
   if (sz > static_cast<int32_t>(maxFrameSize_))
     throw TTransportException(TTransportException::CORRUPTED_DATA, "Received an oversized frame");
 
-  // Read the frame payload, and reset markers.
-  if (sz > static_cast<int32_t>(rBufSize_)) {
-    rBuf_.reset(new uint8_t[sz]);
-    rBufSize_ = sz;
+  // Read the frame payload, and reset markers.  A buffer that is still
+  // pinned by borrowPinned() callers is left to them.
+  if (sz > static_cast<int32_t>(rBufSize_) || !rBuf_.unique()) {
+    rBufSize_ = (std::max)(static_cast<uint32_t>(sz), rBufSize_);
+    rBuf_.reset(new uint8_t[rBufSize_]);
   }
   transport_->readAll(rBuf_.get(), sz);
   setReadBuffer(rBuf_.get(), sz);
@@ -219,7 +250,7 @@ void TFramedTransport::writeSlow(const uint8_t* buf, uint32_t len) {
   // Double buffer size until sufficient.
   uint32_t have = static_cast<uint32_t>(wBase_ - wBuf_.get());
   uint32_t new_size = wBufSize_;
-  if (len + have < have /* overflow */ || len + have > 0x7fffffff) {
+  if (len + have < have /* overflow */ || len + have > 0x7fffffff - wRefBytes_) {
     throw TTransportException(TTransportException::BAD_ARGS,
                               "Attempted to write over 2 GB to TFramedTransport.");
   }
@@ -247,12 +278,87 @@ void TFramedTransport::writeSlow(const uint8_t* buf, uint32_t len) {
   wBase_ += len;
 }
 
+void TFramedTransport::writeRefSlow(const uint8_t* buf, uint32_t len) {
+  if (len == 0) {
+    return;
+  }
+  uint32_t have = static_cast<uint32_t>(wBase_ - wBuf_.get());
+  if (len + wRefBytes_ < wRefBytes_ /* overflow */ || len + wRefBytes_ > 0x7fffffff - have) {
+    throw TTransportException(TTransportException::BAD_ARGS,
+                              "Attempted to write over 2 GB to TFramedTransport.");
+  }
+
+  WriteRef ref;
+  ref.offset = have;
+  ref.buf = buf;
+  ref.len = len;
+  wRefs_.push_back(ref);
+  wRefBytes_ += len;
+}
+
+void TFramedTransport::flushWriteRefs(uint32_t have_bytes) {
+  try {
+#ifdef HAVE_SYS_UIO_H
+    // Interleave the buffered bytes with the referenced payloads.  Pieces go
+    // out in batches so that the iovec array can live on the stack.
+    static const int MAX_IOV = 64;
+    struct iovec iov[MAX_IOV];
+    int iovcnt = 0;
+    uint32_t pos = 0;
+    for (std::vector<WriteRef>::const_iterator it = wRefs_.begin(); it != wRefs_.end(); ++it) {
+      if (iovcnt > MAX_IOV - 2) {
+        writeGathered(transport_.get(), iov, iovcnt);
+        iovcnt = 0;
+      }
+      if (it->offset > pos) {
+        iov[iovcnt].iov_base = wBuf_.get() + pos;
+        iov[iovcnt].iov_len = it->offset - pos;
+        ++iovcnt;
+        pos = it->offset;
+      }
+      iov[iovcnt].iov_base = const_cast<uint8_t*>(it->buf);
+      iov[iovcnt].iov_len = it->len;
+      ++iovcnt;
+    }
+    if (have_bytes > pos) {
+      if (iovcnt == MAX_IOV) {
+        writeGathered(transport_.get(), iov, iovcnt);
+        iovcnt = 0;
+      }
+      iov[iovcnt].iov_base = wBuf_.get() + pos;
+      iov[iovcnt].iov_len = have_bytes - pos;
+      ++iovcnt;
+    }
+    writeGathered(transport_.get(), iov, iovcnt);
+#else
+    uint32_t pos = 0;
+    for (std::vector<WriteRef>::const_iterator it = wRefs_.begin(); it != wRefs_.end(); ++it) {
+      if (it->offset > pos) {
+        transport_->write(wBuf_.get() + pos, it->offset - pos);
+        pos = it->offset;
+      }
+      transport_->write(it->buf, it->len);
+    }
+    if (have_bytes > pos) {
+      transport_->write(wBuf_.get() + pos, have_bytes - pos);
+    }
+#endif
+  } catch (...) {
+    wRefs_.clear();
+    wRefBytes_ = 0;
+    throw;
+  }
+  wRefs_.clear();
+  wRefBytes_ = 0;
+}
+
 void TFramedTransport::flush() {
   int32_t sz_hbo, sz_nbo;
   assert(wBufSize_ > sizeof(sz_nbo));
 
   // Slip the frame size into the start of the buffer.
-  sz_hbo = static_cast<uint32_t>(wBase_ - (wBuf_.get() + sizeof(sz_nbo)));
+  uint32_t have_bytes = static_cast<uint32_t>(wBase_ - wBuf_.get());
+  sz_hbo = static_cast<uint32_t>(have_bytes - sizeof(sz_nbo) + wRefBytes_);
   sz_nbo = (int32_t)htonl((uint32_t)(sz_hbo));
   memcpy(wBuf_.get(), (uint8_t*)&sz_nbo, sizeof(sz_nbo));
 
@@ -263,8 +369,13 @@ void TFramedTransport::flush() {
     // up an exception
     wBase_ = wBuf_.get() + sizeof(sz_nbo);
 
-    // Write size and frame body.
-    transport_->write(wBuf_.get(), static_cast<uint32_t>(sizeof(sz_nbo)) + sz_hbo);
+    if (wRefs_.empty()) {
+      // Write size and frame body.
+      transport_->write(wBuf_.get(), static_cast<uint32_t>(sizeof(sz_nbo)) + sz_hbo);
+    } else {
+      // Write size, frame body and referenced payloads in one go.
+      flushWriteRefs(have_bytes);
+    }
   }
 
   // Flush the underlying transport.
@@ -283,7 +394,7 @@ void TFramedTransport::flush() {
 }
 
 uint32_t TFramedTransport::writeEnd() {
-  return static_cast<uint32_t>(wBase_ - wBuf_.get());
+  return static_cast<uint32_t>(wBase_ - wBuf_.get()) + wRefBytes_;
 }
 
 const uint8_t* TFramedTransport::borrowSlow(uint8_t* buf, uint32_t* len) {
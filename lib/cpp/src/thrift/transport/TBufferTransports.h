@@ -23,7 +23,9 @@
 #include <cstdlib>
 #include <cstring>
 #include <limits>
+#include <vector>
 #include <boost/scoped_array.hpp>
+#include <boost/shared_array.hpp>
 
 #include <thrift/transport/TTransport.h>
 #include <thrift/transport/TVirtualTransport.h>
@@ -103,6 +105,12 @@ public:
     writeSlow(buf, len);
   }
 
+  /**
+   * By default buffered transports copy by-reference writes like any other
+   * write, which keeps the fast path inlinable.
+   */
+  void writeRef(const uint8_t* buf, uint32_t len) { write(buf, len); }
+
   /**
    * Fast-path borrow.  A lot like the fast-path read.
    */
@@ -315,7 +323,9 @@ public:
       wBufSize_(DEFAULT_BUFFER_SIZE),
       rBuf_(),
       wBuf_(new uint8_t[wBufSize_]),
-      bufReclaimThresh_((std::numeric_limits<uint32_t>::max)()) {
+      bufReclaimThresh_((std::numeric_limits<uint32_t>::max)()),
+      wRefBytes_(0),
+      writeRefThreshold_((std::numeric_limits<uint32_t>::max)()) {
     initPointers();
   }
 
@@ -326,7 +336,9 @@ public:
       rBuf_(),
       wBuf_(new uint8_t[wBufSize_]),
       bufReclaimThresh_((std::numeric_limits<uint32_t>::max)()),
-      maxFrameSize_(DEFAULT_MAX_FRAME_SIZE) {
+      maxFrameSize_(DEFAULT_MAX_FRAME_SIZE),
+      wRefBytes_(0),
+      writeRefThreshold_((std::numeric_limits<uint32_t>::max)()) {
     initPointers();
   }
 
@@ -339,7 +351,9 @@ public:
       rBuf_(),
       wBuf_(new uint8_t[wBufSize_]),
       bufReclaimThresh_(bufReclaimThresh),
-      maxFrameSize_(DEFAULT_MAX_FRAME_SIZE) {
+      maxFrameSize_(DEFAULT_MAX_FRAME_SIZE),
+      wRefBytes_(0),
+      writeRefThreshold_((std::numeric_limits<uint32_t>::max)()) {
     initPointers();
   }
 
@@ -360,12 +374,39 @@ public:
 
   virtual void flush();
 
+  /**
+   * Zero-copy write.  Payloads of at least getWriteRefThreshold() bytes are
+   * not copied into the frame buffer; the frame keeps a reference to them
+   * and flush() hands them to the underlying transport in a single
+   * scatter/gather write.  The caller must keep \c buf valid and unmodified
+   * until flush() returns.  Smaller payloads are copied as by write().
+   */
+  void writeRef(const uint8_t* buf, uint32_t len) {
+    if (TDB_LIKELY(len < writeRefThreshold_)) {
+      write(buf, len);
+      return;
+    }
+    writeRefSlow(buf, len);
+  }
+
   uint32_t readEnd();
 
   uint32_t writeEnd();
 
   const uint8_t* borrowSlow(uint8_t* buf, uint32_t* len);
 
+  /**
+   * Borrows from the current frame and pins its buffer.  A frame buffer that
+   * is still pinned is never refilled; readFrame() allocates a new one.
+   */
+  const uint8_t* borrowPinned(uint32_t len, boost::shared_array<uint8_t>& pin) {
+    if (TDB_LIKELY(static_cast<ptrdiff_t>(len) <= rBound_ - rBase_)) {
+      pin = rBuf_;
+      return rBase_;
+    }
+    return NULL;
+  }
+
   boost::shared_ptr<TTransport> getUnderlyingTransport() { return transport_; }
 
   /*
@@ -389,6 +430,18 @@ public:
    */
   uint32_t getMaxFrameSize() { return maxFrameSize_; }
 
+  /**
+   * Set the minimum size of a writeRef() payload that is written by
+   * reference rather than copied into the frame buffer.  By default
+   * writes are always copied.
+   */
+  void setWriteRefThreshold(uint32_t writeRefThreshold) { writeRefThreshold_ = writeRefThreshold; }
+
+  /**
+   * Get the minimum size of a writeRef() payload that is written by reference
+   */
+  uint32_t getWriteRefThreshold() { return writeRefThreshold_; }
+
 protected:
   /**
    * Reads a frame of input from the underlying stream.
@@ -398,6 +451,12 @@ protected:
    */
   virtual bool readFrame();
 
+  /// Slow path writeRef: record a reference to buf in the current frame.
+  void writeRefSlow(const uint8_t* buf, uint32_t len);
+
+  /// Write the frame in wBuf_ together with the referenced payloads.
+  void flushWriteRefs(uint32_t have_bytes);
+
   void initPointers() {
     setReadBuffer(NULL, 0);
     setWriteBuffer(wBuf_.get(), wBufSize_);
@@ -407,14 +466,27 @@ protected:
     this->write((uint8_t*)&pad, sizeof(pad));
   }
 
+  /**
+   * A payload written by reference.  It follows the first \c offset bytes
+   * of wBuf_ in the frame; offsets stay valid when wBuf_ is regrown.
+   */
+  struct WriteRef {
+    uint32_t offset;
+    const uint8_t* buf;
+    uint32_t len;
+  };
+
   boost::shared_ptr<TTransport> transport_;
 
   uint32_t rBufSize_;
   uint32_t wBufSize_;
-  boost::scoped_array<uint8_t> rBuf_;
+  boost::shared_array<uint8_t> rBuf_;
   boost::scoped_array<uint8_t> wBuf_;
   uint32_t bufReclaimThresh_;
   uint32_t maxFrameSize_;
+  std::vector<WriteRef> wRefs_;
+  uint32_t wRefBytes_;
+  uint32_t writeRefThreshold_;
 };
 
 /**
@@ -590,6 +662,7 @@ public:
       wBound_ = wBase_;
       bufferSize_ = 0;
     }
+    pin_.reset();
   }
 
   /// See constructor documentation.
@@ -613,6 +686,16 @@ public:
     // Our old self gets destroyed.
   }
 
+  /**
+   * Observes buf like resetBuffer(buf, sz, OBSERVE), and also lends it to
+   * views (see borrowPinned()) together with pin.  The caller must not
+   * reuse buf while any copy of pin is alive.
+   */
+  void resetBuffer(uint8_t* buf, uint32_t sz, const boost::shared_array<uint8_t>& pin) {
+    resetBuffer(buf, sz, OBSERVE);
+    pin_ = pin;
+  }
+
   /// See constructor documentation.
   void resetBuffer(uint32_t sz) {
     // Construct the new buffer.
@@ -667,6 +750,19 @@ public:
   // that had been provided by getWritePtr().
   void wroteBytes(uint32_t len);
 
+  // Only memory observed with a pin is lent, so views read from any other
+  // memory buffer own a copy.  Our own memory is rewritten and reallocated
+  // without regard for views, and observed memory may be freed by its owner
+  // while a view still refers to it.
+  const uint8_t* borrowPinned(uint32_t len, boost::shared_array<uint8_t>& pin) {
+    if (!pin_ || available_read() < len) {
+      pin.reset();
+      return NULL;
+    }
+    pin = pin_;
+    return rBase_;
+  }
+
   /*
    * TVirtualTransport provides a default implementation of readAll().
    * We want to use the TBufferBase version instead.
@@ -685,6 +781,7 @@ protected:
     swap(wBound_, that.wBound_);
 
     swap(owner_, that.owner_);
+    swap(pin_, that.pin_);
   }
 
   // Make sure there's at least 'len' bytes available for writing.
@@ -708,6 +805,9 @@ protected:
   // Is this object the owner of the buffer?
   bool owner_;
 
+  // Keeps observed memory alive for views, if its owner gave us a pin
+  boost::shared_array<uint8_t> pin_;
+
   // Don't forget to update constrctors, initCommon, and swap if
   // you add new members.
 };
@@ -20,6 +20,7 @@
 #include <thrift/thrift-config.h>
 
 #include <thrift/transport/TFileTransport.h>
+#include <thrift/transport/TBufferTransports.h>
 #include <thrift/transport/TTransportUtils.h>
 #include <thrift/transport/PlatformSocket.h>
 #include <thrift/concurrency/FunctionRunner.h>
@@ -36,13 +37,25 @@
 #ifdef HAVE_STRINGS_H
 #include <strings.h>
 #endif
+#include <algorithm>
 #include <cstdlib>
 #include <cstring>
+#include <deque>
 #include <iostream>
 #include <limits>
+#include <new>
+#include <vector>
 #ifdef HAVE_SYS_STAT_H
 #include <sys/stat.h>
 #endif
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
+#ifdef HAVE_SYS_UIO_H
+#include <sys/uio.h>
+#endif
+
+#include <boost/weak_ptr.hpp>
 
 #ifdef _WIN32
 #include <io.h>
@@ -58,6 +71,18 @@ using namespace std;
 using namespace apache::thrift::protocol;
 using namespace apache::thrift::concurrency;
 
+#ifdef HAVE_SYS_UIO_H
+// Most buffers passed to one writev()
+#if defined(IOV_MAX) && IOV_MAX < 1024
+static const int kMaxWriteSegments = IOV_MAX;
+#else
+static const int kMaxWriteSegments = 1024;
+#endif
+#endif
+
+// Larger event buffers are freed when the writer releases their slot
+static const uint32_t kMaxRetainedEventSize = 64 * 1024;
+
 TFileTransport::TFileTransport(string path, bool readOnly)
   : readState_(),
     readBuff_(NULL),
@@ -73,15 +98,24 @@ TFileTransport::TFileTransport(string path, bool readOnly)
     eofSleepTime_(DEFAULT_EOF_SLEEP_TIME_US),
     corruptedEventSleepTime_(DEFAULT_CORRUPTED_SLEEP_TIME_US),
     writerThreadIOErrorSleepTime_(DEFAULT_WRITER_THREAD_SLEEP_TIME_US),
-    dequeueBuffer_(NULL),
-    enqueueBuffer_(NULL),
+    ringMask_(0),
+    enqueuePos_(0),
+    dequeuePos_(0),
+    writerWaiting_(false),
+    producersWaiting_(0),
     notFull_(&mutex_),
     notEmpty_(&mutex_),
     closing_(false),
     flushed_(&mutex_),
     forceFlush_(false),
+    flushTarget_(0),
+    flushRequested_(0),
+    flushCompleted_(0),
     filename_(path),
     fd_(0),
+    syncPolicy_(SYNC_FSYNC),
+    preallocateChunks_(false),
+    preallocated_(0),
     bufferAndThreadInitialized_(false),
     offset_(0),
     lastBadChunk_(0),
@@ -123,27 +157,18 @@ void TFileTransport::resetOutputFile(int fd, string filename, off_t offset) {
 TFileTransport::~TFileTransport() {
   // flush the buffer if a writer thread is active
   if (writerThread_.get()) {
-    // set state to closing
-    closing_ = true;
-
-    // wake up the writer thread
+    // set state to closing and wake up the writer thread
     // Since closing_ is true, it will attempt to flush all data, then exit.
-    notEmpty_.notify();
+    {
+      Guard g(mutex_);
+      closing_ = true;
+      notEmpty_.notify();
+    }
 
     writerThread_->join();
     writerThread_.reset();
   }
 
-  if (dequeueBuffer_) {
-    delete dequeueBuffer_;
-    dequeueBuffer_ = NULL;
-  }
-
-  if (enqueueBuffer_) {
-    delete enqueueBuffer_;
-    enqueueBuffer_ = NULL;
-  }
-
   if (readBuff_) {
     delete[] readBuff_;
     readBuff_ = NULL;
@@ -171,16 +196,23 @@ bool TFileTransport::initBufferAndWriteThread() {
     return false;
   }
 
+  uint64_t slots = 1;
+  while (slots < eventBufferSize_) {
+    slots <<= 1;
+  }
+  ring_.reset(new EventSlot[slots]);
+  for (uint64_t i = 0; i < slots; ++i) {
+    ring_[i].sequence.store(i, boost::memory_order_relaxed);
+  }
+  ringMask_ = slots - 1;
+  bufferAndThreadInitialized_ = true;
+
   if (!writerThread_.get()) {
     writerThread_ = threadFactory_.newThread(
         apache::thrift::concurrency::FunctionRunner::create(startWriterThread, this));
     writerThread_->start();
   }
 
-  dequeueBuffer_ = new TFileTransportBuffer(eventBufferSize_);
-  enqueueBuffer_ = new TFileTransportBuffer(eventBufferSize_);
-  bufferAndThreadInitialized_ = true;
-
   return true;
 }
 
@@ -209,84 +241,111 @@ void TFileTransport::enqueueEvent(const uint8_t* buf, uint32_t eventLen) {
     return;
   }
 
-  std::auto_ptr<eventInfo> toEnqueue(new eventInfo());
-  toEnqueue->eventBuff_ = new uint8_t[(sizeof(uint8_t) * eventLen) + 4];
-
-  // first 4 bytes is the event length
-  memcpy(toEnqueue->eventBuff_, (void*)(&eventLen), 4);
-  // actual event contents
-  memcpy(toEnqueue->eventBuff_ + 4, buf, eventLen);
-  toEnqueue->eventSize_ = eventLen + 4;
-
-  // lock mutex
-  Guard g(mutex_);
-
-  // make sure that enqueue buffer is initialized and writer thread is running
+  // make sure that the ring is initialized and writer thread is running
   if (!bufferAndThreadInitialized_) {
-    if (!initBufferAndWriteThread()) {
+    Guard g(mutex_);
+    if (!bufferAndThreadInitialized_ && !initBufferAndWriteThread()) {
       return;
     }
   }
 
-  // Can't enqueue while buffer is full
-  while (enqueueBuffer_->isFull()) {
-    notFull_.wait();
+  uint64_t pos;
+  while (!claimSlot(pos)) {
+    // The ring is full, wait for the writer thread to release slots
+    producersWaiting_.fetch_add(1);
+    {
+      Guard g(mutex_);
+      while (ringFull() && !closing_) {
+        notFull_.wait();
+      }
+    }
+    producersWaiting_.fetch_sub(1);
+    if (closing_) {
+      return;
+    }
   }
 
-  // We shouldn't be trying to enqueue new data while a forced flush is
-  // requested.  (Otherwise the writer thread might not ever be able to finish
-  // the flush if more data keeps being enqueued.)
-  assert(!forceFlush_);
+  EventSlot& slot = ring_[pos & ringMask_];
+  uint32_t size = eventLen + 4;
+  if (slot.capacity < size) {
+    slot.buffer.reset(new (std::nothrow) uint8_t[size]);
+    slot.capacity = slot.buffer ? size : 0;
+  }
+  if (slot.buffer) {
+    // first 4 bytes is the event length
+    memcpy(slot.buffer.get(), (void*)(&eventLen), 4);
+    // actual event contents
+    memcpy(slot.buffer.get() + 4, buf, eventLen);
+    slot.size = size;
+  } else {
+    // The slot is still handed over, empty, or the writer would wait for it
+    T_ERROR("TFileTransport: unable to allocate %u bytes for an event", size);
+    slot.size = 0;
+  }
+  slot.sequence.store(pos + 1, boost::memory_order_release);
 
-  // add to the buffer
-  eventInfo* pEvent = toEnqueue.release();
-  if (!enqueueBuffer_->addEvent(pEvent)) {
-    delete pEvent;
-    return;
+  // signal the writer thread if it is waiting for the ring to be non-empty
+  boost::atomic_thread_fence(boost::memory_order_seq_cst);
+  if (writerWaiting_.load(boost::memory_order_relaxed)) {
+    Guard g(mutex_);
+    notEmpty_.notify();
   }
+}
 
-  // signal anybody who's waiting for the buffer to be non-empty
-  notEmpty_.notify();
+bool TFileTransport::claimSlot(uint64_t& pos) {
+  pos = enqueuePos_.load(boost::memory_order_relaxed);
+  for (;;) {
+    EventSlot& slot = ring_[pos & ringMask_];
+    int64_t diff = static_cast<int64_t>(slot.sequence.load(boost::memory_order_acquire) - pos);
+    if (diff == 0) {
+      // Free: take it, unless another producer got there first (which
+      // reloads pos)
+      if (enqueuePos_.compare_exchange_weak(pos, pos + 1, boost::memory_order_relaxed)) {
+        return true;
+      }
+    } else if (diff < 0) {
+      // Still holds the event from the previous time around the ring
+      return false;
+    } else {
+      pos = enqueuePos_.load(boost::memory_order_relaxed);
+    }
+  }
+}
 
-  // this really should be a loop where it makes sure it got flushed
-  // because condition variables can get triggered by the os for no reason
-  // it is probably a non-factor for the time being
+bool TFileTransport::ringFull() {
+  uint64_t pos = enqueuePos_.load();
+  return static_cast<int64_t>(ring_[pos & ringMask_].sequence.load() - pos) < 0;
 }
 
-bool TFileTransport::swapEventBuffers(struct timeval* deadline) {
-  bool swap;
+bool TFileTransport::hasReadyEvent() {
+  return ring_[dequeuePos_ & ringMask_].sequence.load(boost::memory_order_acquire)
+         == dequeuePos_ + 1;
+}
+
+bool TFileTransport::waitForEvents(struct timeval* deadline) {
+  if (hasReadyEvent()) {
+    return true;
+  }
+
   Guard g(mutex_);
+  writerWaiting_.store(true, boost::memory_order_relaxed);
+  boost::atomic_thread_fence(boost::memory_order_seq_cst);
 
-  if (!enqueueBuffer_->isEmpty()) {
-    swap = true;
-  } else if (closing_) {
-    // even though there is no data to write,
-    // return immediately if the transport is closing
-    swap = false;
-  } else {
+  // A flush only keeps the writer awake once every event it waits for is
+  // ready; producers still filling their slots wake it up when they are done.
+  if (!hasReadyEvent() && !closing_ && !(forceFlush_ && dequeuePos_ >= flushTarget_)) {
     if (deadline != NULL) {
       // if we were handed a deadline time struct, do a timed wait
       notEmpty_.waitForTime(deadline);
     } else {
-      // just wait until the buffer gets an item
+      // just wait until the ring gets an item
       notEmpty_.wait();
     }
-
-    // could be empty if we timed out
-    swap = enqueueBuffer_->isEmpty();
-  }
-
-  if (swap) {
-    TFileTransportBuffer* temp = enqueueBuffer_;
-    enqueueBuffer_ = dequeueBuffer_;
-    dequeueBuffer_ = temp;
-  }
-
-  if (swap) {
-    notFull_.notify();
   }
+  writerWaiting_.store(false, boost::memory_order_relaxed);
 
-  return swap;
+  // could be empty if we timed out
+  return hasReadyEvent();
 }
 
 void TFileTransport::writerThread() {
@@ -336,9 +395,9 @@ void TFileTransport::writerThread() {
         return;
       }
 
-      // Try to empty buffers before exit
-      if (enqueueBuffer_->isEmpty() && dequeueBuffer_->isEmpty()) {
-        ::THRIFT_FSYNC(fd_);
+      // Try to empty the ring before exit
+      if (enqueuePos_.load() == dequeuePos_) {
+        syncFile();
         if (-1 == ::THRIFT_CLOSE(fd_)) {
           int errno_copy = THRIFT_ERRNO;
           GlobalOutput.perror("TFileTransport: writerThread() ::close() ", errno_copy);
@@ -350,98 +409,38 @@ void TFileTransport::writerThread() {
       }
     }
 
-    if (swapEventBuffers(&ts_next_flush)) {
-      eventInfo* outEvent;
-      while (NULL != (outEvent = dequeueBuffer_->getNext())) {
-        // Remove an event from the buffer and write it out to disk. If there is any IO error, for
-        // instance,
-        // the output file is unmounted or deleted, then this event is dropped. However, the writer
-        // thread
-        // will: (1) sleep for a short while; (2) try to reopen the file; (3) if successful then
-        // start writing
-        // from the end.
-
-        while (hasIOError) {
-          T_ERROR(
-              "TFileTransport: writer thread going to sleep for %d microseconds due to IO errors",
-              writerThreadIOErrorSleepTime_);
-          THRIFT_SLEEP_USEC(writerThreadIOErrorSleepTime_);
-          if (closing_) {
-            return;
-          }
-          if (!fd_) {
-            ::THRIFT_CLOSE(fd_);
-            fd_ = 0;
-          }
-          try {
-            openLogFile();
-            seekToEnd();
-            unflushed = 0;
-            hasIOError = false;
-            T_LOG_OPER(
-                "TFileTransport: log file %s reopened by writer thread during error recovery",
-                filename_.c_str());
-          } catch (...) {
-            T_ERROR("TFileTransport: unable to reopen log file %s during error recovery",
-                    filename_.c_str());
-          }
+    if (waitForEvents(&ts_next_flush)) {
+      // Write out every ready event. If there is any IO error, for instance, the output
+      // file is unmounted or deleted, then these events are dropped. However, the writer thread
+      // will: (1) sleep for a short while; (2) try to reopen the file; (3) if successful then
+      // start writing from the end.
+      while (hasIOError) {
+        T_ERROR("TFileTransport: writer thread going to sleep for %d microseconds due to IO errors",
+                writerThreadIOErrorSleepTime_);
+        THRIFT_SLEEP_USEC(writerThreadIOErrorSleepTime_);
+        if (closing_) {
+          return;
         }
-
-        // sanity check on event
-        if ((maxEventSize_ > 0) && (outEvent->eventSize_ > maxEventSize_)) {
-          T_ERROR("msg size is greater than max event size: %u > %u\n",
-                  outEvent->eventSize_,
-                  maxEventSize_);
-          continue;
+        if (!fd_) {
+          ::THRIFT_CLOSE(fd_);
+          fd_ = 0;
         }
-
-        // If chunking is required, then make sure that msg does not cross chunk boundary
-        if ((outEvent->eventSize_ > 0) && (chunkSize_ != 0)) {
-          // event size must be less than chunk size
-          if (outEvent->eventSize_ > chunkSize_) {
-            T_ERROR("TFileTransport: event size(%u) > chunk size(%u): skipping event",
-                    outEvent->eventSize_,
-                    chunkSize_);
-            continue;
-          }
-
-          int64_t chunk1 = offset_ / chunkSize_;
-          int64_t chunk2 = (offset_ + outEvent->eventSize_ - 1) / chunkSize_;
-
-          // if adding this event will cross a chunk boundary, pad the chunk with zeros
-          if (chunk1 != chunk2) {
-            // refetch the offset to keep in sync
-            offset_ = THRIFT_LSEEK(fd_, 0, SEEK_CUR);
-            int32_t padding = (int32_t)((offset_ / chunkSize_ + 1) * chunkSize_ - offset_);
-
-            uint8_t* zeros = new uint8_t[padding];
-            memset(zeros, '\0', padding);
-            boost::scoped_array<uint8_t> array(zeros);
-            if (-1 == ::write(fd_, zeros, padding)) {
-              int errno_copy = THRIFT_ERRNO;
-              GlobalOutput.perror("TFileTransport: writerThread() error while padding zeros ",
-                                  errno_copy);
-              hasIOError = true;
-              continue;
-            }
-            unflushed += padding;
-            offset_ += padding;
-          }
+        try {
+          openLogFile();
+          seekToEnd();
+          unflushed = 0;
+          hasIOError = false;
+          T_LOG_OPER("TFileTransport: log file %s reopened by writer thread during error recovery",
+                     filename_.c_str());
+        } catch (...) {
+          T_ERROR("TFileTransport: unable to reopen log file %s during error recovery",
+                  filename_.c_str());
         }
+      }
 
-        // write the dequeued event to the file
-        if (outEvent->eventSize_ > 0) {
-          if (-1 == ::THRIFT_WRITE(fd_, outEvent->eventBuff_, outEvent->eventSize_)) {
-            int errno_copy = THRIFT_ERRNO;
-            GlobalOutput.perror("TFileTransport: error while writing event ", errno_copy);
-            hasIOError = true;
-            continue;
-          }
-          unflushed += outEvent->eventSize_;
-          offset_ += outEvent->eventSize_;
-        }
+      if (!writeEvents(&unflushed)) {
+        hasIOError = true;
       }
-      dequeueBuffer_->reset();
     }
 
     if (hasIOError) {
@@ -455,22 +454,21 @@ void TFileTransport::writerThread() {
     // time, it could have changed state in between.  This will result in us
     // making inconsistent decisions.
     bool forced_flush = false;
+    uint64_t flush_request = 0;
     {
       Guard g(mutex_);
       if (forceFlush_) {
-        if (!enqueueBuffer_->isEmpty()) {
-          // If forceFlush_ is true, we need to flush all available data.
-          // If enqueueBuffer_ is not empty, go back to the start of the loop to
-          // write it out.
+        if (dequeuePos_ < flushTarget_) {
+          // If forceFlush_ is true, we need to flush all data enqueued before
+          // the flush was requested.  Some of it is still in the ring, so go
+          // back to the start of the loop to write it out.
           //
-          // We know the main thread is waiting on forceFlush_ to be cleared,
-          // so no new events will be added to enqueueBuffer_ until we clear
-          // forceFlush_.  Therefore the next time around the loop enqueueBuffer_
-          // is guaranteed to be empty.  (I.e., we're guaranteed to make progress
-          // and clear forceFlush_ the next time around the loop.)
+          // Events enqueued since then do not hold the flush up, so we are
+          // guaranteed to get to flushTarget_ and make progress.
           continue;
         }
         forced_flush = true;
+        flush_request = flushRequested_;
       }
     }
 
@@ -496,22 +494,199 @@ void TFileTransport::writerThread() {
 
     if (flush) {
       // sync (force flush) file to disk
-      THRIFT_FSYNC(fd_);
+      syncFile();
       unflushed = 0;
       getNextFlushTime(&ts_next_flush);
 
       // notify anybody waiting for flush completion
       if (forced_flush) {
         Guard g(mutex_);
-        forceFlush_ = false;
-        assert(enqueueBuffer_->isEmpty());
-        assert(dequeueBuffer_->isEmpty());
+        flushCompleted_ = flush_request;
+        forceFlush_ = flushCompleted_ < flushRequested_;
         flushed_.notifyAll();
       }
     }
   }
 }
 
+// Writes every ready event in the ring, with any padding needed to keep them
+// inside chunks, in as few writes as possible, then releases their slots.
+bool TFileTransport::writeEvents(uint32_t* unflushed) {
+  segments_.clear();
+
+  if (chunkSize_ != 0) {
+    // refetch the offset to keep in sync
+    offset_ = THRIFT_LSEEK(fd_, 0, SEEK_CUR);
+  }
+  off_t end = offset_;
+
+  uint64_t last = dequeuePos_;
+  for (; last - dequeuePos_ <= ringMask_; ++last) {
+    EventSlot& slot = ring_[last & ringMask_];
+    if (slot.sequence.load(boost::memory_order_acquire) != last + 1) {
+      break;
+    }
+
+    // sanity check on event
+    if ((maxEventSize_ > 0) && (slot.size > maxEventSize_)) {
+      T_ERROR("msg size is greater than max event size: %u > %u\n", slot.size, maxEventSize_);
+      continue;
+    }
+    if (slot.size == 0) {
+      continue;
+    }
+
+    // If chunking is required, then make sure that msg does not cross chunk boundary
+    if (chunkSize_ != 0) {
+      // event size must be less than chunk size
+      if (slot.size > chunkSize_) {
+        T_ERROR("TFileTransport: event size(%u) > chunk size(%u): skipping event",
+                slot.size,
+                chunkSize_);
+        continue;
+      }
+
+      int64_t chunk1 = end / chunkSize_;
+      int64_t chunk2 = (end + slot.size - 1) / chunkSize_;
+
+      // if adding this event will cross a chunk boundary, pad the chunk with zeros
+      if (chunk1 != chunk2) {
+        uint32_t padding = static_cast<uint32_t>((chunk1 + 1) * chunkSize_ - end);
+        addPadding(padding);
+        end += padding;
+      }
+    }
+
+    segments_.push_back(std::make_pair(slot.buffer.get(), slot.size));
+    end += slot.size;
+  }
+
+  // Events that fail to be written are dropped along with their slots
+  bool written = segments_.empty() || writeSegments(end, unflushed);
+  releaseSlots(last);
+  return written;
+}
+
+bool TFileTransport::writeSegments(off_t end, uint32_t* unflushed) {
+  if (preallocateChunks_ && chunkSize_ != 0) {
+    preallocate(end);
+  }
+
+  size_t next = 0;
+  while (next < segments_.size()) {
+#ifdef HAVE_SYS_UIO_H
+    struct iovec iov[kMaxWriteSegments];
+    int iovcnt = 0;
+    for (size_t i = next; i < segments_.size() && iovcnt < kMaxWriteSegments; ++i, ++iovcnt) {
+      iov[iovcnt].iov_base = const_cast<uint8_t*>(segments_[i].first);
+      iov[iovcnt].iov_len = segments_[i].second;
+    }
+    ssize_t written = ::writev(fd_, iov, iovcnt);
+#else
+    int written = ::THRIFT_WRITE(fd_, segments_[next].first, segments_[next].second);
+#endif
+    if (written < 0) {
+      int errno_copy = THRIFT_ERRNO;
+      if (errno_copy == EINTR) {
+        continue;
+      }
+      GlobalOutput.perror("TFileTransport: error while writing events ", errno_copy);
+      return false;
+    }
+    *unflushed += static_cast<uint32_t>(written);
+    offset_ += written;
+
+    // Skip what went out in full and carry on from the middle of the rest
+    while (written > 0 && static_cast<uint32_t>(written) >= segments_[next].second) {
+      written -= segments_[next].second;
+      ++next;
+    }
+    if (written > 0) {
+      segments_[next].first += written;
+      segments_[next].second -= static_cast<uint32_t>(written);
+    }
+  }
+  return true;
+}
+
+// Hands the slots up to last back to the producers
+void TFileTransport::releaseSlots(uint64_t last) {
+  for (; dequeuePos_ < last; ++dequeuePos_) {
+    EventSlot& slot = ring_[dequeuePos_ & ringMask_];
+    if (slot.capacity > kMaxRetainedEventSize) {
+      slot.buffer.reset();
+      slot.capacity = 0;
+    }
+    slot.sequence.store(dequeuePos_ + ringMask_ + 1, boost::memory_order_release);
+  }
+
+  // signal any producers waiting for the ring to have room
+  boost::atomic_thread_fence(boost::memory_order_seq_cst);
+  if (producersWaiting_.load(boost::memory_order_relaxed) > 0) {
+    Guard g(mutex_);
+    notFull_.notifyAll();
+  }
+}
+
+// Zeros that padding segments point into
+static const uint8_t kPaddingZeros[64 * 1024] = {0};
+
+void TFileTransport::addPadding(uint32_t padding) {
+  while (padding > 0) {
+    uint32_t len = (std::min)(padding, static_cast<uint32_t>(sizeof(kPaddingZeros)));
+    segments_.push_back(std::make_pair(kPaddingZeros, len));
+    padding -= len;
+  }
+}
+
+// Reserves space up to the end of the chunk that end falls in
+void TFileTransport::preallocate(off_t end) {
+#if defined(HAVE_FALLOCATE) && defined(FALLOC_FL_KEEP_SIZE)
+  off_t chunkEnd = (end / chunkSize_ + 1) * chunkSize_;
+  if (chunkEnd <= preallocated_) {
+    return;
+  }
+  off_t start = (std::max)(preallocated_, offset_);
+  if (0 != fallocate(fd_, FALLOC_FL_KEEP_SIZE, start, chunkEnd - start)) {
+    int errno_copy = THRIFT_ERRNO;
+    GlobalOutput.perror("TFileTransport: fallocate() failed, not preallocating chunks ", errno_copy);
+    preallocateChunks_ = false;
+    return;
+  }
+  preallocated_ = chunkEnd;
+#else
+  (void)end;
+#endif
+}
+
+void TFileTransport::syncFile() {
+  if (syncPolicy_ == SYNC_FSYNC) {
+    THRIFT_FSYNC(fd_);
+  } else if (syncPolicy_ == SYNC_FDATASYNC) {
+#ifdef HAVE_FDATASYNC
+    ::fdatasync(fd_);
+#else
+    THRIFT_FSYNC(fd_);
+#endif
+  }
+  // with SYNC_DSYNC the writes themselves were synchronous
+}
+
+void TFileTransport::setSyncPolicy(SyncPolicy syncPolicy) {
+  if (bufferAndThreadInitialized_) {
+    GlobalOutput("Cannot change the sync policy after writer thread started");
+    return;
+  }
+  bool reopen = fd_ > 0 && !readOnly_ && ((syncPolicy == SYNC_DSYNC) != (syncPolicy_ == SYNC_DSYNC));
+  syncPolicy_ = syncPolicy;
+  if (reopen) {
+    // O_DSYNC cannot be changed on an open file
+    ::THRIFT_CLOSE(fd_);
+    fd_ = 0;
+    openLogFile();
+  }
+}
+
 void TFileTransport::flush() {
   // file must be open for writing for any flushing to take place
   if (!writerThread_.get()) {
@@ -520,12 +695,14 @@ void TFileTransport::flush() {
   // wait for flush to take place
   Guard g(mutex_);
 
-  // Indicate that we are requesting a flush
+  // Indicate that we are requesting a flush of everything enqueued so far
+  uint64_t request = ++flushRequested_;
+  flushTarget_ = enqueuePos_.load();
   forceFlush_ = true;
   // Wake up the writer thread so it will perform the flush immediately
   notEmpty_.notify();
 
-  while (forceFlush_) {
+  while (flushCompleted_ < request) {
     flushed_.wait();
   }
 }
@@ -882,12 +1059,18 @@ void TFileTransport::openLogFile() {
 #ifndef _WIN32
   mode_t mode = readOnly_ ? S_IRUSR | S_IRGRP | S_IROTH : S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH;
   int flags = readOnly_ ? O_RDONLY : O_RDWR | O_CREAT | O_APPEND;
+#ifdef O_DSYNC
+  if (!readOnly_ && syncPolicy_ == SYNC_DSYNC) {
+    flags |= O_DSYNC;
+  }
+#endif
 #else
   int mode = readOnly_ ? _S_IREAD : _S_IREAD | _S_IWRITE;
   int flags = readOnly_ ? _O_RDONLY : _O_RDWR | _O_CREAT | _O_APPEND;
 #endif
   fd_ = ::THRIFT_OPEN(filename_.c_str(), flags, mode);
   offset_ = 0;
+  preallocated_ = 0;
 
   // make sure open call was successful
   if (fd_ == -1) {
@@ -969,6 +1152,339 @@ bool TFileTransportBuffer::isEmpty() {
   return writePoint_ == 0;
 }
 
+namespace {
+
+enum EventStatus { EVENT_FOUND, EVENT_INCOMPLETE, EVENT_CORRUPTED };
+
+// Finds the event whose size field is at or after pos in a log of size bytes,
+// skipping padding the way TFileTransport::readEvent() does.  On EVENT_FOUND
+// the event is [start, start + len) and pos is moved past it; otherwise pos is
+// left at the size field that could not be used.
+EventStatus findEvent(const uint8_t* data,
+                      uint64_t size,
+                      uint32_t chunkSize,
+                      uint32_t maxEventSize,
+                      uint64_t& pos,
+                      uint64_t& start,
+                      uint32_t& len) {
+  while (true) {
+    // size fields never cross a chunk boundary
+    if (pos / chunkSize != (pos + 3) / chunkSize) {
+      pos = (pos / chunkSize + 1) * chunkSize;
+    }
+    if (pos + 4 > size) {
+      return EVENT_INCOMPLETE;
+    }
+    uint32_t eventSize;
+    memcpy(&eventSize, data + pos, sizeof(eventSize));
+    if (eventSize == 0) {
+      // 0 length event indicates padding
+      pos += 4;
+      continue;
+    }
+    if ((maxEventSize > 0 && eventSize > maxEventSize) || eventSize > chunkSize
+        || pos / chunkSize != (pos + 4 + eventSize - 1) / chunkSize) {
+      return EVENT_CORRUPTED;
+    }
+    if (pos + 4 + eventSize > size) {
+      // not written in full yet
+      return EVENT_INCOMPLETE;
+    }
+    start = pos + 4;
+    len = eventSize;
+    pos = start + eventSize;
+    return EVENT_FOUND;
+  }
+}
+
+#ifndef _WIN32
+// Deleter that unmaps a file mapping
+class Unmapper {
+public:
+  explicit Unmapper(size_t size) : size_(size) {}
+  void operator()(uint8_t* addr) const { munmap(addr, size_); }
+
+private:
+  size_t size_;
+};
+#endif
+}
+
+TMappedFileTransport::TMappedFileTransport(string path)
+  : filename_(path),
+    fd_(-1),
+    mapSize_(0),
+    pos_(0),
+    event_(NULL),
+    eventLeft_(0),
+    readTimeout_(TFileTransport::NO_TAIL_READ_TIMEOUT),
+    chunkSize_(DEFAULT_CHUNK_SIZE),
+    maxEventSize_(0),
+    eofSleepTime_(DEFAULT_EOF_SLEEP_TIME_US) {
+#ifdef _WIN32
+  throw TTransportException(TTransportException::NOT_OPEN,
+                            "TMappedFileTransport: not supported on this platform");
+#else
+  fd_ = ::THRIFT_OPEN(filename_.c_str(), O_RDONLY);
+  if (fd_ == -1) {
+    int errno_copy = THRIFT_ERRNO;
+    GlobalOutput.perror("TMappedFileTransport: ::open() file: " + filename_, errno_copy);
+    throw TTransportException(TTransportException::NOT_OPEN, filename_, errno_copy);
+  }
+  try {
+    remap();
+  } catch (...) {
+    ::THRIFT_CLOSE(fd_);
+    throw;
+  }
+#endif
+}
+
+TMappedFileTransport::~TMappedFileTransport() {
+  close();
+}
+
+void TMappedFileTransport::close() {
+  map_.reset();
+  mapSize_ = 0;
+  event_ = NULL;
+  eventLeft_ = 0;
+  eventMap_.reset();
+  if (fd_ >= 0) {
+    ::THRIFT_CLOSE(fd_);
+    fd_ = -1;
+  }
+}
+
+// Maps the whole file again if it has grown.  Returns true if it has.
+bool TMappedFileTransport::remap() {
+#ifdef _WIN32
+  return false;
+#else
+  if (fd_ < 0) {
+    throw TTransportException(TTransportException::NOT_OPEN, "File not open");
+  }
+  struct THRIFT_STAT f_info;
+  if (::THRIFT_FSTAT(fd_, &f_info) < 0) {
+    int errno_copy = THRIFT_ERRNO;
+    throw TTransportException(TTransportException::UNKNOWN,
+                              "TMappedFileTransport::remap() (fstat)",
+                              errno_copy);
+  }
+  uint64_t size = static_cast<uint64_t>(f_info.st_size);
+  if (size <= mapSize_) {
+    return false;
+  }
+  if (size > (std::numeric_limits<size_t>::max)()) {
+    throw TTransportException("TMappedFileTransport: file too large to map");
+  }
+  void* addr = mmap(NULL, static_cast<size_t>(size), PROT_READ, MAP_SHARED, fd_, 0);
+  if (addr == MAP_FAILED) {
+    int errno_copy = THRIFT_ERRNO;
+    GlobalOutput.perror("TMappedFileTransport: mmap() file: " + filename_, errno_copy);
+    throw TTransportException(TTransportException::UNKNOWN,
+                              "TMappedFileTransport::remap() (mmap)",
+                              errno_copy);
+  }
+#ifdef MADV_SEQUENTIAL
+  madvise(addr, static_cast<size_t>(size), MADV_SEQUENTIAL);
+#endif
+  // eventMap_ keeps the old mapping alive for the rest of the current event
+  map_.reset(static_cast<uint8_t*>(addr), Unmapper(static_cast<size_t>(size)));
+  mapSize_ = size;
+  return true;
+#endif
+}
+
+// Makes the next complete event the current one.  Returns false at the end
+// of the file, after waiting for more data as readTimeout_ asks.
+bool TMappedFileTransport::readEvent() {
+  int readTries = 0;
+  event_ = NULL;
+  eventLeft_ = 0;
+  eventMap_.reset();
+
+  while (true) {
+    uint64_t start;
+    uint32_t len;
+    EventStatus status = findEvent(map_.get(), mapSize_, chunkSize_, maxEventSize_, pos_, start, len);
+    if (status == EVENT_FOUND) {
+      event_ = map_.get() + start;
+      eventLeft_ = len;
+      eventMap_ = map_;
+      return true;
+    }
+
+    if (status == EVENT_CORRUPTED) {
+      // the rest of the chunk cannot be trusted, move on to the next one
+      uint64_t nextChunk = (pos_ / chunkSize_ + 1) * chunkSize_;
+      if (nextChunk < mapSize_ || (remap() && nextChunk < mapSize_)) {
+        T_ERROR("TMappedFileTransport: corrupted event at offset %lu, skipping to the next chunk",
+                static_cast<unsigned long>(pos_));
+        pos_ = nextChunk;
+      } else if (readTimeout_ == TFileTransport::TAIL_READ_TIMEOUT) {
+        // wait until there is enough data to start the next chunk
+        THRIFT_SLEEP_USEC(eofSleepTime_);
+      } else {
+        char errorMsg[1024];
+        sprintf(errorMsg,
+                "TMappedFileTransport: log file corrupted at offset: %lu",
+                static_cast<unsigned long>(pos_));
+        GlobalOutput(errorMsg);
+        throw TTransportException(errorMsg);
+      }
+      continue;
+    }
+
+    // end of the file, or of what has been written so far
+    if (remap()) {
+      continue;
+    }
+    if (readTimeout_ == TFileTransport::TAIL_READ_TIMEOUT) {
+      THRIFT_SLEEP_USEC(eofSleepTime_);
+    } else if (readTimeout_ > 0 && readTries == 0) {
+      THRIFT_SLEEP_USEC(readTimeout_ * 1000);
+      readTries++;
+    } else {
+      return false;
+    }
+  }
+}
+
+uint32_t TMappedFileTransport::readAll(uint8_t* buf, uint32_t len) {
+  uint32_t have = 0;
+
+  while (have < len) {
+    uint32_t get = read(buf + have, len - have);
+    if (get == 0) {
+      throw TEOFException();
+    }
+    have += get;
+  }
+
+  return have;
+}
+
+uint32_t TMappedFileTransport::read(uint8_t* buf, uint32_t len) {
+  if (eventLeft_ == 0 && !readEvent()) {
+    return 0;
+  }
+  uint32_t give = (std::min)(len, eventLeft_);
+  memcpy(buf, event_, give);
+  event_ += give;
+  eventLeft_ -= give;
+  return give;
+}
+
+bool TMappedFileTransport::peek() {
+  return eventLeft_ > 0 || readEvent();
+}
+
+bool TMappedFileTransport::nextEvent(const uint8_t** buf,
+                                     uint32_t* len,
+                                     boost::shared_array<uint8_t>& pin) {
+  if (!readEvent()) {
+    return false;
+  }
+  *buf = event_;
+  *len = eventLeft_;
+  pin = eventMap_;
+  eventMap_.reset();
+  event_ += eventLeft_;
+  eventLeft_ = 0;
+  return true;
+}
+
+const uint8_t* TMappedFileTransport::borrow_virt(uint8_t* buf, uint32_t* len) {
+  (void)buf;
+  if (*len > eventLeft_) {
+    return NULL;
+  }
+  *len = eventLeft_;
+  return event_;
+}
+
+const uint8_t* TMappedFileTransport::borrowPinned_virt(uint32_t len,
+                                                       boost::shared_array<uint8_t>& pin) {
+  if (len > eventLeft_) {
+    return NULL;
+  }
+  pin = eventMap_;
+  return event_;
+}
+
+void TMappedFileTransport::consume_virt(uint32_t len) {
+  if (len > eventLeft_) {
+    throw TTransportException(TTransportException::BAD_ARGS, "consume did not follow a borrow.");
+  }
+  event_ += len;
+  eventLeft_ -= len;
+}
+
+// Moves past every complete event from pos_ on
+void TMappedFileTransport::skipEvents() {
+  uint64_t start;
+  uint32_t len;
+  while (findEvent(map_.get(), mapSize_, chunkSize_, maxEventSize_, pos_, start, len)
+         == EVENT_FOUND) {
+  }
+  event_ = NULL;
+  eventLeft_ = 0;
+  eventMap_.reset();
+}
+
+void TMappedFileTransport::seekToChunk(int32_t chunk) {
+  int32_t numChunks = getNumChunks();
+
+  // file is empty, seeking to chunk is pointless
+  if (numChunks == 0) {
+    return;
+  }
+
+  // negative indicates reverse seek (from the end)
+  if (chunk < 0) {
+    chunk += numChunks;
+  }
+  if (chunk < 0) {
+    chunk = 0;
+  }
+
+  event_ = NULL;
+  eventLeft_ = 0;
+  eventMap_.reset();
+  if (chunk < numChunks) {
+    pos_ = uint64_t(chunk) * chunkSize_;
+  } else {
+    // cannot seek past EOF, stop after the last complete event instead
+    pos_ = uint64_t(numChunks - 1) * chunkSize_;
+    skipEvents();
+  }
+}
+
+void TMappedFileTransport::seekToEnd() {
+  seekToChunk(getNumChunks());
+}
+
+uint32_t TMappedFileTransport::getNumChunks() {
+  if (fd_ < 0) {
+    return 0;
+  }
+  remap();
+  if (mapSize_ > 0) {
+    uint64_t numChunks = mapSize_ / chunkSize_ + 1;
+    if (numChunks > (std::numeric_limits<uint32_t>::max)())
+      throw TTransportException("Too many chunks");
+    return static_cast<uint32_t>(numChunks);
+  }
+
+  // empty file has no chunks
+  return 0;
+}
+
+uint32_t TMappedFileTransport::getCurChunk() {
+  return static_cast<uint32_t>(pos_ / chunkSize_);
+}
+
 TFileProcessor::TFileProcessor(shared_ptr<TProcessor> processor,
                                shared_ptr<TProtocolFactory> protocolFactory,
                                shared_ptr<TFileReaderTransport> inputTransport)
@@ -1064,6 +1580,311 @@ void TFileProcessor::processChunk() {
     }
   }
 }
+namespace {
+
+// Events handed to one replay task at a time, when replaying by key
+const size_t kReplayBatchEvents = 256;
+
+// Lanes of ordered events per worker thread, when replaying by key
+const size_t kReplayLanesPerWorker = 4;
+
+// State shared by the tasks of one parallel replay: what to replay with,
+// how many tasks are still queued or running, and whether one has failed.
+class ReplayState {
+public:
+  ReplayState(shared_ptr<TProcessor> processor,
+              shared_ptr<TProtocolFactory> inputProtocolFactory,
+              shared_ptr<TProtocolFactory> outputProtocolFactory)
+    : processor_(processor),
+      inputProtocolFactory_(inputProtocolFactory),
+      outputProtocolFactory_(outputProtocolFactory),
+      pending_(0),
+      failed_(false) {}
+
+  void add(ThreadManager& threadManager, shared_ptr<Runnable> task) {
+    {
+      Synchronized s(monitor_);
+      ++pending_;
+    }
+    try {
+      threadManager.add(task);
+    } catch (...) {
+      done();
+      throw;
+    }
+  }
+
+  void done() {
+    Synchronized s(monitor_);
+    if (--pending_ == 0) {
+      monitor_.notifyAll();
+    }
+  }
+
+  void wait() {
+    Synchronized s(monitor_);
+    while (pending_ > 0) {
+      monitor_.waitForever();
+    }
+  }
+
+  void fail(const char* what) {
+    if (!failed_.exchange(true)) {
+      cerr << what << endl;
+    }
+  }
+
+  bool failed() const { return failed_.load(); }
+
+  shared_ptr<TProcessor> processor_;
+  shared_ptr<TProtocolFactory> inputProtocolFactory_;
+  shared_ptr<TProtocolFactory> outputProtocolFactory_;
+
+private:
+  Monitor monitor_;
+  size_t pending_;
+  boost::atomic<bool> failed_;
+};
+
+// Processes events held in memory, each as one message
+class EventReplayer {
+public:
+  explicit EventReplayer(ReplayState& state)
+    : state_(state), input_(new TMemoryBuffer()), output_(new TNullTransport()) {
+    inputProtocol_ = state_.inputProtocolFactory_->getProtocol(input_);
+    outputProtocol_ = state_.outputProtocolFactory_->getProtocol(output_);
+  }
+
+  bool replay(const uint8_t* buf, uint32_t len) {
+    if (state_.failed()) {
+      return false;
+    }
+    input_->resetBuffer(const_cast<uint8_t*>(buf), len);
+    try {
+      state_.processor_->process(inputProtocol_, outputProtocol_, NULL);
+    } catch (TException& te) {
+      state_.fail(te.what());
+      return false;
+    }
+    return true;
+  }
+
+private:
+  ReplayState& state_;
+  shared_ptr<TMemoryBuffer> input_;
+  shared_ptr<TTransport> output_;
+  shared_ptr<TProtocol> inputProtocol_;
+  shared_ptr<TProtocol> outputProtocol_;
+};
+
+// Replays the events of one chunk, starting at begin
+class ChunkReplay : public Runnable {
+public:
+  ChunkReplay(ReplayState& state,
+              const boost::shared_array<uint8_t>& map,
+              uint64_t mapSize,
+              uint32_t chunkSize,
+              uint32_t maxEventSize,
+              uint64_t begin)
+    : state_(state),
+      map_(map),
+      mapSize_(mapSize),
+      chunkSize_(chunkSize),
+      maxEventSize_(maxEventSize),
+      begin_(begin) {}
+
+  void run() {
+    try {
+      EventReplayer replayer(state_);
+      uint64_t end = (begin_ / chunkSize_ + 1) * chunkSize_;
+      uint64_t pos = begin_;
+      uint64_t start;
+      uint32_t len;
+      while (true) {
+        EventStatus status = findEvent(map_.get(), mapSize_, chunkSize_, maxEventSize_, pos, start, len);
+        if (status == EVENT_CORRUPTED) {
+          T_ERROR("TFileProcessor: corrupted event at offset %lu, skipping the rest of the chunk",
+                  static_cast<unsigned long>(pos));
+        }
+        // events found past the end belong to the next chunk's task
+        if (status != EVENT_FOUND || start >= end || !replayer.replay(map_.get() + start, len)) {
+          break;
+        }
+      }
+    } catch (std::exception& e) {
+      state_.fail(e.what());
+    }
+    state_.done();
+  }
+
+private:
+  ReplayState& state_;
+  boost::shared_array<uint8_t> map_;
+  uint64_t mapSize_;
+  uint32_t chunkSize_;
+  uint32_t maxEventSize_;
+  uint64_t begin_;
+};
+
+// Events with keys that map to the same lane, processed one batch at a
+// time.  The lane is queued on the thread manager only while it has batches
+// and is not already queued, so its events never run concurrently.
+class KeyedLane : public Runnable {
+public:
+  KeyedLane(ReplayState& state) : state_(state), scheduled_(false) {}
+
+  void setSelf(const shared_ptr<KeyedLane>& self) { self_ = self; }
+
+  void add(ThreadManager& threadManager,
+           const uint8_t* buf,
+           uint32_t len,
+           const boost::shared_array<uint8_t>& pin) {
+    if (filling_.pin != pin) {
+      // the file was mapped again, a batch only pins one mapping
+      submit(threadManager);
+      filling_.pin = pin;
+    }
+    filling_.events.push_back(std::make_pair(buf, len));
+    if (filling_.events.size() >= kReplayBatchEvents) {
+      submit(threadManager);
+    }
+  }
+
+  void submit(ThreadManager& threadManager) {
+    if (filling_.events.empty()) {
+      return;
+    }
+    bool schedule;
+    {
+      Guard g(mutex_);
+      batches_.push_back(Batch());
+      batches_.back().swap(filling_);
+      schedule = !scheduled_;
+      scheduled_ = true;
+    }
+    if (schedule) {
+      state_.add(threadManager, self_.lock());
+    }
+  }
+
+  void run() {
+    try {
+      EventReplayer replayer(state_);
+      Batch batch;
+      while (true) {
+        {
+          Guard g(mutex_);
+          if (batches_.empty()) {
+            scheduled_ = false;
+            break;
+          }
+          batch.swap(batches_.front());
+          batches_.pop_front();
+        }
+        for (size_t i = 0; i < batch.events.size(); ++i) {
+          if (!replayer.replay(batch.events[i].first, batch.events[i].second)) {
+            break;
+          }
+        }
+        batch.events.clear();
+      }
+    } catch (std::exception& e) {
+      state_.fail(e.what());
+      Guard g(mutex_);
+      batches_.clear();
+      scheduled_ = false;
+    }
+    state_.done();
+  }
+
+private:
+  struct Batch {
+    std::vector<std::pair<const uint8_t*, uint32_t> > events;
+    boost::shared_array<uint8_t> pin;
+
+    void swap(Batch& other) {
+      events.swap(other.events);
+      pin.swap(other.pin);
+    }
+  };
+
+  ReplayState& state_;
+  Batch filling_;
+  Mutex mutex_;
+  std::deque<Batch> batches_;
+  bool scheduled_;
+  boost::weak_ptr<KeyedLane> self_;
+};
+}
+
+void TFileProcessor::processParallel(shared_ptr<ThreadManager> threadManager, KeyFunction key) {
+  shared_ptr<TMappedFileTransport> input
+      = boost::dynamic_pointer_cast<TMappedFileTransport>(inputTransport_);
+  if (!input) {
+    throw TTransportException(TTransportException::BAD_ARGS,
+                              "TFileProcessor: parallel replay needs a TMappedFileTransport");
+  }
+
+  ReplayState state(processor_, inputProtocolFactory_, outputProtocolFactory_);
+  try {
+    if (key) {
+      size_t numLanes = (std::max)(threadManager->workerCount(), static_cast<size_t>(1))
+                        * kReplayLanesPerWorker;
+      std::vector<shared_ptr<KeyedLane> > lanes;
+      for (size_t i = 0; i < numLanes; ++i) {
+        lanes.push_back(shared_ptr<KeyedLane>(new KeyedLane(state)));
+        lanes.back()->setSelf(lanes.back());
+      }
+
+      // Events are found in file order here and only processed on the threads
+      int32_t oldReadTimeout = input->getReadTimeout();
+      input->setReadTimeout(TFileTransport::NO_TAIL_READ_TIMEOUT);
+      const uint8_t* buf;
+      uint32_t len;
+      boost::shared_array<uint8_t> pin;
+      try {
+        while (!state.failed() && input->nextEvent(&buf, &len, pin)) {
+          lanes[key(buf, len) % numLanes]->add(*threadManager, buf, len, pin);
+        }
+      } catch (...) {
+        input->setReadTimeout(oldReadTimeout);
+        throw;
+      }
+      input->setReadTimeout(oldReadTimeout);
+      for (size_t i = 0; i < numLanes; ++i) {
+        lanes[i]->submit(*threadManager);
+      }
+    } else {
+      // Chunks are replayed independently, the transport ends up after the
+      // last complete event
+      input->remap();
+      input->event_ = NULL;
+      input->eventLeft_ = 0;
+      input->eventMap_.reset();
+      uint32_t chunkSize = input->chunkSize_;
+      uint64_t pos = input->pos_;
+      uint64_t lastChunk = pos;
+      while (pos < input->mapSize_ && !state.failed()) {
+        lastChunk = pos;
+        state.add(*threadManager,
+                  shared_ptr<Runnable>(new ChunkReplay(state,
+                                                       input->map_,
+                                                       input->mapSize_,
+                                                       chunkSize,
+                                                       input->maxEventSize_,
+                                                       pos)));
+        pos = (pos / chunkSize + 1) * chunkSize;
+      }
+      input->pos_ = lastChunk;
+      input->skipEvents();
+    }
+  } catch (...) {
+    state.fail("TFileProcessor: parallel replay stopped early");
+    state.wait();
+    throw;
+  }
+  state.wait();
+}
 }
 }
 } // apache::thrift::transport
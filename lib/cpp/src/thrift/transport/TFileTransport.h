@@ -25,16 +25,21 @@
 #include <thrift/TProcessor.h>
 
 #include <string>
+#include <utility>
+#include <vector>
 #include <stdio.h>
 
 #include <boost/atomic.hpp>
+#include <boost/scoped_array.hpp>
 #include <boost/scoped_ptr.hpp>
+#include <boost/shared_array.hpp>
 #include <boost/shared_ptr.hpp>
 
 #include <thrift/concurrency/Mutex.h>
 #include <thrift/concurrency/Monitor.h>
 #include <thrift/concurrency/PlatformThreadFactory.h>
 #include <thrift/concurrency/Thread.h>
+#include <thrift/concurrency/ThreadManager.h>
 
 namespace apache {
 namespace thrift {
@@ -258,6 +263,32 @@ public:
   }
   uint32_t getEofSleepTimeUs() { return eofSleepTime_; }
 
+  /**
+   * How the writer thread makes events durable.  Every batch of events it
+   * takes from the queue is written with one gathered write, so a sync
+   * commits all of them at once.
+   *
+   *  SYNC_FSYNC      fsync() once flushMaxUs or flushMaxBytes is reached, and
+   *                  on flush().  The default.
+   *  SYNC_FDATASYNC  Like SYNC_FSYNC with fdatasync(), which skips metadata
+   *                  such as timestamps.  Falls back to fsync() where there
+   *                  is no fdatasync().
+   *  SYNC_DSYNC      Open the file with O_DSYNC, so each batch is durable
+   *                  when its write returns and no separate sync is needed.
+   *  SYNC_NONE       Never sync; flush() only waits for events to be written.
+   */
+  enum SyncPolicy { SYNC_FSYNC, SYNC_FDATASYNC, SYNC_DSYNC, SYNC_NONE };
+
+  // Can only be changed before the writer thread starts
+  void setSyncPolicy(SyncPolicy syncPolicy);
+  SyncPolicy getSyncPolicy() { return syncPolicy_; }
+
+  // Reserve disk space for each chunk when the writer enters it, without
+  // changing the file size readers see.  Only has an effect where
+  // fallocate() is available.
+  void setPreallocateChunks(bool preallocateChunks) { preallocateChunks_ = preallocateChunks; }
+  bool getPreallocateChunks() { return preallocateChunks_; }
+
   /*
    * Override TTransport *_virt() functions to invoke our implementations.
    * We cannot use TVirtualTransport to provide these, since we need to inherit
@@ -270,7 +301,10 @@ public:
 private:
   // helper functions for writing to a file
   void enqueueEvent(const uint8_t* buf, uint32_t eventLen);
-  bool swapEventBuffers(struct timeval* deadline);
+  bool claimSlot(uint64_t& pos);
+  bool ringFull();
+  bool hasReadyEvent();
+  bool waitForEvents(struct timeval* deadline);
   bool initBufferAndWriteThread();
 
   // control for writer thread
@@ -279,6 +313,12 @@ private:
     return NULL;
   }
   void writerThread();
+  bool writeEvents(uint32_t* unflushed);
+  bool writeSegments(off_t end, uint32_t* unflushed);
+  void releaseSlots(uint64_t last);
+  void addPadding(uint32_t padding);
+  void preallocate(off_t end);
+  void syncFile();
 
   // helper functions for reading from a file
   eventInfo* readEvent();
@@ -342,28 +382,64 @@ private:
   apache::thrift::concurrency::PlatformThreadFactory threadFactory_;
   boost::shared_ptr<apache::thrift::concurrency::Thread> writerThread_;
 
-  // buffers to hold data before it is flushed. Each element of the buffer stores a msg that
-  // needs to be written to the file.  The buffers are swapped by the writer thread.
-  TFileTransportBuffer* dequeueBuffer_;
-  TFileTransportBuffer* enqueueBuffer_;
+  // One event queued for the writer thread.  A slot keeps its buffer when
+  // it is released, so once the buffers have grown to the usual event size
+  // enqueueing an event does not allocate.
+  struct EventSlot {
+    // pos + 1 once the event queued at ring position pos is ready, and
+    // pos + ring size once the writer has released it
+    boost::atomic<uint64_t> sequence;
+    boost::scoped_array<uint8_t> buffer; // size prefix followed by the event
+    uint32_t capacity;
+    uint32_t size;
+
+    EventSlot() : sequence(0), capacity(0), size(0) {}
+  };
+
+  // Ring of eventBufferSize_ (rounded up to a power of two) slots.
+  // Producers claim positions by advancing enqueuePos_ without a lock; the
+  // writer thread owns dequeuePos_ and writes events straight from the slots.
+  boost::scoped_array<EventSlot> ring_;
+  uint64_t ringMask_;
+  boost::atomic<uint64_t> enqueuePos_;
+  uint64_t dequeuePos_;
+
+  // Set while the writer thread sleeps on notEmpty_, and the number of
+  // producers sleeping on notFull_; nobody takes mutex_ to notify otherwise
+  boost::atomic<bool> writerWaiting_;
+  boost::atomic<uint32_t> producersWaiting_;
 
   // conditions used to block when the buffer is full or empty
   Monitor notFull_, notEmpty_;
-  volatile bool closing_;
+  boost::atomic<bool> closing_;
 
-  // To keep track of whether the buffer has been flushed
+  // To keep track of whether the buffer has been flushed.  flush() waits for
+  // the writer to sync everything enqueued before it was called: the events
+  // before flushTarget_, for flush request flushRequested_.
   Monitor flushed_;
   boost::atomic<bool> forceFlush_;
+  uint64_t flushTarget_;
+  uint64_t flushRequested_;
+  uint64_t flushCompleted_;
 
-  // Mutex that is grabbed when enqueueing and swapping the read/write buffers
+  // Mutex that guards the flush state and the sleeping side of the monitors
   Mutex mutex_;
 
   // File information
   std::string filename_;
   int fd_;
 
+  SyncPolicy syncPolicy_;
+  bool preallocateChunks_;
+
+  // End of the space reserved by preallocate()
+  off_t preallocated_;
+
+  // Pieces of the batch being written: event and padding buffers
+  std::vector<std::pair<const uint8_t*, uint32_t> > segments_;
+
   // Whether the writer thread and buffers have been initialized
-  bool bufferAndThreadInitialized_;
+  boost::atomic<bool> bufferAndThreadInitialized_;
 
   // Offset within the file
   off_t offset_;
@@ -375,6 +451,105 @@ private:
   bool readOnly_;
 };
 
+/**
+ * Reads a log written by TFileTransport through a read-only memory mapping
+ * of the whole file.  Events are walked in place, chunk boundaries and
+ * padding included, and borrow() hands them to the protocol straight from
+ * the mapping, so nothing is copied through a read buffer.
+ *
+ * An event that fails the same checks TFileTransport makes skips the rest of
+ * its chunk.  The mapping grows as the file does, so tailing works as it
+ * does with TFileTransport.  The file must not be truncated while it is
+ * being read.
+ */
+class TMappedFileTransport : public TFileReaderTransport {
+public:
+  TMappedFileTransport(std::string path);
+  ~TMappedFileTransport();
+
+  bool isOpen() { return fd_ >= 0; }
+  void close();
+
+  uint32_t readAll(uint8_t* buf, uint32_t len);
+  uint32_t read(uint8_t* buf, uint32_t len);
+  bool peek();
+
+  /**
+   * Moves to the next event and returns all of it, skipping whatever is
+   * left of the current one.
+   *
+   * @param buf receives the event, which stays valid while pin is alive.
+   * @param len receives the size of the event.
+   * @param pin receives a reference on the mapping.
+   * @return false if there is no complete event left.
+   */
+  bool nextEvent(const uint8_t** buf, uint32_t* len, boost::shared_array<uint8_t>& pin);
+
+  // log-file specific functions
+  void seekToChunk(int32_t chunk);
+  void seekToEnd();
+  uint32_t getNumChunks();
+  uint32_t getCurChunk();
+
+  void setReadTimeout(int32_t readTimeout) { readTimeout_ = readTimeout; }
+  int32_t getReadTimeout() { return readTimeout_; }
+
+  // Must match the chunk size the log was written with
+  void setChunkSize(uint32_t chunkSize) {
+    if (chunkSize) {
+      chunkSize_ = chunkSize;
+    }
+  }
+  uint32_t getChunkSize() { return chunkSize_; }
+
+  void setMaxEventSize(uint32_t maxEventSize) { maxEventSize_ = maxEventSize; }
+  uint32_t getMaxEventSize() { return maxEventSize_; }
+
+  void setEofSleepTimeUs(uint32_t eofSleepTime) {
+    if (eofSleepTime) {
+      eofSleepTime_ = eofSleepTime;
+    }
+  }
+  uint32_t getEofSleepTimeUs() { return eofSleepTime_; }
+
+  virtual uint32_t read_virt(uint8_t* buf, uint32_t len) { return this->read(buf, len); }
+  virtual uint32_t readAll_virt(uint8_t* buf, uint32_t len) { return this->readAll(buf, len); }
+  virtual const uint8_t* borrow_virt(uint8_t* buf, uint32_t* len);
+  virtual const uint8_t* borrowPinned_virt(uint32_t len, boost::shared_array<uint8_t>& pin);
+  virtual void consume_virt(uint32_t len);
+
+private:
+  bool readEvent();
+  bool remap();
+  void skipEvents();
+
+  std::string filename_;
+  int fd_;
+
+  // The mapping is released when the last copy goes away, so memory handed
+  // out by borrowPinned() outlives a remap or close()
+  boost::shared_array<uint8_t> map_;
+  uint64_t mapSize_;
+
+  // Offset of the next event's size field
+  uint64_t pos_;
+
+  // Unread part of the current event, and the mapping it points into,
+  // which getNumChunks() may replace before the event has been read
+  const uint8_t* event_;
+  uint32_t eventLeft_;
+  boost::shared_array<uint8_t> eventMap_;
+
+  int32_t readTimeout_;
+  uint32_t chunkSize_;
+  static const uint32_t DEFAULT_CHUNK_SIZE = 16 * 1024 * 1024;
+  uint32_t maxEventSize_;
+  uint32_t eofSleepTime_;
+  static const uint32_t DEFAULT_EOF_SLEEP_TIME_US = 500 * 1000;
+
+  friend class TFileProcessor;
+};
+
 // Exception thrown when EOF is hit
 class TEOFException : public TTransportException {
 public:
@@ -427,6 +602,26 @@ public:
    */
   void processChunk();
 
+  /// Maps an event to the key whose events must be processed in order
+  typedef apache::thrift::stdcxx::function<uint64_t(const uint8_t* buf, uint32_t len)>
+      KeyFunction;
+
+  /**
+   * Processes the rest of the file on the threads of threadManager and
+   * returns once every event has been processed.  The input transport must
+   * be a TMappedFileTransport, each event must hold one whole message, and
+   * responses are discarded.  Stops at the first error, like process().
+   *
+   * Without a key function each chunk is replayed on its own, so events are
+   * processed in no particular order.  With one, events with equal keys are
+   * processed one at a time, in the order they appear in the file.
+   *
+   * @param threadManager a started thread manager
+   * @param key optional key function
+   */
+  void processParallel(boost::shared_ptr<apache::thrift::concurrency::ThreadManager> threadManager,
+                       KeyFunction key = KeyFunction());
+
 private:
   boost::shared_ptr<TProcessor> processor_;
   boost::shared_ptr<TProtocolFactory> inputProtocolFactory_;
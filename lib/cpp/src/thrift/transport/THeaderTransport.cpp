@@ -23,12 +23,20 @@
 #include <thrift/protocol/TBinaryProtocol.h>
 #include <thrift/protocol/TCompactProtocol.h>
 
+#include <algorithm>
 #include <utility>
 #include <cassert>
 #include <string>
 #include <zlib.h>
 #include <string.h>
 
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
 using std::map;
 using boost::shared_ptr;
 using std::string;
@@ -41,6 +49,140 @@ namespace transport {
 using namespace apache::thrift::protocol;
 using apache::thrift::protocol::TBinaryProtocol;
 
+const int THeaderTransport::DEFAULT_ZLIB_LEVEL;
+const int THeaderTransport::DEFAULT_ZSTD_LEVEL;
+const uint32_t THeaderTransport::DEFAULT_MAX_UNCOMPRESSED_SIZE;
+const uint32_t THeaderTransport::MAX_FRAME_SIZE;
+
+THeaderZstdDictionary::THeaderZstdDictionary(const string& dictionary, int level)
+  : cdict_(NULL), ddict_(NULL), id_(0) {
+#ifdef HAVE_ZSTD
+  cdict_ = ZSTD_createCDict(dictionary.data(), dictionary.size(), level);
+  ddict_ = ZSTD_createDDict(dictionary.data(), dictionary.size());
+  if (cdict_ == NULL || ddict_ == NULL) {
+    ZSTD_freeCDict(cdict_);
+    ZSTD_freeDDict(ddict_);
+    throw std::invalid_argument("Could not load the zstd dictionary");
+  }
+  id_ = ZSTD_getDictID_fromDict(dictionary.data(), dictionary.size());
+#else
+  (void)dictionary;
+  (void)level;
+  throw TTransportException(TTransportException::BAD_ARGS, "Built without zstd support");
+#endif
+}
+
+THeaderZstdDictionary::~THeaderZstdDictionary() {
+#ifdef HAVE_ZSTD
+  ZSTD_freeCDict(cdict_);
+  ZSTD_freeDDict(ddict_);
+#endif
+}
+
+THeaderTransport::~THeaderTransport() {
+  if (inflateStream_ != NULL) {
+    inflateEnd(inflateStream_);
+    delete inflateStream_;
+  }
+  if (deflateStream_ != NULL) {
+    deflateEnd(deflateStream_);
+    delete deflateStream_;
+  }
+#ifdef HAVE_ZSTD
+  ZSTD_freeCCtx(zstdCCtx_);
+  ZSTD_freeDCtx(zstdDCtx_);
+#endif
+}
+
+bool THeaderTransport::isTransformSupported(uint16_t transId) {
+  switch (transId) {
+  case ZLIB_TRANSFORM:
+    return true;
+#ifdef HAVE_LZ4
+  case LZ4_TRANSFORM:
+    return true;
+#endif
+#ifdef HAVE_ZSTD
+  case ZSTD_TRANSFORM:
+    return true;
+#endif
+  default:
+    return false;
+  }
+}
+
+void THeaderTransport::setZstdCompressionLevel(int level) {
+#ifdef HAVE_ZSTD
+  if (level < ZSTD_minCLevel() || level > ZSTD_maxCLevel()) {
+    throw std::invalid_argument("zstd compression level is out of range");
+  }
+#endif
+  zstdLevel_ = level;
+}
+
+void THeaderTransport::setZlibCompressionLevel(int level) {
+  if (level < Z_DEFAULT_COMPRESSION || level > Z_BEST_COMPRESSION) {
+    throw std::invalid_argument("zlib compression level must be between -1 and 9");
+  }
+  if (level != zlibLevel_ && deflateStream_ != NULL) {
+    // Recreated with the new level on the next frame
+    deflateEnd(deflateStream_);
+    delete deflateStream_;
+    deflateStream_ = NULL;
+  }
+  zlibLevel_ = level;
+}
+
+/**
+ * Returns stream ready for a new frame, creating it the first time.
+ */
+static z_stream* resetInflateStream(z_stream*& stream) {
+  if (stream != NULL) {
+    if (inflateReset(stream) != Z_OK) {
+      throw TApplicationException(TApplicationException::MISSING_RESULT,
+                                  "Error while zlib inflateReset");
+    }
+    return stream;
+  }
+
+  z_stream* created = new z_stream;
+  // Setting these to 0 means use the default free/alloc functions
+  created->zalloc = (alloc_func)0;
+  created->zfree = (free_func)0;
+  created->opaque = (voidpf)0;
+  created->next_in = Z_NULL;
+  created->avail_in = 0;
+  if (inflateInit(created) != Z_OK) {
+    delete created;
+    throw TApplicationException(TApplicationException::MISSING_RESULT,
+                                "Error while zlib inflateInit");
+  }
+  stream = created;
+  return stream;
+}
+
+static z_stream* resetDeflateStream(z_stream*& stream, int level) {
+  if (stream != NULL) {
+    if (deflateReset(stream) != Z_OK) {
+      throw TTransportException(TTransportException::CORRUPTED_DATA,
+                                "Error while zlib deflateReset");
+    }
+    return stream;
+  }
+
+  z_stream* created = new z_stream;
+  created->zalloc = (alloc_func)0;
+  created->zfree = (free_func)0;
+  created->opaque = (voidpf)0;
+  if (deflateInit(created, level) != Z_OK) {
+    delete created;
+    throw TTransportException(TTransportException::CORRUPTED_DATA,
+                              "Error while zlib deflateInit");
+  }
+  stream = created;
+  return stream;
+}
+
 uint32_t THeaderTransport::readSlow(uint8_t* buf, uint32_t len) {
   if (clientType == THRIFT_UNFRAMED_BINARY || clientType == THRIFT_UNFRAMED_COMPACT) {
     return transport_->read(buf, len);
@@ -256,52 +398,73 @@ void THeaderTransport::readHeaderFormat(uint16_t headerSize, uint32_t sz) {
 }
 
 void THeaderTransport::untransform(uint8_t* ptr, uint32_t sz) {
-  // Update the transform buffer size if needed
-  resizeTransformBuffer();
-
   for (vector<uint16_t>::const_iterator it = readTrans_.begin(); it != readTrans_.end(); ++it) {
     const uint16_t transId = *it;
+    uint32_t outSize;
 
     if (transId == ZLIB_TRANSFORM) {
-      z_stream stream;
-      int err;
-
-      stream.next_in = ptr;
-      stream.avail_in = sz;
-
-      // Setting these to 0 means use the default free/alloc functions
-      stream.zalloc = (alloc_func)0;
-      stream.zfree = (free_func)0;
-      stream.opaque = (voidpf)0;
-      err = inflateInit(&stream);
-      if (err != Z_OK) {
-        throw TApplicationException(TApplicationException::MISSING_RESULT,
-                                    "Error while zlib deflateInit");
-      }
-      stream.next_out = tBuf_.get();
-      stream.avail_out = tBufSize_;
-      err = inflate(&stream, Z_FINISH);
-      if (err != Z_STREAM_END || stream.avail_out == 0) {
-        throw TApplicationException(TApplicationException::MISSING_RESULT,
-                                    "Error while zlib deflate");
-      }
-      sz = stream.total_out;
-
-      err = inflateEnd(&stream);
-      if (err != Z_OK) {
-        throw TApplicationException(TApplicationException::MISSING_RESULT,
-                                    "Error while zlib deflateEnd");
+      z_stream* stream = resetInflateStream(inflateStream_);
+      stream->next_in = ptr;
+      stream->avail_in = sz;
+
+      // Start with room for a typical ratio and double it until it fits
+      uint32_t guess = sz < maxUncompressedSize_ / 4 ? sz * 4 : maxUncompressedSize_;
+      ensureUntransformBuffer(std::max(guess, static_cast<uint32_t>(DEFAULT_BUFFER_SIZE)), 0);
+      for (;;) {
+        // Room for one byte past the limit is enough to tell it is exceeded
+        uint32_t room = std::min(uBufSize_, maxUncompressedSize_ + 1);
+        stream->next_out = uBuf_.get() + stream->total_out;
+        stream->avail_out = room - static_cast<uint32_t>(stream->total_out);
+        int err = inflate(stream, Z_FINISH);
+        if (stream->total_out > maxUncompressedSize_) {
+          throw TTransportException(TTransportException::CORRUPTED_DATA,
+                                    "Header transport frame decompresses too large");
+        }
+        if (err == Z_STREAM_END) {
+          break;
+        }
+        if ((err != Z_OK && err != Z_BUF_ERROR) || stream->avail_out != 0) {
+          throw TApplicationException(TApplicationException::MISSING_RESULT,
+                                      "Error while zlib inflate");
+        }
+        ensureUntransformBuffer(std::min(uBufSize_ * 2, maxUncompressedSize_ + 1),
+                                static_cast<uint32_t>(stream->total_out));
       }
-
-      memcpy(ptr, tBuf_.get(), sz);
+      outSize = static_cast<uint32_t>(stream->total_out);
+    } else if (transId == LZ4_TRANSFORM) {
+      outSize = uncompressLz4(ptr, sz);
+    } else if (transId == ZSTD_TRANSFORM) {
+      outSize = uncompressZstd(ptr, sz);
     } else {
       throw TApplicationException(TApplicationException::MISSING_RESULT, "Unknown transform");
     }
+
+    // The result becomes the read buffer, and the compressed frame's
+    // buffer is kept for the next frame
+    rBuf_.swap(uBuf_);
+    std::swap(rBufSize_, uBufSize_);
+    ptr = rBuf_.get();
+    sz = outSize;
   }
 
   setReadBuffer(ptr, sz);
 }
 
+/**
+ * Grows the untransform buffer to at least sz bytes, preserving the first
+ * keep bytes.
+ */
+void THeaderTransport::ensureUntransformBuffer(uint32_t sz, uint32_t keep) {
+  if (uBufSize_ < sz) {
+    uint8_t* new_buf = new uint8_t[sz];
+    if (keep > 0) {
+      memcpy(new_buf, uBuf_.get(), keep);
+    }
+    uBuf_.reset(new_buf);
+    uBufSize_ = sz;
+  }
+}
+
 /**
  * We may have updated the wBuf size, update the tBuf size to match.
  * Should be called in transform.
@@ -318,54 +481,203 @@ void THeaderTransport::resizeTransformBuffer(uint32_t additionalSize) {
   }
 }
 
+void THeaderTransport::ensureTransformBuffer(uint32_t sz) {
+  if (tBufSize_ < sz) {
+    tBuf_.reset(new uint8_t[sz]);
+    tBufSize_ = sz;
+  }
+}
+
 void THeaderTransport::transform(uint8_t* ptr, uint32_t sz) {
   // Update the transform buffer size if needed
   resizeTransformBuffer();
 
+  frameTrans_.clear();
   for (vector<uint16_t>::const_iterator it = writeTrans_.begin(); it != writeTrans_.end(); ++it) {
     const uint16_t transId = *it;
+    uint32_t outSize;
+
+    if (sz < minCompressBytes_) {
+      // Not worth it for this frame, the header leaves it out
+      continue;
+    }
 
     if (transId == ZLIB_TRANSFORM) {
-      z_stream stream;
-      int err;
+      z_stream* stream = resetDeflateStream(deflateStream_, zlibLevel_);
+      int err = Z_OK;
 
-      stream.next_in = ptr;
-      stream.avail_in = sz;
+      stream->next_in = ptr;
+      stream->avail_in = sz;
 
-      stream.zalloc = (alloc_func)0;
-      stream.zfree = (free_func)0;
-      stream.opaque = (voidpf)0;
-      err = deflateInit(&stream, Z_DEFAULT_COMPRESSION);
-      if (err != Z_OK) {
-        throw TTransportException(TTransportException::CORRUPTED_DATA,
-                                  "Error while zlib deflateInit");
-      }
       uint32_t tbuf_size = 0;
       while (err == Z_OK) {
         resizeTransformBuffer(tbuf_size);
 
-        stream.next_out = tBuf_.get();
-        stream.avail_out = tBufSize_;
-        err = deflate(&stream, Z_FINISH);
+        stream->next_out = tBuf_.get();
+        stream->avail_out = tBufSize_;
+        err = deflate(stream, Z_FINISH);
         tbuf_size += DEFAULT_BUFFER_SIZE;
       }
-      sz = stream.total_out;
-
-      err = deflateEnd(&stream);
-      if (err != Z_OK) {
+      if (err != Z_STREAM_END) {
         throw TTransportException(TTransportException::CORRUPTED_DATA,
-                                  "Error while zlib deflateEnd");
+                                  "Error while zlib deflate");
       }
-
-      memcpy(ptr, tBuf_.get(), sz);
+      outSize = stream->total_out;
+    } else if (transId == LZ4_TRANSFORM) {
+      outSize = compressLz4(ptr, sz);
+    } else if (transId == ZSTD_TRANSFORM) {
+      outSize = compressZstd(ptr, sz);
     } else {
       throw TTransportException(TTransportException::CORRUPTED_DATA, "Unknown transform");
     }
+
+    if (outSize >= sz) {
+      // Did not shrink, so this frame goes out as it is
+      continue;
+    }
+    memcpy(ptr, tBuf_.get(), outSize);
+    sz = outSize;
+    frameTrans_.push_back(transId);
   }
 
   wBase_ = wBuf_.get() + sz;
 }
 
+/**
+ * LZ4 blocks do not record their size, so the frame starts with the
+ * uncompressed size as a big endian i32.
+ */
+uint32_t THeaderTransport::compressLz4(const uint8_t* ptr, uint32_t sz) {
+#ifdef HAVE_LZ4
+  if (!lz4State_) {
+    lz4State_.reset(new char[LZ4_sizeofState()]);
+  }
+  int bound = LZ4_compressBound(static_cast<int>(sz));
+  ensureTransformBuffer(static_cast<uint32_t>(bound) + 4);
+
+  uint32_t szN = htonl(sz);
+  memcpy(tBuf_.get(), &szN, sizeof(szN));
+  int written = LZ4_compress_fast_extState(lz4State_.get(),
+                                           reinterpret_cast<const char*>(ptr),
+                                           reinterpret_cast<char*>(tBuf_.get() + 4),
+                                           static_cast<int>(sz),
+                                           bound,
+                                           1);
+  if (written <= 0) {
+    throw TTransportException(TTransportException::CORRUPTED_DATA, "Error while LZ4 compress");
+  }
+  return static_cast<uint32_t>(written) + 4;
+#else
+  (void)ptr;
+  (void)sz;
+  throw TTransportException(TTransportException::CORRUPTED_DATA, "Built without LZ4 support");
+#endif
+}
+
+uint32_t THeaderTransport::uncompressLz4(const uint8_t* ptr, uint32_t sz) {
+#ifdef HAVE_LZ4
+  uint32_t szN;
+  if (sz < sizeof(szN)) {
+    throw TApplicationException(TApplicationException::MISSING_RESULT, "LZ4 frame is too short");
+  }
+  memcpy(&szN, ptr, sizeof(szN));
+  uint32_t outSize = ntohl(szN);
+  if (outSize > maxUncompressedSize_) {
+    throw TTransportException(TTransportException::CORRUPTED_DATA,
+                              "Header transport frame decompresses too large");
+  }
+  ensureUntransformBuffer(outSize, 0);
+
+  int read = LZ4_decompress_safe(reinterpret_cast<const char*>(ptr + sizeof(szN)),
+                                 reinterpret_cast<char*>(uBuf_.get()),
+                                 static_cast<int>(sz - sizeof(szN)),
+                                 static_cast<int>(outSize));
+  if (read < 0 || static_cast<uint32_t>(read) != outSize) {
+    throw TApplicationException(TApplicationException::MISSING_RESULT,
+                                "Error while LZ4 decompress");
+  }
+  return outSize;
+#else
+  (void)ptr;
+  (void)sz;
+  throw TApplicationException(TApplicationException::MISSING_RESULT, "Built without LZ4 support");
+#endif
+}
+
+uint32_t THeaderTransport::compressZstd(const uint8_t* ptr, uint32_t sz) {
+#ifdef HAVE_ZSTD
+  if (zstdCCtx_ == NULL) {
+    zstdCCtx_ = ZSTD_createCCtx();
+    if (zstdCCtx_ == NULL) {
+      throw TTransportException(TTransportException::CORRUPTED_DATA,
+                                "Error while zstd createCCtx");
+    }
+  }
+  ensureTransformBuffer(static_cast<uint32_t>(ZSTD_compressBound(sz)));
+
+  size_t written;
+  if (zstdDict_) {
+    written = ZSTD_compress_usingCDict(zstdCCtx_, tBuf_.get(), tBufSize_, ptr, sz, zstdDict_->cdict_);
+  } else {
+    written = ZSTD_compressCCtx(zstdCCtx_, tBuf_.get(), tBufSize_, ptr, sz, zstdLevel_);
+  }
+  if (ZSTD_isError(written)) {
+    throw TTransportException(TTransportException::CORRUPTED_DATA, ZSTD_getErrorName(written));
+  }
+  return static_cast<uint32_t>(written);
+#else
+  (void)ptr;
+  (void)sz;
+  throw TTransportException(TTransportException::CORRUPTED_DATA, "Built without zstd support");
+#endif
+}
+
+uint32_t THeaderTransport::uncompressZstd(const uint8_t* ptr, uint32_t sz) {
+#ifdef HAVE_ZSTD
+  unsigned long long outSize = ZSTD_getFrameContentSize(ptr, sz);
+  if (outSize == ZSTD_CONTENTSIZE_UNKNOWN || outSize == ZSTD_CONTENTSIZE_ERROR) {
+    throw TApplicationException(TApplicationException::MISSING_RESULT,
+                                "zstd frame has no content size");
+  }
+  if (outSize > maxUncompressedSize_) {
+    throw TTransportException(TTransportException::CORRUPTED_DATA,
+                              "Header transport frame decompresses too large");
+  }
+  ensureUntransformBuffer(static_cast<uint32_t>(outSize), 0);
+
+  if (zstdDCtx_ == NULL) {
+    zstdDCtx_ = ZSTD_createDCtx();
+    if (zstdDCtx_ == NULL) {
+      throw TApplicationException(TApplicationException::MISSING_RESULT,
+                                  "Error while zstd createDCtx");
+    }
+  }
+
+  // Frames made with a dictionary name it, except for raw content
+  // dictionaries, which have no id
+  uint32_t dictId = ZSTD_getDictID_fromFrame(ptr, sz);
+  size_t read;
+  if (zstdDict_ && dictId == zstdDict_->id_) {
+    read = ZSTD_decompress_usingDDict(zstdDCtx_, uBuf_.get(), outSize, ptr, sz, zstdDict_->ddict_);
+  } else if (dictId == 0) {
+    read = ZSTD_decompressDCtx(zstdDCtx_, uBuf_.get(), outSize, ptr, sz);
+  } else {
+    throw TApplicationException(TApplicationException::MISSING_RESULT,
+                                "zstd frame needs a dictionary that is not loaded");
+  }
+  if (ZSTD_isError(read) || read != outSize) {
+    throw TApplicationException(TApplicationException::MISSING_RESULT,
+                                "Error while zstd decompress");
+  }
+  return static_cast<uint32_t>(outSize);
+#else
+  (void)ptr;
+  (void)sz;
+  throw TApplicationException(TApplicationException::MISSING_RESULT,
+                              "Built without zstd support");
+#endif
+}
+
 void THeaderTransport::resetProtocol() {
   // Set to anything except HTTP type so we don't flush again
   clientType = THRIFT_HEADER_CLIENT_TYPE;
@@ -431,7 +743,7 @@ void THeaderTransport::flush() {
   if (clientType == THRIFT_HEADER_CLIENT_TYPE) {
     // header size will need to be updated at the end because of varints.
     // Make it big enough here for max varint size, plus 4 for padding.
-    int headerSize = (2 + getNumTransforms()) * THRIFT_MAX_VARINT32_BYTES + 4;
+    int headerSize = (2 + static_cast<int>(frameTrans_.size())) * THRIFT_MAX_VARINT32_BYTES + 4;
     // add approximate size of info headers
     headerSize += getMaxWriteHeadersSize();
 
@@ -469,10 +781,10 @@ void THeaderTransport::flush() {
     headerStart = pkt;
 
     pkt += writeVarint32(protoId, pkt);
-    pkt += writeVarint32(getNumTransforms(), pkt);
+    pkt += writeVarint32(static_cast<int32_t>(frameTrans_.size()), pkt);
 
     // For now, each transform is only the ID, no following data.
-    for (vector<uint16_t>::const_iterator it = writeTrans_.begin(); it != writeTrans_.end(); ++it) {
+    for (vector<uint16_t>::const_iterator it = frameTrans_.begin(); it != frameTrans_.end(); ++it) {
       pkt += writeVarint32(*it, pkt);
     }
 
@@ -20,12 +20,14 @@
 #ifndef THRIFT_TRANSPORT_THEADERTRANSPORT_H_
 #define THRIFT_TRANSPORT_THEADERTRANSPORT_H_ 1
 
+#include <algorithm>
 #include <bitset>
 #include <vector>
 #include <stdexcept>
 #include <string>
 #include <map>
 
+#include <boost/noncopyable.hpp>
 #include <boost/scoped_array.hpp>
 #include <boost/shared_ptr.hpp>
 
@@ -34,6 +36,12 @@
 #include <thrift/transport/TTransport.h>
 #include <thrift/transport/TVirtualTransport.h>
 
+struct z_stream_s;
+struct ZSTD_CCtx_s;
+struct ZSTD_DCtx_s;
+struct ZSTD_CDict_s;
+struct ZSTD_DDict_s;
+
 enum CLIENT_TYPE {
   THRIFT_HEADER_CLIENT_TYPE = 0,
   THRIFT_FRAMED_BINARY = 1,
@@ -49,6 +57,32 @@ namespace transport {
 
 using apache::thrift::protocol::T_COMPACT_PROTOCOL;
 
+/**
+ * A zstd dictionary for ZSTD_TRANSFORM, loaded once and shared by any
+ * number of transports.  Dictionaries trained on typical messages make
+ * small frames compress far better.  Both ends must load the same one.
+ */
+class THeaderZstdDictionary : boost::noncopyable {
+public:
+  /**
+   * @param dictionary contents of a dictionary file, as made by
+   *        "zstd --train".
+   * @param level the compression level frames are compressed with.
+   */
+  explicit THeaderZstdDictionary(const std::string& dictionary, int level = 3);
+  ~THeaderZstdDictionary();
+
+  /// Id recorded in the frames compressed with this dictionary
+  uint32_t getId() const { return id_; }
+
+private:
+  struct ZSTD_CDict_s* cdict_;
+  struct ZSTD_DDict_s* ddict_;
+  uint32_t id_;
+
+  friend class THeaderTransport;
+};
+
 /**
  * Header transport. All writes go into an in-memory buffer until flush is
  * called, at which point the transport writes the length of the entire
@@ -66,6 +100,9 @@ class THeaderTransport : public TVirtualTransport<THeaderTransport, TFramedTrans
 public:
   static const int DEFAULT_BUFFER_SIZE = 512u;
   static const int THRIFT_MAX_VARINT32_BYTES = 5;
+  static const int DEFAULT_ZLIB_LEVEL = -1; // Z_DEFAULT_COMPRESSION
+  static const int DEFAULT_ZSTD_LEVEL = 3;  // ZSTD_CLEVEL_DEFAULT
+  static const uint32_t DEFAULT_MAX_UNCOMPRESSED_SIZE = 256 * 1024 * 1024;
 
   /// Use default buffer sizes.
   explicit THeaderTransport(const boost::shared_ptr<TTransport>& transport)
@@ -76,7 +113,17 @@ public:
       seqId(0),
       flags(0),
       tBufSize_(0),
-      tBuf_(NULL) {
+      tBuf_(NULL),
+      uBufSize_(0),
+      uBuf_(),
+      zlibLevel_(DEFAULT_ZLIB_LEVEL),
+      minCompressBytes_(0),
+      maxUncompressedSize_(DEFAULT_MAX_UNCOMPRESSED_SIZE),
+      inflateStream_(NULL),
+      deflateStream_(NULL),
+      zstdLevel_(DEFAULT_ZSTD_LEVEL),
+      zstdCCtx_(NULL),
+      zstdDCtx_(NULL) {
     if (!transport_) throw std::invalid_argument("transport is empty");
     initBuffers();
   }
@@ -90,15 +137,43 @@ public:
       seqId(0),
       flags(0),
       tBufSize_(0),
-      tBuf_(NULL) {
+      tBuf_(NULL),
+      uBufSize_(0),
+      uBuf_(),
+      zlibLevel_(DEFAULT_ZLIB_LEVEL),
+      minCompressBytes_(0),
+      maxUncompressedSize_(DEFAULT_MAX_UNCOMPRESSED_SIZE),
+      inflateStream_(NULL),
+      deflateStream_(NULL),
+      zstdLevel_(DEFAULT_ZSTD_LEVEL),
+      zstdCCtx_(NULL),
+      zstdDCtx_(NULL) {
     if (!transport_) throw std::invalid_argument("inTransport is empty");
     if (!outTransport_) throw std::invalid_argument("outTransport is empty");
     initBuffers();
   }
 
+  virtual ~THeaderTransport();
+
   virtual uint32_t readSlow(uint8_t* buf, uint32_t len);
   virtual void flush();
 
+  /**
+   * Transforms operate on the whole frame buffer, so payloads are always
+   * copied rather than written by reference.
+   */
+  void writeRef(const uint8_t* buf, uint32_t len) { write(buf, len); }
+
+  /**
+   * Frames are decoded in place, so their buffers cannot be pinned, and
+   * views read through a header transport always own a copy.
+   */
+  const uint8_t* borrowPinned(uint32_t len, boost::shared_array<uint8_t>& pin) {
+    (void)len;
+    (void)pin;
+    return NULL;
+  }
+
   void resizeTransformBuffer(uint32_t additionalSize = 0);
 
   uint16_t getProtocolId() const;
@@ -141,6 +216,55 @@ public:
 
   void setTransform(uint16_t transId) { writeTrans_.push_back(transId); }
 
+  /**
+   * Set the level ZLIB_TRANSFORM compresses with, from 0 (store only,
+   * fastest) to 9 (smallest), or -1 for zlib's default.
+   */
+  void setZlibCompressionLevel(int level);
+  int getZlibCompressionLevel() const { return zlibLevel_; }
+
+  /**
+   * Set the level ZSTD_TRANSFORM compresses with when no dictionary is
+   * set, from ZSTD_minCLevel() (fastest) to ZSTD_maxCLevel() (smallest).
+   */
+  void setZstdCompressionLevel(int level);
+  int getZstdCompressionLevel() const { return zstdLevel_; }
+
+  /**
+   * Compress ZSTD_TRANSFORM frames with a shared dictionary.  Frames
+   * compressed with it can only be read by a transport that has the same
+   * dictionary; frames without a dictionary are always readable.
+   */
+  void setZstdDictionary(const boost::shared_ptr<THeaderZstdDictionary>& dictionary) {
+    zstdDict_ = dictionary;
+  }
+
+  /**
+   * Frames with fewer payload bytes than this are sent uncompressed,
+   * since compressing them costs more than it saves.  The default of 0
+   * compresses every frame.  Frames that do not shrink are always sent
+   * uncompressed.
+   */
+  void setMinCompressBytes(uint32_t minBytes) { minCompressBytes_ = minBytes; }
+  uint32_t getMinCompressBytes() const { return minCompressBytes_; }
+
+  /**
+   * Frames that decompress to more than this many bytes are rejected, so a
+   * small compressed frame cannot make the transport allocate up to
+   * MAX_FRAME_SIZE.  The default matches the frame size limit of
+   * TFramedTransport and TNonblockingServer.
+   */
+  void setMaxUncompressedSize(uint32_t maxSize) {
+    maxUncompressedSize_ = std::min(maxSize, MAX_FRAME_SIZE);
+  }
+  uint32_t getMaxUncompressedSize() const { return maxUncompressedSize_; }
+
+  /**
+   * Whether this build can apply a transform.  LZ4_TRANSFORM and
+   * ZSTD_TRANSFORM need the library to have been built with lz4 and zstd.
+   */
+  static bool isTransformSupported(uint16_t transId);
+
   // Info headers
 
   typedef std::map<std::string, std::string> StringToStringMap;
@@ -159,8 +283,11 @@ public:
   int32_t getSequenceNumber() const { return seqId; }
   void setSequenceNumber(int32_t seqId) { this->seqId = seqId; }
 
+  // 0x02 to 0x04 are taken by other header implementations
   enum TRANSFORMS {
     ZLIB_TRANSFORM = 0x01,
+    ZSTD_TRANSFORM = 0x05,
+    LZ4_TRANSFORM = 0x06,
   };
 
 protected:
@@ -173,6 +300,8 @@ protected:
   virtual bool readFrame();
 
   void ensureReadBuffer(uint32_t sz);
+  void ensureTransformBuffer(uint32_t sz);
+  void ensureUntransformBuffer(uint32_t sz, uint32_t keep);
   uint32_t getWriteBytes();
 
   void initBuffers() {
@@ -196,6 +325,8 @@ protected:
 
   std::vector<uint16_t> readTrans_;
   std::vector<uint16_t> writeTrans_;
+  // Transforms applied to the frame being flushed
+  std::vector<uint16_t> frameTrans_;
 
   // Map to use for headers
   StringToStringMap readHeaders_;
@@ -218,6 +349,35 @@ protected:
   uint32_t tBufSize_;
   boost::scoped_array<uint8_t> tBuf_;
 
+  // Frames are decompressed into this buffer, which then trades places
+  // with the read buffer
+  uint32_t uBufSize_;
+  boost::shared_array<uint8_t> uBuf_;
+
+  // ZLIB_TRANSFORM settings; the streams are created on first use and
+  // reset for every frame
+  int zlibLevel_;
+  uint32_t minCompressBytes_;
+  uint32_t maxUncompressedSize_;
+  struct z_stream_s* inflateStream_;
+  struct z_stream_s* deflateStream_;
+
+  // LZ4_TRANSFORM and ZSTD_TRANSFORM state, also kept between frames
+  boost::scoped_array<char> lz4State_;
+  int zstdLevel_;
+  struct ZSTD_CCtx_s* zstdCCtx_;
+  struct ZSTD_DCtx_s* zstdDCtx_;
+  boost::shared_ptr<THeaderZstdDictionary> zstdDict_;
+
+  /**
+   * Compress a frame into tBuf_, or decompress one into uBuf_, growing
+   * the buffer as needed.  Return the size of the result.
+   */
+  uint32_t compressLz4(const uint8_t* ptr, uint32_t sz);
+  uint32_t uncompressLz4(const uint8_t* ptr, uint32_t sz);
+  uint32_t compressZstd(const uint8_t* ptr, uint32_t sz);
+  uint32_t uncompressZstd(const uint8_t* ptr, uint32_t sz);
+
   void readString(uint8_t*& ptr, /* out */ std::string& str, uint8_t const* headerBoundary);
 
   void writeString(uint8_t*& ptr, const std::string& str);
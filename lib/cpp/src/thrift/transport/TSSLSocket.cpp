@@ -39,6 +39,13 @@
 #include <boost/lexical_cast.hpp>
 #include <boost/shared_array.hpp>
 #include <openssl/err.h>
+#include <openssl/evp.h>
+#if (OPENSSL_VERSION_NUMBER >= 0x30000000L)
+#include <openssl/core_names.h>
+#include <openssl/params.h>
+#else
+#include <openssl/hmac.h>
+#endif
 #include <openssl/rand.h>
 #include <openssl/ssl.h>
 #include <openssl/x509v3.h>
@@ -108,7 +115,7 @@ void initializeOpenSSL() {
   SSL_library_init();
   SSL_load_error_strings();
   // static locking
-  mutexes = boost::shared_array<Mutex>(new Mutex[ ::CRYPTO_num_locks()]);
+  mutexes = boost::shared_array<Mutex>(new Mutex[CRYPTO_num_locks()]);
   if (mutexes == NULL) {
     throw TTransportException(TTransportException::INTERNAL_ERROR,
                               "initializeOpenSSL() failed, "
@@ -148,7 +155,8 @@ static bool matchName(const char* host, const char* pattern, int size);
 static char uppercase(char c);
 
 // SSLContext implementation
-SSLContext::SSLContext(const SSLProtocol& protocol) {
+SSLContext::SSLContext(const SSLProtocol& protocol)
+  : sessionLimit_(SSL_SESSION_CACHE_MAX_SIZE_DEFAULT), sessionHits_(0), sessionMisses_(0) {
   if (protocol == SSLTLS) {
     ctx_ = SSL_CTX_new(SSLv23_method());
 #ifndef OPENSSL_NO_SSL3
@@ -179,9 +187,20 @@ SSLContext::SSLContext(const SSLProtocol& protocol) {
       SSL_CTX_set_options(ctx_, SSL_OP_NO_SSLv2);
       SSL_CTX_set_options(ctx_, SSL_OP_NO_SSLv3);   // THRIFT-3164
   }
+
+  // Servers only resume sessions of the same context, which has to be named
+  // for that once peers are verified
+  SSL_CTX_set_session_id_context(ctx_,
+                                 reinterpret_cast<const unsigned char*>("thrift"),
+                                 6);
+  SSL_CTX_set_app_data(ctx_, this);
+  SSL_CTX_sess_set_new_cb(ctx_, newSessionCallback);
 }
 
 SSLContext::~SSLContext() {
+  for (SessionMap::iterator it = sessions_.begin(); it != sessions_.end(); ++it) {
+    SSL_SESSION_free(it->second.session);
+  }
   if (ctx_ != NULL) {
     SSL_CTX_free(ctx_);
     ctx_ = NULL;
@@ -198,30 +217,193 @@ SSL* SSLContext::createSSL() {
   return ssl;
 }
 
+void SSLContext::resumeSession(SSL* ssl, TSSLSocket* socket, const string& peer) {
+  // Sessions the peer hands out are kept by newSessionCallback()
+  SSL_set_app_data(ssl, socket);
+
+  SSL_SESSION* session = NULL;
+  {
+    Guard guard(mutex_);
+    SessionMap::iterator it = sessions_.find(peer);
+    if (it == sessions_.end()) {
+      return;
+    }
+    session = it->second.session;
+    if (SSL_SESSION_get_time(session) + SSL_SESSION_get_timeout(session) < time(NULL)) {
+      removeSession(it);
+      return;
+    }
+    sessionOrder_.splice(sessionOrder_.end(), sessionOrder_, it->second.order);
+    // Keep it alive while it is being resumed
+#if (OPENSSL_VERSION_NUMBER < 0x10100000L)
+    CRYPTO_add(&session->references, 1, CRYPTO_LOCK_SSL_SESSION);
+#else
+    SSL_SESSION_up_ref(session);
+#endif
+  }
+  SSL_set_session(ssl, session);
+  SSL_SESSION_free(session);
+}
+
+void SSLContext::setClientSessionLimit(size_t limit) {
+  Guard guard(mutex_);
+  sessionLimit_ = limit;
+  while (sessions_.size() > sessionLimit_) {
+    removeSession(sessions_.find(sessionOrder_.front()));
+  }
+}
+
+void SSLContext::removeSession(SessionMap::iterator it) {
+  SSL_SESSION_free(it->second.session);
+  sessionOrder_.erase(it->second.order);
+  sessions_.erase(it);
+}
+
+int SSLContext::newSessionCallback(SSL* ssl, SSL_SESSION* session) {
+  TSSLSocket* socket = static_cast<TSSLSocket*>(SSL_get_app_data(ssl));
+  if (socket == NULL) {
+    // Server sessions stay in OpenSSL's cache
+    return 0;
+  }
+  SSLContext* context = static_cast<SSLContext*>(SSL_CTX_get_app_data(SSL_get_SSL_CTX(ssl)));
+  string peer = socket->getHost() + ":" + boost::lexical_cast<string>(socket->getPort());
+
+  Guard guard(context->mutex_);
+  SessionMap::iterator it = context->sessions_.find(peer);
+  if (it != context->sessions_.end()) {
+    SSL_SESSION_free(it->second.session);
+    it->second.session = session;
+    context->sessionOrder_.splice(context->sessionOrder_.end(),
+                                  context->sessionOrder_,
+                                  it->second.order);
+    return 1;
+  }
+  if (context->sessionLimit_ == 0) {
+    return 0;
+  }
+  if (context->sessions_.size() >= context->sessionLimit_) {
+    // Make room by forgetting the peer that was least recently connected to
+    context->removeSession(context->sessions_.find(context->sessionOrder_.front()));
+  }
+  ClientSession& entry = context->sessions_[peer];
+  entry.session = session;
+  entry.order = context->sessionOrder_.insert(context->sessionOrder_.end(), peer);
+  return 1;
+}
+
+void SSLContext::rotateTicketKeys() {
+  TicketKey key;
+  if (RAND_bytes(key.name, sizeof(key.name)) != 1
+      || RAND_bytes(key.hmacKey, sizeof(key.hmacKey)) != 1
+      || RAND_bytes(key.aesKey, sizeof(key.aesKey)) != 1) {
+    string errors;
+    buildErrors(errors);
+    throw TSSLException("RAND_bytes: " + errors);
+  }
+
+  Guard guard(mutex_);
+  if (ticketKeys_.empty()) {
+#if (OPENSSL_VERSION_NUMBER >= 0x30000000L)
+    SSL_CTX_set_tlsext_ticket_key_evp_cb(ctx_, ticketKeyCallback);
+#else
+    SSL_CTX_set_tlsext_ticket_key_cb(ctx_, ticketKeyCallback);
+#endif
+  }
+  // The previous two keys still decrypt tickets
+  ticketKeys_.insert(ticketKeys_.begin(), key);
+  if (ticketKeys_.size() > 3) {
+    ticketKeys_.pop_back();
+  }
+}
+
+// Keys the ticket MAC with HMAC-SHA256; HMAC_CTX is deprecated from
+// OpenSSL 3.0 on, which hands the callback an EVP_MAC_CTX instead
+#if (OPENSSL_VERSION_NUMBER >= 0x30000000L)
+static bool initTicketMac(EVP_MAC_CTX* mac, const unsigned char* key, size_t size) {
+  char digest[] = "SHA256";
+  OSSL_PARAM params[3];
+  params[0] = OSSL_PARAM_construct_octet_string(OSSL_MAC_PARAM_KEY,
+                                                const_cast<unsigned char*>(key),
+                                                size);
+  params[1] = OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, digest, 0);
+  params[2] = OSSL_PARAM_construct_end();
+  return EVP_MAC_CTX_set_params(mac, params) == 1;
+}
+#else
+static bool initTicketMac(HMAC_CTX* hmac, const unsigned char* key, size_t size) {
+  return HMAC_Init_ex(hmac, key, static_cast<int>(size), EVP_sha256(), NULL) == 1;
+}
+#endif
+
+int SSLContext::ticketKeyCallback(SSL* ssl,
+                                  unsigned char* name,
+                                  unsigned char* iv,
+                                  EVP_CIPHER_CTX* cipher,
+                                  TicketMacCtx* mac,
+                                  int encrypt) {
+  SSLContext* context = static_cast<SSLContext*>(SSL_CTX_get_app_data(SSL_get_SSL_CTX(ssl)));
+  Guard guard(context->mutex_);
+  if (encrypt) {
+    const TicketKey& key = context->ticketKeys_.front();
+    if (RAND_bytes(iv, EVP_MAX_IV_LENGTH) != 1) {
+      return -1;
+    }
+    memcpy(name, key.name, sizeof(key.name));
+    if (EVP_EncryptInit_ex(cipher, EVP_aes_256_cbc(), NULL, key.aesKey, iv) != 1
+        || !initTicketMac(mac, key.hmacKey, sizeof(key.hmacKey))) {
+      return -1;
+    }
+    return 1;
+  }
+
+  for (size_t i = 0; i < context->ticketKeys_.size(); ++i) {
+    const TicketKey& key = context->ticketKeys_[i];
+    if (memcmp(name, key.name, sizeof(key.name)) != 0) {
+      continue;
+    }
+    if (!initTicketMac(mac, key.hmacKey, sizeof(key.hmacKey))
+        || EVP_DecryptInit_ex(cipher, EVP_aes_256_cbc(), NULL, key.aesKey, iv) != 1) {
+      return -1;
+    }
+    // A ticket from an older key gets replaced
+    return i == 0 ? 1 : 2;
+  }
+  // Unknown or retired key: negotiate a new session
+  return 0;
+}
+
+void SSLContext::countHandshake(bool resumed) {
+  if (resumed) {
+    sessionHits_.fetch_add(1, boost::memory_order_relaxed);
+  } else {
+    sessionMisses_.fetch_add(1, boost::memory_order_relaxed);
+  }
+}
+
 // TSSLSocket implementation
 TSSLSocket::TSSLSocket(boost::shared_ptr<SSLContext> ctx)
-  : TSocket(), server_(false), ssl_(NULL), ctx_(ctx) {
+  : TSocket(), server_(false), ssl_(NULL), nonblocking_(false), handshakeDone_(false), wantWrite_(false), ctx_(ctx) {
 }
 
 TSSLSocket::TSSLSocket(boost::shared_ptr<SSLContext> ctx, boost::shared_ptr<THRIFT_SOCKET> interruptListener)
-        : TSocket(), server_(false), ssl_(NULL), ctx_(ctx) {
+        : TSocket(), server_(false), ssl_(NULL), nonblocking_(false), handshakeDone_(false), wantWrite_(false), ctx_(ctx) {
   interruptListener_ = interruptListener;
 }
 
 TSSLSocket::TSSLSocket(boost::shared_ptr<SSLContext> ctx, THRIFT_SOCKET socket)
-  : TSocket(socket), server_(false), ssl_(NULL), ctx_(ctx) {
+  : TSocket(socket), server_(false), ssl_(NULL), nonblocking_(false), handshakeDone_(false), wantWrite_(false), ctx_(ctx) {
 }
 
 TSSLSocket::TSSLSocket(boost::shared_ptr<SSLContext> ctx, THRIFT_SOCKET socket, boost::shared_ptr<THRIFT_SOCKET> interruptListener)
-        : TSocket(socket, interruptListener), server_(false), ssl_(NULL), ctx_(ctx) {
+        : TSocket(socket, interruptListener), server_(false), ssl_(NULL), nonblocking_(false), handshakeDone_(false), wantWrite_(false), ctx_(ctx) {
 }
 
 TSSLSocket::TSSLSocket(boost::shared_ptr<SSLContext> ctx, string host, int port)
-  : TSocket(host, port), server_(false), ssl_(NULL), ctx_(ctx) {
+  : TSocket(host, port), server_(false), ssl_(NULL), nonblocking_(false), handshakeDone_(false), wantWrite_(false), ctx_(ctx) {
 }
 
 TSSLSocket::TSSLSocket(boost::shared_ptr<SSLContext> ctx, string host, int port, boost::shared_ptr<THRIFT_SOCKET> interruptListener)
-        : TSocket(host, port), server_(false), ssl_(NULL), ctx_(ctx) {
+        : TSocket(host, port), server_(false), ssl_(NULL), nonblocking_(false), handshakeDone_(false), wantWrite_(false), ctx_(ctx) {
   interruptListener_ = interruptListener;
 }
 
@@ -290,25 +472,35 @@ void TSSLSocket::close() {
   if (ssl_ != NULL) {
     int rc;
 
-    do {
-      rc = SSL_shutdown(ssl_);
-      if (rc <= 0) {
-        int errno_copy = THRIFT_GET_SOCKET_ERROR;
-        int error = SSL_get_error(ssl_, rc);
-        switch (error) {
-          case SSL_ERROR_SYSCALL:
-            if ((errno_copy != THRIFT_EINTR)
-                && (errno_copy != THRIFT_EAGAIN)) {
-              break;
-            }
-          case SSL_ERROR_WANT_READ:
-          case SSL_ERROR_WANT_WRITE:
-            waitForEvent(error == SSL_ERROR_WANT_READ);
-                rc = 2;
-          default:;// do nothing
-        }
+    if (nonblocking_) {
+      // Send close_notify if the socket takes it right away, but never wait
+      // for it or for the peer's
+      if (handshakeDone_) {
+        ERR_clear_error();
+        SSL_shutdown(ssl_);
       }
-    } while (rc == 2);
+      rc = 1;
+    } else {
+      do {
+        rc = SSL_shutdown(ssl_);
+        if (rc <= 0) {
+          int errno_copy = THRIFT_GET_SOCKET_ERROR;
+          int error = SSL_get_error(ssl_, rc);
+          switch (error) {
+            case SSL_ERROR_SYSCALL:
+              if ((errno_copy != THRIFT_EINTR)
+                  && (errno_copy != THRIFT_EAGAIN)) {
+                break;
+              }
+            case SSL_ERROR_WANT_READ:
+            case SSL_ERROR_WANT_WRITE:
+              waitForEvent(error == SSL_ERROR_WANT_READ);
+                  rc = 2;
+            default:;// do nothing
+          }
+        }
+      } while (rc == 2);
+    }
 
     if (rc < 0) {
       int errno_copy = THRIFT_GET_SOCKET_ERROR;
@@ -320,6 +512,8 @@ void TSSLSocket::close() {
     ssl_ = NULL;
     ERR_remove_state(0);
   }
+  nonblocking_ = false;
+  handshakeDone_ = false;
   TSocket::close();
 }
 
@@ -395,6 +589,15 @@ void TSSLSocket::write(const uint8_t* buf, uint32_t len) {
   }
 }
 
+#ifdef HAVE_SYS_UIO_H
+void TSSLSocket::writev(const struct iovec* iov, int iovcnt) {
+  // Records have to go through SSL_write, so there is nothing to gather.
+  for (int i = 0; i < iovcnt; ++i) {
+    write(static_cast<const uint8_t*>(iov[i].iov_base), static_cast<uint32_t>(iov[i].iov_len));
+  }
+}
+#endif
+
 void TSSLSocket::flush() {
   // Don't throw exception if not open. Thrift servers close socket twice.
   if (ssl_ == NULL) {
@@ -413,6 +616,108 @@ void TSSLSocket::flush() {
   }
 }
 
+bool TSSLSocket::handshakeNonblocking() {
+  if (handshakeDone_) {
+    return true;
+  }
+  if (!TSocket::isOpen()) {
+    throw TTransportException(TTransportException::NOT_OPEN);
+  }
+  if (ssl_ == NULL) {
+    ssl_ = ctx_->createSSL();
+    nonblocking_ = true;
+    SSL_set_fd(ssl_, static_cast<int>(socket_));
+    // A write that has to wait is retried with what is left of the buffer
+    SSL_set_mode(ssl_, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+    if (server()) {
+      SSL_set_accept_state(ssl_);
+    } else {
+      // set the SNI hostname
+      SSL_set_tlsext_host_name(ssl_, getHost().c_str());
+      if (!getHost().empty()) {
+        ctx_->resumeSession(ssl_, this, getHost() + ":" + boost::lexical_cast<string>(getPort()));
+      }
+      SSL_set_connect_state(ssl_);
+    }
+  }
+
+  ERR_clear_error();
+  int rc = SSL_do_handshake(ssl_);
+  if (rc <= 0) {
+    wouldBlock(rc, false, server() ? "SSL_accept" : "SSL_connect");
+    return false;
+  }
+  ctx_->countHandshake(SSL_session_reused(ssl_) != 0);
+  authorize();
+  handshakeDone_ = true;
+  return true;
+}
+
+int32_t TSSLSocket::readNonblocking(uint8_t* buf, uint32_t len) {
+  if (!handshakeDone_) {
+    throw TTransportException(TTransportException::NOT_OPEN, "SSL handshake not done");
+  }
+  ERR_clear_error();
+  int32_t bytes = SSL_read(ssl_, buf, len);
+  if (bytes > 0) {
+    return bytes;
+  }
+
+  // The peer closed the connection, with or without close_notify
+  int error = SSL_get_error(ssl_, bytes);
+  if (error == SSL_ERROR_ZERO_RETURN
+      || (error == SSL_ERROR_SYSCALL && bytes == 0 && ERR_peek_error() == 0)) {
+    return 0;
+  }
+#ifdef SSL_R_UNEXPECTED_EOF_WHILE_READING
+  if (error == SSL_ERROR_SSL
+      && ERR_GET_REASON(ERR_peek_error()) == SSL_R_UNEXPECTED_EOF_WHILE_READING) {
+    return 0;
+  }
+#endif
+  wouldBlock(bytes, false, "SSL_read");
+  return -1;
+}
+
+int32_t TSSLSocket::writeNonblocking(const uint8_t* buf, uint32_t len) {
+  if (!handshakeDone_) {
+    throw TTransportException(TTransportException::NOT_OPEN, "SSL handshake not done");
+  }
+  ERR_clear_error();
+  int32_t bytes = SSL_write(ssl_, buf, len);
+  if (bytes > 0) {
+    return bytes;
+  }
+  wouldBlock(bytes, true, "SSL_write");
+  return -1;
+}
+
+bool TSSLSocket::hasPendingData() {
+  return ssl_ != NULL && SSL_pending(ssl_) > 0;
+}
+
+bool TSSLSocket::wouldBlock(int rc, bool writing, const char* fname) {
+  int errno_copy = THRIFT_GET_SOCKET_ERROR;
+  int error = SSL_get_error(ssl_, rc);
+  switch (error) {
+    case SSL_ERROR_WANT_READ:
+      wantWrite_ = false;
+      return true;
+    case SSL_ERROR_WANT_WRITE:
+      wantWrite_ = true;
+      return true;
+    case SSL_ERROR_SYSCALL:
+      if ((errno_copy == THRIFT_EINTR) || (errno_copy == THRIFT_EAGAIN)) {
+        wantWrite_ = writing;
+        return true;
+      }
+    default:;// do nothing
+  }
+  string errors;
+  buildErrors(errors, errno_copy);
+  throw TSSLException(string(fname) + ": " + errors);
+}
+
 void TSSLSocket::checkHandshake() {
   if (!TSocket::isOpen()) {
     throw TTransportException(TTransportException::NOT_OPEN);
@@ -473,6 +778,9 @@ void TSSLSocket::checkHandshake() {
   } else {
     // set the SNI hostname
     SSL_set_tlsext_host_name(ssl_, getHost().c_str());
+    if (!getHost().empty()) {
+      ctx_->resumeSession(ssl_, this, getHost() + ":" + boost::lexical_cast<string>(getPort()));
+    }
     do {
       rc = SSL_connect(ssl_);
       if (rc <= 0) {
@@ -500,6 +808,7 @@ void TSSLSocket::checkHandshake() {
     buildErrors(errors, errno_copy);
     throw TSSLException(fname + ": " + errors);
   }
+  ctx_->countHandshake(SSL_session_reused(ssl_) != 0);
   authorize();
 }
 
@@ -662,7 +971,8 @@ uint64_t TSSLSocketFactory::count_ = 0;
 Mutex TSSLSocketFactory::mutex_;
 bool TSSLSocketFactory::manualOpenSSLInitialization_ = false;
 
-TSSLSocketFactory::TSSLSocketFactory(SSLProtocol protocol) : server_(false) {
+TSSLSocketFactory::TSSLSocketFactory(SSLProtocol protocol)
+  : server_(false), sessionsDisabled_(false) {
   Guard guard(mutex_);
   if (count_ == 0) {
     if (!manualOpenSSLInitialization_) {
@@ -672,6 +982,7 @@ TSSLSocketFactory::TSSLSocketFactory(SSLProtocol protocol) : server_(false) {
   }
   count_++;
   ctx_ = boost::shared_ptr<SSLContext>(new SSLContext(protocol));
+  server(false);
 }
 
 TSSLSocketFactory::~TSSLSocketFactory() {
@@ -730,6 +1041,52 @@ void TSSLSocketFactory::setup(boost::shared_ptr<TSSLSocket> ssl) {
   }
 }
 
+void TSSLSocketFactory::server(bool flag) {
+  server_ = flag;
+  setSessionCacheMode();
+}
+
+void TSSLSocketFactory::setSessionCacheMode() {
+  long mode;
+  if (sessionsDisabled_) {
+    mode = SSL_SESS_CACHE_OFF;
+  } else if (server_) {
+    mode = SSL_SESS_CACHE_SERVER;
+  } else {
+    // Clients keep sessions by peer in the SSLContext, which OpenSSL's
+    // cache cannot look up
+    mode = SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE;
+  }
+  SSL_CTX_set_session_cache_mode(ctx_->get(), mode);
+}
+
+void TSSLSocketFactory::sessionCache(size_t size, long timeout) {
+  // To OpenSSL a size of 0 means unlimited, so 0 turns the cache off
+  // instead, and tickets along with it, which would resume sessions too
+  if (size == 0) {
+    SSL_CTX_set_options(ctx_->get(), SSL_OP_NO_TICKET);
+  } else if (sessionsDisabled_) {
+    SSL_CTX_clear_options(ctx_->get(), SSL_OP_NO_TICKET);
+  }
+  sessionsDisabled_ = (size == 0);
+  SSL_CTX_sess_set_cache_size(ctx_->get(), static_cast<long>(size));
+  SSL_CTX_set_timeout(ctx_->get(), timeout);
+  ctx_->setClientSessionLimit(size);
+  setSessionCacheMode();
+}
+
+void TSSLSocketFactory::rotateTicketKeys() {
+  ctx_->rotateTicketKeys();
+}
+
+uint64_t TSSLSocketFactory::sessionHits() const {
+  return ctx_->getSessionHits();
+}
+
+uint64_t TSSLSocketFactory::sessionMisses() const {
+  return ctx_->getSessionMisses();
+}
+
 void TSSLSocketFactory::ciphers(const string& enable) {
   int rc = SSL_CTX_set_cipher_list(ctx_->get(), enable.c_str());
   if (ERR_peek_error() != 0) {
@@ -22,7 +22,11 @@
 
 // Put this first to avoid WIN32 build failure
 #include <thrift/transport/TSocket.h>
+#include <list>
+#include <map>
 #include <string>
+#include <vector>
+#include <boost/atomic.hpp>
 #include <boost/shared_ptr.hpp>
 #include <openssl/ssl.h>
 #include <thrift/concurrency/Mutex.h>
@@ -79,6 +83,9 @@ public:
   void close();
   uint32_t read(uint8_t* buf, uint32_t len);
   void write(const uint8_t* buf, uint32_t len);
+#ifdef HAVE_SYS_UIO_H
+  void writev(const struct iovec* iov, int iovcnt);
+#endif
   void flush();
   /**
   * Set whether to use client or server side SSL handshake protocol.
@@ -97,6 +104,47 @@ public:
    */
   virtual void access(boost::shared_ptr<AccessManager> manager) { access_ = manager; }
 
+  /**
+   * Nonblocking I/O, for servers that wait for sockets to become ready
+   * themselves, such as TNonblockingServer.  The underlying socket must be
+   * nonblocking.  A call that cannot go on until the socket is readable or
+   * writable returns at once instead of waiting, and wantWrite() says which
+   * of the two to wait for before calling it again.  The blocking calls
+   * must not be mixed with these on the same connection.
+   */
+
+  /**
+   * Takes the handshake as far as it goes without waiting, and authorizes
+   * the peer once it is done.
+   *
+   * @return true once the handshake is done.
+   */
+  bool handshakeNonblocking();
+
+  /**
+   * @return the number of bytes read, 0 once the peer has closed the
+   *         connection, or -1 if the socket has to become ready first.
+   */
+  int32_t readNonblocking(uint8_t* buf, uint32_t len);
+
+  /**
+   * @return the number of bytes written, or -1 if the socket has to become
+   *         ready first.
+   */
+  int32_t writeNonblocking(const uint8_t* buf, uint32_t len);
+
+  /**
+   * Whether decrypted data is waiting to be read.  Such data has already
+   * been taken off the socket, so the socket does not become readable for it.
+   */
+  bool hasPendingData();
+
+  /**
+   * Whether the last nonblocking call that returned early waits for the
+   * socket to become writable, rather than readable.
+   */
+  bool wantWrite() const { return wantWrite_; }
+
 protected:
   /**
    * Constructor.
@@ -149,9 +197,20 @@ protected:
    *         TSSL_DATA  if data is available on the socket.
    */
   unsigned int waitForEvent(bool wantRead);
+  /**
+   * Sorts out a nonblocking call that did not succeed.
+   *
+   * @throw TSSLException if the call failed.
+   *
+   * @return true if the call has to wait for the socket; wantWrite_ says for what.
+   */
+  bool wouldBlock(int rc, bool writing, const char* fname);
 
   bool server_;
   SSL* ssl_;
+  bool nonblocking_;
+  bool handshakeDone_;
+  bool wantWrite_;
   boost::shared_ptr<SSLContext> ctx_;
   boost::shared_ptr<AccessManager> access_;
   friend class TSSLSocketFactory;
@@ -248,7 +307,7 @@ public:
    *
    * @param flag  Server mode if true
    */
-  virtual void server(bool flag) { server_ = flag; }
+  virtual void server(bool flag);
   /**
    * Determine whether the socket is in server or client mode.
    *
@@ -261,6 +320,35 @@ public:
    * @param manager  The AccessManager instance
    */
   virtual void access(boost::shared_ptr<AccessManager> manager) { access_ = manager; }
+  /**
+   * Size the session cache. Servers keep up to size sessions, and accept
+   * them and the session tickets they hand out for timeout seconds.
+   * Clients keep the last session of up to size servers, and resume it
+   * when they connect to the same host and port again; past size, the
+   * server connected to least recently is forgotten.
+   *
+   * A size of 0 disables resumption on either side: no sessions are kept
+   * and no session tickets are used, until a later call sets a size again.
+   *
+   * @param size    Number of sessions kept, or 0 for none
+   * @param timeout Seconds a session can be resumed for
+   */
+  virtual void sessionCache(size_t size, long timeout);
+  /**
+   * Encrypt new session tickets with a fresh key. Tickets encrypted with
+   * the previous keys are still accepted, and replaced by new ones when
+   * they are. Servers should call this regularly; until they first do,
+   * OpenSSL uses one random key for as long as the factory lives.
+   */
+  virtual void rotateTicketKeys();
+  /**
+   * Number of handshakes that resumed a session.
+   */
+  uint64_t sessionHits() const;
+  /**
+   * Number of handshakes that had to negotiate a new session.
+   */
+  uint64_t sessionMisses() const;
   static void setManualOpenSSLInitialization(bool manualOpenSSLInitialization) {
     manualOpenSSLInitialization_ = manualOpenSSLInitialization;
   }
@@ -279,11 +367,15 @@ protected:
 
 private:
   bool server_;
+  /// Whether sessionCache(0) disabled resumption
+  bool sessionsDisabled_;
   boost::shared_ptr<AccessManager> access_;
   static concurrency::Mutex mutex_;
   static uint64_t count_;
   static bool manualOpenSSLInitialization_;
   void setup(boost::shared_ptr<TSSLSocket> ssl);
+  /// Sets OpenSSL's cache mode for server_ and sessionsDisabled_.
+  void setSessionCacheMode();
   static int passwordCallback(char* password, int size, int, void* data);
 };
 
@@ -314,8 +406,73 @@ public:
   SSL* createSSL();
   SSL_CTX* get() { return ctx_; }
 
+  /**
+   * Have a client connection resume the last session of the peer, if it
+   * has not expired, and keep the sessions the peer hands out next.
+   *
+   * @param ssl    Client connection, before its handshake
+   * @param socket The socket that owns it
+   * @param peer   Host and port of the peer
+   */
+  void resumeSession(SSL* ssl, TSSLSocket* socket, const std::string& peer);
+  /**
+   * Limit the number of peers client sessions are kept for.
+   */
+  void setClientSessionLimit(size_t limit);
+  /**
+   * Start encrypting session tickets with a new key, see
+   * TSSLSocketFactory::rotateTicketKeys().
+   */
+  void rotateTicketKeys();
+  /**
+   * Count a completed handshake.
+   */
+  void countHandshake(bool resumed);
+  uint64_t getSessionHits() const { return sessionHits_.load(boost::memory_order_relaxed); }
+  uint64_t getSessionMisses() const { return sessionMisses_.load(boost::memory_order_relaxed); }
+
 private:
+  /// A session ticket key; the name tells which key a ticket was encrypted with
+  struct TicketKey {
+    unsigned char name[16];
+    unsigned char hmacKey[32];
+    unsigned char aesKey[32];
+  };
+
+  /// Last session of a peer, and where the peer is in sessionOrder_
+  struct ClientSession {
+    SSL_SESSION* session;
+    std::list<std::string>::iterator order;
+  };
+  typedef std::map<std::string, ClientSession> SessionMap;
+
+  /// Forgets the session of a peer; mutex_ must be held
+  void removeSession(SessionMap::iterator it);
+
+  static int newSessionCallback(SSL* ssl, SSL_SESSION* session);
+#if (OPENSSL_VERSION_NUMBER >= 0x30000000L)
+  typedef EVP_MAC_CTX TicketMacCtx;
+#else
+  typedef HMAC_CTX TicketMacCtx;
+#endif
+  static int ticketKeyCallback(SSL* ssl,
+                               unsigned char* name,
+                               unsigned char* iv,
+                               EVP_CIPHER_CTX* cipher,
+                               TicketMacCtx* mac,
+                               int encrypt);
+
   SSL_CTX* ctx_;
+  concurrency::Mutex mutex_;
+  /// Last session of each peer, guarded by mutex_
+  SessionMap sessions_;
+  /// Peers in sessions_, least recently used first, guarded by mutex_
+  std::list<std::string> sessionOrder_;
+  size_t sessionLimit_;
+  /// Newest first, guarded by mutex_
+  std::vector<TicketKey> ticketKeys_;
+  boost::atomic<uint64_t> sessionHits_;
+  boost::atomic<uint64_t> sessionMisses_;
 };
 
 /**
@@ -674,6 +674,84 @@ uint32_t TSocket::write_partial(const uint8_t* buf, uint32_t len) {
   return b;
 }
 
+#ifdef HAVE_SYS_UIO_H
+void TSocket::writev(const struct iovec* iov, int iovcnt) {
+  while (iovcnt > 0) {
+    uint32_t b = writev_partial(iov, iovcnt);
+    if (b == 0) {
+      // This should only happen if the timeout set with SO_SNDTIMEO expired.
+      // Raise an exception.
+      throw TTransportException(TTransportException::TIMED_OUT, "send timeout expired");
+    }
+
+    // Skip the buffers that went out completely.
+    while (iovcnt > 0 && b >= iov->iov_len) {
+      b -= static_cast<uint32_t>(iov->iov_len);
+      ++iov;
+      --iovcnt;
+    }
+
+    // Finish a partially sent buffer on its own, then resume gathering.
+    if (b > 0) {
+      write(static_cast<const uint8_t*>(iov->iov_base) + b,
+            static_cast<uint32_t>(iov->iov_len) - b);
+      ++iov;
+      --iovcnt;
+    }
+  }
+}
+
+uint32_t TSocket::writev_partial(const struct iovec* iov, int iovcnt) {
+  if (socket_ == THRIFT_INVALID_SOCKET) {
+    throw TTransportException(TTransportException::NOT_OPEN, "Called write on non-open socket");
+  }
+
+#ifdef IOV_MAX
+  if (iovcnt > IOV_MAX) {
+    iovcnt = IOV_MAX;
+  }
+#endif
+
+  int flags = 0;
+#ifdef MSG_NOSIGNAL
+  // Note the use of MSG_NOSIGNAL to suppress SIGPIPE errors, instead we
+  // check for the THRIFT_EPIPE return condition and close the socket in that case
+  flags |= MSG_NOSIGNAL;
+#endif // ifdef MSG_NOSIGNAL
+
+  // sendmsg() rather than writev() so that MSG_NOSIGNAL can be passed.
+  struct msghdr msg;
+  std::memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = const_cast<struct iovec*>(iov);
+  msg.msg_iovlen = iovcnt;
+
+  int b = static_cast<int>(sendmsg(socket_, &msg, flags));
+
+  if (b < 0) {
+    if (THRIFT_GET_SOCKET_ERROR == THRIFT_EWOULDBLOCK || THRIFT_GET_SOCKET_ERROR == THRIFT_EAGAIN) {
+      return 0;
+    }
+    // Fail on a send error
+    int errno_copy = THRIFT_GET_SOCKET_ERROR;
+    GlobalOutput.perror("TSocket::writev_partial() sendmsg() " + getSocketInfo(), errno_copy);
+
+    if (errno_copy == THRIFT_EPIPE || errno_copy == THRIFT_ECONNRESET
+        || errno_copy == THRIFT_ENOTCONN) {
+      close();
+      throw TTransportException(TTransportException::NOT_OPEN, "writev() sendmsg()", errno_copy);
+    }
+
+    throw TTransportException(TTransportException::UNKNOWN, "writev() sendmsg()", errno_copy);
+  }
+
+  // Fail on blocked send
+  if (b == 0) {
+    throw TTransportException(TTransportException::NOT_OPEN, "Socket sendmsg returned 0.");
+  }
+  return b;
+}
+#endif // HAVE_SYS_UIO_H
+
 std::string TSocket::getHost() {
   return host_;
 }
@@ -36,6 +36,9 @@
 #ifdef HAVE_NETDB_H
 #include <netdb.h>
 #endif
+#ifdef HAVE_SYS_UIO_H
+#include <sys/uio.h>
+#endif
 
 namespace apache {
 namespace thrift {
@@ -122,6 +125,20 @@ public:
    */
   uint32_t write_partial(const uint8_t* buf, uint32_t len);
 
+#ifdef HAVE_SYS_UIO_H
+  /**
+   * Writes the buffers described by iov to the underlying socket with
+   * scatter/gather sends.  Loops until done or fail.
+   */
+  virtual void writev(const struct iovec* iov, int iovcnt);
+
+  /**
+   * Writes to the underlying socket.  Does a single scatter/gather send()
+   * and returns the number of bytes sent.
+   */
+  uint32_t writev_partial(const struct iovec* iov, int iovcnt);
+#endif
+
   /**
    * Get the host that the socket is connected to
    *
@@ -22,6 +22,7 @@
 
 #include <thrift/Thrift.h>
 #include <boost/shared_ptr.hpp>
+#include <boost/shared_array.hpp>
 #include <thrift/transport/TTransportException.h>
 #include <string>
 
@@ -156,6 +157,25 @@ public:
     throw TTransportException(TTransportException::NOT_OPEN, "Base TTransport cannot write.");
   }
 
+  /**
+   * Writes the buffer, allowing the transport to keep a reference to it
+   * instead of copying it.
+   *
+   * Transports that support this (see TFramedTransport) hand the caller's
+   * memory straight to the next flush(), so the caller must keep \c buf
+   * valid and unmodified until flush() returns.  All other transports simply
+   * copy the data as write() does.
+   *
+   * @param buf  The data to write out
+   * @param len  How many bytes to write
+   * @throws TTransportException if an error occurs
+   */
+  void writeRef(const uint8_t* buf, uint32_t len) {
+    T_VIRTUAL_CALL();
+    writeRef_virt(buf, len);
+  }
+  virtual void writeRef_virt(const uint8_t* buf, uint32_t len) { write_virt(buf, len); }
+
   /**
    * Called when write is completed.
    * This can be over-ridden to perform a transport-specific action
@@ -211,6 +231,30 @@ public:
   }
   virtual const uint8_t* borrow_virt(uint8_t* /* buf */, uint32_t* /* len */) { return NULL; }
 
+  /**
+   * Attempts to return a pointer to \c len bytes of an internal buffer that
+   * stays valid after the bytes are consumed and further reads are made, so
+   * that callers can refer to it instead of copying (see TBinaryView).
+   * Like borrow(), this does not consume the bytes.
+   *
+   * @param len  How many bytes to borrow
+   * @param pin  Receives a reference on the returned memory.  The transport
+   *             will not reuse that memory while any copy of \c pin is
+   *             alive.
+   * @return A pointer to at least \c len bytes, or NULL if the transport
+   *         cannot hand out memory it can keep alive this way (such as
+   *         memory owned by someone else).
+   * @throws TTransportException if an error occurs
+   */
+  const uint8_t* borrowPinned(uint32_t len, boost::shared_array<uint8_t>& pin) {
+    T_VIRTUAL_CALL();
+    return borrowPinned_virt(len, pin);
+  }
+  virtual const uint8_t* borrowPinned_virt(uint32_t /* len */,
+                                           boost::shared_array<uint8_t>& /* pin */) {
+    return NULL;
+  }
+
   /**
    * Remove len bytes from the transport.  This should always follow a borrow
    * of at least len bytes, and should always succeed.
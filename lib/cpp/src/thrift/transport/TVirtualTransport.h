@@ -30,7 +30,7 @@ namespace transport {
  * Helper class that provides default implementations of TTransport methods.
  *
  * This class provides default implementations of read(), readAll(), write(),
- * borrow() and consume().
+ * writeRef(), borrow(), consume() and borrowPinned().
  *
  * In the TTransport base class, each of these methods simply invokes its
  * virtual counterpart.  This class overrides them to always perform the
@@ -51,10 +51,14 @@ public:
   uint32_t read(uint8_t* buf, uint32_t len) { return this->TTransport::read_virt(buf, len); }
   uint32_t readAll(uint8_t* buf, uint32_t len) { return this->TTransport::readAll_virt(buf, len); }
   void write(const uint8_t* buf, uint32_t len) { this->TTransport::write_virt(buf, len); }
+  void writeRef(const uint8_t* buf, uint32_t len) { this->TTransport::writeRef_virt(buf, len); }
   const uint8_t* borrow(uint8_t* buf, uint32_t* len) {
     return this->TTransport::borrow_virt(buf, len);
   }
   void consume(uint32_t len) { this->TTransport::consume_virt(len); }
+  const uint8_t* borrowPinned(uint32_t len, boost::shared_array<uint8_t>& pin) {
+    return this->TTransport::borrowPinned_virt(len, pin);
+  }
 
 protected:
   TTransportDefaults() {}
@@ -96,12 +100,20 @@ public:
     static_cast<Transport_*>(this)->write(buf, len);
   }
 
+  virtual void writeRef_virt(const uint8_t* buf, uint32_t len) {
+    static_cast<Transport_*>(this)->writeRef(buf, len);
+  }
+
   virtual const uint8_t* borrow_virt(uint8_t* buf, uint32_t* len) {
     return static_cast<Transport_*>(this)->borrow(buf, len);
   }
 
   virtual void consume_virt(uint32_t len) { static_cast<Transport_*>(this)->consume(len); }
 
+  virtual const uint8_t* borrowPinned_virt(uint32_t len, boost::shared_array<uint8_t>& pin) {
+    return static_cast<Transport_*>(this)->borrowPinned(len, pin);
+  }
+
   /*
    * Provide a default readAll() implementation that invokes
    * read() non-virtually.
@@ -21,6 +21,7 @@
 #define _THRIFT_TEST_GENERICPROTOCOLTEST_TCC_ 1
 
 #include <limits>
+#include <vector>
 
 #include <thrift/protocol/TBinaryProtocol.h>
 #include <thrift/transport/TBufferTransports.h>
@@ -125,6 +126,75 @@ void testMessage() {
   }
 }
 
+template <typename TProto>
+void testArrays() {
+  std::vector<int32_t> i32s;
+  std::vector<int64_t> i64s;
+  for (int i = 0; i < 31; i++) {
+    i32s.push_back(1 << i);
+    i32s.push_back(-(1 << i));
+    i32s.push_back((1 << i) - 1);
+  }
+  i32s.push_back((std::numeric_limits<int32_t>::min)());
+  i32s.push_back((std::numeric_limits<int32_t>::max)());
+  for (int i = 0; i < 63; i++) {
+    i64s.push_back(1LL << i);
+    i64s.push_back(-(1LL << i));
+    i64s.push_back((1LL << i) - 1);
+  }
+  i64s.push_back((std::numeric_limits<int64_t>::min)());
+  i64s.push_back((std::numeric_limits<int64_t>::max)());
+  std::vector<double> doubles;
+  for (int i = -300; i < 300; i += 7) {
+    doubles.push_back(i * 1.0e10 / 3.0);
+  }
+
+  shared_ptr<TMemoryBuffer> out(new TMemoryBuffer());
+  TProto writer(out);
+  for (size_t i = 0; i < i32s.size(); i++) {
+    writer.writeI32(i32s[i]);
+  }
+  for (size_t i = 0; i < i64s.size(); i++) {
+    writer.writeI64(i64s[i]);
+  }
+  for (size_t i = 0; i < doubles.size(); i++) {
+    writer.writeDouble(doubles[i]);
+  }
+  std::string wire = out->getBufferAsString();
+
+  // Array writes produce the same bytes as element writes
+  shared_ptr<TMemoryBuffer> arrayOut(new TMemoryBuffer());
+  shared_ptr<TProtocol> arrayWriter(new TProto(arrayOut));
+  uint32_t written = arrayWriter->writeI32Array(&i32s[0], static_cast<uint32_t>(i32s.size()));
+  written += arrayWriter->writeI64Array(&i64s[0], static_cast<uint32_t>(i64s.size()));
+  written += arrayWriter->writeDoubleArray(&doubles[0], static_cast<uint32_t>(doubles.size()));
+  if (written != wire.size() || arrayOut->getBufferAsString() != wire) {
+    throw TException("writeI32Array/writeI64Array/writeDoubleArray failed.");
+  }
+
+  // Read from a buffer that holds everything, then through a small buffer
+  // that elements straddle.
+  for (int pass = 0; pass < 2; pass++) {
+    shared_ptr<TTransport> transport(new TMemoryBuffer(
+        reinterpret_cast<uint8_t*>(const_cast<char*>(wire.data())),
+        static_cast<uint32_t>(wire.size())));
+    if (pass == 1) {
+      transport.reset(new TBufferedTransport(transport, 16));
+    }
+    shared_ptr<TProtocol> reader(new TProto(transport));
+
+    std::vector<int32_t> i32sIn(i32s.size());
+    std::vector<int64_t> i64sIn(i64s.size());
+    std::vector<double> doublesIn(doubles.size());
+    uint32_t xfer = reader->readI32Array(&i32sIn[0], static_cast<uint32_t>(i32sIn.size()));
+    xfer += reader->readI64Array(&i64sIn[0], static_cast<uint32_t>(i64sIn.size()));
+    xfer += reader->readDoubleArray(&doublesIn[0], static_cast<uint32_t>(doublesIn.size()));
+    if (xfer != wire.size() || i32sIn != i32s || i64sIn != i64s || doublesIn != doubles) {
+      throw TException("readI32Array/readI64Array/readDoubleArray failed.");
+    }
+  }
+}
+
 template <typename TProto>
 void testProtocol(const char* protoname) {
   try {
@@ -215,6 +285,8 @@ void testProtocol(const char* protoname) {
 
     testMessage<TProto>();
 
+    testArrays<TProto>();
+
     printf("%s => OK\n", protoname);
   } catch (TException e) {
     THRIFT_SNPRINTF(errorMessage, ERR_LEN, "%s => Test FAILED: %s", protoname, e.what());
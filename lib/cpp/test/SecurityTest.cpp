@@ -191,6 +191,40 @@ struct SecurityFixture
         }
     }
 
+    void resumingServer(boost::shared_ptr<TSSLSocketFactory> pServerSocketFactory, int connections)
+    {
+        try
+        {
+            boost::mutex::scoped_lock lock(mMutex);
+
+            boost::shared_ptr<TSSLServerSocket> pServerSocket(
+                new TSSLServerSocket("localhost", 0, pServerSocketFactory));
+            pServerSocket->listen();
+            mPort = pServerSocket->getPort();
+            mCVar.notify_one();
+            lock.unlock();
+
+            for (int i = 0; i < connections; ++i)
+            {
+                // Tickets from the previous key must still be accepted
+                pServerSocketFactory->rotateTicketKeys();
+
+                boost::shared_ptr<TTransport> connectedClient = pServerSocket->accept();
+                uint8_t buf[2];
+                buf[0] = 'O';
+                buf[1] = 'K';
+                connectedClient->write(&buf[0], 2);
+                connectedClient->flush();
+                connectedClient->close();
+            }
+            pServerSocket->close();
+        }
+        catch (std::exception& ex)
+        {
+            BOOST_FAIL(boost::format("%1%: %2%") % typeid(ex).name() % ex.what());
+        }
+    }
+
     static const char *protocol2str(size_t protocol)
     {
         static const char *strings[apache::thrift::transport::LATEST + 1] =
@@ -273,4 +307,93 @@ BOOST_AUTO_TEST_CASE(ssl_security_matrix)
     }
 }
 
+BOOST_AUTO_TEST_CASE(ssl_session_resumption)
+{
+    try
+    {
+        boost::shared_ptr<TSSLSocketFactory> pServerSocketFactory(new TSSLSocketFactory());
+        pServerSocketFactory->loadCertificate(certFile("server.crt").string().c_str());
+        pServerSocketFactory->loadPrivateKey(certFile("server.key").string().c_str());
+        pServerSocketFactory->server(true);
+        pServerSocketFactory->sessionCache(100, 300);
+
+        boost::shared_ptr<TSSLSocketFactory> pClientSocketFactory(new TSSLSocketFactory());
+        pClientSocketFactory->authenticate(true);
+        pClientSocketFactory->loadTrustedCertificates(certFile("CA.pem").string().c_str());
+
+        const int connections = 3;
+        boost::mutex::scoped_lock lock(mMutex);
+        boost::thread_group threads;
+        threads.create_thread(boost::bind(&SecurityFixture::resumingServer, this, pServerSocketFactory, connections));
+        mCVar.wait(lock);           // wait for listen() to succeed
+        lock.unlock();
+
+        for (int i = 0; i < connections; ++i)
+        {
+            boost::shared_ptr<TSSLSocket> pClientSocket = pClientSocketFactory->createSocket("localhost", mPort);
+            pClientSocket->open();
+            uint8_t buf[2];
+            BOOST_CHECK_EQUAL(2, pClientSocket->read(&buf[0], 2));
+            pClientSocket->close();
+        }
+        threads.join_all();
+
+        // Only the first connection negotiates a session
+        BOOST_CHECK_EQUAL(pClientSocketFactory->sessionMisses(), 1u);
+        BOOST_CHECK_EQUAL(pClientSocketFactory->sessionHits(), static_cast<uint64_t>(connections - 1));
+        BOOST_CHECK_EQUAL(pServerSocketFactory->sessionMisses(), 1u);
+        BOOST_CHECK_EQUAL(pServerSocketFactory->sessionHits(), static_cast<uint64_t>(connections - 1));
+    }
+    catch (std::exception& ex)
+    {
+        BOOST_FAIL(boost::format("%1%: %2%") % typeid(ex).name() % ex.what());
+    }
+}
+
+BOOST_AUTO_TEST_CASE(ssl_session_cache_disabled)
+{
+    try
+    {
+        // A cache of size 0 turns resumption off, also when the factory is
+        // switched to server mode afterwards, even for clients that offer
+        // their last session
+        boost::shared_ptr<TSSLSocketFactory> pServerSocketFactory(new TSSLSocketFactory());
+        pServerSocketFactory->loadCertificate(certFile("server.crt").string().c_str());
+        pServerSocketFactory->loadPrivateKey(certFile("server.key").string().c_str());
+        pServerSocketFactory->sessionCache(0, 300);
+        pServerSocketFactory->server(true);
+
+        boost::shared_ptr<TSSLSocketFactory> pClientSocketFactory(new TSSLSocketFactory());
+        pClientSocketFactory->authenticate(true);
+        pClientSocketFactory->loadTrustedCertificates(certFile("CA.pem").string().c_str());
+
+        const int connections = 3;
+        boost::mutex::scoped_lock lock(mMutex);
+        boost::thread_group threads;
+        threads.create_thread(boost::bind(&SecurityFixture::resumingServer, this, pServerSocketFactory, connections));
+        mCVar.wait(lock);           // wait for listen() to succeed
+        lock.unlock();
+
+        for (int i = 0; i < connections; ++i)
+        {
+            boost::shared_ptr<TSSLSocket> pClientSocket = pClientSocketFactory->createSocket("localhost", mPort);
+            pClientSocket->open();
+            uint8_t buf[2];
+            BOOST_CHECK_EQUAL(2, pClientSocket->read(&buf[0], 2));
+            pClientSocket->close();
+        }
+        threads.join_all();
+
+        // Every connection negotiates a new session
+        BOOST_CHECK_EQUAL(pClientSocketFactory->sessionMisses(), static_cast<uint64_t>(connections));
+        BOOST_CHECK_EQUAL(pClientSocketFactory->sessionHits(), 0u);
+        BOOST_CHECK_EQUAL(pServerSocketFactory->sessionMisses(), static_cast<uint64_t>(connections));
+        BOOST_CHECK_EQUAL(pServerSocketFactory->sessionHits(), 0u);
+    }
+    catch (std::exception& ex)
+    {
+        BOOST_FAIL(boost::format("%1%: %2%") % typeid(ex).name() % ex.what());
+    }
+}
+
 BOOST_AUTO_TEST_SUITE_END()
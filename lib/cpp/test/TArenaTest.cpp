@@ -0,0 +1,263 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements. See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership. The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied. See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+#include <map>
+#include <vector>
+
+#include <boost/test/auto_unit_test.hpp>
+
+#include <thrift/TArena.h>
+#include <thrift/TToString.h>
+#include <thrift/protocol/TBinaryProtocol.h>
+#include <thrift/transport/TBufferTransports.h>
+
+using apache::thrift::TArena;
+using apache::thrift::TArenaAllocator;
+using apache::thrift::TArenaScope;
+using apache::thrift::TArenaString;
+using apache::thrift::protocol::TBinaryProtocol;
+using apache::thrift::transport::TMemoryBuffer;
+
+typedef std::vector<TArenaString, TArenaAllocator<TArenaString> > ArenaList;
+typedef std::map<TArenaString, int32_t, std::less<TArenaString>,
+                 TArenaAllocator<std::pair<const TArenaString, int32_t> > > ArenaMap;
+
+// Fields of a struct generated with "--gen cpp:arena", swapped the same way
+struct ArenaRecord {
+  TArenaString name;
+  ArenaList items;
+  ArenaMap counts;
+};
+
+void swap(ArenaRecord& a, ArenaRecord& b) {
+  using ::std::swap;
+  swap(a.name, b.name);
+  swap(a.items, b.items);
+  swap(a.counts, b.counts);
+}
+
+void fillRecord(ArenaRecord& record, const char* value) {
+  record.name = value;
+  record.items.push_back(value);
+  record.counts[value] = 1;
+}
+
+BOOST_AUTO_TEST_SUITE(TArenaTest)
+
+BOOST_AUTO_TEST_CASE(test_Arena_Allocate_Reset) {
+  TArena arena(1024);
+  BOOST_CHECK_EQUAL(arena.used(), 0u);
+
+  void* first = arena.allocate(10);
+  void* second = arena.allocate(10);
+  BOOST_CHECK(arena.owns(first));
+  BOOST_CHECK(arena.owns(second));
+  BOOST_CHECK_EQUAL(reinterpret_cast<uintptr_t>(second) % (2 * sizeof(void*)), 0u);
+  BOOST_CHECK_EQUAL(arena.used(), 2 * 2 * sizeof(void*));
+
+  int local;
+  BOOST_CHECK(!arena.owns(&local));
+
+  // A single block is kept and handed out again after a reset.
+  arena.reset();
+  BOOST_CHECK_EQUAL(arena.used(), 0u);
+  BOOST_CHECK_EQUAL(arena.allocate(10), first);
+
+  // Outgrowing the block makes the next cycle use a larger one.
+  void* big = arena.allocate(4000);
+  BOOST_CHECK(arena.owns(big));
+  BOOST_CHECK(arena.owns(arena.allocate(10)));
+  arena.reset();
+  uint8_t* start = static_cast<uint8_t*>(arena.allocate(16));
+  BOOST_CHECK_EQUAL(arena.allocate(3000), start + 16);
+}
+
+BOOST_AUTO_TEST_CASE(test_Arena_Allocate_Zero) {
+  // Even a fresh arena hands out valid, distinct pointers for empty requests
+  TArena arena;
+  void* first = arena.allocate(0);
+  void* second = arena.allocate(0);
+  BOOST_CHECK(first != NULL);
+  BOOST_CHECK(second != NULL);
+  BOOST_CHECK(first != second);
+  BOOST_CHECK(arena.owns(first));
+  BOOST_CHECK(arena.owns(second));
+}
+
+BOOST_AUTO_TEST_CASE(test_Arena_Allocator) {
+  TArena arena;
+  BOOST_CHECK(TArena::current() == NULL);
+
+  // Without a current arena the allocator uses the heap.
+  ArenaList heap;
+  heap.push_back("heap string that is too long for small string storage");
+  BOOST_CHECK(!arena.owns(heap[0].data()));
+
+  {
+    TArenaScope scope(&arena);
+    BOOST_CHECK(TArena::current() == &arena);
+
+    ArenaList list;
+    ArenaMap map;
+    for (int32_t i = 0; i < 100; ++i) {
+      list.push_back("a string that is too long for small string storage");
+      map[list.back()] = i;
+    }
+    BOOST_CHECK(arena.owns(&list[0]));
+    BOOST_CHECK(arena.owns(list[99].data()));
+    BOOST_CHECK_EQUAL(map.size(), 1u);
+    BOOST_CHECK(arena.used() > 0);
+
+    // Heap memory freed while an arena is current goes back to the heap.
+    heap.clear();
+
+    {
+      TArenaScope noArena(NULL);
+      BOOST_CHECK(TArena::current() == NULL);
+    }
+    BOOST_CHECK(TArena::current() == &arena);
+  }
+  BOOST_CHECK(TArena::current() == NULL);
+  arena.reset();
+}
+
+BOOST_AUTO_TEST_CASE(test_Arena_Allocator_Keeps_Arena) {
+  TArena arena;
+  TArena other;
+
+  // Containers keep allocating from, and never free, the arena that was
+  // current when they were constructed
+  ArenaList* list;
+  {
+    TArenaScope scope(&arena);
+    list = new ArenaList();
+    list->push_back("a string that is too long for small string storage");
+  }
+  BOOST_CHECK(list->get_allocator().arena() == &arena);
+  {
+    TArenaScope scope(&other);
+    list->push_back("another string that is too long for small string storage");
+  }
+  BOOST_CHECK(arena.owns(&list->back()));
+  BOOST_CHECK(!other.owns(&list->back()));
+  delete list;
+
+  ArenaList heap;
+  {
+    TArenaScope scope(&arena);
+    heap.push_back("a string that is too long for small string storage");
+  }
+  BOOST_CHECK(heap.get_allocator().arena() == NULL);
+  BOOST_CHECK(!arena.owns(&heap[0]));
+  arena.reset();
+}
+
+BOOST_AUTO_TEST_CASE(test_Arena_Swap_And_Assign) {
+  const char* arenaValue = "a string built in the arena, too long for small string storage";
+  const char* heapValue = "a string built on the heap, too long for small string storage";
+  TArena arena;
+  ArenaRecord heap;
+  fillRecord(heap, heapValue);
+  {
+    TArenaScope scope(&arena);
+    ArenaRecord built;
+    fillRecord(built, arenaValue);
+
+    // Swapping takes the allocators along with the memory
+    swap(built, heap);
+    BOOST_CHECK(heap.name.get_allocator().arena() == &arena);
+    BOOST_CHECK(heap.items.get_allocator().arena() == &arena);
+    BOOST_CHECK(heap.counts.get_allocator().arena() == &arena);
+    BOOST_CHECK(built.name.get_allocator().arena() == NULL);
+    BOOST_CHECK(built.items.get_allocator().arena() == NULL);
+    BOOST_CHECK(built.counts.get_allocator().arena() == NULL);
+    BOOST_CHECK(heap.name == arenaValue && heap.items[0] == arenaValue);
+    BOOST_CHECK(built.name == heapValue && built.items[0] == heapValue);
+    BOOST_CHECK_EQUAL(heap.counts[arenaValue], 1);
+    BOOST_CHECK_EQUAL(built.counts[heapValue], 1);
+
+    // Growing either side afterwards uses the memory it now holds
+    built.items.push_back(heapValue);
+    heap.items.push_back(arenaValue);
+    BOOST_CHECK(!arena.owns(&built.items[0]));
+    BOOST_CHECK(arena.owns(&heap.items[0]));
+
+    // Swapping back leaves the heap record outside the arena again
+    swap(built, heap);
+  }
+  BOOST_CHECK(heap.items.get_allocator().arena() == NULL);
+  BOOST_CHECK_EQUAL(heap.items.size(), 2u);
+
+  // Copy assignment keeps the target's allocator, so the copy survives a reset
+  ArenaRecord kept;
+  {
+    TArenaScope scope(&arena);
+    ArenaRecord built;
+    fillRecord(built, arenaValue);
+    kept.name = built.name;
+    kept.items = built.items;
+    kept.counts = built.counts;
+  }
+  arena.reset();
+  BOOST_CHECK(kept.items.get_allocator().arena() == NULL);
+  BOOST_CHECK(!arena.owns(kept.name.data()));
+  BOOST_CHECK(!arena.owns(&kept.items[0]));
+  BOOST_CHECK(kept.name == arenaValue && kept.items[0] == arenaValue);
+  BOOST_CHECK_EQUAL(kept.counts[arenaValue], 1);
+}
+
+BOOST_AUTO_TEST_CASE(test_Arena_Protocol) {
+  boost::shared_ptr<TMemoryBuffer> buffer(new TMemoryBuffer());
+  TBinaryProtocol prot(buffer);
+
+  TArena arena;
+  TArenaScope scope(&arena);
+
+  TArenaString str("string value");
+  TArenaString bin("binary\0value", 12);
+  apache::thrift::writeArenaString(prot, str, false);
+  apache::thrift::writeArenaString(prot, bin, true);
+
+  TArenaString str2, bin2;
+  apache::thrift::readArenaString(prot, str2, false);
+  apache::thrift::readArenaString(prot, bin2, true);
+  BOOST_CHECK(str2 == str);
+  BOOST_CHECK(bin2 == bin);
+
+  ArenaList list;
+  list.push_back(str2);
+  BOOST_CHECK_EQUAL(apache::thrift::to_string(list), "[string value]");
+}
+
+BOOST_AUTO_TEST_CASE(test_Arena_Virtual_Protocol) {
+  boost::shared_ptr<TMemoryBuffer> buffer(new TMemoryBuffer());
+  boost::shared_ptr<apache::thrift::protocol::TProtocol> prot(new TBinaryProtocol(buffer));
+
+  TArena arena;
+  TArenaScope scope(&arena);
+
+  TArenaString str("a string that is too long for small string storage");
+  apache::thrift::writeArenaString(*prot, str, false);
+  TArenaString str2;
+  apache::thrift::readArenaString(*prot, str2, false);
+  BOOST_CHECK(str2 == str);
+  BOOST_CHECK(arena.owns(str2.data()));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
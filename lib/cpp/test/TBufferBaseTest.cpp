@@ -21,6 +21,7 @@
 #include <boost/test/auto_unit_test.hpp>
 #include <thrift/transport/TBufferTransports.h>
 #include <thrift/transport/TShortReadTransport.h>
+#include <thrift/protocol/TBinaryProtocol.h>
 
 using std::string;
 using boost::shared_ptr;
@@ -641,5 +642,132 @@ BOOST_AUTO_TEST_CASE( test_FramedTransport_Empty_Flush ) {
   BOOST_CHECK_EQUAL(buffer->getBufferAsString(), output2);
 }
 
+BOOST_AUTO_TEST_CASE( test_FramedTransport_WriteRef ) {
+  init_data();
+
+  string output("\x00\x00\x00\x0a""ab01234567", 14);
+
+  shared_ptr<TMemoryBuffer> buffer(new TMemoryBuffer());
+  TFramedTransport trans(buffer);
+  trans.setWriteRefThreshold(4);
+
+  // Below the threshold the payload is copied right away.
+  uint8_t small[2] = {'a', 'b'};
+  trans.writeRef(small, 2);
+  small[0] = small[1] = 'x';
+
+  // At the threshold the frame refers to the caller's memory until flush.
+  uint8_t large[8] = {'0', '1', '2', '3', '4', '5', '6', '7'};
+  trans.writeRef(large, 8);
+  BOOST_CHECK_EQUAL(trans.writeEnd(), 14u);
+  BOOST_CHECK_EQUAL(buffer->getBufferAsString(), "");
+  trans.flush();
+  BOOST_CHECK_EQUAL(buffer->getBufferAsString(), output);
+
+  // Referenced and copied pieces interleave in write order, and the
+  // references are released by the flush.
+  for (int i = 0; i < 3; i++) {
+    trans.write(&data[i * 1000], 100);
+    trans.writeRef(&data[i * 1000 + 100], 900);
+  }
+  trans.write(&data[3000], 10);
+  trans.flush();
+
+  uint8_t data_out[3010 + 14];
+  uint32_t got = trans.read(data_out, sizeof(data_out));
+  BOOST_CHECK_EQUAL(got, 10u);
+  got = trans.read(data_out, sizeof(data_out));
+  BOOST_CHECK_EQUAL(got, 3010u);
+  BOOST_CHECK(!memcmp(data, data_out, 3010));
+}
+
+BOOST_AUTO_TEST_CASE( test_FramedTransport_BinaryView ) {
+  using apache::thrift::TBinaryView;
+  using apache::thrift::protocol::TBinaryProtocolT;
+
+  shared_ptr<TMemoryBuffer> buffer(new TMemoryBuffer());
+  shared_ptr<TFramedTransport> trans(new TFramedTransport(buffer));
+  TBinaryProtocolT<TFramedTransport> prot(trans);
+
+  prot.writeBinaryView(TBinaryView("first frame"));
+  trans->flush();
+  prot.writeBinaryView(TBinaryView("second"));
+  trans->flush();
+
+  // The view borrows from the frame buffer and keeps it pinned, so reading
+  // the next frame must not overwrite it.
+  TBinaryView first;
+  prot.readBinaryView(first);
+  trans->readEnd();
+  BOOST_CHECK(!first.owned());
+
+  TBinaryView second;
+  prot.readBinaryView(second);
+  trans->readEnd();
+  BOOST_CHECK(!second.owned());
+  BOOST_CHECK_EQUAL(first.str(), "first frame");
+  BOOST_CHECK_EQUAL(second.str(), "second");
+
+  // Plain std::string reads still work on the same data.
+  prot.writeBinaryView(first);
+  trans->flush();
+  string copy;
+  prot.readBinary(copy);
+  BOOST_CHECK_EQUAL(copy, "first frame");
+}
+
+BOOST_AUTO_TEST_CASE( test_MemoryBuffer_BinaryView_Copies ) {
+  using apache::thrift::TBinaryView;
+  using apache::thrift::protocol::TBinaryProtocolT;
+
+  // Observed memory can go away under a view, so the view gets a copy
+  uint8_t* data = new uint8_t[9];
+  memcpy(data, "\0\0\0\x05""bytes", 9);
+  shared_ptr<TMemoryBuffer> buffer(new TMemoryBuffer(data, 9, TMemoryBuffer::OBSERVE));
+  TBinaryProtocolT<TMemoryBuffer> prot(buffer);
+  TBinaryView view;
+  prot.readBinaryView(view);
+  BOOST_CHECK(view.owned());
+  memset(data, 0, 9);
+  delete[] data;
+  BOOST_CHECK_EQUAL(view.str(), "bytes");
+
+  // So does memory the buffer owns, which it overwrites as it pleases
+  TBinaryProtocolT<TMemoryBuffer> owned(shared_ptr<TMemoryBuffer>(new TMemoryBuffer()));
+  owned.writeBinaryView(TBinaryView("bytes"));
+  owned.readBinaryView(view);
+  BOOST_CHECK(view.owned());
+  BOOST_CHECK_EQUAL(view.str(), "bytes");
+}
+
+BOOST_AUTO_TEST_CASE( test_MemoryBuffer_BinaryView_Pinned ) {
+  using apache::thrift::TBinaryView;
+  using apache::thrift::protocol::TBinaryProtocolT;
+
+  // Memory observed with a pin is lent to the view, which keeps it alive
+  boost::shared_array<uint8_t> data(new uint8_t[9]);
+  memcpy(data.get(), "\0\0\0\x05""bytes", 9);
+  shared_ptr<TMemoryBuffer> buffer(new TMemoryBuffer());
+  buffer->resetBuffer(data.get(), 9, data);
+  TBinaryProtocolT<TMemoryBuffer> prot(buffer);
+  TBinaryView view;
+  prot.readBinaryView(view);
+  BOOST_CHECK(!view.owned());
+  BOOST_CHECK(view.data() == data.get() + 4);
+
+  // Neither the buffer nor the caller hold the pin any more
+  buffer->resetBuffer();
+  data.reset();
+  BOOST_CHECK_EQUAL(view.str(), "bytes");
+
+  // Reading past the pinned memory does not lend it
+  boost::shared_array<uint8_t> tooShort(new uint8_t[7]);
+  memcpy(tooShort.get(), "\0\0\0\x05""by", 7);
+  buffer->resetBuffer(tooShort.get(), 7, tooShort);
+  boost::shared_array<uint8_t> pin;
+  BOOST_CHECK(buffer->borrowPinned(8, pin) == NULL);
+  BOOST_CHECK(!pin);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
 
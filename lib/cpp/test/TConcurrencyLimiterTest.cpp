@@ -0,0 +1,100 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements. See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership. The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied. See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+#include <boost/test/auto_unit_test.hpp>
+
+#include <thrift/server/TConcurrencyLimiter.h>
+#include <thrift/transport/PlatformSocket.h>
+
+using apache::thrift::server::TAdaptiveConcurrencyLimiter;
+
+BOOST_AUTO_TEST_SUITE(TConcurrencyLimiterTest)
+
+BOOST_AUTO_TEST_CASE(test_Limit_Enforced) {
+  TAdaptiveConcurrencyLimiter limiter(2);
+  BOOST_CHECK(limiter.tryAcquire());
+  BOOST_CHECK(limiter.tryAcquire());
+  BOOST_CHECK(!limiter.tryAcquire());
+  BOOST_CHECK_EQUAL(limiter.getInFlight(), 2u);
+  BOOST_CHECK_EQUAL(limiter.getRejected(), 1u);
+
+  limiter.release();
+  BOOST_CHECK(limiter.tryAcquire());
+  BOOST_CHECK_EQUAL(limiter.getRejected(), 1u);
+}
+
+BOOST_AUTO_TEST_CASE(test_Standing_Queue_Shrinks_Limit) {
+  TAdaptiveConcurrencyLimiter limiter(32);
+  limiter.setInterval(1000);
+  limiter.setTargetDelay(5000);
+
+  // Each interval the limit at most halves, and never goes below the minimum
+  size_t expected[] = {16, 8, 4, 2, 1, 1};
+  for (size_t i = 0; i < sizeof(expected) / sizeof(expected[0]); ++i) {
+    THRIFT_SLEEP_USEC(2000);
+    limiter.dispatched(20000);
+    BOOST_CHECK_EQUAL(limiter.getLimit(), expected[i]);
+  }
+
+  // Slightly over the target shrinks it in proportion
+  TAdaptiveConcurrencyLimiter gentle(100);
+  gentle.setInterval(1000);
+  gentle.setTargetDelay(5000);
+  THRIFT_SLEEP_USEC(2000);
+  gentle.dispatched(6400);
+  BOOST_CHECK_EQUAL(gentle.getLimit(), 78u);
+}
+
+BOOST_AUTO_TEST_CASE(test_Bursts_Do_Not_Shrink_Limit) {
+  TAdaptiveConcurrencyLimiter limiter(32);
+  limiter.setInterval(20000);
+  limiter.setTargetDelay(5000);
+
+  // One call got through quickly, so the queue drained within the interval
+  limiter.dispatched(50000);
+  limiter.dispatched(0);
+  THRIFT_SLEEP_USEC(25000);
+  limiter.dispatched(50000);
+  BOOST_CHECK_EQUAL(limiter.getLimit(), 32u);
+}
+
+BOOST_AUTO_TEST_CASE(test_Saturated_Limit_Grows) {
+  TAdaptiveConcurrencyLimiter limiter(4, 1, 8);
+  limiter.setInterval(1000);
+  for (int i = 0; i < 4; ++i) {
+    BOOST_CHECK(limiter.tryAcquire());
+  }
+  THRIFT_SLEEP_USEC(2000);
+  limiter.dispatched(0);
+  BOOST_CHECK_EQUAL(limiter.getLimit(), 6u);
+
+  // It does not grow while it is not reached
+  THRIFT_SLEEP_USEC(2000);
+  limiter.dispatched(0);
+  BOOST_CHECK_EQUAL(limiter.getLimit(), 6u);
+
+  // Nor beyond the maximum
+  BOOST_CHECK(limiter.tryAcquire());
+  BOOST_CHECK(limiter.tryAcquire());
+  THRIFT_SLEEP_USEC(2000);
+  limiter.dispatched(0);
+  BOOST_CHECK_EQUAL(limiter.getLimit(), 8u);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
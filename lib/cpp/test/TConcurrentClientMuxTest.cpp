@@ -0,0 +1,232 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements. See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership. The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied. See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+#include <boost/test/auto_unit_test.hpp>
+
+#include <thrift/async/TConcurrentClientMux.h>
+#include <thrift/concurrency/PlatformThreadFactory.h>
+#include <thrift/protocol/TBinaryProtocol.h>
+#include <thrift/transport/PlatformSocket.h>
+#include <thrift/transport/TBufferTransports.h>
+#include <thrift/transport/TServerSocket.h>
+#include <thrift/transport/TSocket.h>
+
+#include <utility>
+#include <vector>
+
+using apache::thrift::async::TConcurrentClientMux;
+using apache::thrift::async::TConcurrentMuxRecvSentry;
+using apache::thrift::async::TConcurrentMuxSendSentry;
+using apache::thrift::concurrency::PlatformThreadFactory;
+using apache::thrift::concurrency::Runnable;
+using apache::thrift::concurrency::Thread;
+using apache::thrift::protocol::TBinaryProtocol;
+using apache::thrift::protocol::TBinaryProtocolFactory;
+using apache::thrift::protocol::TMessageType;
+using apache::thrift::protocol::TProtocol;
+using apache::thrift::protocol::TType;
+using apache::thrift::transport::TFramedTransport;
+using apache::thrift::transport::TServerSocket;
+using apache::thrift::transport::TSocket;
+using apache::thrift::transport::TTransport;
+using apache::thrift::transport::TTransportException;
+using boost::shared_ptr;
+
+namespace {
+
+const int CALLERS = 4;
+const int CALLS_PER_CALLER = 50;
+
+/**
+ * Answers "echo" calls on one connection.  Requests are collected in
+ * batches and answered in reverse order, so responses never arrive in the
+ * order the calls were sent.
+ */
+class ReversingServer : public Runnable {
+public:
+  ReversingServer(shared_ptr<TServerSocket> serverSocket, int batch, int total)
+    : serverSocket_(serverSocket), batch_(batch), total_(total) {}
+
+  void run() {
+    shared_ptr<TFramedTransport> transport(new TFramedTransport(serverSocket_->accept()));
+    TBinaryProtocol prot(transport);
+    std::string name;
+    TMessageType mtype;
+    TType ftype;
+    int16_t fid;
+
+    for (int handled = 0; handled < total_; handled += batch_) {
+      std::vector<std::pair<int32_t, int32_t> > calls;
+      for (int i = 0; i < batch_; ++i) {
+        int32_t seqid;
+        int32_t value;
+        prot.readMessageBegin(name, mtype, seqid);
+        prot.readStructBegin(name);
+        prot.readFieldBegin(name, ftype, fid);
+        prot.readI32(value);
+        prot.readFieldEnd();
+        prot.readFieldBegin(name, ftype, fid);
+        prot.readStructEnd();
+        prot.readMessageEnd();
+        calls.push_back(std::make_pair(seqid, value));
+      }
+      while (!calls.empty()) {
+        prot.writeMessageBegin("echo", apache::thrift::protocol::T_REPLY, calls.back().first);
+        prot.writeStructBegin("echo_result");
+        prot.writeFieldBegin("success", apache::thrift::protocol::T_I32, 0);
+        prot.writeI32(calls.back().second);
+        prot.writeFieldEnd();
+        prot.writeFieldStop();
+        prot.writeStructEnd();
+        prot.writeMessageEnd();
+        transport->flush();
+        calls.pop_back();
+      }
+    }
+    transport->close();
+  }
+
+private:
+  shared_ptr<TServerSocket> serverSocket_;
+  int batch_;
+  int total_;
+};
+
+int32_t echo(TConcurrentClientMux& mux, int32_t value) {
+  int32_t seqid;
+  {
+    TConcurrentMuxSendSentry sentry(&mux);
+    TProtocol* prot = sentry.getProtocol().get();
+    prot->writeMessageBegin("echo", apache::thrift::protocol::T_CALL, sentry.getSeqId());
+    prot->writeStructBegin("echo_args");
+    prot->writeFieldBegin("value", apache::thrift::protocol::T_I32, 1);
+    prot->writeI32(value);
+    prot->writeFieldEnd();
+    prot->writeFieldStop();
+    prot->writeStructEnd();
+    prot->writeMessageEnd();
+    seqid = sentry.send(false);
+  }
+
+  TConcurrentMuxRecvSentry sentry(&mux, seqid);
+  TProtocol* prot = sentry.getProtocol().get();
+  std::string name;
+  TMessageType mtype;
+  int32_t rseqid;
+  TType ftype;
+  int16_t fid;
+  int32_t result = -1;
+  prot->readMessageBegin(name, mtype, rseqid);
+  if (rseqid != seqid) {
+    return -1;
+  }
+  prot->readStructBegin(name);
+  prot->readFieldBegin(name, ftype, fid);
+  prot->readI32(result);
+  return result;
+}
+
+class Caller : public Runnable {
+public:
+  Caller(TConcurrentClientMux& mux, int id) : mux_(mux), id_(id), mismatches_(0) {}
+
+  void run() {
+    for (int i = 0; i < CALLS_PER_CALLER; ++i) {
+      int32_t value = id_ * 1000 + i;
+      if (echo(mux_, value) != value) {
+        ++mismatches_;
+      }
+    }
+  }
+
+  int mismatches() const { return mismatches_; }
+
+private:
+  TConcurrentClientMux& mux_;
+  int id_;
+  int mismatches_;
+};
+}
+
+BOOST_AUTO_TEST_SUITE(TConcurrentClientMuxTest)
+
+BOOST_AUTO_TEST_CASE(test_out_of_order_responses) {
+  shared_ptr<TServerSocket> serverSocket(new TServerSocket("localhost", 0));
+  serverSocket->listen();
+
+  PlatformThreadFactory threadFactory;
+  threadFactory.setDetached(false);
+  shared_ptr<Thread> server = threadFactory.newThread(
+      shared_ptr<Runnable>(new ReversingServer(serverSocket, CALLERS, CALLERS * CALLS_PER_CALLER)));
+  server->start();
+
+  shared_ptr<TTransport> socket(new TSocket("localhost", serverSocket->getPort()));
+  shared_ptr<TBinaryProtocolFactory> protocolFactory(new TBinaryProtocolFactory());
+  TConcurrentClientMux mux(socket, protocolFactory, 8);
+
+  // Each caller always has one call outstanding, so the server sees a full
+  // batch with one call from every caller.
+  std::vector<shared_ptr<Caller> > callers;
+  std::vector<shared_ptr<Thread> > threads;
+  for (int i = 0; i < CALLERS; ++i) {
+    callers.push_back(shared_ptr<Caller>(new Caller(mux, i)));
+    threads.push_back(threadFactory.newThread(callers.back()));
+    threads.back()->start();
+  }
+  for (int i = 0; i < CALLERS; ++i) {
+    threads[i]->join();
+    BOOST_CHECK_EQUAL(callers[i]->mismatches(), 0);
+  }
+  server->join();
+
+  // The server has hung up; the reader notices and later calls fail.
+  for (int i = 0; i < 500 && !mux.isDead(); ++i) {
+    THRIFT_SLEEP_USEC(10000);
+  }
+  BOOST_CHECK(mux.isDead());
+  BOOST_CHECK_THROW(echo(mux, 1), TTransportException);
+  serverSocket->close();
+}
+
+BOOST_AUTO_TEST_CASE(test_unsent_call_releases_slot) {
+  shared_ptr<TServerSocket> serverSocket(new TServerSocket("localhost", 0));
+  serverSocket->listen();
+
+  PlatformThreadFactory threadFactory;
+  threadFactory.setDetached(false);
+  shared_ptr<Thread> server = threadFactory.newThread(
+      shared_ptr<Runnable>(new ReversingServer(serverSocket, 1, 1)));
+  server->start();
+
+  shared_ptr<TTransport> socket(new TSocket("localhost", serverSocket->getPort()));
+  shared_ptr<TBinaryProtocolFactory> protocolFactory(new TBinaryProtocolFactory());
+  TConcurrentClientMux mux(socket, protocolFactory, 1);
+
+  // A sentry that never sends gives its slot back, or the call below
+  // would wait forever for the only slot.
+  { TConcurrentMuxSendSentry abandoned(&mux); }
+  BOOST_CHECK_EQUAL(echo(mux, 42), 42);
+
+  server->join();
+  mux.close();
+  BOOST_CHECK_THROW(echo(mux, 1), TTransportException);
+  serverSocket->close();
+}
+
+BOOST_AUTO_TEST_SUITE_END()
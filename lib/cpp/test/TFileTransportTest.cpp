@@ -28,8 +28,16 @@
 #include <getopt.h>
 #include <boost/test/unit_test.hpp>
 
+#include <thrift/concurrency/PlatformThreadFactory.h>
+#include <thrift/concurrency/ThreadManager.h>
+#include <thrift/protocol/TBinaryProtocol.h>
+#include <thrift/transport/TBufferTransports.h>
 #include <thrift/transport/TFileTransport.h>
 
+#include <algorithm>
+#include <map>
+#include <vector>
+
 #ifdef __MINGW32__
   #include <io.h>
   #include <unistd.h>
@@ -39,6 +47,13 @@
 #endif
 
 using namespace apache::thrift::transport;
+using apache::thrift::concurrency::Guard;
+using apache::thrift::concurrency::Mutex;
+using apache::thrift::concurrency::PlatformThreadFactory;
+using apache::thrift::concurrency::ThreadManager;
+using apache::thrift::protocol::TBinaryProtocol;
+using apache::thrift::protocol::TBinaryProtocolFactory;
+using apache::thrift::protocol::TProtocol;
 
 /**************************************************************************
  * Global state
@@ -349,6 +364,310 @@ BOOST_AUTO_TEST_CASE(test_noop_flush) {
   }
 }
 
+/**
+ * Make sure events written in one batch, with padding between chunks, read
+ * back the same under every sync policy.
+ */
+BOOST_AUTO_TEST_CASE(test_sync_policies) {
+  const TFileTransport::SyncPolicy policies[] = {TFileTransport::SYNC_FSYNC,
+                                                 TFileTransport::SYNC_FDATASYNC,
+                                                 TFileTransport::SYNC_DSYNC,
+                                                 TFileTransport::SYNC_NONE};
+  for (size_t p = 0; p < sizeof(policies) / sizeof(policies[0]); ++p) {
+    TempFile f(tmp_dir, "thrift.TFileTransportTest.");
+    FsyncLog log;
+    fsync_log = &log;
+
+    TFileTransport* transport = new TFileTransport(f.getPath());
+    transport->setChunkSize(256);
+    transport->setSyncPolicy(policies[p]);
+    transport->setPreallocateChunks(true);
+    BOOST_CHECK_EQUAL(transport->getSyncPolicy(), policies[p]);
+    std::string events;
+    for (int i = 0; i < 200; ++i) {
+      std::string event(1 + (i * 37) % 200, static_cast<char>('a' + i % 26));
+      transport->write(reinterpret_cast<const uint8_t*>(event.data()),
+                       static_cast<uint32_t>(event.size()));
+      events += event;
+    }
+    transport->flush();
+    // The writer thread has started, so the policy is fixed now
+    transport->setSyncPolicy(TFileTransport::SYNC_FSYNC);
+    BOOST_CHECK_EQUAL(transport->getSyncPolicy(), policies[p]);
+    delete transport;
+    fsync_log = NULL;
+
+    // Only the policies that sync with fsync() show up in the log
+    if (policies[p] == TFileTransport::SYNC_FSYNC) {
+      BOOST_CHECK_GE(log.getCalls()->size(), 1u);
+    } else if (policies[p] != TFileTransport::SYNC_FDATASYNC) {
+      BOOST_CHECK_EQUAL(log.getCalls()->size(), 0u);
+    }
+
+    TFileTransport reader(f.getPath(), true);
+    reader.setChunkSize(256);
+    std::string readBack(events.size(), '\0');
+    reader.readAll(reinterpret_cast<uint8_t*>(&readBack[0]), static_cast<uint32_t>(readBack.size()));
+    BOOST_CHECK(readBack == events);
+    uint8_t extra;
+    BOOST_CHECK_EQUAL(reader.read(&extra, 1), 0u);
+  }
+}
+
+/**
+ * Writes numbered events from one thread, flushing now and then.
+ */
+class EventWriter : public apache::thrift::concurrency::Runnable {
+public:
+  EventWriter(TFileTransport& transport, uint32_t id, uint32_t count)
+    : transport_(transport), id_(id), count_(count) {}
+
+  void run() {
+    for (uint32_t i = 0; i < count_; ++i) {
+      uint32_t event[2] = {id_, i};
+      transport_.write(reinterpret_cast<const uint8_t*>(event), sizeof(event));
+      if (i % 100 == 99) {
+        transport_.flush();
+      }
+    }
+  }
+
+private:
+  TFileTransport& transport_;
+  uint32_t id_;
+  uint32_t count_;
+};
+
+/**
+ * Make sure events from many threads, more than the event buffer holds, all
+ * make it to the file, in the order each thread wrote them.
+ */
+BOOST_AUTO_TEST_CASE(test_concurrent_writers) {
+  TempFile f(tmp_dir, "thrift.TFileTransportTest.");
+  const uint32_t numThreads = 8;
+  const uint32_t numEvents = 1000;
+  {
+    TFileTransport transport(f.getPath());
+    transport.setChunkSize(1024);
+    transport.setEventBufferSize(16);
+
+    PlatformThreadFactory threadFactory;
+    threadFactory.setDetached(false);
+    std::vector<boost::shared_ptr<apache::thrift::concurrency::Thread> > threads;
+    for (uint32_t i = 0; i < numThreads; ++i) {
+      threads.push_back(threadFactory.newThread(
+          boost::shared_ptr<EventWriter>(new EventWriter(transport, i, numEvents))));
+      threads.back()->start();
+    }
+    for (uint32_t i = 0; i < numThreads; ++i) {
+      threads[i]->join();
+    }
+  }
+
+  TMappedFileTransport reader(f.getPath());
+  reader.setChunkSize(1024);
+  std::vector<uint32_t> next(numThreads, 0);
+  const uint8_t* event;
+  uint32_t len;
+  boost::shared_array<uint8_t> pin;
+  while (reader.nextEvent(&event, &len, pin)) {
+    uint32_t data[2];
+    BOOST_REQUIRE_EQUAL(len, sizeof(data));
+    memcpy(data, event, sizeof(data));
+    BOOST_REQUIRE_LT(data[0], numThreads);
+    BOOST_CHECK_EQUAL(data[1], next[data[0]]++);
+  }
+  for (uint32_t i = 0; i < numThreads; ++i) {
+    BOOST_CHECK_EQUAL(next[i], numEvents);
+  }
+}
+
+/**
+ * Writes count events to path, each an empty call named after one of
+ * numKeys keys, with sequence ids counting up per key.
+ */
+void write_replay_log(const char* path, uint32_t chunkSize, int count, int numKeys) {
+  TFileTransport transport(path);
+  transport.setChunkSize(chunkSize);
+  boost::shared_ptr<TMemoryBuffer> buffer(new TMemoryBuffer());
+  TBinaryProtocol prot(buffer);
+  std::vector<int32_t> seqids(numKeys, 0);
+  for (int i = 0; i < count; ++i) {
+    int key = (i * 3) % numKeys;
+    buffer->resetBuffer();
+    prot.writeMessageBegin(std::string(1, static_cast<char>('a' + key)),
+                           apache::thrift::protocol::T_CALL,
+                           seqids[key]++);
+    prot.writeMessageEnd();
+    // Pad events to different sizes, so that they end up at odd offsets
+    std::string padding(i % 50, 'p');
+    prot.writeString(padding);
+    uint8_t* buf;
+    uint32_t len;
+    buffer->getBuffer(&buf, &len);
+    transport.write(buf, len);
+  }
+  transport.flush();
+}
+
+/**
+ * Records the calls it is given, in the order each key's calls arrive.
+ */
+class RecordingProcessor : public apache::thrift::TProcessor {
+public:
+  bool process(boost::shared_ptr<TProtocol> in, boost::shared_ptr<TProtocol> out, void*) {
+    (void)out;
+    std::string name;
+    apache::thrift::protocol::TMessageType type;
+    int32_t seqid;
+    in->readMessageBegin(name, type, seqid);
+    Guard g(mutex_);
+    calls_[name].push_back(seqid);
+    return true;
+  }
+
+  std::map<std::string, std::vector<int32_t> > calls_;
+  Mutex mutex_;
+};
+
+// The key of an event is the single character name of its call
+uint64_t replay_key(const uint8_t* buf, uint32_t len) {
+  return len > 8 ? buf[8] : 0;
+}
+
+BOOST_AUTO_TEST_CASE(test_mapped_reader) {
+  TempFile f(tmp_dir, "thrift.TFileTransportTest.");
+  const uint32_t chunkSize = 1024;
+  write_replay_log(f.getPath(), chunkSize, 500, 5);
+
+  boost::shared_ptr<TFileTransport> fileTransport(new TFileTransport(f.getPath(), true));
+  fileTransport->setChunkSize(chunkSize);
+  boost::shared_ptr<TMappedFileTransport> mappedTransport(new TMappedFileTransport(f.getPath()));
+  mappedTransport->setChunkSize(chunkSize);
+  BOOST_CHECK_GT(mappedTransport->getNumChunks(), 10u);
+  BOOST_CHECK_EQUAL(mappedTransport->getNumChunks(), fileTransport->getNumChunks());
+
+  // Both read the same events
+  uint8_t expected[1024];
+  const uint8_t* event;
+  uint32_t len;
+  boost::shared_array<uint8_t> pin;
+  int events = 0;
+  while (mappedTransport->nextEvent(&event, &len, pin)) {
+    BOOST_REQUIRE_EQUAL(fileTransport->read(expected, sizeof(expected)), len);
+    BOOST_REQUIRE(memcmp(event, expected, len) == 0);
+    ++events;
+  }
+  BOOST_CHECK_EQUAL(events, 500);
+  BOOST_CHECK_EQUAL(fileTransport->read(expected, sizeof(expected)), 0u);
+
+  // The protocol borrows straight from the mapping
+  mappedTransport->seekToChunk(3);
+  fileTransport->seekToChunk(3);
+  TBinaryProtocol mappedProt(mappedTransport);
+  TBinaryProtocol fileProt(fileTransport);
+  std::string mappedName, fileName, mappedPadding, filePadding;
+  apache::thrift::protocol::TMessageType type;
+  int32_t mappedSeqid, fileSeqid;
+  for (int i = 0; i < 10; ++i) {
+    mappedProt.readMessageBegin(mappedName, type, mappedSeqid);
+    mappedProt.readString(mappedPadding);
+    fileProt.readMessageBegin(fileName, type, fileSeqid);
+    fileProt.readString(filePadding);
+    BOOST_CHECK_EQUAL(mappedName, fileName);
+    BOOST_CHECK_EQUAL(mappedSeqid, fileSeqid);
+    BOOST_CHECK_EQUAL(mappedPadding, filePadding);
+  }
+  BOOST_CHECK_EQUAL(mappedTransport->getCurChunk(), fileTransport->getCurChunk());
+
+  mappedTransport->seekToEnd();
+  BOOST_CHECK(!mappedTransport->peek());
+}
+
+BOOST_AUTO_TEST_CASE(test_mapped_reader_remap_mid_event) {
+  TempFile f(tmp_dir, "thrift.TFileTransportTest.");
+  const uint32_t chunkSize = 1024;
+  write_replay_log(f.getPath(), chunkSize, 10, 3);
+
+  TFileTransport fileTransport(f.getPath(), true);
+  fileTransport.setChunkSize(chunkSize);
+  TMappedFileTransport mappedTransport(f.getPath());
+  mappedTransport.setChunkSize(chunkSize);
+  uint32_t numChunks = mappedTransport.getNumChunks();
+
+  // Start on an event, then let the file grow and be mapped again
+  uint8_t expected[1024];
+  uint8_t actual[1024];
+  uint32_t len = fileTransport.read(expected, sizeof(expected));
+  BOOST_REQUIRE_GT(len, 4u);
+  BOOST_REQUIRE_EQUAL(mappedTransport.read(actual, 4), 4u);
+  write_replay_log(f.getPath(), chunkSize, 500, 3);
+  BOOST_REQUIRE_GT(mappedTransport.getNumChunks(), numChunks);
+
+  // The rest of the event still comes from the mapping it started in
+  boost::shared_array<uint8_t> pin;
+  const uint8_t* borrowed = mappedTransport.borrowPinned(len - 4, pin);
+  BOOST_REQUIRE(borrowed != NULL);
+  BOOST_CHECK(memcmp(borrowed, expected + 4, len - 4) == 0);
+  pin.reset();
+  BOOST_REQUIRE_EQUAL(mappedTransport.read(actual + 4, sizeof(actual) - 4), len - 4);
+  BOOST_CHECK(memcmp(actual, expected, len) == 0);
+
+  // And the next events come from the new mapping
+  int events = 1;
+  while ((len = fileTransport.read(expected, sizeof(expected))) > 0) {
+    BOOST_REQUIRE_EQUAL(mappedTransport.read(actual, sizeof(actual)), len);
+    BOOST_REQUIRE(memcmp(actual, expected, len) == 0);
+    ++events;
+  }
+  BOOST_CHECK_EQUAL(events, 510);
+}
+
+BOOST_AUTO_TEST_CASE(test_parallel_replay) {
+  TempFile f(tmp_dir, "thrift.TFileTransportTest.");
+  const uint32_t chunkSize = 1024;
+  const int numEvents = 2000;
+  const int numKeys = 7;
+  write_replay_log(f.getPath(), chunkSize, numEvents, numKeys);
+
+  boost::shared_ptr<ThreadManager> threadManager = ThreadManager::newSimpleThreadManager(4);
+  threadManager->threadFactory(boost::shared_ptr<PlatformThreadFactory>(new PlatformThreadFactory()));
+  threadManager->start();
+
+  for (int keyed = 0; keyed < 2; ++keyed) {
+    boost::shared_ptr<TMappedFileTransport> transport(new TMappedFileTransport(f.getPath()));
+    transport->setChunkSize(chunkSize);
+    boost::shared_ptr<RecordingProcessor> processor(new RecordingProcessor());
+    TFileProcessor fileProcessor(processor,
+                                 boost::shared_ptr<TBinaryProtocolFactory>(new TBinaryProtocolFactory()),
+                                 transport);
+    if (keyed) {
+      fileProcessor.processParallel(threadManager, replay_key);
+    } else {
+      fileProcessor.processParallel(threadManager);
+    }
+
+    // Every call was made once; with a key function, in order
+    BOOST_CHECK_EQUAL(processor->calls_.size(), static_cast<size_t>(numKeys));
+    int total = 0;
+    for (std::map<std::string, std::vector<int32_t> >::iterator it = processor->calls_.begin();
+         it != processor->calls_.end();
+         ++it) {
+      std::vector<int32_t>& seqids = it->second;
+      total += static_cast<int>(seqids.size());
+      if (!keyed) {
+        std::sort(seqids.begin(), seqids.end());
+      }
+      for (size_t i = 0; i < seqids.size(); ++i) {
+        BOOST_CHECK_EQUAL(seqids[i], static_cast<int32_t>(i));
+      }
+    }
+    BOOST_CHECK_EQUAL(total, numEvents);
+    BOOST_CHECK(!transport->peek());
+  }
+  threadManager->stop();
+}
+
 /**************************************************************************
  * General Initialization
  **************************************************************************/
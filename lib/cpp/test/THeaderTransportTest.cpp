@@ -0,0 +1,332 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements. See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership. The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied. See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+#define BOOST_TEST_MODULE THeaderTransportTest
+#include <boost/test/unit_test.hpp>
+
+#include <limits>
+#include <stdexcept>
+#include <string>
+
+#include <thrift/TDeadline.h>
+#include <thrift/processor/TDeadlineProcessor.h>
+#include <thrift/protocol/THeaderProtocol.h>
+#include <thrift/transport/TBufferTransports.h>
+#include <thrift/transport/THeaderTransport.h>
+
+using apache::thrift::TApplicationException;
+using apache::thrift::TDeadline;
+using apache::thrift::TDeadlineProcessor;
+using apache::thrift::TDeadlineScope;
+using apache::thrift::TProcessor;
+using apache::thrift::protocol::THeaderProtocol;
+using apache::thrift::protocol::TMessageType;
+using apache::thrift::protocol::TProtocol;
+using apache::thrift::transport::THeaderTransport;
+using apache::thrift::transport::THeaderZstdDictionary;
+using apache::thrift::transport::TMemoryBuffer;
+using apache::thrift::transport::TTransportException;
+using boost::shared_ptr;
+
+namespace {
+
+void writeFrame(THeaderTransport& transport, const std::string& payload) {
+  transport.write(reinterpret_cast<const uint8_t*>(payload.data()),
+                  static_cast<uint32_t>(payload.size()));
+  transport.flush();
+}
+
+std::string readFrame(THeaderTransport& transport, uint32_t len) {
+  std::string payload(len, '\0');
+  transport.readAll(reinterpret_cast<uint8_t*>(&payload[0]), len);
+  return payload;
+}
+
+void writeCall(THeaderProtocol& protocol, TMessageType type, int64_t timeout) {
+  TDeadline::setTimeout(protocol.getWriteHeaders(), timeout);
+  protocol.writeMessageBegin("call", type, 1);
+  protocol.writeStructBegin("args");
+  protocol.writeFieldStop();
+  protocol.writeStructEnd();
+  protocol.writeMessageEnd();
+  protocol.getTransport()->writeEnd();
+  protocol.getTransport()->flush();
+}
+
+// Answers every call with an empty reply, noting the time it had left
+class RemainingProcessor : public TProcessor {
+public:
+  RemainingProcessor() : calls(0), remaining(0) {}
+
+  bool process(shared_ptr<TProtocol> in, shared_ptr<TProtocol> out, void*) {
+    std::string name;
+    TMessageType type;
+    int32_t seqid;
+    in->readMessageBegin(name, type, seqid);
+    in->skip(apache::thrift::protocol::T_STRUCT);
+    in->readMessageEnd();
+    in->getTransport()->readEnd();
+    ++calls;
+    remaining = TDeadline::remaining();
+    out->writeMessageBegin(name, apache::thrift::protocol::T_REPLY, seqid);
+    out->writeStructBegin("result");
+    out->writeFieldStop();
+    out->writeStructEnd();
+    out->writeMessageEnd();
+    out->getTransport()->writeEnd();
+    out->getTransport()->flush();
+    return true;
+  }
+
+  int calls;
+  int64_t remaining;
+};
+}
+
+BOOST_AUTO_TEST_SUITE(THeaderTransportTest)
+
+BOOST_AUTO_TEST_CASE(test_zlib_frames_reuse_streams) {
+  shared_ptr<TMemoryBuffer> buffer(new TMemoryBuffer());
+  THeaderTransport writer(buffer);
+  THeaderTransport reader(buffer);
+  writer.setTransform(THeaderTransport::ZLIB_TRANSFORM);
+  writer.setZlibCompressionLevel(9);
+
+  // Frames after the first go through the same, reset, streams.
+  for (int i = 0; i < 3; ++i) {
+    std::string payload(100000, static_cast<char>('a' + i));
+    writeFrame(writer, payload);
+    BOOST_CHECK_LT(buffer->available_read(), 1000u);
+    BOOST_CHECK_EQUAL(readFrame(reader, 100000), payload);
+  }
+
+  // A new level takes effect on the next frame.
+  writer.setZlibCompressionLevel(0);
+  std::string payload(1000, 'z');
+  writeFrame(writer, payload);
+  BOOST_CHECK_GT(buffer->available_read(), 1000u);
+  BOOST_CHECK_EQUAL(readFrame(reader, 1000), payload);
+}
+
+BOOST_AUTO_TEST_CASE(test_small_frames_skip_zlib) {
+  shared_ptr<TMemoryBuffer> buffer(new TMemoryBuffer());
+  THeaderTransport writer(buffer);
+  THeaderTransport reader(buffer);
+  writer.setTransform(THeaderTransport::ZLIB_TRANSFORM);
+  writer.setMinCompressBytes(100);
+
+  // Sent as is, and the reader does not try to inflate it.
+  std::string small(64, 's');
+  writeFrame(writer, small);
+  BOOST_CHECK(buffer->getBufferAsString().find(small) != std::string::npos);
+  BOOST_CHECK_EQUAL(readFrame(reader, 64), small);
+
+  std::string large(4096, 'l');
+  writeFrame(writer, large);
+  BOOST_CHECK(buffer->getBufferAsString().find(large) == std::string::npos);
+  BOOST_CHECK_EQUAL(readFrame(reader, 4096), large);
+}
+
+BOOST_AUTO_TEST_CASE(test_zlib_decompressed_size_limit) {
+  shared_ptr<TMemoryBuffer> buffer(new TMemoryBuffer());
+  THeaderTransport writer(buffer);
+  THeaderTransport reader(buffer);
+  writer.setTransform(THeaderTransport::ZLIB_TRANSFORM);
+  writer.setZlibCompressionLevel(9);
+  BOOST_CHECK_EQUAL(reader.getMaxUncompressedSize(),
+                    THeaderTransport::DEFAULT_MAX_UNCOMPRESSED_SIZE);
+
+  // A frame right at the limit is fine
+  reader.setMaxUncompressedSize(100000);
+  std::string payload(100000, 'a');
+  writeFrame(writer, payload);
+  BOOST_CHECK_EQUAL(readFrame(reader, 100000), payload);
+
+  // A small frame that inflates past it is refused
+  payload.resize(1000000, 'b');
+  writeFrame(writer, payload);
+  BOOST_CHECK_LT(buffer->available_read(), 10000u);
+  BOOST_CHECK_THROW(readFrame(reader, 1000000), TTransportException);
+}
+
+BOOST_AUTO_TEST_CASE(test_lz4_and_zstd_frames) {
+  const uint16_t transforms[] = {THeaderTransport::LZ4_TRANSFORM,
+                                 THeaderTransport::ZSTD_TRANSFORM};
+  for (size_t t = 0; t < sizeof(transforms) / sizeof(transforms[0]); ++t) {
+    shared_ptr<TMemoryBuffer> buffer(new TMemoryBuffer());
+    THeaderTransport writer(buffer);
+    THeaderTransport reader(buffer);
+    writer.setTransform(transforms[t]);
+
+    std::string payload;
+    for (int i = 0; i < 100; ++i) {
+      payload += "a repetitive payload ";
+    }
+    if (!THeaderTransport::isTransformSupported(transforms[t])) {
+      BOOST_CHECK_THROW(writeFrame(writer, payload), apache::thrift::TException);
+      continue;
+    }
+
+    for (int i = 0; i < 3; ++i) {
+      writeFrame(writer, payload);
+      BOOST_CHECK_LT(buffer->available_read(), payload.size() / 4);
+      BOOST_CHECK_EQUAL(readFrame(reader, static_cast<uint32_t>(payload.size())), payload);
+    }
+
+    // Random looking data does not shrink and is sent as it is.
+    std::string noise;
+    uint32_t x = 12345;
+    for (int i = 0; i < 300; ++i) {
+      x = x * 1103515245 + 12345;
+      noise += static_cast<char>(x >> 24);
+    }
+    writeFrame(writer, noise);
+    BOOST_CHECK(buffer->getBufferAsString().find(noise) != std::string::npos);
+    BOOST_CHECK_EQUAL(readFrame(reader, 300), noise);
+  }
+}
+
+BOOST_AUTO_TEST_CASE(test_zstd_dictionary) {
+  if (!THeaderTransport::isTransformSupported(THeaderTransport::ZSTD_TRANSFORM)) {
+    return;
+  }
+  shared_ptr<THeaderZstdDictionary> dictionary(
+      new THeaderZstdDictionary("user_id=; session=; locale=en_US; timezone=UTC; flags=;"));
+  shared_ptr<TMemoryBuffer> buffer(new TMemoryBuffer());
+  THeaderTransport writer(buffer);
+  THeaderTransport reader(buffer);
+  writer.setTransform(THeaderTransport::ZSTD_TRANSFORM);
+  writer.setZstdDictionary(dictionary);
+  reader.setZstdDictionary(dictionary);
+
+  std::string payload("user_id=42; session=abc; locale=en_US; timezone=UTC; flags=;");
+  writeFrame(writer, payload);
+  BOOST_CHECK_EQUAL(readFrame(reader, static_cast<uint32_t>(payload.size())), payload);
+}
+
+BOOST_AUTO_TEST_CASE(test_invalid_zlib_level) {
+  shared_ptr<TMemoryBuffer> buffer(new TMemoryBuffer());
+  THeaderTransport transport(buffer);
+  BOOST_CHECK_THROW(transport.setZlibCompressionLevel(10), std::invalid_argument);
+  BOOST_CHECK_THROW(transport.setZlibCompressionLevel(-2), std::invalid_argument);
+  BOOST_CHECK_EQUAL(transport.getZlibCompressionLevel(), THeaderTransport::DEFAULT_ZLIB_LEVEL);
+}
+
+BOOST_AUTO_TEST_CASE(test_deadline_headers) {
+  TDeadline::Headers headers;
+  int64_t timeout;
+  BOOST_CHECK(!TDeadline::getTimeout(headers, timeout));
+  TDeadline::setTimeout(headers, 250);
+  BOOST_CHECK(TDeadline::getTimeout(headers, timeout));
+  BOOST_CHECK_EQUAL(timeout, 250);
+  headers[TDeadline::HEADER] = "soon";
+  BOOST_CHECK(!TDeadline::getTimeout(headers, timeout));
+
+  // Outside of a call there is nothing to pass on
+  BOOST_CHECK_EQUAL(TDeadline::remaining(), TDeadline::NONE);
+  BOOST_CHECK(!TDeadline::expired());
+  TDeadline::propagate(headers);
+  BOOST_CHECK(headers.empty());
+
+  {
+    TDeadlineScope deadlineScope(apache::thrift::concurrency::Util::currentTime() + 10000);
+    TDeadline::propagate(headers);
+    BOOST_CHECK(TDeadline::getTimeout(headers, timeout));
+    BOOST_CHECK_GT(timeout, 0);
+    BOOST_CHECK_LE(timeout, 10000);
+  }
+  {
+    TDeadlineScope deadlineScope(apache::thrift::concurrency::Util::currentTime() - 1);
+    BOOST_CHECK(TDeadline::expired());
+    TDeadline::propagate(headers);
+    BOOST_CHECK(TDeadline::getTimeout(headers, timeout));
+    BOOST_CHECK_EQUAL(timeout, 0);
+  }
+  BOOST_CHECK_EQUAL(TDeadline::current(), TDeadline::NONE);
+}
+
+BOOST_AUTO_TEST_CASE(test_deadline_processor) {
+  shared_ptr<TMemoryBuffer> requests(new TMemoryBuffer());
+  shared_ptr<TMemoryBuffer> responses(new TMemoryBuffer());
+  THeaderProtocol client(responses, requests, apache::thrift::protocol::T_BINARY_PROTOCOL);
+  shared_ptr<THeaderProtocol> server(
+      new THeaderProtocol(requests, responses, apache::thrift::protocol::T_BINARY_PROTOCOL));
+  shared_ptr<RemainingProcessor> handler(new RemainingProcessor());
+  TDeadlineProcessor processor(handler);
+
+  std::string name;
+  TMessageType type;
+  int32_t seqid;
+
+  // A call with time left reaches the handler, which sees its deadline
+  writeCall(client, apache::thrift::protocol::T_CALL, 10000);
+  BOOST_CHECK(processor.process(server, server, NULL));
+  BOOST_CHECK_EQUAL(handler->calls, 1);
+  BOOST_CHECK_GT(handler->remaining, 0);
+  BOOST_CHECK_LE(handler->remaining, 10000);
+  client.readMessageBegin(name, type, seqid);
+  BOOST_CHECK_EQUAL(type, apache::thrift::protocol::T_REPLY);
+  client.skip(apache::thrift::protocol::T_STRUCT);
+  client.readMessageEnd();
+
+  // An expired one is answered without it
+  writeCall(client, apache::thrift::protocol::T_CALL, 0);
+  BOOST_CHECK(processor.process(server, server, NULL));
+  BOOST_CHECK_EQUAL(handler->calls, 1);
+  client.readMessageBegin(name, type, seqid);
+  BOOST_CHECK_EQUAL(type, apache::thrift::protocol::T_EXCEPTION);
+  TApplicationException x;
+  x.read(&client);
+  client.readMessageEnd();
+  BOOST_CHECK_EQUAL(x.getType(), TApplicationException::INTERNAL_ERROR);
+
+  // Time spent queued at the server counts
+  {
+    apache::thrift::TReceivedScope receivedScope(
+        apache::thrift::concurrency::Util::currentTime() - 1000);
+    writeCall(client, apache::thrift::protocol::T_ONEWAY, 500);
+    BOOST_CHECK(processor.process(server, server, NULL));
+    BOOST_CHECK_EQUAL(handler->calls, 1);
+    BOOST_CHECK_EQUAL(responses->available_read(), 0u);
+  }
+
+  // A timeout too large for a deadline does not wrap around into the past
+  writeCall(client, apache::thrift::protocol::T_CALL, std::numeric_limits<int64_t>::max());
+  BOOST_CHECK(processor.process(server, server, NULL));
+  BOOST_CHECK_EQUAL(handler->calls, 2);
+  BOOST_CHECK_EQUAL(handler->remaining, TDeadline::NONE);
+  client.readMessageBegin(name, type, seqid);
+  BOOST_CHECK_EQUAL(type, apache::thrift::protocol::T_REPLY);
+  client.skip(apache::thrift::protocol::T_STRUCT);
+  client.readMessageEnd();
+
+  // Calls without a timeout have no deadline
+  client.clearHeaders();
+  client.writeMessageBegin("call", apache::thrift::protocol::T_CALL, 2);
+  client.writeStructBegin("args");
+  client.writeFieldStop();
+  client.writeStructEnd();
+  client.writeMessageEnd();
+  client.getTransport()->writeEnd();
+  client.getTransport()->flush();
+  BOOST_CHECK(processor.process(server, server, NULL));
+  BOOST_CHECK_EQUAL(handler->calls, 3);
+  BOOST_CHECK_EQUAL(handler->remaining, TDeadline::NONE);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -19,10 +19,15 @@
 
 #define BOOST_TEST_MODULE TNonblockingServerTest
 #include <boost/test/unit_test.hpp>
+#include <boost/filesystem.hpp>
 #include <boost/smart_ptr.hpp>
 
+#include "thrift/TApplicationException.h"
 #include "thrift/concurrency/Thread.h"
 #include "thrift/server/TNonblockingServer.h"
+#ifdef HAVE_OPENSSL
+#include "thrift/transport/TSSLSocket.h"
+#endif
 
 #include "gen-cpp/ParentService.h"
 
@@ -44,13 +49,24 @@ struct Handler : public test::ParentServiceIf {
   void unexpectedExceptionWait(const std::string&) {}
 };
 
+struct RejectingLimiter : public server::TConcurrencyLimiter {
+  bool tryAcquire() { return false; }
+  void release() {}
+};
+
 class Fixture {
 private:
   struct Runner : public apache::thrift::concurrency::Runnable {
     int port;
+    bool reusePort;
+    size_t maxPipelinedRequests;
     boost::shared_ptr<event_base> userEventBase;
     boost::shared_ptr<TProcessor> processor;
+    boost::shared_ptr<server::TConcurrencyLimiter> concurrencyLimiter;
     boost::shared_ptr<server::TNonblockingServer> server;
+#ifdef HAVE_OPENSSL
+    boost::shared_ptr<transport::TSSLSocketFactory> sslSocketFactory;
+#endif
 
     virtual void run() {
       // When binding to explicit port, allow retrying to workaround bind failures on ports in use
@@ -62,6 +78,25 @@ private:
     void startServer(int retry_count) {
       try {
         server.reset(new server::TNonblockingServer(processor, port));
+        if (reusePort) {
+          server->setNumIOThreads(4);
+          server->setReusePort(true);
+        }
+        if (maxPipelinedRequests > 1 || concurrencyLimiter) {
+          boost::shared_ptr<concurrency::ThreadManager> threadManager
+              = concurrency::ThreadManager::newSimpleThreadManager(4);
+          threadManager->threadFactory(
+              boost::make_shared<concurrency::PlatformThreadFactory>());
+          threadManager->start();
+          server->setThreadManager(threadManager);
+          server->setMaxPipelinedRequests(maxPipelinedRequests);
+          server->setConcurrencyLimiter(concurrencyLimiter);
+        }
+#ifdef HAVE_OPENSSL
+        if (sslSocketFactory) {
+          server->setSSLSocketFactory(sslSocketFactory);
+        }
+#endif
         if (userEventBase) {
           server->registerEvents(userEventBase.get());
         }
@@ -82,7 +117,10 @@ private:
   };
 
 protected:
-  Fixture() : processor(new test::ParentServiceProcessor(boost::make_shared<Handler>())) {}
+  Fixture()
+    : reusePort_(false),
+      maxPipelinedRequests_(1),
+      processor(new test::ParentServiceProcessor(boost::make_shared<Handler>())) {}
 
   ~Fixture() {
     if (server) {
@@ -97,11 +135,46 @@ protected:
     userEventBase_.reset(user_event_base, EventDeleter());
   }
 
+  void setReusePort(bool reusePort) { reusePort_ = reusePort; }
+
+  void setMaxPipelinedRequests(size_t maxRequests) { maxPipelinedRequests_ = maxRequests; }
+
+  void setConcurrencyLimiter(boost::shared_ptr<server::TConcurrencyLimiter> limiter) {
+    concurrencyLimiter_ = limiter;
+  }
+
+#ifdef HAVE_OPENSSL
+  void enableTLS() {
+    // The test certificates live in test/keys, or in the directory given as
+    // the last argument
+    using namespace boost::unit_test::framework;
+    boost::filesystem::path keyDir = boost::filesystem::current_path().parent_path().parent_path()
+                                         .parent_path() / "test" / "keys";
+    if (!boost::filesystem::exists(keyDir / "server.crt")) {
+      keyDir = master_test_suite().argv[master_test_suite().argc - 1];
+    }
+
+    sslServerFactory_.reset(new transport::TSSLSocketFactory(transport::SSLTLS));
+    sslServerFactory_->loadCertificate((keyDir / "server.crt").string().c_str());
+    sslServerFactory_->loadPrivateKey((keyDir / "server.key").string().c_str());
+
+    sslClientFactory_.reset(new transport::TSSLSocketFactory(transport::SSLTLS));
+    sslClientFactory_->loadTrustedCertificates((keyDir / "CA.pem").string().c_str());
+    sslClientFactory_->authenticate(true);
+  }
+#endif
+
   int startServer(int port) {
     boost::shared_ptr<Runner> runner(new Runner);
     runner->port = port;
+    runner->reusePort = reusePort_;
+    runner->maxPipelinedRequests = maxPipelinedRequests_;
+    runner->concurrencyLimiter = concurrencyLimiter_;
     runner->processor = processor;
     runner->userEventBase = userEventBase_;
+#ifdef HAVE_OPENSSL
+    runner->sslSocketFactory = sslServerFactory_;
+#endif
 
     boost::scoped_ptr<apache::thrift::concurrency::ThreadFactory> threadFactory(
         new apache::thrift::concurrency::PlatformThreadFactory(
@@ -119,7 +192,15 @@ protected:
   }
 
   bool canCommunicate(int serverPort) {
-    boost::shared_ptr<transport::TSocket> socket(new transport::TSocket("localhost", serverPort));
+    boost::shared_ptr<transport::TSocket> socket;
+#ifdef HAVE_OPENSSL
+    if (sslClientFactory_) {
+      socket = sslClientFactory_->createSocket("localhost", serverPort);
+    }
+#endif
+    if (!socket) {
+      socket.reset(new transport::TSocket("localhost", serverPort));
+    }
     socket->open();
     test::ParentServiceClient client(boost::make_shared<protocol::TBinaryProtocol>(
         boost::make_shared<transport::TFramedTransport>(socket)));
@@ -130,9 +211,16 @@ protected:
   }
 
 private:
+  bool reusePort_;
+  size_t maxPipelinedRequests_;
+  boost::shared_ptr<server::TConcurrencyLimiter> concurrencyLimiter_;
   boost::shared_ptr<event_base> userEventBase_;
   boost::shared_ptr<test::ParentServiceProcessor> processor;
 protected:
+#ifdef HAVE_OPENSSL
+  boost::shared_ptr<transport::TSSLSocketFactory> sslServerFactory_;
+  boost::shared_ptr<transport::TSSLSocketFactory> sslClientFactory_;
+#endif
   boost::shared_ptr<server::TNonblockingServer> server;
 private:
   boost::shared_ptr<apache::thrift::concurrency::Thread> thread;
@@ -162,6 +250,109 @@ BOOST_FIXTURE_TEST_CASE(get_assigned_port, Fixture) {
   BOOST_CHECK_EQUAL(server->getListenPort(), 0);
 }
 
+BOOST_FIXTURE_TEST_CASE(reuse_port_listeners, Fixture) {
+  setReusePort(true);
+  startServer(0);
+  int assigned_port = server->getListenPort();
+  BOOST_REQUIRE_NE(assigned_port, 0);
+
+  // connections land on whichever IO thread the kernel picks
+  for (size_t i = 0; i < 8; ++i) {
+    boost::shared_ptr<transport::TSocket> socket(new transport::TSocket("localhost", assigned_port));
+    socket->open();
+    test::ParentServiceClient client(boost::make_shared<protocol::TBinaryProtocol>(
+        boost::make_shared<transport::TFramedTransport>(socket)));
+    client.addString("foo");
+    std::vector<std::string> strings;
+    client.getStrings(strings);
+    BOOST_CHECK_EQUAL(strings.size(), i + 1);
+  }
+}
+
+BOOST_FIXTURE_TEST_CASE(connections_are_reused, Fixture) {
+  startServer(0);
+  for (size_t i = 0; i < 3; ++i) {
+    BOOST_CHECK(canCommunicate(server->getListenPort()));
+    // wait 100 ms for the server to see the client go
+    THRIFT_SLEEP_USEC(100000);
+    BOOST_CHECK_EQUAL(server->getNumConnections(), 1u);
+    BOOST_CHECK_EQUAL(server->getNumIdleConnections(), 1u);
+  }
+}
+
+BOOST_FIXTURE_TEST_CASE(pipelined_requests, Fixture) {
+  setMaxPipelinedRequests(8);
+  startServer(0);
+  BOOST_CHECK(canCommunicate(server->getListenPort()));
+}
+
+BOOST_FIXTURE_TEST_CASE(rejected_calls_get_exceptions, Fixture) {
+  setConcurrencyLimiter(boost::make_shared<RejectingLimiter>());
+  startServer(0);
+
+  // The connection stays usable after a call is turned away
+  boost::shared_ptr<transport::TSocket> socket(
+      new transport::TSocket("localhost", server->getListenPort()));
+  socket->open();
+  test::ParentServiceClient client(boost::make_shared<protocol::TBinaryProtocol>(
+      boost::make_shared<transport::TFramedTransport>(socket)));
+  std::vector<std::string> strings;
+  BOOST_CHECK_THROW(client.getStrings(strings), TApplicationException);
+  BOOST_CHECK_THROW(client.getStrings(strings), TApplicationException);
+}
+
+BOOST_FIXTURE_TEST_CASE(pipelined_rejected_calls_get_exceptions, Fixture) {
+  setConcurrencyLimiter(boost::make_shared<RejectingLimiter>());
+  setMaxPipelinedRequests(8);
+  startServer(0);
+
+  // All calls are sent before any answer is read, so they are rejected
+  // while the others are still pending on the connection
+  boost::shared_ptr<transport::TSocket> socket(
+      new transport::TSocket("localhost", server->getListenPort()));
+  socket->open();
+  test::ParentServiceClient client(boost::make_shared<protocol::TBinaryProtocol>(
+      boost::make_shared<transport::TFramedTransport>(socket)));
+  for (int i = 0; i < 4; ++i) {
+    client.send_getStrings();
+  }
+  std::vector<std::string> strings;
+  for (int i = 0; i < 4; ++i) {
+    BOOST_CHECK_THROW(client.recv_getStrings(strings), TApplicationException);
+  }
+  BOOST_CHECK_THROW(client.getStrings(strings), TApplicationException);
+}
+
+#ifdef HAVE_OPENSSL
+BOOST_FIXTURE_TEST_CASE(tls_connections, Fixture) {
+  enableTLS();
+  startServer(0);
+  BOOST_CHECK(canCommunicate(server->getListenPort()));
+}
+
+BOOST_FIXTURE_TEST_CASE(tls_pipelined_requests, Fixture) {
+  enableTLS();
+  setMaxPipelinedRequests(8);
+  startServer(0);
+  BOOST_CHECK(canCommunicate(server->getListenPort()));
+}
+
+BOOST_FIXTURE_TEST_CASE(tls_sessions_are_resumed, Fixture) {
+  enableTLS();
+  startServer(0);
+  BOOST_CHECK(sslServerFactory_->server());
+  for (int i = 0; i < 3; ++i) {
+    BOOST_CHECK(canCommunicate(server->getListenPort()));
+  }
+
+  // Only the first connection negotiates a session
+  BOOST_CHECK_EQUAL(sslClientFactory_->sessionMisses(), 1u);
+  BOOST_CHECK_EQUAL(sslClientFactory_->sessionHits(), 2u);
+  BOOST_CHECK_EQUAL(sslServerFactory_->sessionMisses(), 1u);
+  BOOST_CHECK_EQUAL(sslServerFactory_->sessionHits(), 2u);
+}
+#endif
+
 BOOST_FIXTURE_TEST_CASE(provide_event_base, Fixture) {
   event_base* eb = event_base_new();
   setEventBase(eb);
@@ -98,6 +98,30 @@ int main(int argc, char** argv) {
     TimerManagerTests timerManagerTests;
 
     assert(timerManagerTests.test00());
+
+    std::cout << "\t\tTimerManager test01" << std::endl;
+
+    assert(timerManagerTests.test01());
+  }
+
+  if (runAll || args[0].compare("timer-manager-benchmark") == 0) {
+
+    std::cout << "TimerManager benchmark tests..." << std::endl;
+
+    {
+
+      size_t count = 100000;
+
+      for (size_t threadCount = 1; threadCount <= 8; threadCount *= 2) {
+
+        std::cout << "\t\tTimerManager add/remove test: thread count: " << threadCount
+                  << " timers per thread: " << count << std::endl;
+
+        TimerManagerTests timerManagerTests;
+
+        timerManagerTests.benchmark(count, threadCount);
+      }
+    }
   }
 
   if (runAll || args[0].compare("thread-manager") == 0) {
@@ -123,6 +147,28 @@ int main(int argc, char** argv) {
                 << " delay: " << delay << std::endl;
 
       assert(threadManagerTests.blockTest(delay, workerCount));
+
+      std::cout << "\t\tThreadManager expire test" << std::endl;
+
+      assert(threadManagerTests.expireTest());
+
+      std::cout << "\t\tLockFreeThreadManager load test: worker count: " << workerCount
+                << " task count: " << taskCount << " delay: " << delay << std::endl;
+
+      assert(threadManagerTests.loadTest(taskCount, delay, workerCount, true));
+
+      std::cout << "\t\tLockFreeThreadManager block test: worker count: " << workerCount
+                << " delay: " << delay << std::endl;
+
+      assert(threadManagerTests.blockTest(delay, workerCount, true));
+
+      std::cout << "\t\tLockFreeThreadManager expire test" << std::endl;
+
+      assert(threadManagerTests.expireTest(10, true));
+
+      std::cout << "\t\tLockFreeThreadManager remove test" << std::endl;
+
+      assert(threadManagerTests.removeTest());
     }
   }
 
@@ -150,6 +196,11 @@ int main(int argc, char** argv) {
         ThreadManagerTests threadManagerTests;
 
         threadManagerTests.loadTest(taskCount, delay, workerCount);
+
+        std::cout << "\t\tLockFreeThreadManager load test: worker count: " << workerCount
+                  << " task count: " << taskCount << " delay: " << delay << std::endl;
+
+        threadManagerTests.loadTest(taskCount, delay, workerCount, true);
       }
     }
   }
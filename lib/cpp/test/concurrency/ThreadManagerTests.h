@@ -90,18 +90,28 @@ public:
     Monitor _sleep;
   };
 
+  static shared_ptr<ThreadManager> newThreadManager(size_t workerCount,
+                                                    size_t pendingTaskCountMax,
+                                                    bool lockFree) {
+    return lockFree ? ThreadManager::newLockFreeThreadManager(workerCount, pendingTaskCountMax)
+                    : ThreadManager::newSimpleThreadManager(workerCount, pendingTaskCountMax);
+  }
+
   /**
    * Dispatch count tasks, each of which blocks for timeout milliseconds then
    * completes. Verify that all tasks completed and that thread manager cleans
    * up properly on delete.
    */
-  bool loadTest(size_t count = 100, int64_t timeout = 100LL, size_t workerCount = 4) {
+  bool loadTest(size_t count = 100,
+                int64_t timeout = 100LL,
+                size_t workerCount = 4,
+                bool lockFree = false) {
 
     Monitor monitor;
 
     size_t activeCount = count;
 
-    shared_ptr<ThreadManager> threadManager = ThreadManager::newSimpleThreadManager(workerCount);
+    shared_ptr<ThreadManager> threadManager = newThreadManager(workerCount, 0, lockFree);
 
     shared_ptr<PlatformThreadFactory> threadFactory
         = shared_ptr<PlatformThreadFactory>(new PlatformThreadFactory());
@@ -234,7 +244,7 @@ public:
    * Block test.  Create pendingTaskCountMax tasks.  Verify that we block adding the
    * pendingTaskCountMax + 1th task.  Verify that we unblock when a task completes */
 
-  bool blockTest(int64_t timeout = 100LL, size_t workerCount = 2) {
+  bool blockTest(int64_t timeout = 100LL, size_t workerCount = 2, bool lockFree = false) {
     (void)timeout;
     bool success = false;
 
@@ -248,7 +258,7 @@ public:
       size_t activeCounts[] = {workerCount, pendingTaskMaxCount, 1};
 
       shared_ptr<ThreadManager> threadManager
-          = ThreadManager::newSimpleThreadManager(workerCount, pendingTaskMaxCount);
+          = newThreadManager(workerCount, pendingTaskMaxCount, lockFree);
 
       shared_ptr<PlatformThreadFactory> threadFactory
           = shared_ptr<PlatformThreadFactory>(new PlatformThreadFactory());
@@ -381,6 +391,167 @@ public:
     std::cout << "\t\t\t" << (success ? "Success" : "Failure") << std::endl;
     return success;
   }
+
+  class CountTask : public Runnable {
+
+  public:
+    CountTask(Monitor& monitor, size_t& count) : _monitor(monitor), _count(count) {}
+
+    void run() {
+      Synchronized s(_monitor);
+      _count++;
+      _monitor.notify();
+    }
+
+    Monitor& _monitor;
+    size_t& _count;
+  };
+
+  static void countExpired(size_t* expired, shared_ptr<Runnable> task) {
+    (void)task;
+    (*expired)++;
+  }
+
+  /**
+   * Expiration test.  Queue count tasks with a short expiration behind a
+   * blocked worker.  Verify that none of them run, that each is passed to the
+   * expire callback, and that tasks without expiration still run.
+   */
+  bool expireTest(size_t count = 10, bool lockFree = false) {
+    bool success = false;
+
+    try {
+
+      Monitor bmonitor;
+      Monitor monitor;
+      size_t activeCount = 1;
+      size_t ranCount = 0;
+      size_t expiredCount = 0;
+
+      shared_ptr<ThreadManager> threadManager = newThreadManager(1, 0, lockFree);
+
+      threadManager->threadFactory(
+          shared_ptr<PlatformThreadFactory>(new PlatformThreadFactory()));
+
+      threadManager->setExpireCallback(
+          apache::thrift::stdcxx::bind(&ThreadManagerTests::countExpired,
+                                       &expiredCount,
+                                       apache::thrift::stdcxx::placeholders::_1));
+
+      threadManager->start();
+
+      threadManager->add(shared_ptr<Runnable>(new BlockTask(monitor, bmonitor, activeCount)));
+
+      for (size_t ix = 0; ix < count; ix++) {
+        threadManager->add(shared_ptr<Runnable>(new CountTask(monitor, ranCount)), 0, 1LL);
+      }
+
+      {
+        Monitor sleep;
+        Synchronized s(sleep);
+
+        try {
+          sleep.wait(20);
+        } catch (TimedOutException&) {
+          ;
+        }
+      }
+
+      {
+        Synchronized s(bmonitor);
+
+        bmonitor.notifyAll();
+      }
+
+      threadManager->add(shared_ptr<Runnable>(new CountTask(monitor, ranCount)));
+
+      {
+        Synchronized s(monitor);
+
+        while (ranCount == 0) {
+          monitor.wait();
+        }
+      }
+
+      threadManager->join();
+
+      size_t expiredTaskCount = threadManager->expiredTaskCount();
+
+      std::cout << "\t\t\t"
+                << "ran " << ranCount << " expired " << expiredTaskCount << std::endl;
+
+      success = ranCount == 1 && expiredCount == count && expiredTaskCount == count;
+
+    } catch (TException& e) {
+      std::cout << "ERROR: " << e.what() << std::endl;
+    }
+
+    std::cout << "\t\t\t" << (success ? "Success" : "Failure") << std::endl;
+    return success;
+  }
+
+  /**
+   * Removal test.  Queue three tasks behind a blocked worker and remove the
+   * middle one.  Verify that only the other two run.
+   */
+  bool removeTest() {
+    bool success = false;
+
+    try {
+
+      Monitor bmonitor;
+      Monitor monitor;
+      size_t activeCount = 1;
+      size_t ranCount = 0;
+
+      shared_ptr<ThreadManager> threadManager = newThreadManager(1, 0, true);
+
+      threadManager->threadFactory(
+          shared_ptr<PlatformThreadFactory>(new PlatformThreadFactory()));
+
+      threadManager->start();
+
+      threadManager->add(shared_ptr<Runnable>(new BlockTask(monitor, bmonitor, activeCount)));
+
+      shared_ptr<Runnable> tasks[3];
+      for (size_t ix = 0; ix < 3; ix++) {
+        tasks[ix] = shared_ptr<Runnable>(new CountTask(monitor, ranCount));
+        threadManager->add(tasks[ix]);
+      }
+
+      threadManager->remove(tasks[1]);
+
+      {
+        Monitor sleep;
+        Synchronized s(sleep);
+
+        try {
+          sleep.wait(20);
+        } catch (TimedOutException&) {
+          ;
+        }
+      }
+
+      {
+        Synchronized s(bmonitor);
+
+        bmonitor.notifyAll();
+      }
+
+      threadManager->join();
+
+      std::cout << "\t\t\t"
+                << "ran " << ranCount << std::endl;
+
+      success = ranCount == 2 && threadManager->pendingTaskCount() == 0;
+
+    } catch (TException& e) {
+      std::cout << "ERROR: " << e.what() << std::endl;
+    }
+
+    std::cout << "\t\t\t" << (success ? "Success" : "Failure") << std::endl;
+    return success;
+  }
 };
 
 const double ThreadManagerTests::TEST_TOLERANCE = .20;
@@ -24,6 +24,7 @@
 
 #include <assert.h>
 #include <iostream>
+#include <vector>
 
 namespace apache {
 namespace thrift {
@@ -141,6 +142,147 @@ public:
     return true;
   }
 
+  /**
+   * This test adds tasks at many different timeouts, cancels every other one
+   * through the handle addTimer() returned and checks that exactly the others run,
+   * each within tolerance of its timeout.  A task added with a timeout in the
+   * past runs right away.
+   */
+  bool test01(size_t count = 40, int64_t step = 25LL) {
+
+    TimerManager timerManager;
+
+    timerManager.threadFactory(shared_ptr<PlatformThreadFactory>(new PlatformThreadFactory()));
+
+    timerManager.start();
+
+    std::vector<shared_ptr<TimerManagerTests::Task> > tasks;
+    std::vector<TimerManager::Timer> timers;
+
+    for (size_t ix = 0; ix < count; ++ix) {
+      int64_t timeout = 100LL + step * static_cast<int64_t>(ix);
+      tasks.push_back(shared_ptr<TimerManagerTests::Task>(new TimerManagerTests::Task(_monitor, timeout)));
+      timers.push_back(timerManager.addTimer(tasks.back(), timeout));
+    }
+
+    assert(timerManager.taskCount() == count);
+
+    for (size_t ix = 1; ix < count; ix += 2) {
+      timerManager.remove(timers[ix]);
+    }
+
+    assert(timerManager.taskCount() == count / 2);
+
+    // Cancelling twice is an error
+    try {
+      timerManager.remove(timers[1]);
+      assert(0 == "ERROR: removed a task twice");
+    } catch (UncancellableTaskException&) {
+    }
+
+    shared_ptr<TimerManagerTests::Task> overdue(new TimerManagerTests::Task(_monitor, 1));
+    timerManager.add(overdue, -1000LL);
+
+    {
+      Synchronized s(_monitor);
+      int64_t end = Util::currentTime() + 100LL + step * static_cast<int64_t>(count + 4);
+      int64_t now;
+      while ((now = Util::currentTime()) < end) {
+        try {
+          _monitor.wait(end - now);
+        } catch (TimedOutException&) {
+        }
+      }
+    }
+
+    assert(overdue->_done);
+    assert(timerManager.taskCount() == 0);
+
+    for (size_t ix = 0; ix < count; ++ix) {
+      if (ix % 2 == 0) {
+        assert(tasks[ix]->_done && tasks[ix]->_success);
+      } else {
+        assert(!tasks[ix]->_done);
+      }
+    }
+
+    // The runnable is gone from the timer once it ran
+    try {
+      timerManager.remove(tasks[0]);
+      assert(0 == "ERROR: removed a task that ran");
+    } catch (NoSuchTaskException&) {
+    }
+
+    return true;
+  }
+
+  class NopTask : public Runnable {
+  public:
+    void run() {}
+  };
+
+  /**
+   * Adds count timeouts, spread over a minute, from each of threadCount
+   * threads and cancels them again, the way per-request timeouts come and
+   * go.  Reports how many adds and cancels per second that took.
+   */
+  bool benchmark(size_t count, size_t threadCount) {
+
+    TimerManager timerManager;
+
+    timerManager.threadFactory(shared_ptr<PlatformThreadFactory>(new PlatformThreadFactory()));
+
+    timerManager.start();
+
+    std::vector<shared_ptr<Thread> > threads;
+    PlatformThreadFactory threadFactory;
+    threadFactory.setDetached(false);
+
+    int64_t time00 = Util::currentTime();
+
+    for (size_t ix = 0; ix < threadCount; ++ix) {
+      threads.push_back(
+          threadFactory.newThread(shared_ptr<Runnable>(new AddRemove(timerManager, count))));
+      threads.back()->start();
+    }
+
+    for (size_t ix = 0; ix < threadCount; ++ix) {
+      threads[ix]->join();
+    }
+
+    int64_t time01 = Util::currentTime();
+
+    assert(timerManager.taskCount() == 0);
+
+    double ops = 2.0 * static_cast<double>(count * threadCount);
+    std::cout << "			" << ops / (time01 > time00 ? time01 - time00 : 1) * 1000
+              << " adds and removes/s" << std::endl;
+
+    return true;
+  }
+
+  class AddRemove : public Runnable {
+  public:
+    AddRemove(TimerManager& timerManager, size_t count)
+      : timerManager_(timerManager), count_(count) {}
+
+    void run() {
+      shared_ptr<Runnable> task(new NopTask());
+      std::vector<TimerManager::Timer> timers;
+      timers.reserve(count_);
+      for (size_t ix = 0; ix < count_; ++ix) {
+        timers.push_back(timerManager_.addTimer(task, 1000LL + static_cast<int64_t>(ix % 60000)));
+      }
+      for (size_t ix = 0; ix < count_; ++ix) {
+        timerManager_.remove(timers[ix]);
+      }
+    }
+
+  private:
+    TimerManager& timerManager_;
+    size_t count_;
+  };
+
   friend class TestTask;
 
   Monitor _monitor;